@@ -35,6 +35,7 @@ class BinaryPackage:
         self.src_hash = src_hash
         self.pkg_path = None
         self.ghost = ghost
+        self.compression = ('xz', None)
 
         self.description = ''
         # * System dependencies are stored as opaque strings.
@@ -132,11 +133,31 @@ class BinaryPackage:
             os.makedirs(os.path.dirname(dst), exist_ok=True)
             os.link(src, dst, follow_symlinks=False)
 
+    def _metadata_files(self, pkgdir: str) -> List[str]:
+        """
+        List the files of the package holding its metadata, MMPACK/info
+        being the first. They form the metadata header of the package file
+        (see package-structure.md).
+        """
+        metadata = ['MMPACK/info']
+        for metadir in ('MMPACK', 'var/lib/mmpack/metadata'):
+            if not os.path.isdir(os.path.join(pkgdir, metadir)):
+                continue
+
+            for filename in sorted(os.listdir(os.path.join(pkgdir, metadir))):
+                relpath = metadir + '/' + filename
+                if relpath not in metadata \
+                        and os.path.isfile(os.path.join(pkgdir, relpath)):
+                    metadata.append(relpath)
+
+        return metadata
+
     def _make_archive(self, pkgdir: str, dstdir: str) -> str:
         mpkfile = "{0}/{1}_{2}_{3}.mpk".format(dstdir, self.name,
                                                self.version, self.arch)
         dprint('[tar] {0} -> {1}'.format(pkgdir, mpkfile))
-        create_tarball(pkgdir, mpkfile, 'xz')
+        create_tarball(pkgdir, mpkfile, *self.compression,
+                       leading=self._metadata_files(pkgdir))
 
         return mpkfile
 
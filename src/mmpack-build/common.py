@@ -3,10 +3,14 @@
 A set of helpers used throughout the mmpack project
 """
 
+import bz2
+import gzip
 import logging
 import logging.handlers
+import lzma
 import os
 import re
+import shutil
 import sys
 import tarfile
 
@@ -14,7 +18,7 @@ import platform
 
 from hashlib import sha256
 from subprocess import PIPE, run
-from typing import Union, Tuple, List, Set
+from typing import Optional, Union, Tuple, List, Set
 
 import urllib3
 import yaml
@@ -22,6 +26,25 @@ import yaml
 CONFIG = {'debug': True, 'verbose': True}
 LOGGER = None
 
+# Size of the uncompressed data of each block of xz tarballs. The blocks are
+# compressed independently, hence can be decompressed in parallel.
+XZ_BLOCK_SIZE = 8 * 1024 * 1024
+
+# Compressions of the package payload that can be selected in the specfile.
+# zstd-long is zstd with the long distance matching enabled.
+MPK_COMPRESSIONS = ('xz', 'zstd', 'zstd-long')
+MPK_COMPRESSION_LEVELS = {'xz': (0, 9), 'zstd': (1, 22), 'zstd-long': (1, 22)}
+
+# zstd level used if none is specified. Decompression speed barely depends on
+# the level, so it is worth compressing hard a package built once but
+# installed many times.
+ZSTD_DEFAULT_LEVEL = 19
+
+# Window size (log2) of zstd long distance matching. Decoders refuse windows
+# larger than 2^27 bytes unless configured otherwise, hence it must not be
+# increased without breaking the installation of packages by other tools.
+ZSTD_LONG_WINDOW_LOG = 27
+
 # list of stored level-msg pairs of logged lines issued before the
 # filename-based logger becomes available. Once it becomes available this
 # list will populate the newly created log.
@@ -424,13 +447,151 @@ def _reset_entry_attrs(tarinfo: tarfile.TarInfo):
     return tarinfo
 
 
-def create_tarball(srcdir: str, dstfile: str, compression: str = '') -> None:
+def parse_compression(spec: str) -> Tuple[str, Optional[int]]:
+    """
+    Parse the compression of package payload as written in specfile
+
+    Args:
+        spec: compression in the form <name>[:<level>], name being one of
+            MPK_COMPRESSIONS
+    Returns:
+        tuple of compression name and level (None if not specified)
+    Raises:
+        ValueError: if spec is not a supported compression
+    """
+    name, _, level_str = str(spec).partition(':')
+    if name not in MPK_COMPRESSIONS:
+        raise ValueError('Unsupported compression "{}" (must be one of: {})'
+                         .format(name, ', '.join(MPK_COMPRESSIONS)))
+
+    if not level_str:
+        return (name, None)
+
+    minlevel, maxlevel = MPK_COMPRESSION_LEVELS[name]
+    if not level_str.isdigit() or not minlevel <= int(level_str) <= maxlevel:
+        raise ValueError('Invalid {} compression level "{}" (must be in {}-{})'
+                         .format(name, level_str, minlevel, maxlevel))
+
+    return (name, int(level_str))
+
+
+def _xz_blocks_cmd(level: int = None) -> List[str]:
+    """
+    Get the command compressing its standard input in xz format, split into
+    blocks compressed independently by the multi-threaded mode of xz. The
+    size of each block is recorded in its header, which allows a
+    multi-threaded decoder to decompress the blocks in parallel. The result is
+    a regular xz stream.
+
+    The output depends on the block size but not on the number of threads:
+    the multi-threaded mode is enforced by requesting at least 2 threads.
+
+    Args:
+        level: compression preset (xz default if None)
+    """
+    cmd = ['xz', '--compress', '--stdout',
+           '--threads={:d}'.format(max(2, os.cpu_count() or 1)),
+           '--block-size={:d}'.format(XZ_BLOCK_SIZE)]
+    if level is not None:
+        cmd.append('-{:d}'.format(level))
+
+    return cmd
+
+
+def _zstd_cmd(level: int = None, long_mode: bool = False) -> List[str]:
+    """
+    Get the command compressing its standard input in zstd format. The
+    multi-threaded mode of zstd is used, which gives the same output whatever
+    the number of threads.
+
+    Args:
+        level: compression level (ZSTD_DEFAULT_LEVEL if None)
+        long_mode: if True, enable long distance matching
+    """
+    if level is None:
+        level = ZSTD_DEFAULT_LEVEL
+
+    cmd = ['zstd', '--compress', '--quiet', '--stdout', '--threads=0',
+           '-{:d}'.format(level)]
+    if level > 19:
+        cmd.append('--ultra')
+    if long_mode:
+        cmd.append('--long={:d}'.format(ZSTD_LONG_WINDOW_LOG))
+
+    return cmd
+
+
+def _compress_cmd(compression: str, level: int = None) -> List[str]:
+    """
+    Get the command compressing its standard input with given compression
+
+    Returns:
+        the command, None if the compression must be done by the tarfile
+        module.
+    Raises:
+        ShellException: if the command required by compression is missing
+    """
+    if compression in ('zstd', 'zstd-long'):
+        if not shutil.which('zstd'):
+            raise ShellException('zstd command not found')
+        return _zstd_cmd(level, compression == 'zstd-long')
+
+    if compression == 'xz' and shutil.which('xz'):
+        return _xz_blocks_cmd(level)
+
+    return None
+
+
+def _write_tar(srcdir: str, tarpath: str, leading: List[str] = None) -> int:
+    """
+    Write uncompressed tar of the content of a folder with the attributes
+    that make the build not reproducible reset.
+
+    Args:
+        srcdir: folder whose content will be put in the tar
+        tarpath: path of the tar to write
+        leading: files (relative to srcdir) to be put first in the tar in
+            this order. The rest of the content of srcdir follows.
+
+    Returns:
+        the size of the part of the tar holding the leading files
+    """
+    leading = leading if leading else []
+    leading_set = set(leading)
+
+    def _reset_non_leading(tarinfo: tarfile.TarInfo):
+        if tarinfo.name[2:] in leading_set:
+            return None
+        return _reset_entry_attrs(tarinfo)
+
+    with tarfile.open(tarpath, 'w') as tar:
+        for relpath in leading:
+            tar.add(os.path.join(srcdir, relpath), arcname='./' + relpath,
+                    recursive=False, filter=_reset_entry_attrs)
+        leading_size = tar.offset
+        tar.add(srcdir, recursive=True, filter=_reset_non_leading,
+                arcname='.')
+
+    return leading_size
+
+
+def create_tarball(srcdir: str, dstfile: str, compression: str = '',
+                   level: int = None, leading: List[str] = None) -> None:
     """
     Generate a tarball from the content of a folder. The generated file should
     be for deterministic build. Hence all user, group member ship, mode
     (excepting for the execution but), timestamps will be set to generic
     values.
 
+    If the xz command is available, xz tarballs are made of blocks which can
+    be decompressed in parallel (see _xz_blocks_cmd()). Otherwise they are
+    compressed in a single block.
+
+    If leading files are specified, they are put first in the tarball and the
+    part of the tarball holding them is compressed separately: it is a
+    compressed stream (or zstd frame) followed by the one of the rest of the
+    tarball. Hence they can be read without decompressing anything else.
+
     Args:
         srcfolder: folder whose content will be put in the tarball
         dstfile: path of the generated tarball
@@ -440,10 +601,78 @@ def create_tarball(srcdir: str, dstfile: str, compression: str = '') -> None:
             - 'gz': create a tarfile with gzip compression
             - 'bz2': create a tarfile with bzip2 compression
             - 'xz': create a tarfile with lzma compression
+            - 'zstd': create a tarfile with zstd compression (requires the
+              zstd command)
+            - 'zstd-long': same as 'zstd' with long distance matching
+        level: compression level, default of the algorithm if None
+        leading: files (relative to srcdir) to put first in the tarball
+    Raises:
+        ShellException: if the compression command is missing or failed
     """
-    tar = tarfile.open(dstfile, 'w:' + compression)
-    tar.add(srcdir, recursive=True, filter=_reset_entry_attrs, arcname='.')
-    tar.close()
+    cmd = _compress_cmd(compression, level) if compression else None
+    tarpath = dstfile + '.tar' if compression else dstfile
+    leading_size = _write_tar(srcdir, tarpath, leading)
+    if not compression:
+        return
+
+    try:
+        if cmd:
+            _compress_segments_cmd(cmd, tarpath, dstfile, leading_size)
+        else:
+            _compress_segments_py(compression, level, tarpath, dstfile,
+                                  leading_size)
+    finally:
+        os.remove(tarpath)
+
+
+def _compress_segments_cmd(cmd: List[str], srcfile: str, dstfile: str,
+                           split: int) -> None:
+    """
+    Compress a file with a command reading standard input and writing to
+    standard output. The data before split and the rest are compressed
+    separately and the results concatenated.
+
+    Raises:
+        ShellException: if compression failed
+    """
+    dprint('[shell] {0} < {1} > {2}'.format(' '.join(cmd), srcfile, dstfile))
+    with open(srcfile, 'rb', buffering=0) as src, \
+            open(dstfile, 'wb', buffering=0) as dst:
+        rets = []
+        if split:
+            rets.append(run(cmd, input=src.read(split), stdout=dst))
+
+        # The compression command inherits the file position of src
+        rets.append(run(cmd, stdin=src, stdout=dst))
+
+    for ret in rets:
+        if ret.returncode != 0:
+            raise ShellException('compression of {} failed with error {:d}'
+                                 .format(srcfile, ret.returncode))
+
+
+def _compress_segments_py(compression: str, level: Optional[int],
+                          srcfile: str, dstfile: str, split: int) -> None:
+    """
+    Same as _compress_segments_cmd() with the compression modules of python
+    """
+    def _compressor(fileobj):
+        if compression == 'xz':
+            return lzma.LZMAFile(fileobj, 'wb', preset=level)
+        if compression == 'bz2':
+            return bz2.BZ2File(fileobj, 'wb', compresslevel=level or 9)
+        if compression == 'gz':
+            return gzip.GzipFile(fileobj=fileobj, mode='wb', mtime=0,
+                                 compresslevel=level or 9)
+        raise ValueError('Unsupported compression: ' + compression)
+
+    with open(srcfile, 'rb') as src, open(dstfile, 'wb') as dst:
+        if split:
+            with _compressor(dst) as segment:
+                segment.write(src.read(split))
+
+        with _compressor(dst) as segment:
+            shutil.copyfileobj(src, segment)
 
 
 def get_name_version_from_srcdir(srcdir: str) -> Tuple[str, str]:
@@ -76,6 +76,7 @@ class SrcPackage:
         self.build_options = None
         self.build_system = None
         self.build_depends = []
+        self.compression = ('xz', None)
 
         # dict of (name, BinaryPackage) generated from the source package
         self._packages = {}
@@ -200,6 +201,8 @@ class SrcPackage:
                 self.copyright = value
             elif key == 'ghost':
                 self.ghost = str2bool(value)
+            elif key == 'compression':
+                self.compression = parse_compression(value)
 
     def _default_license(self) -> None:
         if self.ghost:
@@ -465,6 +468,7 @@ class SrcPackage:
                                    src_hash=self.src_hash,
                                    ghost=self.ghost)
             binpkg.install_files = pkginfo.files
+            binpkg.compression = self.compression
 
             # Init dependency and system dependency that were already specified
             # from specs of custom packages
@@ -16,6 +16,7 @@
 
 #include "common.h"
 #include "context.h"
+#include "download.h"
 #include "indextable.h"
 #include "mmstring.h"
 #include "package-utils.h"
@@ -156,9 +157,16 @@ void mmpack_ctx_deinit(struct mmpack_ctx * ctx)
 	mmstr_free(ctx->prefix);
 	mmstr_free(ctx->cwd);
 	mmstr_free(ctx->pkgcachedir);
+	download_summary_destroy(ctx->dl_summary);
 
-	if (ctx->curl != NULL) {
-		curl_easy_cleanup(ctx->curl);
+	if (ctx->curl != NULL || ctx->curl_multi != NULL) {
+		if (ctx->curl_multi != NULL)
+			curl_multi_cleanup(ctx->curl_multi);
+
+		if (ctx->curl != NULL)
+			curl_easy_cleanup(ctx->curl);
+
+		ctx->curl_multi = NULL;
 		ctx->curl = NULL;
 		curl_global_cleanup();
 	}
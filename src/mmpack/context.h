@@ -11,6 +11,8 @@
 #include "package-utils.h"
 #include "settings.h"
 
+struct download_summary;
+
 #define CTX_SKIP_PKGLIST 0x01
 #define CTX_SKIP_REDIRECT_LOG 0x02
 
@@ -23,6 +25,7 @@ struct mmpack_opts {
  * struct mmpack_ctx - context of a mmpack prefix
  * @curl:       common curl handle for reuse
  * @curl:       buffer where curl may write error message
+ * @curl_multi: curl multi handle used for concurrent downloads
  * @binindex:   binary index of all package available (in repo or installed)
  * @installed:  list of installed package (store in an index table)
  * @manually_inst: list of packages whose installation has been asked explicitly
@@ -30,10 +33,12 @@ struct mmpack_opts {
  * @prefix:     path to the root of folder to use for prefix
  * @cwd:        path to where mmpack was invoked
  * @pkgcachedir: path to dowloaded package cache folder
+ * @dl_summary: metrics of the transfers performed (NULL if none)
  */
 struct mmpack_ctx {
 	CURL * curl;
 	char curl_errbuf[CURL_ERROR_SIZE];
+	CURLM * curl_multi;
 	struct binindex binindex;
 	struct install_state installed;
 	struct strset manually_inst;
@@ -41,6 +46,7 @@ struct mmpack_ctx {
 	mmstr* prefix;
 	mmstr* cwd;
 	mmstr* pkgcachedir;
+	struct download_summary* dl_summary;
 };
 
 int mmpack_ctx_init(struct mmpack_ctx * ctx, struct mmpack_opts* opts);
@@ -0,0 +1,383 @@
+/*
+ * @mindmaze_header@
+ */
+#if defined (HAVE_CONFIG_H)
+# include <config.h>
+#endif
+
+#include <errno.h>
+#include <mmerrno.h>
+#include <mmlib.h>
+#include <mmsysio.h>
+#include <string.h>
+
+#if !defined (_WIN32)
+# include <fcntl.h>
+# include <stdio.h>
+# include <sys/stat.h>
+# include <unistd.h>
+#endif
+
+#include "dir-cache.h"
+#include "indextable.h"
+#include "mmstring.h"
+
+/*
+ * While a package is unpacked, many files are created in the same few
+ * directories. Passing the path relative to prefix to each system call
+ * makes the kernel resolve every component of the path again and again.
+ * Instead, the directories in which files are created are opened once and
+ * the files are manipulated relative to them (openat(), renameat()...).
+ *
+ * The number of descriptors held open is bounded by DIR_CACHE_MAX_FDS. Past
+ * this, the files are manipulated with their path relative to prefix.
+ */
+#define DIR_CACHE_MAX_FDS 128
+
+
+/**
+ * dir_cache_init() - initialize a directory cache
+ * @cache:      directory cache to initialize
+ *
+ * Return: 0 in case of success, -1 otherwise
+ */
+LOCAL_SYMBOL
+int dir_cache_init(struct dir_cache* cache)
+{
+	cache->num_fds = 0;
+	return indextable_init(&cache->dirs, -1, -1);
+}
+
+
+/**
+ * dir_cache_deinit() - close the directories and free a directory cache
+ * @cache:      directory cache initialized with dir_cache_init()
+ */
+LOCAL_SYMBOL
+void dir_cache_deinit(struct dir_cache* cache)
+{
+	struct it_iterator iter;
+	struct it_entry* entry;
+
+	entry = it_iter_first(&iter, &cache->dirs);
+	while (entry) {
+		if (entry->ivalue >= 0)
+			mm_close(entry->ivalue);
+
+		mmstr_free(entry->key);
+		entry = it_iter_next(&iter);
+	}
+
+	indextable_deinit(&cache->dirs);
+	cache->num_fds = 0;
+}
+
+
+/**
+ * dir_cache_lookup() - find a directory in the cache
+ * @cache:      directory cache
+ * @dir:        path of the directory (not necessarily null terminated)
+ * @len:        length of @dir
+ *
+ * Return: the entry of @dir if it is known to exist, NULL otherwise
+ */
+static
+struct it_entry* dir_cache_lookup(struct dir_cache* cache,
+                                  const char* dir, int len)
+{
+	struct it_entry* entry;
+	mmstr* key;
+
+	key = mmstr_malloca_copy(dir, len);
+	entry = indextable_lookup(&cache->dirs, key);
+	mmstr_freea(key);
+
+	return entry;
+}
+
+
+/**
+ * dir_cache_add() - record a directory known to exist
+ * @cache:      directory cache
+ * @dir:        path of the directory (not necessarily null terminated)
+ * @len:        length of @dir
+ *
+ * Return: the entry of @dir
+ */
+static
+struct it_entry* dir_cache_add(struct dir_cache* cache, const char* dir,
+                               int len)
+{
+	struct it_entry* entry;
+	mmstr* key;
+
+	entry = dir_cache_lookup(cache, dir, len);
+	if (entry)
+		return entry;
+
+	key = mmstr_malloc_copy(dir, len);
+	entry = indextable_insert(&cache->dirs, key);
+	entry->ivalue = -1;
+	return entry;
+}
+
+
+static
+int parent_dir_len(const char* path, int len)
+{
+	while (len > 0 && path[len-1] != '/')
+		len--;
+
+	// Remove trailing separators
+	while (len > 0 && path[len-1] == '/')
+		len--;
+
+	return len;
+}
+
+
+#if !defined (_WIN32)
+
+/**
+ * dir_cache_resolve() - get the directory relative to which a file is used
+ * @cache:      directory cache (may be NULL)
+ * @path:       path of a file relative to prefix
+ * @name:       pointer receiving the path to use relative to the returned
+ *              directory descriptor
+ *
+ * Return: a descriptor opened on the parent directory of @path, @name being
+ * then set to its basename. If no such descriptor can be provided, AT_FDCWD
+ * is returned and @name is set to @path.
+ */
+LOCAL_SYMBOL
+int dir_cache_resolve(struct dir_cache* cache, const char* path,
+                      const char** name)
+{
+	struct it_entry* entry;
+	const char* base;
+	mmstr* dir;
+	int fd, dirlen;
+
+	*name = path;
+	base = strrchr(path, '/');
+	if (!cache || !base)
+		return AT_FDCWD;
+
+	dirlen = parent_dir_len(path, base - path + 1);
+	if (dirlen == 0)
+		return AT_FDCWD;
+
+	entry = dir_cache_lookup(cache, path, dirlen);
+	if (!entry || entry->ivalue < 0) {
+		if (cache->num_fds >= DIR_CACHE_MAX_FDS)
+			return AT_FDCWD;
+
+		// The path must be null terminated to be opened
+		dir = mmstr_malloca_copy(path, dirlen);
+		fd = open(dir, O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+		mmstr_freea(dir);
+		if (fd < 0)
+			return AT_FDCWD;
+
+		entry = dir_cache_add(cache, path, dirlen);
+		entry->ivalue = fd;
+		cache->num_fds++;
+	}
+
+	*name = base + 1;
+	return entry->ivalue;
+}
+
+
+static
+int make_dir(struct dir_cache* cache, const mmstr* dir)
+{
+	const char* name;
+	int dirfd;
+
+	dirfd = dir_cache_resolve(cache, dir, &name);
+	if (mkdirat(dirfd, name, 0777) && errno != EEXIST)
+		return mm_raise_from_errno("Cannot create folder %s", dir);
+
+	return 0;
+}
+
+
+/**
+ * dir_cache_create_file() - create a file for writing
+ * @cache:      directory cache
+ * @path:       path of the file to create, relative to prefix
+ * @mode:       permission of the file
+ *
+ * A file already present at @path is removed and replaced by a new one:
+ * since it might be a hardlink to another file, it must not be truncated.
+ *
+ * Return: file descriptor of the created file in case of success, -1
+ * otherwise with error state set accordingly.
+ */
+LOCAL_SYMBOL
+int dir_cache_create_file(struct dir_cache* cache, const char* path,
+                          int mode)
+{
+	const char* name;
+	int fd, dirfd;
+	int flags = O_CREAT|O_EXCL|O_WRONLY|O_CLOEXEC;
+
+	dirfd = dir_cache_resolve(cache, path, &name);
+	fd = openat(dirfd, name, flags, mode);
+	if (fd < 0 && errno == EEXIST && unlinkat(dirfd, name, 0) == 0)
+		fd = openat(dirfd, name, flags, mode);
+
+	if (fd < 0)
+		return mm_raise_from_errno("Cannot create %s", path);
+
+	return fd;
+}
+
+
+/**
+ * dir_cache_symlink() - create a symbolic link
+ * @cache:      directory cache
+ * @target:     target of the symbolic link
+ * @path:       path of the symbolic link to create, relative to prefix
+ *
+ * A file already present at @path is replaced.
+ *
+ * Return: 0 in case of success, -1 otherwise with error state set
+ */
+LOCAL_SYMBOL
+int dir_cache_symlink(struct dir_cache* cache, const char* target,
+                      const char* path)
+{
+	const char* name;
+	int rv, dirfd;
+
+	dirfd = dir_cache_resolve(cache, path, &name);
+	rv = symlinkat(target, dirfd, name);
+	if (rv && errno == EEXIST && unlinkat(dirfd, name, 0) == 0)
+		rv = symlinkat(target, dirfd, name);
+
+	if (rv)
+		return mm_raise_from_errno("Cannot create symlink %s", path);
+
+	return 0;
+}
+
+
+/**
+ * dir_cache_rename() - rename a file
+ * @cache:      directory cache
+ * @oldpath:    path of the file to rename, relative to prefix
+ * @newpath:    destination of the file, relative to prefix
+ *
+ * Return: 0 in case of success, -1 otherwise with error state set
+ */
+LOCAL_SYMBOL
+int dir_cache_rename(struct dir_cache* cache, const char* oldpath,
+                     const char* newpath)
+{
+	const char * oldname, * newname;
+	int olddirfd, newdirfd;
+
+	olddirfd = dir_cache_resolve(cache, oldpath, &oldname);
+	newdirfd = dir_cache_resolve(cache, newpath, &newname);
+	if (renameat(olddirfd, oldname, newdirfd, newname))
+		return mm_raise_from_errno("Cannot rename %s to %s",
+		                           oldpath, newpath);
+
+	return 0;
+}
+
+#else /* _WIN32 */
+
+static
+int make_dir(struct dir_cache* cache, const mmstr* dir)
+{
+	(void) cache;
+	return mm_mkdir(dir, 0777, MM_RECURSIVE);
+}
+
+
+LOCAL_SYMBOL
+int dir_cache_create_file(struct dir_cache* cache, const char* path,
+                          int mode)
+{
+	(void) cache;
+
+	if (mm_check_access(path, F_OK) != ENOENT) {
+		if (mm_unlink(path))
+			return -1;
+	}
+
+	return mm_open(path, O_CREAT|O_EXCL|O_WRONLY, mode);
+}
+
+
+LOCAL_SYMBOL
+int dir_cache_symlink(struct dir_cache* cache, const char* target,
+                      const char* path)
+{
+	(void) cache;
+
+	if (mm_check_access(path, F_OK) != ENOENT) {
+		if (mm_unlink(path))
+			return -1;
+	}
+
+	return mm_symlink(target, path);
+}
+
+
+LOCAL_SYMBOL
+int dir_cache_rename(struct dir_cache* cache, const char* oldpath,
+                     const char* newpath)
+{
+	(void) cache;
+	return mm_rename(oldpath, newpath);
+}
+
+#endif /* _WIN32 */
+
+
+/**
+ * dir_cache_mkdir() - create a directory if not known to exist
+ * @cache:      directory cache
+ * @path:       path of the directory relative to prefix
+ *
+ * If the parent of @path is known to exist, only the last component of
+ * @path is created. Otherwise, all the missing components are created and
+ * recorded in @cache, so that the next directories created in the same tree
+ * do not have to be created recursively.
+ *
+ * Return: 0 in case of success, -1 otherwise with error state set
+ */
+LOCAL_SYMBOL
+int dir_cache_mkdir(struct dir_cache* cache, const char* path)
+{
+	mmstr* dir;
+	int len, parent_len, rv;
+
+	len = strlen(path);
+	while (len > 0 && path[len-1] == '/')
+		len--;
+
+	if (len == 0 || dir_cache_lookup(cache, path, len))
+		return 0;
+
+	dir = mmstr_malloca_copy(path, len);
+	parent_len = parent_dir_len(path, len);
+	if (parent_len == 0 || dir_cache_lookup(cache, path, parent_len)) {
+		rv = make_dir(cache, dir);
+	} else {
+		rv = mm_mkdir(dir, 0777, MM_RECURSIVE);
+		for (; rv == 0 && parent_len > 0;
+		     parent_len = parent_dir_len(path, parent_len))
+			dir_cache_add(cache, path, parent_len);
+	}
+
+	if (rv == 0)
+		dir_cache_add(cache, path, len);
+
+	mmstr_freea(dir);
+	return rv;
+}
@@ -0,0 +1,36 @@
+/*
+ * @mindmaze_header@
+ */
+#ifndef DIR_CACHE_H
+#define DIR_CACHE_H
+
+#include "indextable.h"
+#include "mmstring.h"
+
+/**
+ * struct dir_cache - directories of the prefix known to exist
+ * @dirs:       table of the directories (relative to prefix) known to exist,
+ *              associated with a descriptor opened on it (-1 if none)
+ * @num_fds:    number of descriptors held open in @dirs
+ */
+struct dir_cache {
+	struct indextable dirs;
+	int num_fds;
+};
+
+int dir_cache_init(struct dir_cache* cache);
+void dir_cache_deinit(struct dir_cache* cache);
+int dir_cache_mkdir(struct dir_cache* cache, const char* path);
+int dir_cache_create_file(struct dir_cache* cache, const char* path,
+                          int mode);
+int dir_cache_symlink(struct dir_cache* cache, const char* target,
+                      const char* path);
+int dir_cache_rename(struct dir_cache* cache, const char* oldpath,
+                     const char* newpath);
+
+#if !defined (_WIN32)
+int dir_cache_resolve(struct dir_cache* cache, const char* path,
+                      const char** name);
+#endif
+
+#endif /* DIR_CACHE_H */
@@ -10,10 +10,24 @@
 
 #include <mmerrno.h>
 #include <mmsysio.h>
+#include <stdint.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 
+#if defined (HAVE_LIBLZMA)
+# include <lzma.h>
+#endif
+
+#include "common.h"
 #include "context.h"
+#include "sha256.h"
 #include "utils.h"
 
+#define PART_EXT ".part"
+#define PART_READ_SIZE 8192
+
 // On systems (Win32 that do not define EREMOTEIO, alias it to EIO
 #if !defined (EREMOTEIO)
 # define EREMOTEIO EIO
@@ -79,26 +93,249 @@ int get_error_from_curl(CURL* curl, int last_retcode, char* errbuf)
 }
 
 
+/**
+ * sink_output() - write data to the destination of a sink
+ * @sink:       destination of downloaded data
+ * @buf:        data to write
+ * @len:        size of @buf
+ *
+ * Return: 0 in case of success, -1 otherwise
+ */
 static
-size_t write_download_data(char* buffer, size_t size, size_t nmemb, void* data)
+int sink_output(struct download_sink* sink, const void* buf, size_t len)
 {
-	int fd = *((int*)data);
-	char* buf;
-	size_t buflen;
+	const char* data = buf;
 	ssize_t rsz;
 
-	buf = buffer;
-	buflen = size*nmemb;
-	while (buflen > 0) {
-		rsz = mm_write(fd, buf, buflen);
+	if (sink->mem)
+		buffer_push(sink->mem, buf, len);
+
+	// Data is kept in memory only
+	if (sink->fd < 0)
+		return 0;
+
+	while (len > 0) {
+		rsz = mm_write(sink->fd, data, len);
 		if (rsz < 0)
-			break;
+			return -1;
+
+		len -= rsz;
+		data += rsz;
+	}
+
+	return 0;
+}
+
+
+#if defined (HAVE_LIBLZMA)
+
+#define DECODE_CHUNK_SIZE (64*1024)
+
+static
+void* decoder_create(void)
+{
+	lzma_stream* strm;
+
+	strm = xx_malloc(sizeof(*strm));
+	*strm = (lzma_stream) LZMA_STREAM_INIT;
+	if (lzma_stream_decoder(strm, UINT64_MAX, LZMA_CONCATENATED)
+	    != LZMA_OK) {
+		free(strm);
+		mm_raise_error(ENOMEM, "Cannot initialize xz decoder");
+		return NULL;
+	}
+
+	return strm;
+}
+
+
+static
+void decoder_destroy(void* decoder)
+{
+	if (!decoder)
+		return;
+
+	lzma_end(decoder);
+	free(decoder);
+}
+
+
+/**
+ * sink_decode() - decompress data and write it to the sink destination
+ * @sink:       destination of downloaded data, with decoder set
+ * @buf:        compressed data
+ * @len:        size of @buf
+ * @finish:     non zero if there is no more data to decompress
+ *
+ * Return: 0 in case of success, -1 otherwise with error state set
+ */
+static
+int sink_decode(struct download_sink* sink, const void* buf, size_t len,
+                int finish)
+{
+	uint8_t out[DECODE_CHUNK_SIZE];
+	lzma_stream* strm = sink->decoder;
+	lzma_action action = finish ? LZMA_FINISH : LZMA_RUN;
+	lzma_ret ret;
+
+	strm->next_in = buf;
+	strm->avail_in = len;
+	do {
+		strm->next_out = out;
+		strm->avail_out = sizeof(out);
+		ret = lzma_code(strm, action);
+		if (ret != LZMA_OK && ret != LZMA_STREAM_END)
+			return mm_raise_error(MM_EBADFMT, "Invalid xz data");
+
+		if (sink_output(sink, out, sizeof(out) - strm->avail_out))
+			return -1;
+	} while (strm->avail_out == 0 || (finish && ret != LZMA_STREAM_END));
+
+	if (finish && ret != LZMA_STREAM_END)
+		return mm_raise_error(MM_EBADFMT, "Truncated xz data");
+
+	return 0;
+}
+
+#else /* HAVE_LIBLZMA */
+
+static
+void* decoder_create(void)
+{
+	mm_raise_error(ENOSYS, "Decompression not supported");
+	return NULL;
+}
+
+
+static
+void decoder_destroy(void* decoder)
+{
+	(void)decoder;
+}
+
+
+static
+int sink_decode(struct download_sink* sink, const void* buf, size_t len,
+                int finish)
+{
+	(void)sink;
+	(void)buf;
+	(void)len;
+	(void)finish;
+	return mm_raise_error(ENOSYS, "Decompression not supported");
+}
+
+#endif /* HAVE_LIBLZMA */
+
+
+/**
+ * download_can_decompress() - indicates whether xz resource can be fetched
+ *
+ * Return: 1 if mmpack has been built with support of xz decompression of
+ * downloaded resources, 0 otherwise.
+ */
+LOCAL_SYMBOL
+int download_can_decompress(void)
+{
+#if defined (HAVE_LIBLZMA)
+	return 1;
+#else
+	return 0;
+#endif
+}
+
+
+/**
+ * write_download_data() - curl write callback
+ * @buffer:     data received
+ * @size:       size of one element of @buffer (always 1)
+ * @nmemb:      number of elements in @buffer
+ * @data:       pointer to the struct download_sink of the transfer
+ *
+ * Write the received data to the destination file and, if requested, update
+ * the hash of the data received so far and keep a copy of the data in
+ * memory. Hashing data as it is received avoids to read back the whole file
+ * once the transfer is done. If the sink has a decoder, the data is
+ * decompressed on the fly and only the decompressed data is written.
+ *
+ * Return: number of bytes processed. If different from @size*@nmemb, the
+ * transfer is aborted by curl.
+ */
+static
+size_t write_download_data(char* buffer, size_t size, size_t nmemb, void* data)
+{
+	struct download_sink* sink = data;
+	size_t buflen = size*nmemb;
+	int rv;
+
+	// Abort transfer if receiving more than expected
+	if (sink->max_size && sink->size + buflen > sink->max_size)
+		return 0;
+
+	if (sink->hash_data)
+		sha256_update(&sink->sha_ctx, buffer, buflen);
+
+	if (sink->decoder)
+		rv = sink_decode(sink, buffer, buflen, 0);
+	else
+		rv = sink_output(sink, buffer, buflen);
 
-		buflen -= rsz;
-		buf += rsz;
+	if (rv)
+		return 0;
+
+	sink->size += buflen;
+	return buflen;
+}
+
+
+/**
+ * download_sink_check_hash() - verify the hash of the data received
+ * @sink:       sink of the completed transfer
+ * @ref_sha:    expected SHA-256 in hexadecimal
+ * @url:        URL of the transfer (used for error message)
+ *
+ * Return: 0 if the hash of the data received matches @ref_sha or if the sink
+ * does not hash the data, -1 otherwise with error state set accordingly.
+ */
+static
+int download_sink_check_hash(struct download_sink* sink,
+                             const mmstr* ref_sha, const mmstr* url)
+{
+	unsigned char md[SHA256_BLOCK_SIZE];
+	char hexstr[2*SHA256_BLOCK_SIZE];
+
+	if (!sink->hash_data)
+		return 0;
+
+	sha256_final(&sink->sha_ctx, md);
+	conv_to_hexstr(hexstr, md, sizeof(md));
+
+	if (mmstrlen(ref_sha) != sizeof(hexstr)
+	    || memcmp(hexstr, ref_sha, sizeof(hexstr)) != 0) {
+		mm_raise_error(EBADMSG, "bad SHA-256 detected %s", url);
+		return -1;
 	}
 
-	return (buf - buffer);
+	return 0;
+}
+
+
+/**
+ * setup_curl_handle() - set the options common to all transfers
+ * @curl:       curl easy handle to configure
+ * @errbuf:     buffer of CURL_ERROR_SIZE where curl may write error message
+ */
+static
+void setup_curl_handle(CURL* curl, char* errbuf)
+{
+	curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1L);
+	curl_easy_setopt(curl, CURLOPT_FAILONERROR, 1L);
+	curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, write_download_data);
+	curl_easy_setopt(curl, CURLOPT_ERRORBUFFER, errbuf);
+	curl_easy_setopt(curl, CURLOPT_RESUME_FROM_LARGE, (curl_off_t)0);
+	curl_easy_setopt(curl, CURLOPT_HTTPHEADER, NULL);
+	curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, NULL);
+	curl_easy_setopt(curl, CURLOPT_HEADERDATA, NULL);
 }
 
 
@@ -112,21 +349,245 @@ CURL* get_curl_handle(struct mmpack_ctx * ctx)
 			return NULL;
 		}
 
-		// Common config
-		curl_easy_setopt(ctx->curl, CURLOPT_FOLLOWLOCATION, 1L);
-		curl_easy_setopt(ctx->curl, CURLOPT_FAILONERROR, 1L);
-		curl_easy_setopt(ctx->curl,
-		                 CURLOPT_WRITEFUNCTION,
-		                 write_download_data);
-		curl_easy_setopt(ctx->curl,
-		                 CURLOPT_ERRORBUFFER,
-		                 ctx->curl_errbuf);
+		setup_curl_handle(ctx->curl, ctx->curl_errbuf);
 	}
 
 	return ctx->curl;
 }
 
 
+/**
+ * get_curl_multi_handle() - get the multi handle of context
+ * @ctx:        mmpack context
+ *
+ * The multi handle is created at first call and kept in @ctx afterward. This
+ * allows the connections opened by one download batch to be reused by the
+ * next ones, since the connection cache is owned by the multi handle.
+ *
+ * Return: the curl multi handle in case of success, NULL otherwise with
+ * error state set accordingly
+ */
+static
+CURLM* get_curl_multi_handle(struct mmpack_ctx * ctx)
+{
+	CURLM* multi;
+
+	if (ctx->curl_multi != NULL)
+		return ctx->curl_multi;
+
+	multi = curl_multi_init();
+	if (multi == NULL) {
+		mm_raise_from_errno("curl multi init failed");
+		return NULL;
+	}
+
+	curl_multi_setopt(multi, CURLMOPT_MAX_TOTAL_CONNECTIONS,
+	                  (long)ctx->settings.max_parallel_downloads);
+	curl_multi_setopt(multi, CURLMOPT_MAX_HOST_CONNECTIONS,
+	                  (long)ctx->settings.max_host_connections);
+#if defined (CURLPIPE_MULTIPLEX)
+	curl_multi_setopt(multi, CURLMOPT_PIPELINING, CURLPIPE_MULTIPLEX);
+#endif
+
+	ctx->curl_multi = multi;
+	return multi;
+}
+
+
+/**************************************************************************
+ *                                                                        *
+ *                           Transfer metrics                             *
+ *                                                                        *
+ **************************************************************************/
+
+/**
+ * get_summary() - get the summary of transfers of context
+ * @ctx:        mmpack context
+ *
+ * Return: the summary of the transfers, created at first call
+ */
+static
+struct download_summary* get_summary(struct mmpack_ctx* ctx)
+{
+	if (!ctx->dl_summary)
+		ctx->dl_summary = xx_calloc(1, sizeof(*ctx->dl_summary));
+
+	return ctx->dl_summary;
+}
+
+
+LOCAL_SYMBOL
+void download_summary_destroy(struct download_summary* summary)
+{
+	if (!summary)
+		return;
+
+	if (summary->log)
+		fclose(summary->log);
+
+	free(summary);
+}
+
+
+/**
+ * fprint_json_str() - write a string as JSON string literal
+ * @fp:         stream to write to
+ * @str:        null terminated string to write
+ */
+static
+void fprint_json_str(FILE* fp, const char* str)
+{
+	unsigned char c;
+
+	fputc('"', fp);
+	for (; *str; str++) {
+		c = *str;
+		if (c == '"' || c == '\\')
+			fprintf(fp, "\\%c", c);
+		else if (c < 0x20)
+			fprintf(fp, "\\u%04x", c);
+		else
+			fputc(c, fp);
+	}
+
+	fputc('"', fp);
+}
+
+
+/**
+ * log_metrics() - append metrics of a transfer to the transfer log
+ * @ctx:        mmpack context
+ * @summary:    summary of the transfers of @ctx
+ * @url:        URL of the transferred resource
+ * @status:     0 if the transfer has succeeded, -1 otherwise
+ * @m:          metrics of the transfer
+ *
+ * The log file set in the transfer-log setting is opened in append mode at
+ * first call. Failing to write the log does not affect the transfers.
+ */
+static
+void log_metrics(struct mmpack_ctx* ctx, struct download_summary* summary,
+                 const mmstr* url, int status,
+                 const struct download_metrics* m)
+{
+	const mmstr* log_path = ctx->settings.transfer_log;
+	FILE* fp;
+
+	if (!log_path || !mmstrlen(log_path))
+		return;
+
+	if (!summary->log) {
+		summary->log = fopen(log_path, "a");
+		if (!summary->log) {
+			mm_log_warn("Cannot open transfer log %s: %s",
+			            log_path, strerror(errno));
+			mmstr_free(ctx->settings.transfer_log);
+			ctx->settings.transfer_log = NULL;
+			return;
+		}
+	}
+
+	fp = summary->log;
+	fputs("{\"url\": ", fp);
+	fprint_json_str(fp, url);
+	fprintf(fp, ", \"status\": \"%s\", \"namelookup\": %.6f, "
+	        "\"connect\": %.6f, \"ttfb\": %.6f, \"total\": %.6f, "
+	        "\"bytes\": %zu, \"speed\": %.0f}\n",
+	        status ? "failed" : "ok", m->namelookup_time, m->connect_time,
+	        m->ttfb, m->total_time, m->size, m->speed);
+	fflush(fp);
+}
+
+
+/**
+ * record_metrics() - collect and account metrics of a terminated transfer
+ * @ctx:        mmpack context
+ * @curl:       curl handle used for the transfer
+ * @url:        URL of the transferred resource
+ * @status:     0 if the transfer has succeeded, -1 otherwise
+ * @metrics:    pointer to structure receiving the metrics of the transfer
+ *
+ * The metrics are added to the summary of the transfers of @ctx and written
+ * to the transfer log if one is configured.
+ */
+static
+void record_metrics(struct mmpack_ctx* ctx, CURL* curl, const mmstr* url,
+                    int status, struct download_metrics* metrics)
+{
+	struct download_summary* summary;
+	struct download_metrics* sum;
+	curl_off_t size = 0, speed = 0;
+	long num_connects = 0;
+
+	*metrics = (struct download_metrics) {0};
+	curl_easy_getinfo(curl, CURLINFO_NAMELOOKUP_TIME,
+	                  &metrics->namelookup_time);
+	curl_easy_getinfo(curl, CURLINFO_CONNECT_TIME, &metrics->connect_time);
+	curl_easy_getinfo(curl, CURLINFO_STARTTRANSFER_TIME, &metrics->ttfb);
+	curl_easy_getinfo(curl, CURLINFO_TOTAL_TIME, &metrics->total_time);
+	curl_easy_getinfo(curl, CURLINFO_SIZE_DOWNLOAD_T, &size);
+	curl_easy_getinfo(curl, CURLINFO_SPEED_DOWNLOAD_T, &speed);
+	curl_easy_getinfo(curl, CURLINFO_NUM_CONNECTS, &num_connects);
+	metrics->size = size;
+	metrics->speed = speed;
+	metrics->reused = (num_connects == 0);
+
+	summary = get_summary(ctx);
+	summary->num_transfers++;
+	if (status)
+		summary->num_failed++;
+
+	sum = &summary->sum;
+	sum->namelookup_time += metrics->namelookup_time;
+	sum->connect_time += metrics->connect_time;
+	sum->ttfb += metrics->ttfb;
+	sum->total_time += metrics->total_time;
+	sum->size += metrics->size;
+
+	log_metrics(ctx, summary, url, status, metrics);
+}
+
+
+/**
+ * download_report_summary() - print aggregated metrics of the transfers
+ * @ctx:        mmpack context
+ *
+ * Nothing is printed if no transfer has been performed with @ctx.
+ */
+LOCAL_SYMBOL
+void download_report_summary(struct mmpack_ctx* ctx)
+{
+	const struct download_summary* summary = ctx->dl_summary;
+	const struct download_metrics* sum;
+	double xfer_time;
+	int num;
+
+	if (!summary || !summary->num_transfers)
+		return;
+
+	sum = &summary->sum;
+	num = summary->num_transfers;
+	info("Transfers: %d (%d failed), %.1f MiB received",
+	     num, summary->num_failed, sum->size / (1024.0*1024.0));
+	// Rate at which data flowed once connections were established
+	xfer_time = sum->total_time - sum->connect_time;
+	if (xfer_time > 0.0)
+		info(", %.1f MiB/s average rate excluding connection",
+		     sum->size / xfer_time / (1024.0*1024.0));
+
+	info("\nAverage times: name lookup %.3fs, connect %.3fs, "
+	     "first byte %.3fs, total %.3fs\n",
+	     sum->namelookup_time / num, sum->connect_time / num,
+	     sum->ttfb / num, sum->total_time / num);
+}
+
+
+/**************************************************************************
+ *                                                                        *
+ *                          Single downloads                              *
+ *                                                                        *
+ **************************************************************************/
+
 /**
  * download_from_repo() - download resource from specified repository
  * @ctx:        mmpack context used (used to get curl handle)
@@ -151,7 +612,9 @@ int download_from_repo(struct mmpack_ctx * ctx,
 	mmstr* url;
 	CURL* curl;
 	CURLcode res;
-	int fd, oflag, rv = -1;
+	struct download_sink sink = {.hash_data = 0};
+	struct download_metrics metrics;
+	int oflag, rv = -1;
 	int err;
 
 	curl = get_curl_handle(ctx);
@@ -164,15 +627,16 @@ int download_from_repo(struct mmpack_ctx * ctx,
 
 	// Open destination file
 	oflag = O_WRONLY|O_CREAT|O_TRUNC;
-	fd = open_file_in_prefix(prefix, prefix_relpath, oflag);
-	if (fd < 0)
+	sink.fd = open_file_in_prefix(prefix, prefix_relpath, oflag);
+	if (sink.fd < 0)
 		goto exit;
 
 	// Perform the download
 	ctx->curl_errbuf[0] = '\0';
-	curl_easy_setopt(curl, CURLOPT_WRITEDATA, &fd);
+	curl_easy_setopt(curl, CURLOPT_WRITEDATA, &sink);
 	curl_easy_setopt(curl, CURLOPT_URL, url);
 	res = curl_easy_perform(curl);
+	record_metrics(ctx, curl, url, res != CURLE_OK ? -1 : 0, &metrics);
 	if (res != CURLE_OK) {
 		err = get_error_from_curl(curl, res, ctx->curl_errbuf);
 		mm_raise_error(err, "Failed to download %s (%s)",
@@ -183,7 +647,935 @@ int download_from_repo(struct mmpack_ctx * ctx,
 	rv = 0;
 
 exit:
-	mm_close(fd);
+	mm_close(sink.fd);
 	mmstr_freea(url);
 	return rv;
 }
+
+
+/**************************************************************************
+ *                                                                        *
+ *                         Concurrent downloads                           *
+ *                                                                        *
+ **************************************************************************/
+
+/**
+ * download_batch_init() - initialize a download batch
+ * @batch:      download batch to initialize
+ * @ctx:        mmpack context used for the transfers
+ * @done_cb:    callback to call each time a job terminates
+ *
+ * The batch must be cleansed by calling download_batch_deinit()
+ */
+LOCAL_SYMBOL
+void download_batch_init(struct download_batch* batch,
+                         struct mmpack_ctx* ctx, download_done_cb done_cb)
+{
+	*batch = (struct download_batch) {
+		.ctx = ctx,
+		.done_cb = done_cb,
+	};
+	buffer_init(&batch->idle_handles);
+}
+
+
+static
+void download_job_destroy(struct download_job* job)
+{
+	mmstr_free(job->url);
+	mmstr_free(job->path);
+	mmstr_free(job->part_path);
+	mmstr_free(job->ref_sha);
+	buffer_deinit(&job->mem);
+	curl_slist_free_all(job->headers);
+	decoder_destroy(job->sink.decoder);
+	free(job);
+}
+
+
+/**
+ * download_batch_deinit() - cleanup a download batch
+ * @batch:      download batch to cleanse
+ *
+ * Jobs still pending are dropped without calling the done callback.
+ */
+LOCAL_SYMBOL
+void download_batch_deinit(struct download_batch* batch)
+{
+	struct download_job* job;
+	CURL* curl;
+
+	while (batch->head) {
+		job = batch->head;
+		batch->head = job->next;
+		download_job_destroy(job);
+	}
+
+	while (batch->idle_handles.size) {
+		buffer_pop(&batch->idle_handles, &curl, sizeof(curl));
+		curl_easy_cleanup(curl);
+	}
+
+	buffer_deinit(&batch->idle_handles);
+}
+
+
+/**
+ * download_batch_add() - queue a download in a batch
+ * @batch:      initialized download batch
+ * @repo:       URL of repository
+ * @repo_relpath: path relative to @repo URL of the resource to download
+ * @prefix:     folder from where to write the downloaded file (may be NULL)
+ * @prefix_relpath: path relative to @prefix of the downloaded file. If NULL,
+ *              the resource is kept in memory in the mem field of the job.
+ * @ref_sha:    expected SHA-256 in hexadecimal of the resource. If not NULL,
+ *              the data is hashed while being received and the job fails
+ *              if the hash does not match at the end of the transfer.
+ * @ref_size:   expected size of the resource (0 if unknown)
+ * @data:       user data to associate with the job
+ *
+ * Same as download_from_repo() excepting that the transfer is only queued.
+ * It will be performed concurrently with the other jobs of @batch when
+ * download_batch_perform() is called. This function may be called from the
+ * done callback of @batch.
+ *
+ * If both @ref_sha and @ref_size are set, the download is resumable: the
+ * data is received in a file named after the destination with ".part"
+ * appended and this file is renamed only once the whole resource has been
+ * received and verified. If the transfer is interrupted, the partial file is
+ * kept and the next download of the same resource resumes from where it has
+ * stopped.
+ *
+ * Return: the queued job. It may be used to set the cond field before the
+ * batch is performed.
+ */
+LOCAL_SYMBOL
+struct download_job* download_batch_add(struct download_batch* batch,
+                                        const mmstr* repo,
+                                        const mmstr* repo_relpath,
+                                        const mmstr* prefix,
+                                        const mmstr* prefix_relpath,
+                                        const mmstr* ref_sha, size_t ref_size,
+                                        void* data)
+{
+	struct download_job* job;
+	int len;
+
+	job = xx_malloc(sizeof(*job));
+	*job = (struct download_job) {.sink = {.fd = -1}, .data = data};
+
+	if (ref_sha) {
+		job->ref_sha = mmstrdup(ref_sha);
+		job->sink.hash_data = 1;
+	}
+
+	len = mmstrlen(repo) + mmstrlen(repo_relpath) + 1;
+	job->url = mmstr_malloc(len);
+	mmstr_join_path(job->url, repo, repo_relpath);
+
+	buffer_init(&job->mem);
+	if (!prefix_relpath) {
+		job->sink.mem = &job->mem;
+	} else if (prefix) {
+		len = mmstrlen(prefix) + mmstrlen(prefix_relpath) + 1;
+		job->path = mmstr_malloc(len);
+		mmstr_join_path(job->path, prefix, prefix_relpath);
+	} else {
+		job->path = mmstrdup(prefix_relpath);
+	}
+
+	if (job->path && ref_sha && ref_size) {
+		job->sink.max_size = ref_size;
+		len = mmstrlen(job->path) + sizeof(PART_EXT);
+		job->part_path = mmstr_malloc(len);
+		mmstrcpy(job->part_path, job->path);
+		mmstrcat_cstr(job->part_path, PART_EXT);
+	}
+
+	// Append to the queue of pending jobs
+	if (batch->last)
+		batch->last->next = job;
+	else
+		batch->head = job;
+
+	batch->last = job;
+	return job;
+}
+
+
+/**
+ * download_batch_finish_job() - process the termination of a job
+ * @batch:      download batch the job belongs to
+ * @job:        terminated job
+ * @status:     0 if job has succeeded, -1 otherwise
+ *
+ * Release the resources held by @job (the easy handle is kept for reuse by
+ * next jobs), notify the done callback and destroy @job.
+ */
+static
+void download_batch_finish_job(struct download_batch* batch,
+                               struct download_job* job, int status)
+{
+	mm_close(job->sink.fd);
+	job->sink.fd = -1;
+
+	if (job->curl) {
+		buffer_push(&batch->idle_handles, &job->curl, sizeof(job->curl));
+		job->curl = NULL;
+	}
+
+	if (batch->done_cb(batch, job, status))
+		batch->num_failed++;
+
+	download_job_destroy(job);
+}
+
+
+/**
+ * download_job_open_part() - open partial file of a resumable job
+ * @job:        resumable job about to be started
+ *
+ * If a partial file is left from a previous interrupted transfer and is
+ * smaller than the expected size, its content is hashed and the transfer
+ * will be resumed from its end. Otherwise the partial file is truncated.
+ * @job->resume_from and @job->sink.size are set accordingly.
+ *
+ * Return: file descriptor of the partial file opened for writing in case of
+ * success, -1 otherwise with error state set accordingly.
+ */
+static
+int download_job_open_part(struct download_job* job)
+{
+	char data[PART_READ_SIZE];
+	struct mm_stat st;
+	size_t remaining;
+	ssize_t rsz;
+	int fd;
+
+	job->resume_from = 0;
+	if (mm_check_access(job->part_path, F_OK) == 0
+	    && mm_stat(job->part_path, &st, 0) == 0
+	    && st.size > 0 && (size_t)st.size < job->sink.max_size)
+		job->resume_from = st.size;
+
+	fd = open_file_in_prefix(NULL, job->part_path, O_RDWR|O_CREAT);
+	if (fd < 0)
+		return -1;
+
+	// Hash data already received
+	remaining = job->resume_from;
+	while (remaining > 0) {
+		rsz = mm_read(fd, data, MIN(remaining, sizeof(data)));
+		if (rsz <= 0)
+			break;
+
+		if (job->sink.hash_data)
+			sha256_update(&job->sink.sha_ctx, data, rsz);
+
+		remaining -= rsz;
+	}
+
+	// Start from scratch if partial file could not be read back
+	if (remaining > 0) {
+		job->resume_from = 0;
+		if (job->sink.hash_data)
+			sha256_init(&job->sink.sha_ctx);
+	}
+
+	if (mm_ftruncate(fd, job->resume_from)
+	    || mm_seek(fd, job->resume_from, SEEK_SET) < 0) {
+		mm_close(fd);
+		return -1;
+	}
+
+	if (job->resume_from)
+		mm_log_info("Resuming download of %s from offset %zu",
+		            job->url, job->resume_from);
+
+	job->sink.size = job->resume_from;
+	return fd;
+}
+
+
+/**
+ * download_job_discard_part() - remove partial file of a job if any
+ * @job:        job whose partial file must be removed
+ */
+static
+void download_job_discard_part(struct download_job* job)
+{
+	if (!job->part_path)
+		return;
+
+	if (mm_check_access(job->part_path, F_OK) == 0)
+		mm_unlink(job->part_path);
+}
+
+
+/**
+ * download_job_complete() - finalize a job whose transfer has succeeded
+ * @job:        job whose transfer has succeeded
+ *
+ * Flush the decompressed data if any, verify the hash of data received and,
+ * for resumable job, move the partial file to its final destination. For
+ * conditional job, detect whether the server has reported the resource as
+ * not modified.
+ *
+ * Return: 0 in case of success, -1 otherwise with error state set
+ */
+static
+int download_job_complete(struct download_job* job)
+{
+	long respcode;
+	int rv = 0;
+
+	if (job->cond) {
+		curl_easy_getinfo(job->curl, CURLINFO_RESPONSE_CODE, &respcode);
+		if (respcode == 304) {
+			job->cond->not_modified = 1;
+			return 0;
+		}
+	}
+
+	// Flush the data remaining in decoder
+	if (job->sink.decoder)
+		rv = sink_decode(&job->sink, NULL, 0, 1);
+
+	mm_close(job->sink.fd);
+	job->sink.fd = -1;
+	if (rv)
+		return -1;
+
+	if (download_sink_check_hash(&job->sink, job->ref_sha, job->url)) {
+		download_job_discard_part(job);
+		return -1;
+	}
+
+	if (job->part_path)
+		return mm_rename(job->part_path, job->path);
+
+	return 0;
+}
+
+
+/**
+ * download_cond_deinit() - cleanup validators of conditional download
+ * @cond:       validators to cleanse
+ */
+LOCAL_SYMBOL
+void download_cond_deinit(struct download_cond* cond)
+{
+	mmstr_free(cond->etag);
+	mmstr_free(cond->last_modified);
+	mmstr_free(cond->resp_etag);
+	mmstr_free(cond->resp_last_modified);
+	*cond = (struct download_cond) {0};
+}
+
+
+/**
+ * header_value_dup() - copy value of HTTP header if it has the given name
+ * @line:       header line as received from server (not null terminated)
+ * @len:        length of @line
+ * @name:       name of header (including ':') to match
+ *
+ * Return: allocated copy of value stripped from whitespace if @line is the
+ * header @name, NULL otherwise.
+ */
+static
+mmstr* header_value_dup(const char* line, size_t len, const char* name)
+{
+	size_t namelen = strlen(name);
+
+	if (len < namelen || strncasecmp(line, name, namelen) != 0)
+		return NULL;
+
+	line += namelen;
+	len -= namelen;
+
+	// Strip leading spaces and trailing end of line
+	while (len > 0 && (line[0] == ' ' || line[0] == '\t')) {
+		line++;
+		len--;
+	}
+
+	while (len > 0 && (line[len-1] == '\r' || line[len-1] == '\n'
+	                   || line[len-1] == ' '))
+		len--;
+
+	return mmstr_malloc_copy(line, len);
+}
+
+
+/**
+ * record_validator_header() - curl header callback of conditional download
+ * @buffer:     header line received
+ * @size:       size of one element of @buffer (always 1)
+ * @nmemb:      number of elements in @buffer
+ * @data:       pointer to struct download_cond of the transfer
+ *
+ * Keep the ETag and Last-Modified headers of the last response received.
+ *
+ * Return: @size*@nmemb
+ */
+static
+size_t record_validator_header(char* buffer, size_t size, size_t nmemb,
+                               void* data)
+{
+	struct download_cond* cond = data;
+	size_t len = size*nmemb;
+	mmstr* value;
+
+	// A new response starts (after redirection for example)
+	if (len > 5 && strncmp(buffer, "HTTP/", 5) == 0) {
+		mmstr_free(cond->resp_etag);
+		mmstr_free(cond->resp_last_modified);
+		cond->resp_etag = NULL;
+		cond->resp_last_modified = NULL;
+		return len;
+	}
+
+	if ((value = header_value_dup(buffer, len, "ETag:"))) {
+		mmstr_free(cond->resp_etag);
+		cond->resp_etag = value;
+	} else if ((value = header_value_dup(buffer, len, "Last-Modified:"))) {
+		mmstr_free(cond->resp_last_modified);
+		cond->resp_last_modified = value;
+	}
+
+	return len;
+}
+
+
+/**
+ * download_job_set_cond() - make the request of job conditional
+ * @job:        job about to be started whose cond field is set
+ */
+static
+void download_job_set_cond(struct download_job* job)
+{
+	struct download_cond* cond = job->cond;
+	mmstr* hdr;
+
+	cond->not_modified = 0;
+
+	curl_slist_free_all(job->headers);
+	job->headers = NULL;
+
+	if (cond->etag) {
+		hdr = mmstr_malloc(mmstrlen(cond->etag) + 16);
+		mmstrcpy_cstr(hdr, "If-None-Match: ");
+		mmstrcat(hdr, cond->etag);
+		job->headers = curl_slist_append(job->headers, hdr);
+		mmstr_free(hdr);
+	}
+
+	if (cond->last_modified) {
+		hdr = mmstr_malloc(mmstrlen(cond->last_modified) + 20);
+		mmstrcpy_cstr(hdr, "If-Modified-Since: ");
+		mmstrcat(hdr, cond->last_modified);
+		job->headers = curl_slist_append(job->headers, hdr);
+		mmstr_free(hdr);
+	}
+
+	curl_easy_setopt(job->curl, CURLOPT_HTTPHEADER, job->headers);
+	curl_easy_setopt(job->curl, CURLOPT_HEADERFUNCTION,
+	                 record_validator_header);
+	curl_easy_setopt(job->curl, CURLOPT_HEADERDATA, cond);
+}
+
+
+/**
+ * download_batch_start_next() - start the first pending job of the batch
+ * @batch:      download batch whose pending job must be started
+ * @multi:      curl multi handle driving the transfers
+ */
+static
+void download_batch_start_next(struct download_batch* batch, CURLM* multi)
+{
+	struct download_job* job;
+	CURL* curl;
+
+	// Pop job from the queue of pending jobs
+	job = batch->head;
+	batch->head = job->next;
+	if (!batch->head)
+		batch->last = NULL;
+
+	job->next = NULL;
+
+	// Reuse an idle easy handle if any, create one otherwise
+	if (batch->idle_handles.size) {
+		buffer_pop(&batch->idle_handles, &curl, sizeof(curl));
+	} else {
+		curl = curl_easy_init();
+		if (curl == NULL) {
+			mm_raise_from_errno("curl init failed");
+			download_batch_finish_job(batch, job, -1);
+			return;
+		}
+	}
+
+	job->curl = curl;
+	setup_curl_handle(curl, job->errbuf);
+
+	if (job->sink.hash_data)
+		sha256_init(&job->sink.sha_ctx);
+
+	job->sink.size = 0;
+	job->mem.size = 0;
+	if (job->part_path) {
+		job->sink.fd = download_job_open_part(job);
+	} else if (job->path) {
+		job->sink.fd = open_file_in_prefix(NULL, job->path,
+		                                   O_WRONLY|O_CREAT|O_TRUNC);
+	}
+
+	if (job->path && job->sink.fd < 0) {
+		download_batch_finish_job(batch, job, -1);
+		return;
+	}
+
+	if (job->cond)
+		download_job_set_cond(job);
+
+	if (job->decompress) {
+		decoder_destroy(job->sink.decoder);
+		job->sink.decoder = decoder_create();
+		if (!job->sink.decoder) {
+			download_batch_finish_job(batch, job, -1);
+			return;
+		}
+	}
+
+	curl_easy_setopt(curl, CURLOPT_RESUME_FROM_LARGE,
+	                 (curl_off_t)job->resume_from);
+
+	job->errbuf[0] = '\0';
+	curl_easy_setopt(curl, CURLOPT_WRITEDATA, &job->sink);
+	curl_easy_setopt(curl, CURLOPT_URL, job->url);
+	curl_easy_setopt(curl, CURLOPT_PRIVATE, job);
+
+	if (curl_multi_add_handle(multi, curl) != CURLM_OK) {
+		mm_raise_error(ENOMEM, "Cannot start download of %s",
+		               job->url);
+		download_batch_finish_job(batch, job, -1);
+		return;
+	}
+
+	job->next = batch->running;
+	batch->running = job;
+	batch->num_running++;
+}
+
+
+/**
+ * download_batch_detach_job() - remove a job from the running transfers
+ * @batch:      download batch the job belongs to
+ * @job:        running job
+ * @multi:      curl multi handle driving the transfers
+ */
+static
+void download_batch_detach_job(struct download_batch* batch,
+                               struct download_job* job, CURLM* multi)
+{
+	struct download_job** pjob;
+
+	for (pjob = &batch->running; *pjob; pjob = &(*pjob)->next) {
+		if (*pjob == job) {
+			*pjob = job->next;
+			break;
+		}
+	}
+
+	job->next = NULL;
+	curl_multi_remove_handle(multi, job->curl);
+	batch->num_running--;
+}
+
+
+/**
+ * download_batch_abort_running() - stop all running transfers of a batch
+ * @batch:      download batch being performed
+ * @multi:      curl multi handle driving the transfers
+ *
+ * The easy handles of the running jobs are removed from @multi and the jobs
+ * are terminated as failed. The partial files are kept for resumption.
+ */
+static
+void download_batch_abort_running(struct download_batch* batch, CURLM* multi)
+{
+	struct download_job* job;
+
+	while (batch->running) {
+		job = batch->running;
+		download_batch_detach_job(batch, job, multi);
+		mm_raise_error(EIO, "Download of %s aborted", job->url);
+		download_batch_finish_job(batch, job, -1);
+	}
+}
+
+
+/**
+ * download_batch_restart_job() - restart a resumed job from scratch
+ * @batch:      download batch the job belongs to
+ * @job:        job whose resumed transfer has been refused by the server
+ *
+ * The partial file is discarded and the job is put back at the head of the
+ * queue of pending jobs.
+ */
+static
+void download_batch_restart_job(struct download_batch* batch,
+                                struct download_job* job)
+{
+	mm_log_info("Cannot resume download of %s, restarting", job->url);
+
+	mm_close(job->sink.fd);
+	job->sink.fd = -1;
+	download_job_discard_part(job);
+
+	buffer_push(&batch->idle_handles, &job->curl, sizeof(job->curl));
+	job->curl = NULL;
+
+	job->next = batch->head;
+	batch->head = job;
+	if (!batch->last)
+		batch->last = job;
+}
+
+
+/**
+ * is_resume_refused() - test whether transfer failed because of resumption
+ * @curl:       curl handle used for the transfer
+ * @res:        result code of the transfer
+ *
+ * Return: 1 if the server has refused to serve the requested range, 0
+ * otherwise.
+ */
+static
+int is_resume_refused(CURL* curl, CURLcode res)
+{
+	long respcode;
+
+	if (res == CURLE_RANGE_ERROR)
+		return 1;
+
+	if (res == CURLE_HTTP_RETURNED_ERROR) {
+		curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &respcode);
+		return (respcode == 416);
+	}
+
+	return 0;
+}
+
+
+/**
+ * download_batch_process_done() - handle the transfers that have terminated
+ * @batch:      download batch being performed
+ * @multi:      curl multi handle driving the transfers
+ */
+static
+void download_batch_process_done(struct download_batch* batch, CURLM* multi)
+{
+	struct download_job* job;
+	CURLMsg* msg;
+	CURLcode res;
+	char* priv;
+	int num_msg, err, status;
+
+	while ((msg = curl_multi_info_read(multi, &num_msg)) != NULL) {
+		if (msg->msg != CURLMSG_DONE)
+			continue;
+
+		curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, &priv);
+		job = (struct download_job*)priv;
+		res = msg->data.result;
+
+		download_batch_detach_job(batch, job, multi);
+
+		if (res != CURLE_OK
+		    && job->resume_from
+		    && is_resume_refused(job->curl, res)) {
+			download_batch_restart_job(batch, job);
+			continue;
+		}
+
+		status = 0;
+		if (res != CURLE_OK) {
+			err = get_error_from_curl(job->curl, res, job->errbuf);
+			mm_raise_error(err, "Failed to download %s (%s)",
+			               job->url, job->errbuf);
+			status = -1;
+
+			// Partial data is kept for resumption only if valid
+			if (res == CURLE_WRITE_ERROR)
+				download_job_discard_part(job);
+		} else {
+			status = download_job_complete(job);
+		}
+
+		// Only transfers run to their end are measured
+		record_metrics(batch->ctx, job->curl, job->url, status,
+		               &job->metrics);
+		download_batch_finish_job(batch, job, status);
+	}
+}
+
+
+/**
+ * download_batch_perform() - run all the transfers of a download batch
+ * @batch:      download batch to perform
+ *
+ * This function performs concurrently the jobs queued in @batch, including
+ * the ones queued by the done callback while the batch is being performed.
+ * At most max-parallel-downloads transfers are run at the same time (and at
+ * most max-host-connections connections are opened to the same host). The
+ * function returns when there is no job left to run.
+ *
+ * Return: 0 if all jobs have succeeded, -1 if the done callback has reported
+ * at least one failure or if the transfers could not be driven (the running
+ * jobs are then terminated as failed).
+ */
+LOCAL_SYMBOL
+int download_batch_perform(struct download_batch* batch)
+{
+	CURLM* multi;
+	int still_running, max_running;
+
+	multi = get_curl_multi_handle(batch->ctx);
+	if (!multi)
+		return -1;
+
+	max_running = batch->ctx->settings.max_parallel_downloads;
+	if (max_running < 1)
+		max_running = 1;
+
+	while (batch->head || batch->num_running) {
+		while (batch->head && batch->num_running < max_running)
+			download_batch_start_next(batch, multi);
+
+		if (!batch->num_running)
+			continue;
+
+		if (curl_multi_perform(multi, &still_running) != CURLM_OK) {
+			mm_raise_error(EIO, "curl multi perform failed");
+			download_batch_abort_running(batch, multi);
+			return -1;
+		}
+
+		download_batch_process_done(batch, multi);
+
+		if (still_running)
+			curl_multi_wait(multi, NULL, 0, 1000, NULL);
+	}
+
+	return (batch->num_failed == 0) ? 0 : -1;
+}
+
+
+/**************************************************************************
+ *                                                                        *
+ *                           Streamed download                            *
+ *                                                                        *
+ **************************************************************************/
+
+/**
+ * download_stream_open() - start a download whose data is consumed on the fly
+ * @stream:     download stream to initialize
+ * @ctx:        mmpack context used for the transfer
+ * @repo:       URL of repository
+ * @repo_relpath: path relative to @repo URL of the resource to download
+ * @path:       path of the file where the downloaded data is also written
+ * @ref_sha:    expected SHA-256 in hexadecimal of the resource (may be NULL)
+ *
+ * This starts the transfer of the resource. The data must be then consumed
+ * with download_stream_read() as it arrives. Meanwhile it is also written in
+ * @path and, if @ref_sha is not NULL, hashed. The stream must be cleansed
+ * with download_stream_close() when done with it.
+ *
+ * Return: 0 in case of success, -1 otherwise with error state set
+ * accordingly. In both cases, download_stream_close() must be called.
+ */
+LOCAL_SYMBOL
+int download_stream_open(struct download_stream* stream,
+                         struct mmpack_ctx* ctx,
+                         const mmstr* repo, const mmstr* repo_relpath,
+                         const mmstr* path, const mmstr* ref_sha)
+{
+	int len;
+
+	*stream = (struct download_stream) {.ctx = ctx, .sink = {.fd = -1}};
+	buffer_init(&stream->data);
+	stream->sink.mem = &stream->data;
+
+	len = mmstrlen(repo) + mmstrlen(repo_relpath) + 1;
+	stream->url = mmstr_malloc(len);
+	mmstr_join_path(stream->url, repo, repo_relpath);
+	stream->path = mmstrdup(path);
+
+	if (ref_sha) {
+		stream->ref_sha = mmstrdup(ref_sha);
+		stream->sink.hash_data = 1;
+		sha256_init(&stream->sink.sha_ctx);
+	}
+
+	stream->multi = get_curl_multi_handle(ctx);
+	if (!stream->multi)
+		return -1;
+
+	stream->sink.fd = open_file_in_prefix(NULL, path,
+	                                      O_WRONLY|O_CREAT|O_TRUNC);
+	if (stream->sink.fd < 0)
+		return -1;
+
+	stream->curl = curl_easy_init();
+	if (stream->curl == NULL)
+		return mm_raise_from_errno("curl init failed");
+
+	setup_curl_handle(stream->curl, stream->errbuf);
+	curl_easy_setopt(stream->curl, CURLOPT_WRITEDATA, &stream->sink);
+	curl_easy_setopt(stream->curl, CURLOPT_URL, stream->url);
+
+	if (curl_multi_add_handle(stream->multi, stream->curl) != CURLM_OK) {
+		curl_easy_cleanup(stream->curl);
+		stream->curl = NULL;
+		return mm_raise_error(ENOMEM, "Cannot start download of %s",
+		                      stream->url);
+	}
+
+	return 0;
+}
+
+
+/**
+ * download_stream_check_done() - check whether the transfer has terminated
+ * @stream:     download stream being performed
+ */
+static
+void download_stream_check_done(struct download_stream* stream)
+{
+	CURLMsg* msg;
+	int num_msg;
+
+	while ((msg = curl_multi_info_read(stream->multi, &num_msg)) != NULL) {
+		if (msg->msg != CURLMSG_DONE
+		    || msg->easy_handle != stream->curl)
+			continue;
+
+		stream->done = 1;
+		stream->result = msg->data.result;
+	}
+}
+
+
+/**
+ * download_stream_read() - get next chunk of data of a download stream
+ * @stream:     download stream opened with download_stream_open()
+ * @buf:        pointer receiving the address of the data chunk
+ *
+ * Wait for data to be received. The data returned in @buf remains valid
+ * until the next call to download_stream_read() or download_stream_close().
+ *
+ * Return: the size of the chunk returned in @buf, 0 if the whole resource
+ * has been read, -1 in case of failure with error state set accordingly.
+ */
+LOCAL_SYMBOL
+ssize_t download_stream_read(struct download_stream* stream,
+                             const void** buf)
+{
+	int still_running, err;
+
+	// Data returned by the previous call has been consumed
+	stream->data.size = 0;
+
+	while (stream->data.size == 0 && !stream->done) {
+		if (curl_multi_perform(stream->multi, &still_running)
+		    != CURLM_OK)
+			return mm_raise_error(EIO, "curl multi perform failed");
+
+		download_stream_check_done(stream);
+		if (stream->data.size == 0 && !stream->done)
+			curl_multi_wait(stream->multi, NULL, 0, 1000, NULL);
+	}
+
+	if (stream->done && stream->result != CURLE_OK) {
+		err = get_error_from_curl(stream->curl, stream->result,
+		                          stream->errbuf);
+		return mm_raise_error(err, "Failed to download %s (%s)",
+		                      stream->url, stream->errbuf);
+	}
+
+	*buf = stream->data.base;
+	return stream->data.size;
+}
+
+
+/**
+ * download_stream_finish() - complete a download stream
+ * @stream:     download stream opened with download_stream_open()
+ *
+ * Receive the data of the resource that has not been consumed yet (if
+ * any) and verify that the data received match the expected hash. If not,
+ * the file written along the transfer is removed.
+ *
+ * Return: 0 if the whole resource has been received and is valid, -1
+ * otherwise with error state set accordingly.
+ */
+LOCAL_SYMBOL
+int download_stream_finish(struct download_stream* stream)
+{
+	const void* buf;
+	ssize_t rsz;
+
+	do {
+		rsz = download_stream_read(stream, &buf);
+	} while (rsz > 0);
+
+	mm_close(stream->sink.fd);
+	stream->sink.fd = -1;
+
+	if (rsz < 0
+	    || download_sink_check_hash(&stream->sink, stream->ref_sha,
+	                                stream->url)) {
+		mm_unlink(stream->path);
+		return -1;
+	}
+
+	stream->verified = 1;
+	return 0;
+}
+
+
+/**
+ * download_stream_close() - cleanup a download stream
+ * @stream:     download stream to cleanse
+ *
+ * If the transfer was still running, it is aborted. If it has terminated, its
+ * metrics are left in @stream->metrics.
+ */
+LOCAL_SYMBOL
+void download_stream_close(struct download_stream* stream)
+{
+	int status;
+
+	if (stream->curl) {
+		status = (stream->done && stream->result == CURLE_OK) ? 0 : -1;
+		record_metrics(stream->ctx, stream->curl, stream->url,
+		               status, &stream->metrics);
+
+		if (stream->multi)
+			curl_multi_remove_handle(stream->multi, stream->curl);
+
+		curl_easy_cleanup(stream->curl);
+	}
+
+	if (stream->sink.fd >= 0) {
+		mm_close(stream->sink.fd);
+		mm_unlink(stream->path);
+	}
+
+	buffer_deinit(&stream->data);
+	mmstr_free(stream->url);
+	mmstr_free(stream->path);
+	mmstr_free(stream->ref_sha);
+}
@@ -4,12 +4,242 @@
 #ifndef DOWNLOAD_H
 #define DOWNLOAD_H
 
+#include <curl/curl.h>
+#include <stdio.h>
+
 #include "context.h"
 #include "mmstring.h"
+#include "sha256.h"
+#include "utils.h"
+
+struct download_batch;
+struct download_job;
+
+/**
+ * typedef download_done_cb - callback called when a job of batch terminates
+ * @batch:      download batch the job was part of
+ * @job:        job that has just terminated
+ * @status:     0 if the transfer has succeeded, -1 otherwise (error state is
+ *              set accordingly in such a case)
+ *
+ * The callback is allowed to queue new jobs in @batch (typically to retry
+ * the failed transfer from another repository).
+ *
+ * Return: 0 if the job must be considered as successful (or handled by a
+ * new queued job), -1 if it must be accounted as a failure of the batch.
+ */
+typedef int (* download_done_cb)(struct download_batch* batch,
+                                 struct download_job* job, int status);
 
+/**
+ * struct download_sink - destination of downloaded data
+ * @fd:         file descriptor where the received data is written
+ * @hash_data:  if non zero, the received data is fed into @sha_ctx
+ * @sha_ctx:    SHA-256 context updated as data are received
+ * @mem:        if not NULL, buffer to which the received data is appended
+ * @size:       amount of data written so far in @fd
+ * @max_size:   if not zero, the transfer is aborted if @size would exceed it
+ * @decoder:    if not NULL, state of the decoder decompressing the data
+ *              received before it is written
+ */
+struct download_sink {
+	int fd;
+	int hash_data;
+	SHA256_CTX sha_ctx;
+	struct buffer* mem;
+	size_t size;
+	size_t max_size;
+	void* decoder;
+};
+
+/**
+ * struct download_cond - validators of a conditional download
+ * @etag:       entity tag of the local copy of the resource (may be NULL)
+ * @last_modified: value of Last-Modified header received along the local
+ *              copy of the resource (may be NULL)
+ * @resp_etag:  entity tag sent by the server in its response (NULL if none)
+ * @resp_last_modified: Last-Modified header sent by the server in its
+ *              response (NULL if none)
+ * @not_modified: set to non zero if the server has reported that the
+ *              resource has not changed since the local copy
+ *
+ * If a job is associated with such a structure, the resource is requested
+ * only if it has changed compared to the local copy identified by @etag
+ * and @last_modified. If it has not, the job succeeds without any data being
+ * received and @not_modified is set.
+ */
+struct download_cond {
+	mmstr* etag;
+	mmstr* last_modified;
+	mmstr* resp_etag;
+	mmstr* resp_last_modified;
+	int not_modified;
+};
+
+void download_cond_deinit(struct download_cond* cond);
+
+/**
+ * struct download_metrics - timing measurements of a terminated transfer
+ * @namelookup_time: time in seconds spent to resolve the remote host name
+ * @connect_time: time in seconds spent to connect to the remote host
+ * @ttfb:       time in seconds until the first byte has been received
+ * @total_time: total time in seconds of the transfer
+ * @size:       amount of bytes received
+ * @speed:      average download speed in bytes per second
+ * @reused:     non zero if the transfer has reused an established connection,
+ *              in which case @connect_time is not meaningful
+ *
+ * All times are measured from the start of the transfer.
+ */
+struct download_metrics {
+	double namelookup_time;
+	double connect_time;
+	double ttfb;
+	double total_time;
+	size_t size;
+	double speed;
+	int reused;
+};
+
+
+/**
+ * struct download_summary - aggregated metrics of the transfers of a run
+ * @num_transfers: number of transfers performed
+ * @num_failed: number of transfers which have failed
+ * @sum:        sum of the metrics of all transfers
+ * @log:        stream where the metrics of each transfer are written as JSON
+ *              lines (NULL if not opened yet)
+ */
+struct download_summary {
+	int num_transfers;
+	int num_failed;
+	struct download_metrics sum;
+	FILE* log;
+};
+
+void download_summary_destroy(struct download_summary* summary);
+void download_report_summary(struct mmpack_ctx* ctx);
+
+
+/**
+ * struct download_job - single transfer of a download batch
+ * @next:       next job in the queue of pending jobs, or in the list of
+ *              running jobs once the transfer has started
+ * @curl:       easy handle used for the transfer (NULL if not started)
+ * @url:        URL of the remote resource
+ * @path:       path of the local file where the resource is written. If NULL,
+ *              the resource is received in @mem only.
+ * @part_path:  path of the partial file where the resource is written while
+ *              being received (NULL if the download is not resumable)
+ * @ref_sha:    expected SHA-256 of the resource (NULL if not checked)
+ * @resume_from: offset from which the transfer has been resumed
+ * @sink:       destination of the data while the transfer is running
+ * @mem:        data received if @path is NULL
+ * @cond:       validators making the request conditional (may be NULL)
+ * @headers:    list of extra HTTP headers sent in the request
+ * @decompress: if non zero, the resource is xz-compressed and is
+ *              decompressed on the fly while being received
+ * @metrics:    measurements of the transfer, zeroed if it has not been run to
+ *              its end
+ * @data:       user data associated with the job
+ * @errbuf:     buffer where curl may write error message
+ */
+struct download_job {
+	struct download_job* next;
+	CURL* curl;
+	mmstr* url;
+	mmstr* path;
+	mmstr* part_path;
+	mmstr* ref_sha;
+	size_t resume_from;
+	struct download_sink sink;
+	struct buffer mem;
+	struct download_cond* cond;
+	struct curl_slist* headers;
+	int decompress;
+	struct download_metrics metrics;
+	void* data;
+	char errbuf[CURL_ERROR_SIZE];
+};
+
+/**
+ * struct download_batch - set of transfers to run concurrently
+ * @ctx:        mmpack context (provides settings and curl multi handle)
+ * @done_cb:    callback called each time a job terminates
+ * @head:       first job in the queue of pending jobs
+ * @last:       last job in the queue of pending jobs
+ * @running:    list of jobs whose transfer is attached to the multi handle
+ * @idle_handles: curl easy handles that can be reused by the next jobs
+ * @num_running: number of transfers currently running
+ * @num_failed: number of jobs accounted as failed by @done_cb
+ */
+struct download_batch {
+	struct mmpack_ctx* ctx;
+	download_done_cb done_cb;
+	struct download_job* head;
+	struct download_job* last;
+	struct download_job* running;
+	struct buffer idle_handles;
+	int num_running;
+	int num_failed;
+};
+
+/**
+ * struct download_stream - transfer whose data is consumed as it arrives
+ * @ctx:        mmpack context used for the transfer
+ * @multi:      curl multi handle driving the transfer
+ * @curl:       easy handle of the transfer
+ * @url:        URL of the remote resource
+ * @path:       path of the local file where the resource is also written
+ * @ref_sha:    expected SHA-256 of the resource (NULL if not checked)
+ * @sink:       destination of the data received
+ * @data:       data received and not consumed yet
+ * @done:       non zero once the transfer has terminated
+ * @result:     curl result code of the terminated transfer
+ * @verified:   non zero once the whole resource has been received and checked
+ * @metrics:    metrics of the transfer, filled by download_stream_close()
+ * @errbuf:     buffer where curl may write error message
+ */
+struct download_stream {
+	struct mmpack_ctx* ctx;
+	CURLM* multi;
+	CURL* curl;
+	mmstr* url;
+	mmstr* path;
+	mmstr* ref_sha;
+	struct download_sink sink;
+	struct buffer data;
+	int done;
+	CURLcode result;
+	int verified;
+	struct download_metrics metrics;
+	char errbuf[CURL_ERROR_SIZE];
+};
+
+int download_can_decompress(void);
 int download_from_repo(struct mmpack_ctx * ctx,
                        const mmstr* repo, const mmstr* repo_relpath,
                        const mmstr* prefix, const mmstr* prefix_relpath);
 
-#endif /* DOWNLOAD_H */
+void download_batch_init(struct download_batch* batch,
+                         struct mmpack_ctx* ctx, download_done_cb done_cb);
+void download_batch_deinit(struct download_batch* batch);
+struct download_job* download_batch_add(struct download_batch* batch,
+                                        const mmstr* repo,
+                                        const mmstr* repo_relpath,
+                                        const mmstr* prefix,
+                                        const mmstr* prefix_relpath,
+                                        const mmstr* ref_sha, size_t ref_size,
+                                        void* data);
+int download_batch_perform(struct download_batch* batch);
+
+int download_stream_open(struct download_stream* stream,
+                         struct mmpack_ctx* ctx,
+                         const mmstr* repo, const mmstr* repo_relpath,
+                         const mmstr* path, const mmstr* ref_sha);
+ssize_t download_stream_read(struct download_stream* stream,
+                             const void** buf);
+int download_stream_finish(struct download_stream* stream);
+void download_stream_close(struct download_stream* stream);
 
+#endif /* DOWNLOAD_H */
@@ -0,0 +1,599 @@
+/*
+ * @mindmaze_header@
+ */
+#if defined (HAVE_CONFIG_H)
+# include <config.h>
+#endif
+
+#include <errno.h>
+#include <mmerrno.h>
+#include <mmlib.h>
+#include <mmsysio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined (HAVE_LIBURING)
+# include <fcntl.h>
+# include <liburing.h>
+#endif
+
+#include "dir-cache.h"
+#include "file-batch.h"
+#include "mmstring.h"
+#include "utils.h"
+#include "xx-alloc.h"
+
+/*
+ * The operations queued in a batch are submitted to the kernel through
+ * io_uring, hence creating a file and placing it in its final location
+ * costs a few system calls per batch instead of several per file.
+ *
+ * Operations are queued until FILE_BATCH_MAX_OPS operations or
+ * FILE_BATCH_MAX_DATA bytes of file content are pending. At most
+ * FILE_BATCH_RING_SIZE requests are in flight at once, which guarantees that
+ * the completion queue (twice as large as the submission queue) never
+ * overflows.
+ */
+#define FILE_BATCH_RING_SIZE 256
+#define FILE_BATCH_MAX_OPS 1024
+#define FILE_BATCH_MAX_DATA (4*1024*1024)
+
+#define OP_CREATE 0
+#define OP_RENAME 1
+
+/**
+ * struct file_batch_op - operation queued in a file batch
+ * @type:       OP_CREATE or OP_RENAME
+ * @path:       path of the file to create or to rename
+ * @newpath:    destination of the rename
+ * @mode:       permission of the file to create
+ * @fd:         file descriptor of the file being created (-1 if not opened)
+ * @offset:     offset of the content of the file in the batch data
+ * @size:       size of the content of the file
+ * @written:    amount of content written
+ * @res:        result of the last request submitted for this operation
+ */
+struct file_batch_op {
+	int type;
+	mmstr* path;
+	mmstr* newpath;
+	int mode;
+	int fd;
+	size_t offset;
+	size_t size;
+	size_t written;
+	int res;
+};
+
+
+static
+void file_batch_clear_ops(struct file_batch* batch)
+{
+	struct file_batch_op* op;
+	int i;
+
+	for (i = 0; i < batch->num_ops; i++) {
+		op = &batch->ops[i];
+		if (op->fd >= 0)
+			mm_close(op->fd);
+
+		mmstr_free(op->path);
+		mmstr_free(op->newpath);
+	}
+
+	batch->num_ops = 0;
+	batch->data.size = 0;
+}
+
+
+static
+struct file_batch_op* file_batch_push_op(struct file_batch* batch, int type,
+                                         const char* path)
+{
+	struct file_batch_op* op;
+
+	op = &batch->ops[batch->num_ops++];
+	*op = (struct file_batch_op) {
+		.type = type,
+		.path = mmstr_malloc_from_cstr(path),
+		.fd = -1,
+	};
+
+	return op;
+}
+
+
+#if defined (HAVE_LIBURING)
+
+#define REQ_OPEN 0
+#define REQ_WRITE 1
+#define REQ_CLOSE 2
+#define REQ_RENAME 3
+
+#define REQ_DATA(index, req) ((void*)(((uintptr_t)(index) << 2) | (req)))
+#define REQ_INDEX(data) ((int)((uintptr_t)(data) >> 2))
+#define REQ_TYPE(data) ((int)((uintptr_t)(data) & 3))
+
+
+/**
+ * write_remaining() - synchronously write content not written by io_uring
+ * @batch:      batch owning the operation
+ * @op:         file creation operation whose file is still open
+ *
+ * Return: 0 in case of success, -1 otherwise with error state set
+ */
+static
+int write_remaining(struct file_batch* batch, struct file_batch_op* op)
+{
+	const char* data = (const char*)batch->data.base + op->offset;
+	ssize_t rsz;
+
+	if (mm_seek(op->fd, op->written, SEEK_SET) < 0)
+		return -1;
+
+	while (op->written < op->size) {
+		rsz = mm_write(op->fd, data + op->written,
+		               op->size - op->written);
+		if (rsz < 0)
+			return -1;
+
+		op->written += rsz;
+	}
+
+	return 0;
+}
+
+
+/**
+ * create_file_sync() - create synchronously the file of an operation
+ * @batch:      batch owning the operation
+ * @op:         file creation operation
+ *
+ * Like in the unbatched extraction, a file left at the location is removed
+ * rather than truncated since it might be a hardlink to another file.
+ *
+ * Return: 0 in case of success, -1 otherwise with error state set
+ */
+static
+int create_file_sync(struct file_batch* batch, struct file_batch_op* op)
+{
+	op->fd = dir_cache_create_file(batch->cache, op->path, op->mode);
+	return (op->fd < 0) ? -1 : 0;
+}
+
+
+static
+int raise_op_error(const struct file_batch_op* op, int res, const char* what)
+{
+	errno = -res;
+	return mm_raise_from_errno("Cannot %s %s", what, op->path);
+}
+
+
+/**
+ * prep_requests() - queue the io_uring requests of an operation
+ * @batch:      batch owning the operation
+ * @op:         operation to submit
+ * @index:      index of @op in the batch
+ * @phase:      REQ_OPEN, REQ_WRITE or REQ_RENAME
+ *
+ * In the REQ_WRITE phase, the write of the content and the close of the
+ * file are linked: if the write is short, the close is cancelled and both
+ * are completed synchronously.
+ *
+ * Return: the number of requests queued
+ */
+static
+int prep_requests(struct file_batch* batch, struct file_batch_op* op,
+                  int index, int phase)
+{
+	struct io_uring* ring = batch->ring;
+	struct io_uring_sqe* sqe;
+	const char * data, * name, * newname;
+	int dirfd, newdirfd;
+
+	switch (phase) {
+	case REQ_OPEN:
+		dirfd = dir_cache_resolve(batch->cache, op->path, &name);
+		sqe = io_uring_get_sqe(ring);
+		io_uring_prep_openat(sqe, dirfd, name,
+		                     O_CREAT|O_EXCL|O_WRONLY|O_CLOEXEC,
+		                     op->mode);
+		io_uring_sqe_set_data(sqe, REQ_DATA(index, REQ_OPEN));
+		return 1;
+
+	case REQ_WRITE:
+		if (op->size == 0) {
+			sqe = io_uring_get_sqe(ring);
+			io_uring_prep_close(sqe, op->fd);
+			io_uring_sqe_set_data(sqe, REQ_DATA(index, REQ_CLOSE));
+			return 1;
+		}
+
+		data = (const char*)batch->data.base + op->offset;
+		sqe = io_uring_get_sqe(ring);
+		io_uring_prep_write(sqe, op->fd, data, op->size, 0);
+		io_uring_sqe_set_data(sqe, REQ_DATA(index, REQ_WRITE));
+		sqe->flags |= IOSQE_IO_LINK;
+
+		sqe = io_uring_get_sqe(ring);
+		io_uring_prep_close(sqe, op->fd);
+		io_uring_sqe_set_data(sqe, REQ_DATA(index, REQ_CLOSE));
+		return 2;
+
+	case REQ_RENAME:
+		dirfd = dir_cache_resolve(batch->cache, op->path, &name);
+		newdirfd = dir_cache_resolve(batch->cache, op->newpath,
+		                             &newname);
+		sqe = io_uring_get_sqe(ring);
+		io_uring_prep_renameat(sqe, dirfd, name, newdirfd, newname, 0);
+		io_uring_sqe_set_data(sqe, REQ_DATA(index, REQ_RENAME));
+		return 1;
+
+	default:
+		return 0;
+	}
+}
+
+
+static
+void complete_request(struct file_batch* batch, void* data, int res)
+{
+	struct file_batch_op* op = &batch->ops[REQ_INDEX(data)];
+
+	switch (REQ_TYPE(data)) {
+	case REQ_OPEN:
+		op->res = res;
+		if (res >= 0)
+			op->fd = res;
+
+		break;
+
+	case REQ_WRITE:
+		op->res = res;
+		if (res > 0)
+			op->written = res;
+
+		break;
+
+	case REQ_CLOSE:
+		// A cancelled close leaves the file open for synchronous
+		// completion. Otherwise the descriptor is released whatever
+		// the outcome.
+		if (res == -ECANCELED)
+			break;
+
+		op->fd = -1;
+		if (res < 0 && op->res >= 0)
+			op->res = res;
+
+		break;
+
+	case REQ_RENAME:
+		op->res = res;
+		break;
+	}
+}
+
+
+/**
+ * run_phase() - submit a step of the operations of a given type
+ * @batch:      batch whose operations must be run
+ * @type:       type of the operation concerned by the phase
+ * @phase:      REQ_OPEN, REQ_WRITE or REQ_RENAME
+ *
+ * Return: 0 in case of success, -1 if the submission failed.
+ */
+static
+int run_phase(struct file_batch* batch, int type, int phase)
+{
+	struct io_uring* ring = batch->ring;
+	struct io_uring_cqe* cqe;
+	struct file_batch_op* op;
+	int i, rv, inflight;
+
+	i = 0;
+	inflight = 0;
+	while (i < batch->num_ops || inflight > 0) {
+		while (i < batch->num_ops
+		       && inflight + 2 <= FILE_BATCH_RING_SIZE
+		       && io_uring_sq_space_left(ring) >= 2) {
+			op = &batch->ops[i];
+			if (op->type == type && op->res >= 0
+			    && (phase != REQ_WRITE || op->fd >= 0))
+				inflight += prep_requests(batch, op, i, phase);
+
+			i++;
+		}
+
+		if (inflight == 0)
+			break;
+
+		rv = io_uring_submit_and_wait(ring, 1);
+		if (rv < 0) {
+			errno = -rv;
+			return mm_raise_from_errno("io_uring submission failed");
+		}
+
+		while (io_uring_peek_cqe(ring, &cqe) == 0) {
+			complete_request(batch, io_uring_cqe_get_data(cqe),
+			                 cqe->res);
+			io_uring_cqe_seen(ring, cqe);
+			inflight--;
+		}
+	}
+
+	return 0;
+}
+
+
+/**
+ * file_batch_flush_uring() - perform the queued operations with io_uring
+ * @batch:      batch to flush
+ *
+ * The files are opened in a first round of submissions, then written and
+ * closed in a second one. Once all files have been created, the renames are
+ * submitted. The uncommon cases (file already present, short write) are
+ * completed synchronously.
+ *
+ * Return: 0 in case of success, -1 otherwise with error state set
+ */
+static
+int file_batch_flush_uring(struct file_batch* batch)
+{
+	struct file_batch_op* op;
+	int i;
+
+	if (run_phase(batch, OP_CREATE, REQ_OPEN))
+		return -1;
+
+	for (i = 0; i < batch->num_ops; i++) {
+		op = &batch->ops[i];
+		if (op->type != OP_CREATE || op->res >= 0)
+			continue;
+
+		if (op->res != -EEXIST)
+			return raise_op_error(op, op->res, "create");
+
+		op->res = 0;
+		if (create_file_sync(batch, op))
+			return -1;
+	}
+
+	if (run_phase(batch, OP_CREATE, REQ_WRITE))
+		return -1;
+
+	for (i = 0; i < batch->num_ops; i++) {
+		op = &batch->ops[i];
+		if (op->type != OP_CREATE)
+			continue;
+
+		if (op->res < 0)
+			return raise_op_error(op, op->res, "write");
+
+		if (op->fd < 0)
+			continue;
+
+		// Short write: the linked close has been cancelled
+		if (write_remaining(batch, op) || mm_close(op->fd)) {
+			op->fd = -1;
+			return -1;
+		}
+
+		op->fd = -1;
+	}
+
+	if (run_phase(batch, OP_RENAME, REQ_RENAME))
+		return -1;
+
+	for (i = 0; i < batch->num_ops; i++) {
+		op = &batch->ops[i];
+		if (op->type == OP_RENAME && op->res < 0)
+			return raise_op_error(op, op->res, "rename");
+	}
+
+	return 0;
+}
+
+
+/**
+ * file_batch_init() - initialize a batch of file operations
+ * @batch:      batch to initialize
+ * @cache:      cache of the directories relative to which the files are
+ *              created and renamed (may be NULL)
+ *
+ * The batch can be used only if the kernel supports all the io_uring
+ * operations needed to create and rename files. Setting the environment
+ * variable MMPACK_DISABLE_IO_URING disables the batching.
+ *
+ * Return: 0 if the batch can be used, -1 otherwise. In such a case, the
+ * caller is expected to perform the file operations directly. No error
+ * state is set.
+ */
+LOCAL_SYMBOL
+int file_batch_init(struct file_batch* batch, struct dir_cache* cache)
+{
+	static const int required_ops[] = {
+		IORING_OP_OPENAT, IORING_OP_WRITE,
+		IORING_OP_CLOSE, IORING_OP_RENAMEAT,
+	};
+	struct io_uring_probe* probe;
+	struct io_uring* ring;
+	int i, supported;
+
+	*batch = (struct file_batch) {0};
+
+	if (mm_getenv("MMPACK_DISABLE_IO_URING", NULL))
+		return -1;
+
+	// io_uring may be unavailable (old kernel, seccomp filter...)
+	ring = xx_malloc(sizeof(*ring));
+	if (io_uring_queue_init(FILE_BATCH_RING_SIZE, ring, 0) < 0) {
+		free(ring);
+		return -1;
+	}
+
+	supported = 0;
+	probe = io_uring_get_probe_ring(ring);
+	if (probe) {
+		supported = 1;
+		for (i = 0; i < MM_NELEM(required_ops); i++) {
+			if (!io_uring_opcode_supported(probe, required_ops[i]))
+				supported = 0;
+		}
+
+		io_uring_free_probe(probe);
+	}
+
+	if (!supported) {
+		io_uring_queue_exit(ring);
+		free(ring);
+		return -1;
+	}
+
+	batch->ring = ring;
+	batch->cache = cache;
+	batch->ops = xx_malloc(FILE_BATCH_MAX_OPS * sizeof(*batch->ops));
+	buffer_init(&batch->data);
+	return 0;
+}
+
+
+/**
+ * file_batch_deinit() - cleanup a batch of file operations
+ * @batch:      batch initialized with file_batch_init()
+ *
+ * The operations that have not been flushed are discarded.
+ */
+LOCAL_SYMBOL
+void file_batch_deinit(struct file_batch* batch)
+{
+	if (!batch->ring)
+		return;
+
+	file_batch_clear_ops(batch);
+	io_uring_queue_exit(batch->ring);
+	free(batch->ring);
+	free(batch->ops);
+	buffer_deinit(&batch->data);
+	*batch = (struct file_batch) {0};
+}
+
+#else /* HAVE_LIBURING */
+
+LOCAL_SYMBOL
+int file_batch_init(struct file_batch* batch, struct dir_cache* cache)
+{
+	(void) cache;
+
+	*batch = (struct file_batch) {0};
+	return -1;
+}
+
+
+LOCAL_SYMBOL
+void file_batch_deinit(struct file_batch* batch)
+{
+	(void) batch;
+}
+
+
+static
+int file_batch_flush_uring(struct file_batch* batch)
+{
+	(void) batch;
+	return mm_raise_error(ENOTSUP, "io_uring support not available");
+}
+
+#endif /* HAVE_LIBURING */
+
+
+/**
+ * file_batch_flush() - perform all the operations queued in a batch
+ * @batch:      batch to flush
+ *
+ * The files are all created before any rename is done.
+ *
+ * Return: 0 in case of success, -1 otherwise with error state set. In case
+ * of failure, the operations may have been partially performed.
+ */
+LOCAL_SYMBOL
+int file_batch_flush(struct file_batch* batch)
+{
+	int rv;
+
+	if (batch->num_ops == 0)
+		return 0;
+
+	rv = file_batch_flush_uring(batch);
+	file_batch_clear_ops(batch);
+	return rv;
+}
+
+
+/**
+ * file_batch_add_file() - queue the creation of a file
+ * @batch:      initialized batch
+ * @path:       path of the file to create
+ * @mode:       permission of the file
+ * @size:       size of the file content
+ * @data:       pointer receiving the buffer to fill with the file content
+ *
+ * A file already present at @path is replaced. The content of the file must
+ * be written by the caller in the buffer returned in @data, which remains
+ * valid until the next operation on @batch. The queued operations are
+ * flushed if the batch is full.
+ *
+ * Return: 0 in case of success, -1 if the batch had to be flushed and this
+ * has failed. In such a case, error state is set accordingly.
+ */
+LOCAL_SYMBOL
+int file_batch_add_file(struct file_batch* batch, const char* path,
+                        int mode, size_t size, void** data)
+{
+	struct file_batch_op* op;
+
+	if (batch->num_ops == FILE_BATCH_MAX_OPS
+	    || batch->data.size + size > FILE_BATCH_MAX_DATA) {
+		if (file_batch_flush(batch))
+			return -1;
+	}
+
+	op = file_batch_push_op(batch, OP_CREATE, path);
+	op->mode = mode;
+	op->offset = batch->data.size;
+	op->size = size;
+
+	*data = buffer_reserve_data(&batch->data, size);
+	buffer_inc_size(&batch->data, size);
+	return 0;
+}
+
+
+/**
+ * file_batch_add_rename() - queue the rename of a file
+ * @batch:      initialized batch
+ * @oldpath:    path of the file to rename
+ * @newpath:    destination of the file
+ *
+ * The queued operations are flushed if the batch is full.
+ *
+ * Return: 0 in case of success, -1 if the batch had to be flushed and this
+ * has failed. In such a case, error state is set accordingly.
+ */
+LOCAL_SYMBOL
+int file_batch_add_rename(struct file_batch* batch, const char* oldpath,
+                          const char* newpath)
+{
+	struct file_batch_op* op;
+
+	if (batch->num_ops == FILE_BATCH_MAX_OPS) {
+		if (file_batch_flush(batch))
+			return -1;
+	}
+
+	op = file_batch_push_op(batch, OP_RENAME, oldpath);
+	op->newpath = mmstr_malloc_from_cstr(newpath);
+	return 0;
+}
@@ -0,0 +1,40 @@
+/*
+ * @mindmaze_header@
+ */
+#ifndef FILE_BATCH_H
+#define FILE_BATCH_H
+
+#include <stddef.h>
+
+#include "dir-cache.h"
+#include "mmstring.h"
+#include "utils.h"
+
+// Files larger than this are not worth being held in memory to be batched
+#define FILE_BATCH_MAX_FILESIZE (64*1024)
+
+/**
+ * struct file_batch - queue of file operations submitted together
+ * @ring:       io_uring instance used to submit the operations
+ * @cache:      cache of the directories in which files are manipulated
+ * @ops:        array of queued operations
+ * @num_ops:    number of elements in @ops
+ * @data:       content of the files to be created
+ */
+struct file_batch {
+	void* ring;
+	struct dir_cache* cache;
+	struct file_batch_op* ops;
+	int num_ops;
+	struct buffer data;
+};
+
+int file_batch_init(struct file_batch* batch, struct dir_cache* cache);
+void file_batch_deinit(struct file_batch* batch);
+int file_batch_add_file(struct file_batch* batch, const char* path,
+                        int mode, size_t size, void** data);
+int file_batch_add_rename(struct file_batch* batch, const char* oldpath,
+                          const char* newpath);
+int file_batch_flush(struct file_batch* batch);
+
+#endif /* FILE_BATCH_H */
@@ -0,0 +1,582 @@
+/*
+ * @mindmaze_header@
+ */
+#if defined (HAVE_CONFIG_H)
+# include <config.h>
+#endif
+
+#include <mmerrno.h>
+#include <mmlib.h>
+#include <mmsysio.h>
+#include <mmthread.h>
+#include <mmtime.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "context.h"
+#include "integrity-check.h"
+#include "mmstring.h"
+#include "package-utils.h"
+#include "pkg-fs-utils.h"
+#include "utils.h"
+#include "xx-alloc.h"
+
+/*
+ * The files of the installed packages are hashed by a pool of worker
+ * threads. The main thread parses the SHA-256 sums files of the packages and
+ * queues one job per file in a bounded ring, blocking when the ring is full.
+ * Since the latency of reading the files (especially on network filesystems)
+ * dominates the hashing time, the number of workers does not depend on the
+ * number of CPUs. Each worker takes several jobs at once so that small
+ * files can be hashed together (see sha_compute_batch()).
+ *
+ * While it waits for the workers, the main thread reports the status of the
+ * packages whose files have all been processed, in the order in which they
+ * have been added to the check.
+ *
+ * In quick mode, the stat attributes of the files recorded at installation
+ * are passed along with the jobs. The workers hash only the files whose
+ * current attributes differ or have not been recorded.
+ */
+#define CHECK_DEFAULT_NUM_THREADS 8
+#define CHECK_MAX_NUM_THREADS 64
+#define PROGRESS_PERIOD_MS 200
+
+// Values of check index of jobs whose file is not hashed
+#define JOB_SKIPPED (-1)
+#define JOB_UNCHANGED (-2)
+
+/**
+ * struct pkg_check - progress of the check of a package
+ * @pkg:         package being checked
+ * @num_pending: number of jobs of @pkg not processed yet, plus one while
+ *               its files are being queued
+ * @failed:      non zero if a problem has been found in @pkg
+ * @interrupted: non zero if some files of @pkg have not been checked
+ *               because the check has been cancelled
+ */
+struct pkg_check {
+	const struct mmpkg* pkg;
+	int num_pending;
+	int failed;
+	int interrupted;
+};
+
+
+/**
+ * dequeue_jobs() - take jobs from the queue
+ * @chk:        integrity check in progress
+ * @jobs:       array receiving the dequeued jobs
+ * @check_idx:  array receiving for each dequeued job JOB_SKIPPED if the job
+ *              must be skipped, 0 otherwise
+ *
+ * Must be called with @chk->lock held and the queue not empty. The queued
+ * jobs are shared among the workers, up to a full batch each.
+ *
+ * Return: the number of jobs dequeued
+ */
+static
+int dequeue_jobs(struct integrity_check* chk, struct check_job* jobs,
+                 int* check_idx)
+{
+	int i, num;
+
+	num = chk->num_jobs / chk->num_threads;
+	if (num < 1)
+		num = 1;
+	else if (num > SHA_BATCH_MAX_FILES)
+		num = SHA_BATCH_MAX_FILES;
+
+	for (i = 0; i < num; i++) {
+		jobs[i] = chk->jobs[chk->first_job];
+		chk->first_job = (chk->first_job + 1) % CHECK_QUEUE_LEN;
+		chk->num_jobs--;
+
+		if (chk->cancelled || chk->pkgs[jobs[i].pkg_idx].failed)
+			check_idx[i] = JOB_SKIPPED;
+		else
+			check_idx[i] = 0;
+	}
+
+	return num;
+}
+
+
+static
+int is_file_unchanged(const struct integrity_check* chk,
+                      const struct check_job* job)
+{
+	struct file_stamp stamp;
+	int prev_err_flags, rv;
+
+	if (!job->has_stamp)
+		return 0;
+
+	// A file that cannot be stat'ed will be reported by the hash
+	prev_err_flags = mm_error_set_flags(MM_ERROR_SET, MM_ERROR_IGNORE);
+	rv = file_stamp_get(&stamp, job->filename, chk->ctx->prefix);
+	mm_error_set_flags(prev_err_flags, MM_ERROR_IGNORE);
+
+	return (rv == 0 && file_stamp_equal(&stamp, &job->stamp));
+}
+
+
+/**
+ * prepare_checks() - list the files of dequeued jobs that must be hashed
+ * @chk:        integrity check in progress
+ * @jobs:       dequeued jobs
+ * @num:        number of elements in @jobs
+ * @checks:     array receiving the files to check
+ * @check_idx:  array set by dequeue_jobs(), updated for each job not
+ *              skipped with its index in @checks or JOB_UNCHANGED if the
+ *              file has not been modified since installation
+ *
+ * This must be called without @chk->lock held, since the files of the jobs
+ * may be stat'ed.
+ *
+ * Return: the number of files to check
+ */
+static
+int prepare_checks(const struct integrity_check* chk,
+                   const struct check_job* jobs, int num,
+                   struct file_check* checks, int* check_idx)
+{
+	int i, num_checks;
+
+	num_checks = 0;
+	for (i = 0; i < num; i++) {
+		if (check_idx[i] == JOB_SKIPPED)
+			continue;
+
+		if (is_file_unchanged(chk, &jobs[i])) {
+			check_idx[i] = JOB_UNCHANGED;
+			continue;
+		}
+
+		check_idx[i] = num_checks++;
+		checks[check_idx[i]] = (struct file_check) {
+			.filename = jobs[i].filename,
+			.ref_sha = jobs[i].ref_sha,
+		};
+	}
+
+	return num_checks;
+}
+
+
+static
+void* check_worker(void* arg)
+{
+	struct integrity_check* chk = arg;
+	struct check_job jobs[SHA_BATCH_MAX_FILES];
+	struct file_check checks[SHA_BATCH_MAX_FILES];
+	int check_idx[SHA_BATCH_MAX_FILES];
+	struct pkg_check* pkgchk;
+	struct file_check* check;
+	int i, num, num_checks;
+
+	mm_thr_mutex_lock(&chk->lock);
+	while (1) {
+		while (chk->num_jobs == 0 && !chk->stop)
+			mm_thr_cond_wait(&chk->job_cond, &chk->lock);
+
+		// Stop only when all queued jobs have been processed
+		if (chk->num_jobs == 0)
+			break;
+
+		num = dequeue_jobs(chk, jobs, check_idx);
+		mm_thr_mutex_unlock(&chk->lock);
+
+		num_checks = prepare_checks(chk, jobs, num, checks, check_idx);
+		if (num_checks > 0)
+			check_files_pkg(checks, num_checks, chk->ctx->prefix);
+
+		mm_thr_mutex_lock(&chk->lock);
+		for (i = 0; i < num; i++) {
+			pkgchk = &chk->pkgs[jobs[i].pkg_idx];
+			pkgchk->num_pending--;
+
+			mmstr_free(jobs[i].filename);
+			mmstr_free(jobs[i].ref_sha);
+
+			if (check_idx[i] == JOB_UNCHANGED) {
+				chk->num_unchanged++;
+				continue;
+			}
+
+			if (check_idx[i] == JOB_SKIPPED) {
+				if (chk->cancelled)
+					pkgchk->interrupted = 1;
+
+				continue;
+			}
+
+			check = &checks[check_idx[i]];
+			chk->num_files++;
+			chk->num_bytes += check->size;
+			if (check->rv != 0) {
+				pkgchk->failed = 1;
+				if (chk->fail_fast)
+					chk->cancelled = 1;
+			}
+		}
+
+		mm_thr_cond_signal(&chk->done_cond);
+	}
+
+	mm_thr_mutex_unlock(&chk->lock);
+	return NULL;
+}
+
+
+static
+double get_elapsed_seconds(const struct integrity_check* chk,
+                           struct mm_timespec* now)
+{
+	mm_gettime(MM_CLK_MONOTONIC, now);
+	return mm_timediff_ms(now, &chk->start) / 1000.0;
+}
+
+
+static
+double mib_per_second(int64_t num_bytes, double elapsed)
+{
+	if (elapsed <= 0.0)
+		return 0.0;
+
+	return num_bytes / (1024.0 * 1024.0) / elapsed;
+}
+
+
+/**
+ * report_progress() - display the number of files checked and throughput
+ * @chk:        integrity check in progress
+ *
+ * Must be called with @chk->lock held. The lock is released while the
+ * progress is printed. The progress is displayed only if standard output
+ * is a terminal and is refreshed at most every PROGRESS_PERIOD_MS.
+ */
+static
+void report_progress(struct integrity_check* chk)
+{
+	struct mm_timespec now;
+	double elapsed;
+	int num_files;
+	int64_t num_bytes;
+
+	if (!chk->show_progress)
+		return;
+
+	elapsed = get_elapsed_seconds(chk, &now);
+	if (mm_timediff_ms(&now, &chk->last_progress) < PROGRESS_PERIOD_MS)
+		return;
+
+	chk->last_progress = now;
+	num_files = chk->num_files;
+	num_bytes = chk->num_bytes;
+
+	mm_thr_mutex_unlock(&chk->lock);
+	printf("\r%d files checked (%.1f MiB/s)",
+	       num_files, mib_per_second(num_bytes, elapsed));
+	fflush(stdout);
+	mm_thr_mutex_lock(&chk->lock);
+}
+
+
+static
+void clear_progress(const struct integrity_check* chk)
+{
+	if (chk->show_progress)
+		printf("\r\033[K");
+}
+
+
+/**
+ * report_done_pkgs() - report status of packages whose check is complete
+ * @chk:        integrity check in progress
+ *
+ * Print the result of the packages whose files have all been processed,
+ * following the order in which the packages have been added to @chk. This
+ * must be called with @chk->lock held. The lock is released while the
+ * reports are printed.
+ */
+static
+void report_done_pkgs(struct integrity_check* chk)
+{
+	const struct mmpkg* pkg;
+	int failed, interrupted;
+
+	while (chk->num_reported < chk->num_pkgs
+	       && chk->pkgs[chk->num_reported].num_pending == 0) {
+		pkg = chk->pkgs[chk->num_reported].pkg;
+		failed = chk->pkgs[chk->num_reported].failed;
+		interrupted = chk->pkgs[chk->num_reported].interrupted;
+		chk->num_reported++;
+		if (failed)
+			chk->num_failed++;
+
+		// Do not report a status for a package partially checked
+		if (interrupted && !failed)
+			continue;
+
+		mm_thr_mutex_unlock(&chk->lock);
+		clear_progress(chk);
+		info("Checking %s (%s) ... %s\n", pkg->name, pkg->version,
+		     failed ? "Failed!" : "OK");
+		mm_thr_mutex_lock(&chk->lock);
+	}
+
+	report_progress(chk);
+}
+
+
+static
+int get_num_threads(void)
+{
+	const char* str;
+	int num_threads;
+
+	str = mm_getenv("MMPACK_CHECK_THREADS", NULL);
+	if (!str)
+		return CHECK_DEFAULT_NUM_THREADS;
+
+	num_threads = atoi(str);
+	if (num_threads < 1)
+		return 1;
+
+	if (num_threads > CHECK_MAX_NUM_THREADS)
+		return CHECK_MAX_NUM_THREADS;
+
+	return num_threads;
+}
+
+
+/**
+ * integrity_check_init() - initialize and start the pool of workers
+ * @chk:        integrity check structure to initialize
+ * @ctx:        mmpack context of the prefix whose packages will be checked
+ * @fail_fast:  if non zero, the check stops at the first problem found
+ * @quick:      if non zero, the files whose stat attributes match the ones
+ *              recorded at installation are not hashed
+ *
+ * The number of worker threads can be set with the environment variable
+ * MMPACK_CHECK_THREADS.
+ *
+ * Return: 0 in case of success, -1 otherwise. In both case, @chk must be
+ * cleaned up with integrity_check_deinit().
+ */
+LOCAL_SYMBOL
+int integrity_check_init(struct integrity_check* chk,
+                         const struct mmpack_ctx* ctx, int fail_fast,
+                         int quick)
+{
+	int i, num_threads;
+
+	*chk = (struct integrity_check) {
+		.ctx = ctx,
+		.fail_fast = fail_fast,
+		.quick = quick,
+		.show_progress = (mm_isatty(1) == 1),
+	};
+
+	mm_thr_mutex_init(&chk->lock, 0);
+	mm_thr_cond_init(&chk->job_cond, 0);
+	mm_thr_cond_init(&chk->done_cond, 0);
+	mm_gettime(MM_CLK_MONOTONIC, &chk->start);
+	chk->last_progress = chk->start;
+
+	num_threads = get_num_threads();
+	chk->threads = xx_malloc(num_threads * sizeof(*chk->threads));
+	for (i = 0; i < num_threads; i++) {
+		if (mm_thr_create(&chk->threads[i], check_worker, chk))
+			break;
+
+		chk->num_threads++;
+	}
+
+	// Failing to create some threads is fine as long as one is running
+	return (chk->num_threads > 0) ? 0 : -1;
+}
+
+
+/**
+ * integrity_check_deinit() - stop the workers and free the resources
+ * @chk:        integrity check structure to cleanup
+ */
+LOCAL_SYMBOL
+void integrity_check_deinit(struct integrity_check* chk)
+{
+	int i;
+
+	mm_thr_mutex_lock(&chk->lock);
+	chk->stop = 1;
+	chk->cancelled = 1;
+	mm_thr_cond_broadcast(&chk->job_cond);
+	mm_thr_mutex_unlock(&chk->lock);
+
+	for (i = 0; i < chk->num_threads; i++)
+		mm_thr_join(chk->threads[i], NULL);
+
+	free(chk->threads);
+	free(chk->pkgs);
+
+	mm_thr_cond_deinit(&chk->done_cond);
+	mm_thr_cond_deinit(&chk->job_cond);
+	mm_thr_mutex_deinit(&chk->lock);
+
+	*chk = (struct integrity_check) {0};
+}
+
+
+struct queue_data {
+	struct integrity_check* chk;
+	int pkg_idx;
+	const struct stamp_record* stamps;
+};
+
+
+static
+int queue_file_cb(const mmstr* filename, const mmstr* ref_sha, void* data)
+{
+	struct queue_data* qdata = data;
+	struct integrity_check* chk = qdata->chk;
+	const struct file_stamp* stamp = NULL;
+	struct check_job* job;
+	int rv = 0;
+
+	if (qdata->stamps)
+		stamp = stamp_record_lookup(qdata->stamps, filename);
+
+	mm_thr_mutex_lock(&chk->lock);
+
+	while (chk->num_jobs == CHECK_QUEUE_LEN) {
+		report_done_pkgs(chk);
+		mm_thr_cond_wait(&chk->done_cond, &chk->lock);
+	}
+
+	// No need to queue more files if the package is known to be broken
+	if (chk->cancelled || chk->pkgs[qdata->pkg_idx].failed) {
+		chk->pkgs[qdata->pkg_idx].interrupted = chk->cancelled;
+		rv = -1;
+		goto exit;
+	}
+
+	job = &chk->jobs[(chk->first_job + chk->num_jobs) % CHECK_QUEUE_LEN];
+	*job = (struct check_job) {
+		.filename = mmstrdup(filename),
+		.ref_sha = mmstrdup(ref_sha),
+		.pkg_idx = qdata->pkg_idx,
+		.has_stamp = (stamp != NULL),
+		.stamp = stamp ? *stamp : (struct file_stamp) {0},
+	};
+	chk->num_jobs++;
+	chk->pkgs[qdata->pkg_idx].num_pending++;
+	mm_thr_cond_signal(&chk->job_cond);
+
+exit:
+	mm_thr_mutex_unlock(&chk->lock);
+	return rv;
+}
+
+
+/**
+ * integrity_check_add_pkg() - queue the files of a package to be checked
+ * @chk:        initialized integrity check
+ * @pkg:        installed package to check
+ *
+ * Queue the files listed in the SHA-256 sums file of @pkg to be verified by
+ * the workers of @chk. This function blocks while the queue is full. The
+ * status of the packages whose check is complete is reported meanwhile. In
+ * quick mode, the stat attributes recorded at the installation of @pkg are
+ * loaded to be passed along with the files.
+ *
+ * Return: 0 if the check can continue, -1 if the check has been cancelled
+ * (a problem has been found while fail-fast mode is enabled).
+ */
+LOCAL_SYMBOL
+int integrity_check_add_pkg(struct integrity_check* chk,
+                            const struct mmpkg* pkg)
+{
+	struct queue_data qdata = {.chk = chk};
+	struct stamp_record stamps;
+	int rv;
+
+	mm_thr_mutex_lock(&chk->lock);
+	if (chk->cancelled) {
+		mm_thr_mutex_unlock(&chk->lock);
+		return -1;
+	}
+
+	qdata.pkg_idx = chk->num_pkgs++;
+	chk->pkgs = xx_realloc(chk->pkgs, chk->num_pkgs * sizeof(*chk->pkgs));
+	chk->pkgs[qdata.pkg_idx] = (struct pkg_check) {
+		.pkg = pkg,
+		.num_pending = 1,
+	};
+	mm_thr_mutex_unlock(&chk->lock);
+
+	if (chk->quick) {
+		stamp_record_load(&stamps, chk->ctx, pkg);
+		qdata.stamps = &stamps;
+	}
+
+	rv = foreach_installed_file(chk->ctx, pkg, queue_file_cb, &qdata);
+
+	if (chk->quick)
+		stamp_record_deinit(&stamps);
+
+	mm_thr_mutex_lock(&chk->lock);
+	// Either the sums file could not be parsed or a file has failed
+	if (rv != 0 && !chk->pkgs[qdata.pkg_idx].interrupted) {
+		chk->pkgs[qdata.pkg_idx].failed = 1;
+		if (chk->fail_fast)
+			chk->cancelled = 1;
+	}
+
+	chk->pkgs[qdata.pkg_idx].num_pending--;
+	report_done_pkgs(chk);
+	rv = chk->cancelled ? -1 : 0;
+	mm_thr_mutex_unlock(&chk->lock);
+
+	return rv;
+}
+
+
+/**
+ * integrity_check_finish() - wait for all queued files to be checked
+ * @chk:        initialized integrity check
+ *
+ * Wait for the workers to process all the queued files, report the status
+ * of the remaining packages and display the hashing throughput. In quick
+ * mode, the number of files not hashed is displayed as well.
+ *
+ * Return: 0 if all packages have passed the check, -1 otherwise.
+ */
+LOCAL_SYMBOL
+int integrity_check_finish(struct integrity_check* chk)
+{
+	struct mm_timespec now;
+	double elapsed;
+
+	mm_thr_mutex_lock(&chk->lock);
+	while (1) {
+		report_done_pkgs(chk);
+		if (chk->num_reported == chk->num_pkgs)
+			break;
+
+		mm_thr_cond_wait(&chk->done_cond, &chk->lock);
+	}
+	mm_thr_mutex_unlock(&chk->lock);
+
+	clear_progress(chk);
+	elapsed = get_elapsed_seconds(chk, &now);
+	info("%d files checked (%.1f MiB) in %.1fs (%.1f MiB/s)\n",
+	     chk->num_files, chk->num_bytes / (1024.0 * 1024.0), elapsed,
+	     mib_per_second(chk->num_bytes, elapsed));
+	if (chk->quick)
+		info("%d files unchanged since installation\n",
+		     chk->num_unchanged);
+
+	return (chk->num_failed == 0) ? 0 : -1;
+}
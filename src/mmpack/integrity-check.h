@@ -0,0 +1,96 @@
+/*
+ * @mindmaze_header@
+ */
+#ifndef INTEGRITY_CHECK_H
+#define INTEGRITY_CHECK_H
+
+#include <mmthread.h>
+#include <mmtime.h>
+#include <stdint.h>
+
+#include "context.h"
+#include "mmstring.h"
+#include "package-utils.h"
+#include "utils.h"
+
+// Maximum number of files waiting to be hashed
+#define CHECK_QUEUE_LEN 256
+
+/**
+ * struct check_job - file of an installed package to be verified
+ * @filename:   path of the file relative to prefix
+ * @ref_sha:    reference hash of the file
+ * @pkg_idx:    index of the package owning the file
+ * @has_stamp:  non zero if @stamp holds the attributes of the file recorded
+ *              at installation (only set in quick mode)
+ * @stamp:      stat attributes of the file recorded at installation
+ */
+struct check_job {
+	mmstr* filename;
+	mmstr* ref_sha;
+	int pkg_idx;
+	int has_stamp;
+	struct file_stamp stamp;
+};
+
+/**
+ * struct integrity_check - pool of threads verifying installed files
+ * @ctx:        mmpack context of the prefix being checked
+ * @fail_fast:  if non zero, the whole check is cancelled at first failure
+ * @quick:      if non zero, files unchanged since installation are not hashed
+ * @threads:    array of worker threads
+ * @num_threads: number of elements in @threads
+ * @lock:       lock protecting the fields below
+ * @job_cond:   condition signaled when a job is queued or pool is stopping
+ * @done_cond:  condition signaled when a worker has completed a job
+ * @jobs:       ring of jobs waiting to be processed
+ * @first_job:  index in @jobs of the next job to be processed
+ * @num_jobs:   number of jobs in @jobs
+ * @stop:       if non zero, workers terminate once @jobs is empty
+ * @cancelled:  if non zero, the remaining jobs are dropped
+ * @pkgs:       array of packages whose files have been queued
+ * @num_pkgs:   number of elements in @pkgs
+ * @num_reported: number of packages in @pkgs whose status has been reported
+ * @num_failed: number of packages that have failed the check
+ * @num_files:  number of files hashed so far
+ * @num_unchanged: number of files skipped in quick mode
+ * @num_bytes:  amount of data hashed so far
+ * @start:      time at which the check has started
+ * @last_progress: time at which the progress has been last displayed
+ * @show_progress: if non zero, progress is displayed on standard output
+ */
+struct integrity_check {
+	const struct mmpack_ctx* ctx;
+	int fail_fast;
+	int quick;
+	mm_thread_t* threads;
+	int num_threads;
+	mm_thr_mutex_t lock;
+	mm_thr_cond_t job_cond;
+	mm_thr_cond_t done_cond;
+	struct check_job jobs[CHECK_QUEUE_LEN];
+	int first_job;
+	int num_jobs;
+	int stop;
+	int cancelled;
+	struct pkg_check* pkgs;
+	int num_pkgs;
+	int num_reported;
+	int num_failed;
+	int num_files;
+	int num_unchanged;
+	int64_t num_bytes;
+	struct mm_timespec start;
+	struct mm_timespec last_progress;
+	int show_progress;
+};
+
+int integrity_check_init(struct integrity_check* chk,
+                         const struct mmpack_ctx* ctx, int fail_fast,
+                         int quick);
+void integrity_check_deinit(struct integrity_check* chk);
+int integrity_check_add_pkg(struct integrity_check* chk,
+                            const struct mmpkg* pkg);
+int integrity_check_finish(struct integrity_check* chk);
+
+#endif /* INTEGRITY_CHECK_H */
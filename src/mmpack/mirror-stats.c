@@ -0,0 +1,344 @@
+/*
+ * @mindmaze_header@
+ */
+#if defined (HAVE_CONFIG_H)
+# include <config.h>
+#endif
+
+#include <mmerrno.h>
+#include <mmlib.h>
+#include <mmsysio.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "mirror-stats.h"
+#include "mmstring.h"
+#include "utils.h"
+#include "xx-alloc.h"
+
+// weight of a new measurement in the running averages
+#define MIRROR_STAT_WEIGHT 0.3
+
+// connect time accounted when a transfer from a repository fails
+#define MIRROR_FAILURE_PENALTY 10.0
+
+// transfers smaller than this are dominated by latency: they do not give
+// a meaningful throughput measurement
+#define MIN_THROUGHPUT_SAMPLE_SIZE (64*1024)
+
+
+LOCAL_SYMBOL
+void mirror_stats_init(struct mirror_stats* stats)
+{
+	*stats = (struct mirror_stats) {0};
+}
+
+
+LOCAL_SYMBOL
+void mirror_stats_deinit(struct mirror_stats* stats)
+{
+	int i;
+
+	for (i = 0; i < stats->num_entries; i++)
+		mmstr_free(stats->entries[i].url);
+
+	free(stats->entries);
+	mirror_stats_init(stats);
+}
+
+
+static
+struct mirror_stat* mirror_stats_lookup(const struct mirror_stats* stats,
+                                        const mmstr* url)
+{
+	int i;
+
+	for (i = 0; i < stats->num_entries; i++) {
+		if (mmstrequal(stats->entries[i].url, url))
+			return &stats->entries[i];
+	}
+
+	return NULL;
+}
+
+
+static
+struct mirror_stat* mirror_stats_add(struct mirror_stats* stats,
+                                     const char* url, int len)
+{
+	struct mirror_stat* entry;
+	size_t size;
+
+	size = (stats->num_entries + 1) * sizeof(*stats->entries);
+	stats->entries = xx_realloc(stats->entries, size);
+
+	entry = &stats->entries[stats->num_entries++];
+	*entry = (struct mirror_stat) {
+		.url = mmstr_malloc_copy(url, len),
+	};
+
+	return entry;
+}
+
+
+/**
+ * mirror_stats_load() - load repository stats stored in prefix
+ * @stats:      initialized mirror stats to fill
+ * @prefix:     path of the prefix
+ *
+ * The stats are stored in MIRROR_STATS_RELPATH, one repository per line in
+ * the form "<connect_time> <throughput> <url>". If the file does not exist,
+ * @stats is left empty.
+ *
+ * Return: 0 in case of success, -1 otherwise with error state set
+ * accordingly.
+ */
+LOCAL_SYMBOL
+int mirror_stats_load(struct mirror_stats* stats, const mmstr* prefix)
+{
+	STATIC_CONST_MMSTR(stats_relpath, MIRROR_STATS_RELPATH);
+	struct mirror_stat* entry;
+	double connect_time, throughput;
+	char * line, * eol, * url, * data;
+	void* map;
+	size_t mapsize;
+	mmstr* path;
+	int rv;
+
+	path = mmstr_malloca(mmstrlen(prefix) + mmstrlen(stats_relpath) + 1);
+	mmstr_join_path(path, prefix, stats_relpath);
+	rv = mm_check_access(path, F_OK);
+	mmstr_freea(path);
+	if (rv != 0)
+		return 0;
+
+	if (map_file_in_prefix(prefix, stats_relpath, &map, &mapsize))
+		return -1;
+
+	// Copy the content to get a null terminated string
+	data = xx_malloc(mapsize + 1);
+	memcpy(data, map, mapsize);
+	data[mapsize] = '\0';
+	mm_unmap(map);
+
+	for (line = data; (eol = strchr(line, '\n')) != NULL; line = eol + 1) {
+		*eol = '\0';
+		connect_time = strtod(line, &url);
+		throughput = strtod(url, &url);
+		url += strspn(url, " ");
+		if (*url == '\0' || connect_time < 0.0 || throughput < 0.0)
+			continue;
+
+		entry = mirror_stats_add(stats, url, strlen(url));
+		entry->connect_time = connect_time;
+		entry->throughput = throughput;
+	}
+
+	free(data);
+	stats->dirty = 0;
+	return 0;
+}
+
+
+/**
+ * mirror_stats_save() - store repository stats in prefix
+ * @stats:      mirror stats to store
+ * @prefix:     path of the prefix
+ *
+ * The file is updated atomically and only if @stats has been updated since
+ * it has been loaded.
+ *
+ * Return: 0 in case of success, -1 otherwise with error state set
+ * accordingly.
+ */
+LOCAL_SYMBOL
+int mirror_stats_save(struct mirror_stats* stats, const mmstr* prefix)
+{
+	STATIC_CONST_MMSTR(stats_relpath, MIRROR_STATS_RELPATH);
+	const struct mirror_stat* entry;
+	mmstr * path, * tmp_path;
+	FILE* fp;
+	int i, rv;
+
+	if (!stats->dirty)
+		return 0;
+
+	path = mmstr_malloca(mmstrlen(prefix) + mmstrlen(stats_relpath) + 1);
+	mmstr_join_path(path, prefix, stats_relpath);
+	tmp_path = mmstr_malloca(mmstrlen(path) + 4);
+	mmstrcpy(tmp_path, path);
+	mmstrcat_cstr(tmp_path, ".tmp");
+
+	rv = -1;
+	fp = fopen(tmp_path, "wb");
+	if (!fp) {
+		mm_raise_from_errno("Cannot open %s", tmp_path);
+		goto exit;
+	}
+
+	for (i = 0; i < stats->num_entries; i++) {
+		entry = &stats->entries[i];
+		fprintf(fp, "%.6f %.0f %s\n",
+		        entry->connect_time, entry->throughput, entry->url);
+	}
+
+	if (fclose(fp) != 0) {
+		mm_raise_from_errno("Cannot write %s", tmp_path);
+		goto exit;
+	}
+
+	rv = mm_rename(tmp_path, path);
+	if (rv == 0)
+		stats->dirty = 0;
+
+exit:
+	mmstr_freea(tmp_path);
+	mmstr_freea(path);
+	return rv;
+}
+
+
+static
+double running_average(double average, double sample)
+{
+	return (1.0 - MIRROR_STAT_WEIGHT) * average
+	       + MIRROR_STAT_WEIGHT * sample;
+}
+
+
+/**
+ * mirror_stats_update() - account a transfer from a repository
+ * @stats:      mirror stats to update
+ * @url:        URL of the repository
+ * @metrics:    measurements of the terminated transfer
+ * @status:     0 if the transfer has succeeded, -1 otherwise
+ *
+ * A failed transfer is accounted as a long connection and halves the
+ * throughput expected from the repository. The connect time of a transfer
+ * that has reused an established connection is not accounted: it does not
+ * reflect the cost of reaching the repository.
+ */
+LOCAL_SYMBOL
+void mirror_stats_update(struct mirror_stats* stats, const mmstr* url,
+                         const struct download_metrics* metrics, int status)
+{
+	struct mirror_stat* entry;
+	double connect_time, throughput, xfer_time;
+	int is_new = 0;
+
+	entry = mirror_stats_lookup(stats, url);
+	if (!entry) {
+		entry = mirror_stats_add(stats, url, mmstrlen(url));
+		is_new = 1;
+	}
+
+	if (status != 0) {
+		connect_time = MIRROR_FAILURE_PENALTY;
+		throughput = entry->throughput / 2.0;
+	} else {
+		connect_time = metrics->connect_time;
+		throughput = entry->throughput;
+		xfer_time = metrics->total_time - metrics->connect_time;
+		if (metrics->size >= MIN_THROUGHPUT_SAMPLE_SIZE
+		    && xfer_time > 0.0) {
+			throughput = metrics->size / xfer_time;
+			if (!is_new && entry->throughput > 0.0)
+				throughput = running_average(entry->throughput,
+				                             throughput);
+		}
+	}
+
+	if (status == 0 && metrics->reused && !is_new)
+		connect_time = entry->connect_time;
+	else if (!is_new)
+		connect_time = running_average(entry->connect_time,
+		                               connect_time);
+
+	entry->connect_time = connect_time;
+	entry->throughput = throughput;
+	stats->dirty = 1;
+}
+
+
+/**
+ * mirror_stats_estimate() - estimate time to download from a repository
+ * @stats:      mirror stats
+ * @url:        URL of the repository
+ * @size:       size of the data to download
+ *
+ * Return: the expected transfer time in seconds. If the repository has
+ * never been used, 0 is returned so that it is tried first and get measured.
+ */
+LOCAL_SYMBOL
+double mirror_stats_estimate(const struct mirror_stats* stats,
+                             const mmstr* url, size_t size)
+{
+	const struct mirror_stat* entry;
+	double estimate;
+
+	entry = mirror_stats_lookup(stats, url);
+	if (!entry)
+		return 0.0;
+
+	estimate = entry->connect_time;
+	if (entry->throughput > 0.0)
+		estimate += size / entry->throughput;
+
+	return estimate;
+}
+
+
+/**
+ * mirror_stats_rank() - order repositories providing a package
+ * @stats:      mirror stats
+ * @from_list:  list of repositories providing the package
+ * @num_ranked: pointer to variable receiving the number of repositories
+ *
+ * The repositories of @from_list are sorted by increasing expected transfer
+ * time of the package. Repositories with the same estimate keep the order
+ * of @from_list. Elements of @from_list which do not refer to a repository
+ * are skipped.
+ *
+ * Return: array of the ranked elements of @from_list, to be freed with free()
+ */
+LOCAL_SYMBOL
+const struct from_repo** mirror_stats_rank(const struct mirror_stats* stats,
+                                           const struct from_repo* from_list,
+                                           int* num_ranked)
+{
+	const struct from_repo* from;
+	const struct from_repo** ranked;
+	double* estimates;
+	double estimate;
+	int i, num;
+
+	num = 0;
+	for (from = from_list; from; from = from->next)
+		num++;
+
+	ranked = xx_malloc((num + 1) * sizeof(*ranked));
+	estimates = xx_malloc((num + 1) * sizeof(*estimates));
+
+	// Insertion sort: the list is short and the sort must be stable
+	num = 0;
+	for (from = from_list; from; from = from->next) {
+		if (!from->repo)
+			continue;
+
+		estimate = mirror_stats_estimate(stats, from->repo->url,
+		                                 from->size);
+		for (i = num; i > 0 && estimates[i-1] > estimate; i--) {
+			ranked[i] = ranked[i-1];
+			estimates[i] = estimates[i-1];
+		}
+
+		ranked[i] = from;
+		estimates[i] = estimate;
+		num++;
+	}
+
+	free(estimates);
+	*num_ranked = num;
+	return ranked;
+}
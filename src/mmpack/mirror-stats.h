@@ -0,0 +1,49 @@
+/*
+ * @mindmaze_header@
+ */
+#ifndef MIRROR_STATS_H
+#define MIRROR_STATS_H
+
+#include <stddef.h>
+
+#include "download.h"
+#include "mmstring.h"
+#include "package-utils.h"
+
+/**
+ * struct mirror_stat - transfer performance measured for a repository
+ * @url:        URL of the repository
+ * @connect_time: average time in seconds to connect to the repository host
+ * @throughput: average throughput in bytes per second (0 if unknown)
+ */
+struct mirror_stat {
+	mmstr* url;
+	double connect_time;
+	double throughput;
+};
+
+/**
+ * struct mirror_stats - performance of the repositories used in a prefix
+ * @entries:    array of stats of each repository
+ * @num_entries: number of element in @entries
+ * @dirty:      non zero if @entries has been updated since loaded
+ */
+struct mirror_stats {
+	struct mirror_stat* entries;
+	int num_entries;
+	int dirty;
+};
+
+void mirror_stats_init(struct mirror_stats* stats);
+void mirror_stats_deinit(struct mirror_stats* stats);
+int mirror_stats_load(struct mirror_stats* stats, const mmstr* prefix);
+int mirror_stats_save(struct mirror_stats* stats, const mmstr* prefix);
+void mirror_stats_update(struct mirror_stats* stats, const mmstr* url,
+                         const struct download_metrics* metrics, int status);
+double mirror_stats_estimate(const struct mirror_stats* stats,
+                             const mmstr* url, size_t size);
+const struct from_repo** mirror_stats_rank(const struct mirror_stats* stats,
+                                           const struct from_repo* from_list,
+                                           int* num_ranked);
+
+#endif /* MIRROR_STATS_H */
@@ -18,40 +18,44 @@
 
 #include "cmdline.h"
 #include "context.h"
+#include "integrity-check.h"
 #include "mmstring.h"
 #include "package-utils.h"
-#include "pkg-fs-utils.h"
 #include "utils.h"
 
+static int quick_check = 0;
+static char check_integrity_doc[] =
+	"\"mmpack check-integrity\" verifies that the files of the given "
+	"installed package, or of all installed packages if none is given, "
+	"have not been modified since their installation.";
+
+static const struct mm_arg_opt cmdline_optv[] = {
+	{"q|quick", MM_OPT_NOVAL|MM_OPT_INT, "1", {.iptr = &quick_check},
+	 "hash only the files whose size, modification or status change time "
+	 "or inode differ from the ones recorded at installation"},
+};
+
+
 struct cb_data {
 	char const * pkg_name;
-	const struct mmpack_ctx* ctx;
+	struct integrity_check* chk;
 	int found;
-	int error;
 };
 
 
 static
 int binindex_cb(struct mmpkg* pkg, void * void_data)
 {
-	int rv;
 	struct cb_data * data = (struct cb_data*) void_data;
 
 	if (pkg->state == MMPACK_PKG_INSTALLED
 	    && (data->pkg_name == NULL
 	        || strcmp(pkg->name, data->pkg_name) == 0)) {
-		info("Checking %s (%s) ... ", pkg->name, pkg->version);
 		data->found = 1;
 
-		rv = check_installed_pkg(data->ctx, pkg);
-		if (rv == 0) {
-			info("OK\n");
-		} else {
-			info("Failed!\n");
-			data->error = 1;
-			if (data->pkg_name != NULL)
-				return rv;
-		}
+		// Files are checked asynchronously: the status of the
+		// package is reported by the integrity check once done
+		return integrity_check_add_pkg(data->chk, pkg);
 	}
 
 	return 0;
@@ -72,37 +76,57 @@ LOCAL_SYMBOL
 int mmpack_check_integrity(struct mmpack_ctx * ctx, int argc,
                            char const* argv[])
 {
+	struct integrity_check chk;
 	struct cb_data data = {
-		.pkg_name = (argc < 2) ? NULL : argv[1],
-		.ctx = ctx,
+		.pkg_name = NULL,
+		.chk = &chk,
 		.found = 0,
-		.error = 0,
+	};
+	int arg_index, rv;
+	struct mm_arg_parser parser = {
+		.flags = mm_arg_is_completing() ? MM_ARG_PARSER_COMPLETION : 0,
+		.doc = check_integrity_doc,
+		.args_doc = CHECK_INTEGRITY_SYNOPSIS,
+		.optv = cmdline_optv,
+		.num_opt = MM_NELEM(cmdline_optv),
+		.execname = "mmpack",
 	};
 
+	arg_index = mm_arg_parse(&parser, argc, (char**)argv);
 	if (mm_arg_is_completing()) {
 		// Complete only first command argument and if not empty
-		if (argc != 2 || argv[1][0] == '\0')
+		if (argc - arg_index != 1 || argv[argc-1][0] == '\0')
 			return 0;
 
-		return complete_pkgname(ctx, argv[1], ONLY_INSTALLED);
+		return complete_pkgname(ctx, argv[argc-1], ONLY_INSTALLED);
 	}
 
-	if (argc > 2
-	    || (argc == 2
-	        && (STR_EQUAL(argv[1], strlen(argv[1]), "--help")
-	            || STR_EQUAL(argv[1], strlen(argv[1]), "-h")))) {
-		fprintf(stderr,
-		        "Usage:\n\tmmpack "CHECK_INTEGRITY_SYNOPSIS "\n");
-		return argc > 2;
+	if (argc - arg_index > 1) {
+		fprintf(stderr, "Too many arguments.\n"
+		        "Run \"mmpack check-integrity --help\" to see usage\n");
+		return -1;
 	}
 
+	if (arg_index < argc)
+		data.pkg_name = argv[arg_index];
+
 	/* Load prefix configuration and caches */
 	if (mmpack_ctx_use_prefix(ctx, 0))
 		return -1;
 
+	// If a package is named, stop at the first problem found
+	if (integrity_check_init(&chk, ctx, data.pkg_name != NULL,
+	                         quick_check)) {
+		integrity_check_deinit(&chk);
+		return -1;
+	}
+
 	binindex_foreach(&ctx->binindex, binindex_cb, (void*) &data);
+	rv = integrity_check_finish(&chk);
+	integrity_check_deinit(&chk);
+
 	if (data.pkg_name && !data.found)
 		printf("Package \"%s\" not found\n", data.pkg_name);
 
-	return data.error;
+	return (rv == 0) ? 0 : 1;
 }
@@ -8,7 +8,7 @@
 #include "context.h"
 
 #define CHECK_INTEGRITY_SYNOPSIS \
-	"check-integrity [<pkg-name>]"
+	"check-integrity [-q|--quick] [<pkg-name>]"
 
 int mmpack_check_integrity(struct mmpack_ctx * ctx, int argc,
                            const char* argv[]);
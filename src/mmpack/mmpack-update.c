@@ -7,39 +7,812 @@
 #endif
 
 #include <mmargparse.h>
+#include <mmerrno.h>
+#include <mmsysio.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 
 #include "context.h"
 #include "download.h"
+#include "indextable.h"
 #include "mmpack-update.h"
 #include "mmstring.h"
 #include "settings.h"
 #include "utils.h"
 
 
+#define BINDEX_GEN_RELPATH "binary-index.gen"
+#define BINDEX_DELTA_DIR "binary-index.d"
+#define MAX_DELTA_FETCH 32
+
+
+/**************************************************************************
+ *                                                                        *
+ *                              File helpers                              *
+ *                                                                        *
+ **************************************************************************/
+
+/**
+ * load_file() - load content of a file in memory
+ * @path:       path of the file to read
+ * @buff:       initialized buffer to which the content is appended
+ *
+ * Return: 0 in case of success, -1 otherwise with error state set
+ */
 static
-int download_repo_index(struct mmpack_ctx * ctx, int repo_index)
+int load_file(const mmstr* path, struct buffer* buff)
 {
-	STATIC_CONST_MMSTR(pkglist, "binary-index");
+	char data[4096];
+	ssize_t rsz;
+	int fd;
+
+	fd = mm_open(path, O_RDONLY, 0);
+	if (fd < 0)
+		return -1;
+
+	while ((rsz = mm_read(fd, data, sizeof(data))) > 0)
+		buffer_push(buff, data, rsz);
+
+	mm_close(fd);
+	return (rsz < 0) ? -1 : 0;
+}
+
+
+/**
+ * save_file_atomic() - replace content of a file atomically
+ * @path:       path of the file to write
+ * @data:       content to write
+ * @len:        length of @data
+ *
+ * Return: 0 in case of success, -1 otherwise with error state set
+ */
+static
+int save_file_atomic(const mmstr* path, const void* data, size_t len)
+{
+	mmstr* tmp;
+	ssize_t rsz;
+	int fd, rv = -1;
+
+	tmp = mmstr_malloc(mmstrlen(path) + sizeof(".tmp"));
+	mmstrcpy(tmp, path);
+	mmstrcat_cstr(tmp, ".tmp");
+
+	fd = open_file_in_prefix(NULL, tmp, O_WRONLY|O_CREAT|O_TRUNC);
+	if (fd < 0)
+		goto exit;
+
+	rsz = mm_write(fd, data, len);
+	mm_close(fd);
+	if (rsz != (ssize_t)len || mm_rename(tmp, path)) {
+		mm_unlink(tmp);
+		goto exit;
+	}
+
+	rv = 0;
+
+exit:
+	mmstr_free(tmp);
+	return rv;
+}
+
+
+/**************************************************************************
+ *                                                                        *
+ *                     Local state of repository cache                    *
+ *                                                                        *
+ **************************************************************************/
+
+/**
+ * struct repo_state - state of the cached index of a repository
+ * @cond:       validators of the cached binary index (from last full fetch)
+ * @generation: generation of cached binary index, 0 if unknown
+ */
+struct repo_state {
+	struct download_cond cond;
+	int generation;
+};
+
+
+static
+mmstr* repo_state_path(const mmstr* cache_path)
+{
+	mmstr* path;
+
+	path = mmstr_malloc(mmstrlen(cache_path) + sizeof(".state"));
+	mmstrcpy(path, cache_path);
+	mmstrcat_cstr(path, ".state");
+
+	return path;
+}
+
+
+/**
+ * repo_state_load() - load state of the cached index of a repository
+ * @state:      repository state to initialize
+ * @cache_path: path of the cached binary index of the repository
+ *
+ * If the state file or the cached index is missing, @state is initialized
+ * to empty state, ie, a full unconditional fetch will be done.
+ */
+static
+void repo_state_load(struct repo_state* state, const mmstr* cache_path)
+{
+	char line[512];
+	char* value;
+	size_t len;
+	mmstr* path;
+	FILE* fp = NULL;
+
+	*state = (struct repo_state) {.generation = 0};
+
+	path = repo_state_path(cache_path);
+	if (mm_check_access(cache_path, F_OK) == 0
+	    && mm_check_access(path, F_OK) == 0)
+		fp = fopen(path, "rb");
+
+	mmstr_free(path);
+	if (!fp)
+		return;
+
+	while (fgets(line, sizeof(line), fp)) {
+		value = strchr(line, ':');
+		if (!value)
+			continue;
+
+		*value = '\0';
+		value += 2;
+		len = strlen(value);
+		while (len > 0 && (value[len-1] == '\n' || value[len-1] == '\r'))
+			value[--len] = '\0';
+
+		if (strcmp(line, "generation") == 0)
+			state->generation = atoi(value);
+		else if (strcmp(line, "etag") == 0)
+			state->cond.etag = mmstr_malloc_from_cstr(value);
+		else if (strcmp(line, "last-modified") == 0)
+			state->cond.last_modified = mmstr_malloc_from_cstr(value);
+	}
+
+	fclose(fp);
+}
+
+
+/**
+ * repo_state_save() - store state of the cached index of a repository
+ * @state:      repository state to save
+ * @cache_path: path of the cached binary index of the repository
+ *
+ * Return: 0 in case of success, -1 otherwise with error state set
+ */
+static
+int repo_state_save(const struct repo_state* state, const mmstr* cache_path)
+{
+	struct buffer content;
+	char line[64];
 	mmstr* path;
-	int rv = -1;
-	struct repolist_elt * repo;
+	int rv;
+
+	buffer_init(&content);
+
+	sprintf(line, "generation: %i\n", state->generation);
+	buffer_push(&content, line, strlen(line));
+
+	if (state->cond.etag) {
+		buffer_push(&content, "etag: ", 6);
+		buffer_push(&content, state->cond.etag,
+		            mmstrlen(state->cond.etag));
+		buffer_push(&content, "\n", 1);
+	}
+
+	if (state->cond.last_modified) {
+		buffer_push(&content, "last-modified: ", 15);
+		buffer_push(&content, state->cond.last_modified,
+		            mmstrlen(state->cond.last_modified));
+		buffer_push(&content, "\n", 1);
+	}
+
+	path = repo_state_path(cache_path);
+	rv = save_file_atomic(path, content.base, content.size);
+	mmstr_free(path);
+
+	buffer_deinit(&content);
+	return rv;
+}
+
+
+/**************************************************************************
+ *                                                                        *
+ *                     Delta update of binary index                       *
+ *                                                                        *
+ **************************************************************************/
+
+/**
+ * struct index_block - text of a package entry of a binary index
+ * @name:       pointer to the name of the package
+ * @namelen:    length of @name
+ * @text:       pointer to the beginning of the entry (starting with @name)
+ * @len:        length of the entry text (including final newline)
+ */
+struct index_block {
+	const char* name;
+	int namelen;
+	const char* text;
+	size_t len;
+};
+
+
+/**
+ * split_index_blocks() - split binary index text into package entries
+ * @data:       text of a binary index or of a delta of binary index
+ * @len:        length of @data
+ * @blocks:     initialized buffer receiving the array of struct index_block
+ *
+ * The binary index is a YAML mapping written in block style whose keys are
+ * the package names. Each package entry starts with a non indented line
+ * holding the package name and continues with all the indented lines that
+ * follow.
+ *
+ * Return: the number of package entries found
+ */
+static
+int split_index_blocks(const char* data, size_t len, struct buffer* blocks)
+{
+	const char* end = data + len;
+	const char* eol;
+	const char* colon;
+	struct index_block* curr = NULL;
+	int num = 0;
+
+	while (data < end) {
+		eol = memchr(data, '\n', end - data);
+		eol = eol ? eol + 1 : end;
+
+		// Continuation line of current entry
+		if (data[0] == ' ' || data[0] == '\t'
+		    || data[0] == '\n' || data[0] == '\r') {
+			if (curr)
+				curr->len = eol - curr->text;
+
+			data = eol;
+			continue;
+		}
+
+		// Skip document markers, comments and empty mapping
+		colon = memchr(data, ':', eol - data);
+		if (data[0] == '#' || data[0] == '{' || data[0] == '-'
+		    || colon == NULL) {
+			curr = NULL;
+			data = eol;
+			continue;
+		}
+
+		curr = buffer_reserve_data(blocks, sizeof(*curr));
+		*curr = (struct index_block) {
+			.name = data,
+			.namelen = colon - data,
+			.text = data,
+			.len = eol - data,
+		};
+		buffer_inc_size(blocks, sizeof(*curr));
+		num++;
+
+		data = eol;
+	}
+
+	return num;
+}
+
+
+/**
+ * is_removal_block() - test whether delta entry removes a package
+ * @block:      entry of a delta of binary index
+ *
+ * Return: 1 if @block is "<name>: null" (or "<name>: ~"), 0 otherwise
+ */
+static
+int is_removal_block(const struct index_block* block)
+{
+	const char* v = block->name + block->namelen + 1;
+	const char* end = block->text + block->len;
+
+	while (v < end && *v == ' ')
+		v++;
+
+	if (end - v >= 4 && strncmp(v, "null", 4) == 0)
+		return 1;
+
+	return (v < end && *v == '~');
+}
+
+
+/**
+ * apply_index_delta() - apply delta to the text of a binary index
+ * @index:      buffer holding text of binary index. Updated on output.
+ * @delta:      text of the delta
+ * @deltalen:   length of @delta
+ *
+ * Entries of @delta replace the entries of same package in @index. If not
+ * present in @index, they are appended. An entry whose value is null
+ * removes the package from @index.
+ */
+static
+void apply_index_delta(struct buffer* index, const char* delta,
+                       size_t deltalen)
+{
+	struct buffer idx_blks, delta_blks, out;
+	struct index_block *iblk, *dblk;
+	struct indextable table;
+	struct it_entry* entry;
+	char* applied;
+	mmstr** keys;
+	mmstr* name;
+	int i, num_idx, num_delta;
+
+	buffer_init(&idx_blks);
+	buffer_init(&delta_blks);
+	buffer_init(&out);
+
+	num_idx = split_index_blocks(index->base, index->size, &idx_blks);
+	num_delta = split_index_blocks(delta, deltalen, &delta_blks);
+	iblk = idx_blks.base;
+	dblk = delta_blks.base;
+
+	// Index the entries of delta by package name
+	indextable_init(&table, num_delta, -1);
+	keys = xx_malloc(num_delta * sizeof(*keys) + 1);
+	applied = xx_malloc(num_delta + 1);
+	for (i = 0; i < num_delta; i++) {
+		keys[i] = mmstr_malloc_copy(dblk[i].name, dblk[i].namelen);
+		applied[i] = 0;
+		entry = indextable_lookup_create(&table, keys[i]);
+		entry->ivalue = i + 1;
+	}
+
+	// Rewrite index, replacing the entries updated by delta
+	for (i = 0; i < num_idx; i++) {
+		name = mmstr_malloca_copy(iblk[i].name, iblk[i].namelen);
+		entry = indextable_lookup(&table, name);
+		mmstr_freea(name);
+
+		if (!entry) {
+			buffer_push(&out, iblk[i].text, iblk[i].len);
+			continue;
+		}
+
+		applied[entry->ivalue - 1] = 1;
+		if (!is_removal_block(&dblk[entry->ivalue - 1]))
+			buffer_push(&out, dblk[entry->ivalue - 1].text,
+			            dblk[entry->ivalue - 1].len);
+	}
+
+	// Append the new packages
+	for (i = 0; i < num_delta; i++) {
+		if (!applied[i] && !is_removal_block(&dblk[i]))
+			buffer_push(&out, dblk[i].text, dblk[i].len);
+	}
+
+	for (i = 0; i < num_delta; i++)
+		mmstr_free(keys[i]);
+
+	free(keys);
+	free(applied);
+	indextable_deinit(&table);
+	buffer_deinit(&idx_blks);
+	buffer_deinit(&delta_blks);
+
+	buffer_deinit(index);
+	*index = out;
+}
+
+
+/**************************************************************************
+ *                                                                        *
+ *                      Fetch of repository index                         *
+ *                                                                        *
+ **************************************************************************/
+
+enum update_stage {
+	FETCH_GENERATION,
+	FETCH_DELTAS,
+	FETCH_FULL,
+	UPDATE_DONE,
+};
+
+struct repo_update;
 
-	repo = settings_get_repo(&ctx->settings, repo_index);
+/**
+ * struct index_fetch - data received by a transfer of a repository update
+ * @ru:         repository update the transfer belongs to
+ * @data:       data received if the transfer is kept in memory
+ */
+struct index_fetch {
+	struct repo_update* ru;
+	struct buffer data;
+};
+
+/**
+ * struct repo_update - update of the cached index of one repository
+ * @repo:       repository to update
+ * @cache_path: path of cached binary index of @repo
+ * @tmp_path:   path of the temporary file receiving the full index
+ * @state:      state of the cached index
+ * @stage:      current step of the update
+ * @remote_gen: generation of the binary index published by @repo, -1 if
+ *              @repo does not publish generations
+ * @fetch:      transfer of generation or of full index
+ * @deltas:     transfers of deltas (@num_deltas elements)
+ * @num_deltas: number of deltas to fetch
+ * @num_pending: number of transfers of deltas not terminated yet
+ * @delta_failed: non zero if one of the deltas could not be fetched
+ * @use_xz:     non zero if the xz-compressed full index must be requested
+ * @rv:         result of the update (0 in case of success)
+ *
+ * The update of a repository index goes through the following steps, each
+ * step being started by the termination of the transfer of the previous one:
+ * the generation of the remote index is fetched first. If the cached index
+ * is up to date, the update stops here. If deltas can be used, they are all
+ * fetched and applied. Otherwise (or if a delta fails to be fetched), the
+ * full index is fetched conditionally.
+ */
+struct repo_update {
+	const struct repolist_elt* repo;
+	mmstr* cache_path;
+	mmstr* tmp_path;
+	struct repo_state state;
+	enum update_stage stage;
+	int remote_gen;
+	struct index_fetch fetch;
+	struct index_fetch* deltas;
+	int num_deltas;
+	int num_pending;
+	int delta_failed;
+	int use_xz;
+	int rv;
+};
+
+
+static
+void repo_update_init(struct repo_update* ru, struct mmpack_ctx* ctx,
+                      const struct repolist_elt* repo)
+{
+	*ru = (struct repo_update) {
+		.repo = repo,
+		.stage = FETCH_GENERATION,
+		.remote_gen = -1,
+		.fetch = {.ru = ru},
+		.use_xz = download_can_decompress(),
+		.rv = -1,
+	};
+	buffer_init(&ru->fetch.data);
+
+	ru->cache_path = mmpack_get_repocache_path(ctx, repo->name);
+	ru->tmp_path = mmstr_malloc(mmstrlen(ru->cache_path) + sizeof(".tmp"));
+	mmstrcpy(ru->tmp_path, ru->cache_path);
+	mmstrcat_cstr(ru->tmp_path, ".tmp");
+
+	repo_state_load(&ru->state, ru->cache_path);
+}
+
+
+static
+void repo_update_deinit(struct repo_update* ru)
+{
+	int i;
+
+	if (mm_check_access(ru->tmp_path, F_OK) == 0)
+		mm_unlink(ru->tmp_path);
 
-	path = mmpack_get_repocache_path(ctx, repo->name);
+	for (i = 0; i < ru->num_deltas; i++)
+		buffer_deinit(&ru->deltas[i].data);
 
-	if (download_from_repo(ctx, repo->url, pkglist, NULL, path)) {
+	free(ru->deltas);
+	buffer_deinit(&ru->fetch.data);
+	download_cond_deinit(&ru->state.cond);
+	mmstr_free(ru->cache_path);
+	mmstr_free(ru->tmp_path);
+}
+
+
+/**
+ * repo_update_finish() - terminate update of a repository
+ * @ru:         repository update
+ * @rv:         0 if the cached index has been updated successfully
+ */
+static
+void repo_update_finish(struct repo_update* ru, int rv)
+{
+	const struct repolist_elt* repo = ru->repo;
+
+	ru->stage = UPDATE_DONE;
+	ru->rv = rv;
+
+	if (rv) {
 		error("Failed to download package list from %s (%s)\n",
 		      repo->name, repo->url);
+		return;
+	}
+
+	ru->state.generation = (ru->remote_gen > 0) ? ru->remote_gen : 0;
+	repo_state_save(&ru->state, ru->cache_path);
+	info("Updated package list from repository: %s\n", repo->name);
+}
 
+
+/**
+ * repo_update_queue_full() - fetch the whole index if changed
+ * @ru:         repository update
+ * @batch:      download batch driving the transfers
+ *
+ * The binary index is requested only if it differs from the cached one
+ * (based on ETag and Last-Modified validators). If supported, the
+ * xz-compressed index is requested first and decompressed while being
+ * received. The new index is written into a temporary file renamed over the
+ * cached index only once complete.
+ */
+static
+void repo_update_queue_full(struct repo_update* ru,
+                            struct download_batch* batch)
+{
+	STATIC_CONST_MMSTR(pkglist, "binary-index");
+	STATIC_CONST_MMSTR(pkglist_xz, "binary-index.xz");
+	struct download_job* job;
+
+	ru->stage = FETCH_FULL;
+	job = download_batch_add(batch, ru->repo->url,
+	                         ru->use_xz ? pkglist_xz : pkglist,
+	                         NULL, ru->tmp_path, NULL, 0, &ru->fetch);
+	job->cond = &ru->state.cond;
+	job->decompress = ru->use_xz;
+}
+
+
+/**
+ * repo_update_queue_deltas() - fetch deltas since cached generation
+ * @ru:         repository update
+ * @batch:      download batch driving the transfers
+ *
+ * Delta <N> is published by the repository in binary-index.d/<N> and holds
+ * the entries changed between generation N-1 and N. All the deltas are
+ * fetched concurrently.
+ */
+static
+void repo_update_queue_deltas(struct repo_update* ru,
+                              struct download_batch* batch)
+{
+	mmstr* relpath;
+	int i, gen;
+
+	ru->stage = FETCH_DELTAS;
+	ru->num_deltas = ru->remote_gen - ru->state.generation;
+	ru->num_pending = ru->num_deltas;
+	ru->deltas = xx_malloc(ru->num_deltas * sizeof(*ru->deltas));
+
+	relpath = mmstr_malloc(sizeof(BINDEX_DELTA_DIR) + 16);
+	for (i = 0; i < ru->num_deltas; i++) {
+		ru->deltas[i].ru = ru;
+		buffer_init(&ru->deltas[i].data);
+
+		gen = ru->state.generation + i + 1;
+		sprintf(relpath, BINDEX_DELTA_DIR "/%i", gen);
+		mmstr_update_len_from_buffer(relpath);
+		download_batch_add(batch, ru->repo->url, relpath,
+		                   NULL, NULL, NULL, 0, &ru->deltas[i]);
+	}
+
+	mmstr_free(relpath);
+}
+
+
+/**
+ * repo_update_apply_deltas() - apply fetched deltas to cached index
+ * @ru:         repository update whose deltas have all been fetched
+ *
+ * Return: 0 in case of success, -1 otherwise.
+ */
+static
+int repo_update_apply_deltas(struct repo_update* ru)
+{
+	struct buffer index;
+	int i, rv = -1;
+
+	buffer_init(&index);
+	if (load_file(ru->cache_path, &index))
 		goto exit;
+
+	for (i = 0; i < ru->num_deltas; i++)
+		apply_index_delta(&index, ru->deltas[i].data.base,
+		                  ru->deltas[i].data.size);
+
+	rv = save_file_atomic(ru->cache_path, index.base, index.size);
+
+	// Validators apply to the full index fetched previously
+	download_cond_deinit(&ru->state.cond);
+
+exit:
+	buffer_deinit(&index);
+	return rv;
+}
+
+
+/**
+ * repo_update_generation_done() - process the generation of remote index
+ * @ru:         repository update
+ * @batch:      download batch driving the transfers
+ * @status:     0 if generation has been fetched
+ */
+static
+void repo_update_generation_done(struct repo_update* ru,
+                                 struct download_batch* batch, int status)
+{
+	int gen = ru->state.generation;
+
+	if (status == 0) {
+		buffer_push(&ru->fetch.data, "", 1);
+		ru->remote_gen = atoi(ru->fetch.data.base);
+	}
+
+	if (gen > 0 && ru->remote_gen == gen) {
+		mm_log_info("Package list of %s is up to date", ru->repo->name);
+		repo_update_finish(ru, 0);
+	} else if (gen > 0 && ru->remote_gen > gen
+	           && ru->remote_gen - gen <= MAX_DELTA_FETCH) {
+		repo_update_queue_deltas(ru, batch);
+	} else {
+		repo_update_queue_full(ru, batch);
+	}
+}
+
+
+/**
+ * repo_update_full_done() - process the fetch of the full index
+ * @ru:         repository update
+ * @batch:      download batch driving the transfers
+ * @status:     0 if the transfer has succeeded
+ */
+static
+void repo_update_full_done(struct repo_update* ru,
+                           struct download_batch* batch, int status)
+{
+	struct download_cond* cond = &ru->state.cond;
+
+	// Repository may not publish compressed index: fetch plain one
+	if (status != 0 && ru->use_xz) {
+		mm_log_info("Compressed package list of %s not available",
+		            ru->repo->name);
+		ru->use_xz = 0;
+		repo_update_queue_full(ru, batch);
+		return;
 	}
 
+	if (status != 0) {
+		repo_update_finish(ru, -1);
+		return;
+	}
+
+	if (cond->not_modified) {
+		mm_log_info("Package list of %s not modified", ru->repo->name);
+		repo_update_finish(ru, 0);
+		return;
+	}
+
+	if (mm_rename(ru->tmp_path, ru->cache_path)) {
+		repo_update_finish(ru, -1);
+		return;
+	}
+
+	// Keep validators of the new index
+	mmstr_free(cond->etag);
+	mmstr_free(cond->last_modified);
+	cond->etag = cond->resp_etag;
+	cond->last_modified = cond->resp_last_modified;
+	cond->resp_etag = NULL;
+	cond->resp_last_modified = NULL;
+
+	repo_update_finish(ru, 0);
+}
+
+
+/**
+ * repo_update_done() - done callback of the transfers of repository updates
+ * @batch:      download batch driving the transfers of all repositories
+ * @job:        terminated job whose data field points to a struct index_fetch
+ * @status:     0 if the transfer has succeeded, -1 otherwise
+ *
+ * Advance the update of the repository the job belongs to.
+ *
+ * Return: always 0, failures are accounted per repository
+ */
+static
+int repo_update_done(struct download_batch* batch, struct download_job* job,
+                     int status)
+{
+	struct index_fetch* fetch = job->data;
+	struct repo_update* ru = fetch->ru;
+
+	if (status == 0)
+		buffer_push(&fetch->data, job->mem.base, job->mem.size);
+
+	switch (ru->stage) {
+	case FETCH_GENERATION:
+		repo_update_generation_done(ru, batch, status);
+		break;
+
+	case FETCH_DELTAS:
+		if (status != 0)
+			ru->delta_failed = 1;
+
+		if (--ru->num_pending > 0)
+			break;
+
+		if (ru->delta_failed || repo_update_apply_deltas(ru))
+			repo_update_queue_full(ru, batch);
+		else
+			repo_update_finish(ru, 0);
+
+		break;
+
+	case FETCH_FULL:
+		repo_update_full_done(ru, batch, status);
+		break;
+
+	default:
+		break;
+	}
+
+	return 0;
+}
+
+
+/**
+ * update_repo_indexes() - update cached index of all enabled repositories
+ * @ctx:        mmpack context
+ *
+ * The indexes of all repositories are updated concurrently: all transfers
+ * are driven by the same download batch (and then the same curl multi
+ * handle).
+ *
+ * Return: 0 if all repositories have been updated, -1 otherwise.
+ */
+static
+int update_repo_indexes(struct mmpack_ctx* ctx)
+{
+	STATIC_CONST_MMSTR(gen_relpath, BINDEX_GEN_RELPATH);
+	struct download_batch batch;
+	struct repo_update* updates;
+	const struct repolist_elt* repo;
+	int i, num_repo, rv;
+
+	num_repo = settings_num_repo(&ctx->settings);
+	updates = xx_malloc(num_repo * sizeof(*updates));
+
+	// Start update of each repository by fetching index generation
+	download_batch_init(&batch, ctx, repo_update_done);
+	for (i = 0; i < num_repo; i++) {
+		repo = settings_get_repo(&ctx->settings, i);
+		repo_update_init(&updates[i], ctx, repo);
+		if (!repo->enabled) {
+			updates[i].stage = UPDATE_DONE;
+			updates[i].rv = 0;
+			continue;
+		}
+
+		download_batch_add(&batch, repo->url, gen_relpath,
+		                   NULL, NULL, NULL, 0, &updates[i].fetch);
+	}
+
+	download_batch_perform(&batch);
+	download_batch_deinit(&batch);
+
 	rv = 0;
-	info("Updated package list from repository: %s\n", repo->name);
+	for (i = 0; i < num_repo; i++) {
+		if (updates[i].rv)
+			rv = -1;
 
-exit:
-	mmstr_free(path);
+		repo_update_deinit(&updates[i]);
+	}
+
+	free(updates);
 	return rv;
 }
 
@@ -57,7 +830,7 @@ exit:
 LOCAL_SYMBOL
 int mmpack_update_all(struct mmpack_ctx * ctx, int argc, char const ** argv)
 {
-	int i, num_repo;
+	int num_repo;
 
 	if (mm_arg_is_completing())
 		return 0;
@@ -79,9 +852,7 @@ int mmpack_update_all(struct mmpack_ctx * ctx, int argc, char const ** argv)
 		return -1;
 	}
 
-	for (i = 0; i < num_repo; i++) {
-		download_repo_index(ctx, i);
-	}
+	update_repo_indexes(ctx);
 
 	return 0;
 }
@@ -16,6 +16,7 @@
 
 #include "cmdline.h"
 #include "common.h"
+#include "download.h"
 #include "mmpack-autoremove.h"
 #include "mmpack-check-integrity.h"
 #include "mmpack-download.h"
@@ -152,6 +153,7 @@ int main(int argc, char* argv[])
 
 	/* Run identified sub command with the remaining arguments */
 	rv = subcmd->cb(&ctx, cmd_argc, cmd_argv);
+	download_report_summary(&ctx);
 
 	mmpack_ctx_deinit(&ctx);
 	return (rv == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
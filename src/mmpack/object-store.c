@@ -0,0 +1,724 @@
+/*
+ * @mindmaze_header@
+ */
+#if defined (HAVE_CONFIG_H)
+# include <config.h>
+#endif
+
+#include <mmerrno.h>
+#include <mmlib.h>
+#include <mmsysio.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "mmstring.h"
+#include "object-store.h"
+#include "sha256.h"
+#include "utils.h"
+#include "xx-alloc.h"
+
+#define OBJECTS_SUBDIR "objects"
+#define MANIFESTS_SUBDIR "pkgs"
+#define TMP_EXT ".tmp"
+#define OBJECT_READ_SIZE (64*1024)
+
+/**
+ * store_path() - get path of an element of the object store
+ * @store:      folder of the object store
+ * @subdir:     subfolder of the element in @store
+ * @name:       name of the element
+ * @mode:       if not negative, permission bits to append to @name
+ * @ext:        suffix to append to the path (may be NULL)
+ *
+ * Return: an allocated string to be freed with mmstr_free()
+ */
+static
+mmstr* store_path(const mmstr* store, const char* subdir, const char* name,
+                  int mode, const char* ext)
+{
+	mmstr* path;
+	int len;
+
+	len = mmstrlen(store) + strlen(subdir) + strlen(name) + 16;
+	len += ext ? strlen(ext) : 0;
+	path = mmstr_malloc(len);
+
+	mmstrcpy(path, store);
+	mmstrcat_cstr(path, "/");
+	mmstrcat_cstr(path, subdir);
+	mmstrcat_cstr(path, "/");
+	mmstrcat_cstr(path, name);
+	if (mode >= 0)
+		mmstr_setlen(path, mmstrlen(path)
+		             + sprintf(path + mmstrlen(path), ".%04o", mode));
+
+	if (ext)
+		mmstrcat_cstr(path, ext);
+
+	return path;
+}
+
+
+/**
+ * is_sha_hexstr() - test whether a string is a SHA-256 in hexadecimal
+ * @str:        string to test
+ *
+ * Return: 1 if @str is made of SHA_HEXSTR_LEN - SHA_HDRLEN lowercase
+ * hexadecimal digits, 0 otherwise.
+ */
+static
+int is_sha_hexstr(const char* str)
+{
+	int i;
+
+	for (i = 0; i < SHA_HEXSTR_LEN - SHA_HDRLEN; i++) {
+		if (!((str[i] >= '0' && str[i] <= '9')
+		      || (str[i] >= 'a' && str[i] <= 'f')))
+			return 0;
+	}
+
+	return (str[i] == '\0');
+}
+
+
+/**
+ * is_safe_relpath() - test whether a path stays below the prefix
+ * @path:       path relative to prefix read from a manifest
+ *
+ * Return: 1 if @path is a non empty relative path without any ".."
+ * component, 0 otherwise.
+ */
+static
+int is_safe_relpath(const char* path)
+{
+	const char* end;
+
+	if (path[0] == '\0' || is_path_separator(path[0]))
+		return 0;
+
+#if defined (_WIN32)
+	// Reject drive letter
+	if (path[1] == ':')
+		return 0;
+#endif
+
+	while (1) {
+		for (end = path; *end && !is_path_separator(*end); end++)
+			;
+
+		if (end - path == 2 && path[0] == '.' && path[1] == '.')
+			return 0;
+
+		if (*end == '\0')
+			return 1;
+
+		path = end + 1;
+	}
+}
+
+
+/**
+ * drop_corrupted_object() - remove an object whose content is not expected
+ * @obj_path:   path of the object
+ *
+ * Return: always -1 with error state set to EBADMSG.
+ */
+static
+int drop_corrupted_object(const mmstr* obj_path)
+{
+	int prev_err_flags;
+
+	prev_err_flags = mm_error_set_flags(MM_ERROR_SET, MM_ERROR_IGNORE);
+	mm_unlink(obj_path);
+	mm_error_set_flags(prev_err_flags, MM_ERROR_IGNORE);
+
+	return mm_raise_error(EBADMSG, "corrupted object %s", obj_path);
+}
+
+
+/**
+ * check_object() - verify the content of an object of the store
+ * @obj_path:   path of the object
+ * @hash:       expected SHA-256 of the content of the object
+ * @st:         pointer to structure receiving the status of the checked object
+ *
+ * The store may be shared between prefixes of different users: an object
+ * may have been altered since it has been stored. The object must be a
+ * regular file (not a symlink planted in the store) and it is hashed through
+ * the file descriptor opened on the very inode whose status is returned in
+ * @st. A corrupted object is removed from the store, so that it can be
+ * stored again.
+ *
+ * Return: 0 if the content of @obj_path matches @hash, -1 otherwise with
+ * error state set accordingly.
+ */
+static
+int check_object(const mmstr* obj_path, const char* hash, struct mm_stat* st)
+{
+	char actual[2*SHA256_BLOCK_SIZE + 1];
+	struct mm_stat lst;
+	int fd, oflags, rv;
+
+	if (mm_stat(obj_path, &lst, MM_NOFOLLOW))
+		return -1;
+
+	if (!S_ISREG(lst.mode))
+		return drop_corrupted_object(obj_path);
+
+	oflags = O_RDONLY;
+#if defined (O_NOFOLLOW)
+	oflags |= O_NOFOLLOW;
+#endif
+	fd = mm_open(obj_path, oflags, 0);
+	if (fd < 0)
+		return -1;
+
+	if (mm_fstat(fd, st)) {
+		mm_close(fd);
+		return -1;
+	}
+
+	// The object must not have been replaced since it has been lstat'ed
+	if (!S_ISREG(st->mode) || st->dev != lst.dev || st->ino != lst.ino) {
+		mm_close(fd);
+		return drop_corrupted_object(obj_path);
+	}
+
+	rv = sha_fd_compute(actual, fd);
+	mm_close(fd);
+	if (rv)
+		return -1;
+
+	actual[2*SHA256_BLOCK_SIZE] = '\0';
+	if (strcmp(actual, hash) != 0)
+		return drop_corrupted_object(obj_path);
+
+	return 0;
+}
+
+
+/**
+ * objstore_has_pkg() - test whether the files of a package are in store
+ * @store:      folder of the object store
+ * @sumsha:     sumsha of the package
+ *
+ * Return: 1 if the manifest of package identified by @sumsha is in @store,
+ * 0 otherwise.
+ */
+LOCAL_SYMBOL
+int objstore_has_pkg(const mmstr* store, const mmstr* sumsha)
+{
+	mmstr* path;
+	int rv;
+
+	if (!store || !sumsha)
+		return 0;
+
+	path = store_path(store, MANIFESTS_SUBDIR, sumsha, -1, NULL);
+	rv = (mm_check_access(path, F_OK) == 0);
+	mmstr_free(path);
+
+	return rv;
+}
+
+
+/**************************************************************************
+ *                                                                        *
+ *                         Population of the store                        *
+ *                                                                        *
+ **************************************************************************/
+
+/**
+ * objstore_manifest_init() - initialize the manifest of a package to store
+ * @manifest:   manifest to initialize
+ * @store:      folder of the object store
+ * @sumsha:     sumsha of the package whose files are going to be stored
+ *
+ * The manifest must be cleansed by calling objstore_manifest_deinit()
+ */
+LOCAL_SYMBOL
+void objstore_manifest_init(struct objstore_manifest* manifest,
+                            const mmstr* store, const mmstr* sumsha)
+{
+	*manifest = (struct objstore_manifest) {
+		.store = store,
+		.sumsha = sumsha,
+	};
+	buffer_init(&manifest->data);
+}
+
+
+LOCAL_SYMBOL
+void objstore_manifest_deinit(struct objstore_manifest* manifest)
+{
+	buffer_deinit(&manifest->data);
+}
+
+
+/**
+ * objstore_manifest_reset() - drop the entries added to a manifest
+ * @manifest:   manifest to reset
+ *
+ * This must be called before trying again to store a package whose
+ * extraction has been interrupted.
+ */
+LOCAL_SYMBOL
+void objstore_manifest_reset(struct objstore_manifest* manifest)
+{
+	manifest->data.size = 0;
+	manifest->failed = 0;
+}
+
+
+/**
+ * objstore_manifest_add() - add an entry to the manifest of a package
+ * @manifest:   manifest of the package being stored
+ * @type:       OBJSTORE_DIR, OBJSTORE_REG or OBJSTORE_SYMLINK
+ * @mode:       permission bits of the file
+ * @ref:        SHA-256 of a regular file, target of a symlink, ignored for
+ *              folders
+ * @path:       path of the file relative to prefix
+ *
+ * The fields of a manifest line are separated by tabs. If @ref or @path
+ * contains a tab or a newline, the package cannot be listed: the manifest
+ * is marked as failed and will not be committed.
+ */
+LOCAL_SYMBOL
+void objstore_manifest_add(struct objstore_manifest* manifest, int type,
+                           int mode, const char* ref, const char* path)
+{
+	char* line;
+	int len;
+
+	if (type == OBJSTORE_DIR)
+		ref = "-";
+
+	if (strpbrk(ref, "\t\n") || strpbrk(path, "\t\n")) {
+		manifest->failed = 1;
+		return;
+	}
+
+	len = strlen(ref) + strlen(path) + 16;
+	line = buffer_reserve_data(&manifest->data, len);
+	len = sprintf(line, "%c\t%04o\t%s\t%s\n", type, mode & 07777,
+	              ref, path);
+	buffer_inc_size(&manifest->data, len);
+}
+
+
+/**
+ * objstore_manifest_add_regfile() - store a regular file of a package
+ * @manifest:   manifest of the package being stored
+ * @src:        path of the extracted file whose content must be stored
+ * @mode:       permission bits of the file
+ * @path:       path of the file relative to prefix
+ *
+ * The content of @src is added to the store (unless an object with the same
+ * content and permission is already there) and the file is listed in
+ * @manifest. The object is created from a temporary file renamed once
+ * complete, so concurrent processes never see a partial object.
+ *
+ * Return: 0 in case of success, -1 otherwise. In such a case, the manifest
+ * will not be committed.
+ */
+LOCAL_SYMBOL
+int objstore_manifest_add_regfile(struct objstore_manifest* manifest,
+                                  const char* src, int mode,
+                                  const char* path)
+{
+	mmstr * hash, * obj_path, * tmp_path, * src_path, * dir;
+	int prev_err_flags, rv;
+
+	if (manifest->failed)
+		return -1;
+
+	mode &= 07777;
+	hash = mmstr_alloca(SHA_HEXSTR_LEN);
+	src_path = mmstr_malloc_from_cstr(src);
+	obj_path = tmp_path = dir = NULL;
+	rv = -1;
+
+	if (sha_compute(hash, src_path, NULL, 1))
+		goto exit;
+
+	obj_path = store_path(manifest->store, OBJECTS_SUBDIR, hash, mode,
+	                      NULL);
+	if (mm_check_access(obj_path, F_OK) == 0) {
+		rv = 0;
+		goto exit;
+	}
+
+	tmp_path = store_path(manifest->store, OBJECTS_SUBDIR, hash, mode,
+	                      TMP_EXT);
+	dir = mmstr_malloc(mmstrlen(tmp_path));
+	mmstr_dirname(dir, tmp_path);
+	if (mm_mkdir(dir, 0777, MM_RECURSIVE))
+		goto exit;
+
+	// Objects are shared by hardlinks: they must not be modified. If the
+	// temporary file exists, another process is storing the same object
+	prev_err_flags = mm_error_set_flags(MM_ERROR_SET, MM_ERROR_IGNORE);
+	if (copy_file_excl(src, tmp_path, mode & ~0222)
+	    && (mm_get_lasterror_number() != EEXIST
+	        || remove_stale_tmp(tmp_path)
+	        || copy_file_excl(src, tmp_path, mode & ~0222))) {
+		mm_error_set_flags(prev_err_flags, MM_ERROR_IGNORE);
+		goto exit;
+	}
+
+	mm_error_set_flags(prev_err_flags, MM_ERROR_IGNORE);
+
+	rv = mm_rename(tmp_path, obj_path);
+	if (rv)
+		mm_unlink(tmp_path);
+
+exit:
+	if (rv == 0)
+		objstore_manifest_add(manifest, OBJSTORE_REG, mode,
+		                      hash, path);
+	else
+		manifest->failed = 1;
+
+	mmstr_free(dir);
+	mmstr_free(tmp_path);
+	mmstr_free(obj_path);
+	mmstr_free(src_path);
+	mmstr_freea(hash);
+	return rv;
+}
+
+
+/**
+ * objstore_manifest_commit() - publish the manifest of a stored package
+ * @manifest:   manifest of the package being stored
+ *
+ * The manifest is published only if all the files of the package have been
+ * stored. Once published, the package can be installed from the store.
+ *
+ * Return: 0 in case of success, -1 otherwise.
+ */
+LOCAL_SYMBOL
+int objstore_manifest_commit(struct objstore_manifest* manifest)
+{
+	mmstr * path, * tmp_path, * dir;
+	int fd, prev_err_flags, rv = -1;
+
+	if (manifest->failed)
+		return -1;
+
+	path = store_path(manifest->store, MANIFESTS_SUBDIR,
+	                  manifest->sumsha, -1, NULL);
+	tmp_path = store_path(manifest->store, MANIFESTS_SUBDIR,
+	                      manifest->sumsha, -1, TMP_EXT);
+	dir = mmstr_malloc(mmstrlen(path));
+	mmstr_dirname(dir, path);
+
+	if (mm_mkdir(dir, 0777, MM_RECURSIVE))
+		goto exit;
+
+	// If the temporary file exists, another process is storing the package
+	prev_err_flags = mm_error_set_flags(MM_ERROR_SET, MM_ERROR_IGNORE);
+	fd = mm_open(tmp_path, O_WRONLY|O_CREAT|O_EXCL, 0666);
+	if (fd < 0 && mm_get_lasterror_number() == EEXIST
+	    && remove_stale_tmp(tmp_path) == 0)
+		fd = mm_open(tmp_path, O_WRONLY|O_CREAT|O_EXCL, 0666);
+
+	mm_error_set_flags(prev_err_flags, MM_ERROR_IGNORE);
+	if (fd < 0)
+		goto exit;
+
+	if (fullwrite(fd, manifest->data.base, manifest->data.size)) {
+		mm_close(fd);
+		mm_unlink(tmp_path);
+		goto exit;
+	}
+
+	mm_close(fd);
+	rv = mm_rename(tmp_path, path);
+
+exit:
+	mmstr_free(dir);
+	mmstr_free(tmp_path);
+	mmstr_free(path);
+	return rv;
+}
+
+
+/**************************************************************************
+ *                                                                        *
+ *                        Installation from the store                     *
+ *                                                                        *
+ **************************************************************************/
+
+/**
+ * objstore_reader_open() - load the manifest of a package
+ * @reader:     reader to initialize
+ * @store:      folder of the object store
+ * @sumsha:     sumsha of the package
+ *
+ * Return: 0 in case of success, -1 otherwise with error state set
+ * accordingly. In both cases, @reader must be cleansed by
+ * objstore_reader_close().
+ */
+LOCAL_SYMBOL
+int objstore_reader_open(struct objstore_reader* reader,
+                         const mmstr* store, const mmstr* sumsha)
+{
+	mmstr* path;
+	void* map;
+	size_t mapsize;
+	int rv;
+
+	*reader = (struct objstore_reader) {0};
+
+	path = store_path(store, MANIFESTS_SUBDIR, sumsha, -1, NULL);
+	rv = map_file_in_prefix(NULL, path, &map, &mapsize);
+	mmstr_free(path);
+	if (rv)
+		return -1;
+
+	// Copy the content to get a null terminated string
+	reader->data = xx_malloc(mapsize + 1);
+	memcpy(reader->data, map, mapsize);
+	reader->data[mapsize] = '\0';
+	reader->curr = reader->data;
+	mm_unmap(map);
+
+	return 0;
+}
+
+
+/**
+ * objstore_reader_next() - get next entry of a manifest
+ * @reader:     manifest reader
+ * @entry:      structure receiving the entry read. The strings it points to
+ *              remain valid until @reader is closed.
+ *
+ * The store may be shared between prefixes of different users, so its
+ * content is not trusted: an entry whose path is absolute or contains a ".."
+ * component, or whose regular file reference is not a SHA-256, makes the
+ * manifest malformed.
+ *
+ * Return: 1 if an entry has been read, 0 if the end of manifest has been
+ * reached, -1 if the manifest is malformed.
+ */
+LOCAL_SYMBOL
+int objstore_reader_next(struct objstore_reader* reader,
+                         struct objstore_entry* entry)
+{
+	char * start, * line, * fields[3], * eol, * end;
+	long mode;
+	int i;
+
+	start = line = reader->curr;
+	if (!line || *line == '\0')
+		return 0;
+
+	eol = strchr(line, '\n');
+	if (!eol)
+		goto malformed;
+
+	*eol = '\0';
+	reader->curr = eol + 1;
+
+	// Split "<type>\t<mode>\t<ref>\t<path>"
+	for (i = 0; i < 3; i++) {
+		line = strchr(line, '\t');
+		if (!line)
+			goto malformed;
+
+		*line++ = '\0';
+		fields[i] = line;
+	}
+
+	mode = strtol(fields[0], &end, 8);
+	if (end == fields[0] || *end != '\0' || mode < 0 || mode > 07777)
+		goto malformed;
+
+	*entry = (struct objstore_entry) {
+		.type = start[0],
+		.mode = mode,
+		.ref = fields[1],
+		.path = fields[2],
+	};
+
+	if (fields[0] != start + 2
+	    || (entry->type != OBJSTORE_DIR && entry->type != OBJSTORE_REG
+	        && entry->type != OBJSTORE_SYMLINK)
+	    || !is_safe_relpath(entry->path)
+	    || (entry->type == OBJSTORE_REG && !is_sha_hexstr(entry->ref)))
+		goto malformed;
+
+	return 1;
+
+malformed:
+	reader->curr = NULL;
+	return mm_raise_error(MM_EBADFMT, "malformed object store manifest");
+}
+
+
+LOCAL_SYMBOL
+void objstore_reader_close(struct objstore_reader* reader)
+{
+	free(reader->data);
+	*reader = (struct objstore_reader) {0};
+}
+
+
+/**
+ * objstore_has_object() - test whether an object is in the store
+ * @store:      folder of the object store
+ * @hash:       SHA-256 of the content of the file
+ * @mode:       permission bits of the file
+ *
+ * Return: 1 if the object is in @store, 0 otherwise.
+ */
+LOCAL_SYMBOL
+int objstore_has_object(const mmstr* store, const char* hash, int mode)
+{
+	mmstr* obj_path;
+	int rv;
+
+	obj_path = store_path(store, OBJECTS_SUBDIR, hash, mode & 07777, NULL);
+	rv = (mm_check_access(obj_path, F_OK) == 0);
+	mmstr_free(obj_path);
+
+	return rv;
+}
+
+
+/**
+ * objstore_load_object() - read the content of an object of the store
+ * @store:      folder of the object store
+ * @hash:       SHA-256 of the content of the file
+ * @mode:       permission bits of the file
+ * @data:       buffer to which the content of the object is appended
+ *
+ * The content is verified once loaded in @data, hence it cannot change
+ * after having been checked.
+ *
+ * Return: 0 in case of success, -1 otherwise with error state set
+ * accordingly.
+ */
+LOCAL_SYMBOL
+int objstore_load_object(const mmstr* store, const char* hash, int mode,
+                         struct buffer* data)
+{
+	unsigned char md[SHA256_BLOCK_SIZE];
+	char hexstr[2*SHA256_BLOCK_SIZE + 1];
+	SHA256_CTX ctx;
+	mmstr* obj_path;
+	size_t start = data->size;
+	ssize_t rsz;
+	void* buf;
+	int fd, rv = -1;
+
+	obj_path = store_path(store, OBJECTS_SUBDIR, hash, mode & 07777, NULL);
+	fd = mm_open(obj_path, O_RDONLY, 0);
+	if (fd < 0)
+		goto exit;
+
+	do {
+		buf = buffer_reserve_data(data, OBJECT_READ_SIZE);
+		rsz = mm_read(fd, buf, OBJECT_READ_SIZE);
+		if (rsz > 0)
+			buffer_inc_size(data, rsz);
+	} while (rsz > 0);
+
+	mm_close(fd);
+	if (rsz < 0)
+		goto exit;
+
+	sha256_init(&ctx);
+	sha256_update(&ctx, (char*)data->base + start, data->size - start);
+	sha256_final(&ctx, md);
+	hexstr[conv_to_hexstr(hexstr, md, sizeof(md))] = '\0';
+	if (strcmp(hexstr, hash) != 0) {
+		mm_raise_error(EBADMSG, "corrupted object %s", obj_path);
+		goto exit;
+	}
+
+	rv = 0;
+
+exit:
+	if (rv)
+		data->size = start;
+
+	mmstr_free(obj_path);
+	return rv;
+}
+
+
+/**
+ * objstore_materialize() - create a file from an object of the store
+ * @store:      folder of the object store
+ * @hash:       SHA-256 of the content of the file
+ * @mode:       permission bits of the file
+ * @dst:        path of the file to create, must not exist
+ *
+ * The content of the object is verified against @hash before being used.
+ * Then, a read-only file is created as hardlink of the object. Since the
+ * object may be replaced between its verification and the link, the created
+ * file must be the very regular file that has been verified. Otherwise (or
+ * if the object is on another filesystem), the file is a reflink of the
+ * object if supported by the filesystem, a copy if not, whose content is
+ * verified once created.
+ *
+ * Return: 0 in case of success, -1 otherwise with error state set
+ * accordingly.
+ */
+LOCAL_SYMBOL
+int objstore_materialize(const mmstr* store, const char* hash, int mode,
+                         const char* dst)
+{
+	mmstr* obj_path;
+	mmstr* actual;
+	struct mm_stat obj_st, dst_st;
+	int prev_err_flags, rv;
+
+	obj_path = store_path(store, OBJECTS_SUBDIR, hash, mode & 07777,
+	                      NULL);
+
+	rv = check_object(obj_path, hash, &obj_st);
+	if (rv)
+		goto exit;
+
+	if (!(mode & 0222)) {
+		prev_err_flags = mm_error_set_flags(MM_ERROR_SET,
+		                                    MM_ERROR_IGNORE);
+		rv = mm_link(obj_path, dst);
+		mm_error_set_flags(prev_err_flags, MM_ERROR_IGNORE);
+		if (rv == 0) {
+			rv = mm_stat(dst, &dst_st, MM_NOFOLLOW);
+			if (rv == 0
+			    && S_ISREG(dst_st.mode)
+			    && dst_st.dev == obj_st.dev
+			    && dst_st.ino == obj_st.ino)
+				goto exit;
+
+			mm_unlink(dst);
+			rv = mm_raise_error(EBADMSG, "object %s replaced "
+			                    "while linked to %s",
+			                    obj_path, dst);
+			goto exit;
+		}
+	}
+
+	rv = copy_file_excl(obj_path, dst, mode & 07777);
+	if (rv)
+		goto exit;
+
+	actual = mmstr_alloca(SHA_HEXSTR_LEN);
+	rv = sha_compute(actual, dst, NULL, 1);
+	if (rv == 0 && strcmp(actual, hash) != 0) {
+		mm_unlink(dst);
+		rv = mm_raise_error(EBADMSG, "object %s altered while "
+		                    "copied to %s", obj_path, dst);
+	}
+	mmstr_freea(actual);
+
+exit:
+	mmstr_free(obj_path);
+	return rv;
+}
@@ -0,0 +1,78 @@
+/*
+ * @mindmaze_header@
+ */
+#ifndef OBJECT_STORE_H
+#define OBJECT_STORE_H
+
+#include "mmstring.h"
+#include "utils.h"
+
+#define OBJSTORE_DIR 'd'
+#define OBJSTORE_REG 'f'
+#define OBJSTORE_SYMLINK 'l'
+
+/**
+ * struct objstore_manifest - list of the files of a package being stored
+ * @store:      folder of the object store
+ * @sumsha:     sumsha of the package whose files are listed
+ * @data:       content of the manifest being built
+ * @failed:     non zero if a file could not be stored
+ */
+struct objstore_manifest {
+	const mmstr* store;
+	const mmstr* sumsha;
+	struct buffer data;
+	int failed;
+};
+
+/**
+ * struct objstore_entry - file of a package listed in a manifest
+ * @type:       OBJSTORE_DIR, OBJSTORE_REG or OBJSTORE_SYMLINK
+ * @mode:       permission bits of the file
+ * @ref:        SHA-256 of the content of a regular file, target of a
+ *              symlink
+ * @path:       path of the file relative to prefix
+ */
+struct objstore_entry {
+	int type;
+	int mode;
+	const char* ref;
+	const char* path;
+};
+
+/**
+ * struct objstore_reader - iterator over the entries of a manifest
+ * @data:       null terminated content of the manifest
+ * @curr:       beginning of the next line to parse
+ */
+struct objstore_reader {
+	char* data;
+	char* curr;
+};
+
+int objstore_has_pkg(const mmstr* store, const mmstr* sumsha);
+
+void objstore_manifest_init(struct objstore_manifest* manifest,
+                            const mmstr* store, const mmstr* sumsha);
+void objstore_manifest_deinit(struct objstore_manifest* manifest);
+void objstore_manifest_reset(struct objstore_manifest* manifest);
+void objstore_manifest_add(struct objstore_manifest* manifest, int type,
+                           int mode, const char* ref, const char* path);
+int objstore_manifest_add_regfile(struct objstore_manifest* manifest,
+                                  const char* src, int mode,
+                                  const char* path);
+int objstore_manifest_commit(struct objstore_manifest* manifest);
+
+int objstore_reader_open(struct objstore_reader* reader,
+                         const mmstr* store, const mmstr* sumsha);
+int objstore_reader_next(struct objstore_reader* reader,
+                         struct objstore_entry* entry);
+void objstore_reader_close(struct objstore_reader* reader);
+
+int objstore_has_object(const mmstr* store, const char* hash, int mode);
+int objstore_load_object(const mmstr* store, const char* hash, int mode,
+                         struct buffer* data);
+int objstore_materialize(const mmstr* store, const char* hash, int mode,
+                         const char* dst);
+
+#endif /* OBJECT_STORE_H */
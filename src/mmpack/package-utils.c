@@ -216,6 +216,11 @@ void from_repolist_deinit(struct from_repo* list)
 		next = elt->next;
 		mmstr_free(elt->filename);
 		mmstr_free(elt->sha256);
+		mmstr_free(elt->delta_filename);
+		mmstr_free(elt->delta_sha256);
+		mmstr_free(elt->delta_base);
+		mmstr_free(elt->delta_base_tar);
+		mmstr_free(elt->delta_target);
 		free(elt);
 		elt = next;
 	}
@@ -651,7 +656,7 @@ void pkglist_deinit(struct pkglist* list)
  * @list:         list of repositories from which the package pkg_in is provided
  *
  * Be careful when using this function: the function takes ownership on the
- * fields filename and sha256 of the argument list.
+ * fields filename, sha256 and delta_* of the argument list.
  */
 static
 void mmpkg_add_from_repo_list(struct mmpkg* pkg_in, struct from_repo* list)
@@ -661,6 +666,11 @@ void mmpkg_add_from_repo_list(struct mmpkg* pkg_in, struct from_repo* list)
 		dst = mmpkg_get_or_create_from_repo(pkg_in, src->repo);
 		mmstr_free(dst->filename);
 		mmstr_free(dst->sha256);
+		mmstr_free(dst->delta_filename);
+		mmstr_free(dst->delta_sha256);
+		mmstr_free(dst->delta_base);
+		mmstr_free(dst->delta_base_tar);
+		mmstr_free(dst->delta_target);
 
 		// copy from src while preserving the original chaining
 		next = dst->next;
@@ -1411,6 +1421,12 @@ enum field_type {
 	FIELD_DESC,
 	FIELD_SUMSHA,
 	FIELD_GHOST,
+	FIELD_DELTA_FILENAME,
+	FIELD_DELTA_SHA,
+	FIELD_DELTA_BASE,
+	FIELD_DELTA_BASE_TAR,
+	FIELD_DELTA_TARGET,
+	FIELD_DELTA_SIZE,
 };
 
 static
@@ -1428,6 +1444,17 @@ const char* scalar_field_names[] = {
 	// same, even in their installed (unpacked) form
 	[FIELD_SUMSHA] = "sumsha256sums",
 	[FIELD_GHOST] = "ghost",
+	// delta-*: optional delta allowing to rebuild the uncompressed
+	// archive of the package (whose sha256 is delta-target-sha256) from
+	// the mpk file of a previous version whose sha256 is delta-base-sha256
+	// or from its uncompressed archive whose sha256 is
+	// delta-base-tar-sha256 (previous version itself rebuilt from delta)
+	[FIELD_DELTA_FILENAME] = "delta-filename",
+	[FIELD_DELTA_SHA] = "delta-sha256",
+	[FIELD_DELTA_BASE] = "delta-base-sha256",
+	[FIELD_DELTA_BASE_TAR] = "delta-base-tar-sha256",
+	[FIELD_DELTA_TARGET] = "delta-target-sha256",
+	[FIELD_DELTA_SIZE] = "delta-size",
 };
 
 
@@ -1528,6 +1555,36 @@ int mmpkg_set_scalar_field(struct mmpkg * pkg,
 		from_repo->size = atoi(value);
 		return 0;
 
+	case FIELD_DELTA_FILENAME:
+		from_repo = mmpkg_get_or_create_from_repo(pkg, repo);
+		field = &from_repo->delta_filename;
+		break;
+
+	case FIELD_DELTA_SHA:
+		from_repo = mmpkg_get_or_create_from_repo(pkg, repo);
+		field = &from_repo->delta_sha256;
+		break;
+
+	case FIELD_DELTA_BASE:
+		from_repo = mmpkg_get_or_create_from_repo(pkg, repo);
+		field = &from_repo->delta_base;
+		break;
+
+	case FIELD_DELTA_BASE_TAR:
+		from_repo = mmpkg_get_or_create_from_repo(pkg, repo);
+		field = &from_repo->delta_base_tar;
+		break;
+
+	case FIELD_DELTA_TARGET:
+		from_repo = mmpkg_get_or_create_from_repo(pkg, repo);
+		field = &from_repo->delta_target;
+		break;
+
+	case FIELD_DELTA_SIZE:
+		from_repo = mmpkg_get_or_create_from_repo(pkg, repo);
+		from_repo->delta_size = atoi(value);
+		return 0;
+
 	default:
 		return -1;
 	}
@@ -56,6 +56,13 @@ struct from_repo {
 	mmstr const * filename;
 	mmstr const * sha256;
 	size_t size;
+	// optional delta to rebuild the package from a previous version
+	mmstr const * delta_filename;
+	mmstr const * delta_sha256;
+	mmstr const * delta_base;
+	mmstr const * delta_base_tar;
+	mmstr const * delta_target;
+	size_t delta_size;
 	struct repolist_elt * repo;
 	struct from_repo * next;
 };
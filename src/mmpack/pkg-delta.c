@@ -0,0 +1,334 @@
+/*
+ * @mindmaze_header@
+ */
+#if defined (HAVE_CONFIG_H)
+# include <config.h>
+#endif
+
+#include <archive.h>
+#include <archive_entry.h>
+#include <mmerrno.h>
+#include <mmlib.h>
+#include <mmsysio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined (HAVE_LIBZSTD)
+# include <zstd.h>
+#endif
+
+#include "pkg-delta.h"
+#include "sha256.h"
+#include "utils.h"
+#include "xx-alloc.h"
+
+/*
+ * A delta package is a zstd frame compressed using the uncompressed archive
+ * of the previous version of the package as prefix (what "zstd --patch-from"
+ * generates from the uncompressed archives). Since the prefix must be within
+ * the window, the window may be as large as the uncompressed archives.
+ */
+#define DELTA_WINDOW_LOG_MAX (sizeof(size_t) == 4 ? 30 : 31)
+#define DELTA_CHUNK_SIZE (64*1024)
+
+
+#if defined (HAVE_LIBZSTD)
+
+/**
+ * zstd_uncompress() - decompress all the zstd frames of a memory block
+ * @data:       compressed data
+ * @size:       size of @data
+ * @out_buf:    buffer receiving the decompressed data
+ *
+ * Return: 0 in case of success, -1 otherwise with error state set
+ * accordingly.
+ */
+static
+int zstd_uncompress(const void* data, size_t size, struct buffer* out_buf)
+{
+	ZSTD_DCtx* dctx;
+	ZSTD_inBuffer in = {.src = data, .size = size};
+	ZSTD_outBuffer out;
+	size_t ret = 0;
+	int rv = 0;
+
+	dctx = ZSTD_createDCtx();
+	if (!dctx)
+		return mm_raise_error(ENOMEM, "Cannot create zstd context");
+
+	ZSTD_DCtx_setParameter(dctx, ZSTD_d_windowLogMax,
+	                       DELTA_WINDOW_LOG_MAX);
+
+	// Successive frames (metadata header, then payload) are decompressed
+	// one after the other
+	while (in.pos < in.size) {
+		out.dst = buffer_reserve_data(out_buf, DELTA_CHUNK_SIZE);
+		out.size = DELTA_CHUNK_SIZE;
+		out.pos = 0;
+		ret = ZSTD_decompressStream(dctx, &out, &in);
+		if (ZSTD_isError(ret)) {
+			rv = mm_raise_error(EBADMSG, "Corrupted package: %s",
+			                    ZSTD_getErrorName(ret));
+			break;
+		}
+
+		buffer_inc_size(out_buf, out.pos);
+	}
+
+	if (rv == 0 && ret != 0)
+		rv = mm_raise_error(EBADMSG, "Truncated package");
+
+	ZSTD_freeDCtx(dctx);
+	return rv;
+}
+
+
+/**
+ * load_uncompressed_pkg() - load uncompressed archive of a package file
+ * @data:       content of the package file
+ * @size:       size of @data
+ * @out_buf:    buffer receiving the uncompressed archive
+ *
+ * Return: 0 in case of success, -1 otherwise with error state set
+ * accordingly.
+ */
+static
+int load_uncompressed_pkg(const void* data, size_t size,
+                          struct buffer* out_buf)
+{
+	static const unsigned char zstd_magic[] = {0x28, 0xB5, 0x2F, 0xFD};
+	struct archive * a;
+	struct archive_entry * entry;
+	la_ssize_t rsz;
+	int rv = -1;
+
+	if (size >= sizeof(zstd_magic)
+	    && memcmp(data, zstd_magic, sizeof(zstd_magic)) == 0)
+		return zstd_uncompress(data, size, out_buf);
+
+	// Other packages are xz compressed which is always supported by
+	// libarchive. The raw format gives access to the decompressed stream.
+	a = archive_read_new();
+	archive_read_support_filter_all(a);
+	archive_read_support_format_raw(a);
+	if (archive_read_open_memory(a, data, size) != ARCHIVE_OK
+	    || archive_read_next_header(a, &entry) != ARCHIVE_OK) {
+		mm_raise_error(EBADMSG, "Cannot decompress package: %s",
+		               archive_error_string(a));
+		goto exit;
+	}
+
+	do {
+		rsz = archive_read_data(a,
+		                        buffer_reserve_data(out_buf,
+		                                            DELTA_CHUNK_SIZE),
+		                        DELTA_CHUNK_SIZE);
+		if (rsz < 0) {
+			mm_raise_error(EBADMSG, "Cannot decompress package: %s",
+			               archive_error_string(a));
+			goto exit;
+		}
+
+		buffer_inc_size(out_buf, rsz);
+	} while (rsz > 0);
+
+	rv = 0;
+
+exit:
+	archive_read_free(a);
+	return rv;
+}
+
+
+/**
+ * delta_decode() - reconstruct a file from its base and delta
+ * @base_data:  content of the base file
+ * @base_size:  size of @base_data
+ * @delta_data: content of the delta file
+ * @delta_size: size of @delta_data
+ * @fd:         file descriptor where to write the reconstructed file
+ * @md:         buffer receiving the SHA-256 of the reconstructed file
+ *
+ * Return: 0 in case of success, -1 otherwise with error state set
+ * accordingly.
+ */
+static
+int delta_decode(const void* base_data, size_t base_size,
+                 const void* delta_data, size_t delta_size,
+                 int fd, unsigned char* md)
+{
+	ZSTD_DCtx* dctx;
+	ZSTD_inBuffer in = {.src = delta_data, .size = delta_size};
+	ZSTD_outBuffer out;
+	SHA256_CTX sha_ctx;
+	size_t ret;
+	char* buff;
+	int rv = -1;
+
+	dctx = ZSTD_createDCtx();
+	if (!dctx)
+		return mm_raise_error(ENOMEM, "Cannot create zstd context");
+
+	ZSTD_DCtx_setParameter(dctx, ZSTD_d_windowLogMax,
+	                       DELTA_WINDOW_LOG_MAX);
+	ret = ZSTD_DCtx_refPrefix(dctx, base_data, base_size);
+	if (ZSTD_isError(ret)) {
+		mm_raise_error(EINVAL, "Cannot use delta base: %s",
+		               ZSTD_getErrorName(ret));
+		ZSTD_freeDCtx(dctx);
+		return -1;
+	}
+
+	sha256_init(&sha_ctx);
+	buff = xx_malloc(DELTA_CHUNK_SIZE);
+
+	do {
+		out = (ZSTD_outBuffer) {.dst = buff, .size = DELTA_CHUNK_SIZE};
+		ret = ZSTD_decompressStream(dctx, &out, &in);
+		if (ZSTD_isError(ret)) {
+			mm_raise_error(EBADMSG, "Corrupted delta: %s",
+			               ZSTD_getErrorName(ret));
+			goto exit;
+		}
+
+		sha256_update(&sha_ctx, buff, out.pos);
+		if (fullwrite(fd, buff, out.pos))
+			goto exit;
+	} while (in.pos < in.size || out.pos == out.size);
+
+	// A non zero value means that the frame is incomplete
+	if (ret != 0) {
+		mm_raise_error(EBADMSG, "Truncated delta");
+		goto exit;
+	}
+
+	sha256_final(&sha_ctx, md);
+	rv = 0;
+
+exit:
+	free(buff);
+	ZSTD_freeDCtx(dctx);
+	return rv;
+}
+
+
+/**
+ * pkg_delta_supported() - indicates whether delta packages can be applied
+ *
+ * Return: 1 if mmpack has been built with delta support, 0 otherwise
+ */
+LOCAL_SYMBOL
+int pkg_delta_supported(void)
+{
+	return 1;
+}
+
+#else /* HAVE_LIBZSTD */
+
+static
+int load_uncompressed_pkg(const void* data, size_t size,
+                          struct buffer* out_buf)
+{
+	(void)data;
+	(void)size;
+	(void)out_buf;
+
+	return mm_raise_error(ENOSYS, "Delta packages not supported");
+}
+
+
+static
+int delta_decode(const void* base_data, size_t base_size,
+                 const void* delta_data, size_t delta_size,
+                 int fd, unsigned char* md)
+{
+	(void)base_data;
+	(void)base_size;
+	(void)delta_data;
+	(void)delta_size;
+	(void)fd;
+	(void)md;
+
+	return mm_raise_error(ENOSYS, "Delta packages not supported");
+}
+
+
+LOCAL_SYMBOL
+int pkg_delta_supported(void)
+{
+	return 0;
+}
+
+#endif /* HAVE_LIBZSTD */
+
+
+/**
+ * pkg_delta_apply() - reconstruct a package archive from a delta
+ * @base:       path of the package file the delta has been computed from,
+ *              or of its uncompressed archive
+ * @delta:      path of the delta file
+ * @dst:        path of the package archive to reconstruct
+ * @ref_sha:    expected SHA-256 of the reconstructed package archive
+ *
+ * The delta is applied to the uncompressed archive of @base (which is @base
+ * itself if it has been rebuilt from a previous delta). The result is
+ * the uncompressed archive of the new package, which can be installed like
+ * the package file. It is reconstructed in a temporary file, renamed to @dst
+ * only if its hash matches @ref_sha.
+ *
+ * Return: 0 in case of success, -1 otherwise with error state set
+ * accordingly.
+ */
+LOCAL_SYMBOL
+int pkg_delta_apply(const mmstr* base, const mmstr* delta, const mmstr* dst,
+                    const mmstr* ref_sha)
+{
+	unsigned char md[SHA256_BLOCK_SIZE];
+	char hexstr[2*SHA256_BLOCK_SIZE + 1];
+	void * base_map, * delta_map;
+	size_t base_size, delta_size;
+	struct buffer base_tar;
+	mmstr* tmp_path;
+	int fd, created = 0, rv = -1;
+
+	base_map = delta_map = NULL;
+	buffer_init(&base_tar);
+	tmp_path = mmstr_malloca(mmstrlen(dst) + 4);
+	mmstrcpy(tmp_path, dst);
+	mmstrcat_cstr(tmp_path, ".tmp");
+
+	if (map_file_in_prefix(NULL, base, &base_map, &base_size)
+	    || load_uncompressed_pkg(base_map, base_size, &base_tar)
+	    || map_file_in_prefix(NULL, delta, &delta_map, &delta_size))
+		goto exit;
+
+	fd = mm_open(tmp_path, O_WRONLY|O_CREAT|O_TRUNC, 0666);
+	if (fd < 0)
+		goto exit;
+
+	created = 1;
+	rv = delta_decode(base_tar.base, base_tar.size,
+	                  delta_map, delta_size, fd, md);
+	mm_close(fd);
+	if (rv)
+		goto exit;
+
+	hexstr[conv_to_hexstr(hexstr, md, sizeof(md))] = '\0';
+	if (strcmp(hexstr, ref_sha) != 0) {
+		rv = mm_raise_error(EBADMSG, "bad SHA-256 of %s rebuilt from "
+		                    "delta %s", dst, delta);
+		goto exit;
+	}
+
+	rv = mm_rename(tmp_path, dst);
+
+exit:
+	if (rv && created)
+		mm_unlink(tmp_path);
+
+	mm_unmap(base_map);
+	mm_unmap(delta_map);
+	buffer_deinit(&base_tar);
+	mmstr_freea(tmp_path);
+	return rv;
+}
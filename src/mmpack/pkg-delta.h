@@ -0,0 +1,13 @@
+/*
+ * @mindmaze_header@
+ */
+#ifndef PKG_DELTA_H
+#define PKG_DELTA_H
+
+#include "mmstring.h"
+
+int pkg_delta_supported(void);
+int pkg_delta_apply(const mmstr* base, const mmstr* delta, const mmstr* dst,
+                    const mmstr* ref_sha);
+
+#endif /* PKG_DELTA_H */
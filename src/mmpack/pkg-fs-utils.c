@@ -11,13 +11,31 @@
 #include <archive_entry.h>
 #include <mmsysio.h>
 #include <mmerrno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#if defined (HAVE_LIBLZMA)
+# include <lzma.h>
+#endif
+
+#if defined (HAVE_LIBZSTD)
+# include <zstd.h>
+#endif
 
 #include "common.h"
 #include "context.h"
+#include "dir-cache.h"
 #include "download.h"
+#include "file-batch.h"
+#include "mirror-stats.h"
 #include "mmstring.h"
+#include "object-store.h"
 #include "package-utils.h"
+#include "pkg-delta.h"
 #include "pkg-fs-utils.h"
+#include "sha256.h"
 #include "utils.h"
 #include "sysdeps.h"
 
@@ -44,67 +62,58 @@ mmstr* sha256sums_path(const struct mmpkg* pkg)
 }
 
 
-/**************************************************************************
- *                                                                        *
- *                      Packages files unpacking                          *
- *                                                                        *
- **************************************************************************/
-#define READ_ARCHIVE_BLOCK 10240
-#define READ_ARCHIVE_EOF 1
-
 /**
- * fullwrite() - write fully data buffer to a file
- * @fd:         file descriptor where to write data
- * @data:       data buffer to write
- * @size:       size of @data
+ * stamps_path() - get path to the file stamps record of given package
+ * @pkg:      package whose file stamps record must be obtained.
  *
- * Return: 0 if @data has been fully written to @fd, -1 otherwise
+ * Return:
+ * An allocated path string relative to a prefix path. The returned pointer
+ * must be freed with mmstr_free() when done with it.
  */
 static
-int fullwrite(int fd, const char* data, size_t size)
+mmstr* stamps_path(const struct mmpkg* pkg)
 {
-	ssize_t rsz;
-
-	do {
-		rsz = mm_write(fd, data, size);
-		if (rsz < 0)
-			return -1;
+	int len = sizeof(METADATA_RELPATH "/.stamps") + mmstrlen(pkg->name);
+	mmstr* stamps = mmstr_malloc(len);
 
-		size -= rsz;
-		data += rsz;
-	} while (size > 0);
+	mmstrcat_cstr(stamps, METADATA_RELPATH "/");
+	mmstrcat(stamps, pkg->name);
+	mmstrcat_cstr(stamps, ".stamps");
 
-	return 0;
+	return stamps;
 }
 
 
+/**************************************************************************
+ *                                                                        *
+ *                      Packages files unpacking                          *
+ *                                                                        *
+ **************************************************************************/
+#define READ_ARCHIVE_BLOCK 10240
+#define READ_ARCHIVE_EOF 1
+
 /**
  * pkg_unpack_regfile() - extract a regular file from archive
  * @entry:      entry header of the file being extracted
  * @path:       path to which the file must be extracted
  * @a:          archive stream from which to read the file content
+ * @dirs:       cache of the directories of the prefix
  *
  * Return: 0 in case of success, -1 otherwise
  */
 static
 int pkg_unpack_regfile(struct archive_entry * entry, const char* path,
-                       struct archive * a)
+                       struct archive * a, struct dir_cache* dirs)
 {
 	int r, rv, fd, mode;
 	const void * buff;
 	size_t size;
 	int64_t offset;
 
-	// If previous file exists, remove it first
-	if (mm_check_access(path, F_OK) != ENOENT) {
-		if (mm_unlink(path))
-			return -1;
-	}
-
-	// Create the new file. This step should not fail because the caller
-	// must have created parent dir
+	// Create the new file (replacing any previous one). This step should
+	// not fail because the caller must have created parent dir
 	mode = archive_entry_perm(entry);
-	fd = mm_open(path, O_CREAT|O_EXCL|O_WRONLY, mode);
+	fd = dir_cache_create_file(dirs, path, mode);
 	if (fd < 0)
 		return -1;
 
@@ -136,30 +145,72 @@ int pkg_unpack_regfile(struct archive_entry * entry, const char* path,
 }
 
 
+/**
+ * pkg_unpack_regfile_batched() - queue extraction of a regular file
+ * @entry:      entry header of the file being extracted
+ * @path:       path to which the file must be extracted
+ * @a:          archive stream from which to read the file content
+ * @batch:      batch in which the creation of the file is queued
+ *
+ * The content of the file is read in memory and the file is actually
+ * created when @batch is flushed.
+ *
+ * Return: 0 in case of success, -1 otherwise
+ */
+static
+int pkg_unpack_regfile_batched(struct archive_entry * entry, const char* path,
+                               struct archive * a, struct file_batch* batch)
+{
+	int r, mode;
+	const void * buff;
+	void* data;
+	size_t size, filesize;
+	int64_t offset;
+
+	mode = archive_entry_perm(entry);
+	filesize = archive_entry_size(entry);
+	if (file_batch_add_file(batch, path, mode, filesize, &data))
+		return -1;
+
+	// Holes of sparse files are not reported as data blocks
+	memset(data, 0, filesize);
+
+	while (1) {
+		r = archive_read_data_block(a, &buff, &size, &offset);
+		if (r == ARCHIVE_EOF)
+			break;
+
+		if (r != ARCHIVE_OK)
+			return mm_raise_from_errno("Unpacking %s failed", path);
+
+		if (offset < 0 || (size_t)offset + size > filesize)
+			return mm_raise_error(MM_EBADFMT, "Unpacking %s failed: "
+			                      "inconsistent file size", path);
+
+		memcpy((char*)data + offset, buff, size);
+	}
+
+	return 0;
+}
+
+
 /**
  * pkg_unpack_symlink() - extract a symbolic link from archive
  * @entry:      entry header of the symlink being extracted
  * @path:       path to which the symlink must be extracted
+ * @dirs:       cache of the directories of the prefix
  *
  * Return: 0 in case of success, -1 otherwise
  */
 static
-int pkg_unpack_symlink(struct archive_entry * entry, const char* path)
+int pkg_unpack_symlink(struct archive_entry * entry, const char* path,
+                       struct dir_cache* dirs)
 {
 	const char* target;
-	int rv;
-
-	// If previous file exists, remove it first
-	if (mm_check_access(path, F_OK) != ENOENT) {
-		if (mm_unlink(path))
-			return -1;
-	}
 
-	// Create a symlink (path -> target)
+	// Create a symlink (path -> target), replacing any previous file
 	target = archive_entry_symlink_utf8(entry);
-	rv = mm_symlink(target, path);
-
-	return rv;
+	return dir_cache_symlink(dirs, target, path);
 }
 
 
@@ -171,6 +222,9 @@ int pkg_unpack_symlink(struct archive_entry * entry, const char* path)
  *              different from the one advertised in entry)
  * @cpt:        counter permitting to create the name of the file in which
  *              regular and symlink files are extracted to
+ * @dirs:       cache of the directories of the prefix
+ * @batch:      batch in which small regular files are queued (may be NULL)
+ * @to_mkdir:   list to which the directories to create are appended
  *
  * Return: 0 or 1 on success, a negative value otherwise. If 1 is returned, this
  * implies that a file has been unpacked in a temporary directory and should be
@@ -178,7 +232,8 @@ int pkg_unpack_symlink(struct archive_entry * entry, const char* path)
  */
 static
 int pkg_unpack_entry(struct archive * a, struct archive_entry* entry,
-                     const mmstr* path, int cpt)
+                     const mmstr* path, int cpt, struct dir_cache* dirs,
+                     struct file_batch* batch, struct strlist* to_mkdir)
 {
 	int type, rv;
 	mmstr* file;
@@ -187,7 +242,7 @@ int pkg_unpack_entry(struct archive * a, struct archive_entry* entry,
 	type = archive_entry_filetype(entry);
 	switch (type) {
 	case AE_IFDIR:
-		rv = mm_mkdir(path, 0777, MM_RECURSIVE);
+		rv = strlist_add(to_mkdir, path);
 		break;
 
 	case AE_IFREG:
@@ -196,10 +251,14 @@ int pkg_unpack_entry(struct archive * a, struct archive_entry* entry,
 		file = mmstr_malloc(len);
 		sprintf(file, "%s/%d", UNPACK_CACHEDIR_RELPATH, cpt);
 
-		if (type == AE_IFREG)
-			rv = pkg_unpack_regfile(entry, file, a);
+		if (type == AE_IFREG && batch
+		    && archive_entry_size_is_set(entry)
+		    && archive_entry_size(entry) <= FILE_BATCH_MAX_FILESIZE)
+			rv = pkg_unpack_regfile_batched(entry, file, a, batch);
+		else if (type == AE_IFREG)
+			rv = pkg_unpack_regfile(entry, file, a, dirs);
 		else
-			rv = pkg_unpack_symlink(entry, file);
+			rv = pkg_unpack_symlink(entry, file, dirs);
 
 		if (rv == 0)
 			rv = 1;
@@ -233,79 +292,242 @@ int is_mmpack_metadata(mmstr const * path)
 /**
  * rename_all() - rename all the files
  * @to_rename:    files to be renamed
+ * @dirs:         cache of the directories of the prefix
+ * @batch:        batch in which the renames are queued (may be NULL)
  *
  * In order for the install and upgrade commands to be atomic, the extraction is
  * done in two steps: first all the regular files and symlink are extracted in a
  * temporary directory (in var/cache/unpack), then they are all renamed, to be
- * placed into their final directories. Note that the directories of the package
- * are extracted directly in the good directory during the first step.
+ * placed into their final directories. The directories of the package are
+ * created just before the renames (see mkdir_all()).
  *
- * The current function permits to rename the regular and symlink files.
+ * The current function permits to rename the regular and symlink files. If
+ * @batch is not NULL, the renames are submitted together by flushing it.
  *
  * Return: 0 on success, a negative value otherwise.
  */
 static
-int rename_all(struct strlist* to_rename)
+int rename_all(struct strlist* to_rename, struct dir_cache* dirs,
+               struct file_batch* batch)
 {
 	mmstr * file = NULL;
 	int len = sizeof(UNPACK_CACHEDIR_RELPATH) + 10;
 	struct strlist_elt * curr = to_rename->head;
-	int cpt = 0;
+	int rv, cpt = 0;
 
+	rv = 0;
 	file = mmstr_malloc(len);
-	while (curr) {
+	while (curr && rv == 0) {
 		sprintf(file, "%s/%d", UNPACK_CACHEDIR_RELPATH, cpt);
 
-		if (mm_rename(file, curr->str.buf) == -1)
-			return -1;
+		if (batch)
+			rv = file_batch_add_rename(batch, file, curr->str.buf);
+		else
+			rv = dir_cache_rename(dirs, file, curr->str.buf);
 
 		curr = curr->next;
 		cpt++;
 	}
 
+	if (rv == 0 && batch)
+		rv = file_batch_flush(batch);
+
 	mmstr_free(file);
+	return rv;
+}
+
+
+/**
+ * mkdir_all() - create the directories of a package
+ * @to_mkdir:   directories to create, parents first
+ * @dirs:       cache of the directories of the prefix
+ *
+ * Return: 0 on success, -1 otherwise.
+ */
+static
+int mkdir_all(struct strlist* to_mkdir, struct dir_cache* dirs)
+{
+	struct strlist_elt * curr;
+
+	for (curr = to_mkdir->head; curr; curr = curr->next) {
+		if (dir_cache_mkdir(dirs, curr->str.buf))
+			return -1;
+	}
+
 	return 0;
 }
 
 
+/**
+ * pkg_store_entry() - add an extracted archive entry to the object store
+ * @manifest:   manifest of the package being stored
+ * @entry:      archive entry that has been extracted
+ * @src:        file in which the entry has been extracted
+ * @path:       filename of package file being unpacked
+ *
+ * A failure to store the entry does not prevent the installation: the
+ * manifest is simply not going to be committed.
+ */
+static
+void pkg_store_entry(struct objstore_manifest* manifest,
+                     struct archive_entry* entry, const char* src,
+                     const mmstr* path)
+{
+	int mode;
+
+	mode = archive_entry_perm(entry);
+	switch (archive_entry_filetype(entry)) {
+	case AE_IFDIR:
+		objstore_manifest_add(manifest, OBJSTORE_DIR, mode, NULL, path);
+		break;
+
+	case AE_IFREG:
+		objstore_manifest_add_regfile(manifest, src, mode, path);
+		break;
+
+	case AE_IFLNK:
+		objstore_manifest_add(manifest, OBJSTORE_SYMLINK, mode,
+		                      archive_entry_symlink_utf8(entry), path);
+		break;
+
+	default:
+		manifest->failed = 1;
+		break;
+	}
+}
+
+
+/**
+ * is_installed_file_unchanged() - test whether an entry is already installed
+ * @unchanged:  table of the files whose hash is the same in installed and new
+ *              version of the package, associated with this hash
+ * @entry:      archive entry of the new version of the file
+ * @path:       filename of package file being unpacked
+ *
+ * The file at @path is kept only if it is still installed with the expected
+ * type and permissions and if its content still has the hash recorded in
+ * @unchanged: the installed file may have been modified since the
+ * installation of the previous version.
+ *
+ * Return: 1 if the file at @path does not need to be extracted, 0 otherwise
+ */
+static
+int is_installed_file_unchanged(const struct indextable* unchanged,
+                                struct archive_entry* entry,
+                                const mmstr* path)
+{
+	struct it_entry* ref;
+	struct mm_stat st;
+	struct file_stamp before, after;
+	mmstr* sha = mmstr_alloca(SHA_HEXSTR_LEN);
+	int prev_err_flags, rv;
+
+	ref = indextable_lookup(unchanged, path);
+	if (!ref)
+		return 0;
+
+	// Check the file is still there and has the expected permissions
+	prev_err_flags = mm_error_set_flags(MM_ERROR_SET, MM_ERROR_IGNORE);
+	rv = mm_stat(path, &st, MM_NOFOLLOW);
+	mm_error_set_flags(prev_err_flags, MM_ERROR_IGNORE);
+	if (rv)
+		return 0;
+
+	switch (archive_entry_filetype(entry)) {
+	case AE_IFLNK:
+		if (!S_ISLNK(st.mode))
+			return 0;
+
+		break;
+
+	case AE_IFREG:
+		if (!S_ISREG(st.mode)
+		    || (st.mode & 07777) != archive_entry_perm(entry))
+			return 0;
+
+		break;
+
+	default:
+		return 0;
+	}
+
+	// Check the content is still the one of the previous version. Since
+	// the file is going to be stamped as verified, it must not have been
+	// modified while being hashed.
+	prev_err_flags = mm_error_set_flags(MM_ERROR_SET, MM_ERROR_IGNORE);
+	rv = file_stamp_get(&before, path, NULL)
+	     || sha_compute(sha, path, NULL, 0)
+	     || file_stamp_get(&after, path, NULL);
+	mm_error_set_flags(prev_err_flags, MM_ERROR_IGNORE);
+	if (rv)
+		return 0;
+
+	return mmstrequal(sha, ref->value) && file_stamp_equal(&before, &after);
+}
+
+
 /**
  * pkg_unpack_files() - extract files of a given package
- * @mpk_filename: filename of the downloaded package file
+ * @a:            archive stream opened on the package file
+ * @mpk_filename: name of the package file (used for error messages)
  * @files:        files to be removed
+ * @stream:       download stream from which @a is read (may be NULL)
+ * @manifest:     manifest in which the extracted files are added to the object
+ *                store (may be NULL)
+ * @unchanged:    table of files identical in installed and new version of the
+ *                package (may be NULL)
  *
  * In order the install and upgrade commands to be atomic, the extraction is
  * done in two steps: first all the regular files and symlink are extracted in a
- * temporary directory (in var/cache/upack), then they are all renamed, to be
- * placed in the good directory. Note that the directories of the package are
- * extracted directly in the good directory during the first step.
+ * temporary directory (in var/cache/upack), then the directories of the
+ * package are created and the files are all renamed, to be placed in the good
+ * directory.
+ *
+ * If the package is extracted while being downloaded (@stream not NULL), the
+ * integrity of the whole package is verified before the second step. If it
+ * is corrupted, the prefix is left untouched.
+ *
+ * The files listed in @unchanged which are still installed with the same
+ * type, permissions and hash are left untouched. Since their content has been
+ * verified, they are added to @manifest like the extracted files.
+ *
+ * If @manifest is not NULL, the manifest is committed once all the files
+ * have been successfully installed, so that the next installations of the
+ * package on the host can be done from the object store.
+ *
+ * When supported by the system, the small regular files are created and all
+ * files are renamed by batches of asynchronous operations. This is not done
+ * if @manifest is not NULL since each extracted file is then read back right
+ * away to be added to the object store.
+ *
+ * @a is closed and freed by this function.
  *
  * Return: 0 on success, a negative value otherwise.
  */
 static
-int pkg_unpack_files(const char* mpk_filename, struct strlist* files)
+int pkg_unpack_files(struct archive * a, const char* mpk_filename,
+                     struct strset* files, struct download_stream* stream,
+                     struct objstore_manifest* manifest,
+                     const struct indextable* unchanged)
 {
 	const char* entry_path;
 	struct archive_entry * entry;
-	struct archive * a;
 	int r, rv;
 	mmstr* path = NULL;
+	mmstr* tmpfile;
 	struct strlist to_rename;
+	struct strlist to_mkdir;
+	struct dir_cache dirs;
+	struct file_batch batch;
+	struct file_batch* batch_ptr = NULL;
 	int cpt = 0;
 
 	strlist_init(&to_rename);
-
-	// Initialize an archive stream
-	a = archive_read_new();
-	archive_read_support_filter_all(a);
-	archive_read_support_format_all(a);
-
-	// Open binary package in the archive stream
-	if (archive_read_open_filename(a, mpk_filename, READ_ARCHIVE_BLOCK)) {
-		mm_raise_error(archive_errno(a), "opening mpk %s failed: %s",
-		               mpk_filename, archive_error_string(a));
-		archive_read_free(a);
-		return -1;
-	}
+	strlist_init(&to_mkdir);
+	dir_cache_init(&dirs);
+	tmpfile = mmstr_malloc(sizeof(UNPACK_CACHEDIR_RELPATH) + 10);
+	if (!manifest && file_batch_init(&batch, &dirs) == 0)
+		batch_ptr = &batch;
 
 	// Loop over each entry in the archive and process them
 	rv = 0;
@@ -332,7 +554,24 @@ int pkg_unpack_files(const char* mpk_filename, struct strlist* files)
 		if (!mmstrlen(path) || is_mmpack_metadata(path))
 			continue;
 
-		rv = pkg_unpack_entry(a, entry, path, cpt);
+		// Keep installed file if identical in the new version
+		if (unchanged
+		    && is_installed_file_unchanged(unchanged, entry, path)) {
+			if (manifest)
+				pkg_store_entry(manifest, entry, path, path);
+
+			if (files)
+				strset_remove(files, path);
+
+			continue;
+		}
+
+		rv = pkg_unpack_entry(a, entry, path, cpt, &dirs, batch_ptr,
+		                      &to_mkdir);
+		if (rv >= 0 && manifest) {
+			sprintf(tmpfile, "%s/%d", UNPACK_CACHEDIR_RELPATH, cpt);
+			pkg_store_entry(manifest, entry, tmpfile, path);
+		}
 
 		if (rv == 1) {
 			strlist_add(&to_rename, path);
@@ -341,217 +580,2284 @@ int pkg_unpack_files(const char* mpk_filename, struct strlist* files)
 		}
 
 		if (files)
-			strlist_remove(files, path);
+			strset_remove(files, path);
 	}
 
+	mmstr_free(tmpfile);
 	mmstr_free(path);
 
 	// Cleanup
 	archive_read_close(a);
 	archive_read_free(a);
 
+	// Create the files whose creation is still pending
+	if (rv != -1 && batch_ptr)
+		rv = file_batch_flush(batch_ptr) ? -1 : rv;
+
+	// Do not commit anything before the whole package is verified
+	if (rv != -1 && stream)
+		rv = download_stream_finish(stream);
+
 	if (rv != -1) {
 		// proceed to the rename of the files that have been unpacked in
 		// another directory than the "true" one, in order to execute an
 		// atomic upgrade
-		rv = rename_all(&to_rename);
+		rv = mkdir_all(&to_mkdir, &dirs);
+		if (rv == 0)
+			rv = rename_all(&to_rename, &dirs, batch_ptr);
 	}
 
+	if (rv == 0 && manifest)
+		objstore_manifest_commit(manifest);
+
+	if (batch_ptr)
+		file_batch_deinit(batch_ptr);
+
+	dir_cache_deinit(&dirs);
+	strlist_deinit(&to_mkdir);
 	strlist_deinit(&to_rename);
 
 	return rv;
 }
 
 
-/* same as archive_read_data_into_fd(), but into a buffer */
-static
-int unpack_entry_into_buffer(struct archive * archive,
-                             struct archive_entry * entry,
-                             struct buffer * buffer)
-{
-	ssize_t r;
-	int64_t info_size = archive_entry_size(entry);
-
-	if (info_size == 0)
-		return -1;
+/**
+ * struct store_pkg - authenticated content of a package in the object store
+ * @reader:     reader of the manifest of the package
+ * @entries:    array of the entries of the manifest
+ * @num:        number of elements in @entries
+ * @sums:       entry of the sha256sums file of the package in @entries
+ */
+struct store_pkg {
+	struct objstore_reader reader;
+	struct objstore_entry* entries;
+	int num;
+	const struct objstore_entry* sums;
+};
 
-	buffer_reserve_data(buffer, info_size);
-	buffer_inc_size(buffer, info_size);
 
-	r = archive_read_data(archive, buffer->base, buffer->size);
-	if (r >= ARCHIVE_OK && (size_t) r == buffer->size)
-		return 0;
+/**
+ * store_entry_sums_line() - get the sha256sums line expected for an entry
+ * @line:       pointer to string receiving the line (may be reallocated)
+ * @entry:      regular file or symlink entry of a manifest
+ * @typed:      if 0, the line of legacy sha256sums (without type) is built
+ */
+static
+void store_entry_sums_line(mmstr** line, const struct objstore_entry* entry,
+                           int typed)
+{
+	unsigned char md[SHA256_BLOCK_SIZE];
+	char hexstr[2*SHA256_BLOCK_SIZE + 1];
+	const char* hash = entry->ref;
+	const char* hdr = typed ? SHA_HDR_REG : "";
+	SHA256_CTX ctx;
+	size_t len;
+
+	// sha256sums lists symlinks by the hash of their target
+	if (entry->type == OBJSTORE_SYMLINK) {
+		sha256_init(&ctx);
+		sha256_update(&ctx, entry->ref, strlen(entry->ref));
+		sha256_final(&ctx, md);
+		hexstr[conv_to_hexstr(hexstr, md, sizeof(md))] = '\0';
+		hash = hexstr;
+		hdr = SHA_HDR_SYM;
+	}
 
-	return -1;
+	len = strlen(entry->path) + strlen(hdr) + strlen(hash) + 2;
+	*line = mmstr_realloc(*line, len);
+	mmstrcpy_cstr(*line, entry->path);
+	mmstrcat_cstr(*line, ": ");
+	mmstrcat_cstr(*line, hdr);
+	mmstrcat_cstr(*line, hash);
 }
 
+
 /**
- * pkg_get_mmpack_info() - load MMPACK/info file from package into buffer
- * @mpk_filename: mmpack package to read from
- * @buffer: buffer structure to receive the raw data
- *
- * Open, scans for the MMPACK/info file, and load its data into given buffer
- * structure. The buffer will be enlarged as needed, and must be freed by the
- * caller after usage by calling the buffer_deinit() function.
+ * store_pkg_check() - check manifest entries against package sha256sums
+ * @spkg:       package in object store whose sha256sums is in @sums_data
+ * @sums_data:  authenticated content of the sha256sums of the package
  *
- * Return: 0 on success, -1 on error
+ * Return: 0 if every regular file and symlink of the manifest is listed
+ * identically in the sha256sums and every file listed there is provided by
+ * the manifest, -1 otherwise.
  */
-LOCAL_SYMBOL
-int pkg_get_mmpack_info(char const * mpk_filename, struct buffer * buffer)
+static
+int store_pkg_check(struct store_pkg* spkg, const struct buffer* sums_data)
 {
-	int rv;
-	struct archive * a;
-	struct archive_entry * entry;
-
-	a = archive_read_new();
-	archive_read_support_filter_all(a);
-	archive_read_support_format_all(a);
+	const struct objstore_entry* entry;
+	struct strset_iterator iter;
+	struct strset sums;
+	mmstr* line = NULL;
+	char * data, * end, * eol;
+	int i, rv = -1;
+
+	strset_init(&sums, STRSET_HANDLE_STRINGS_MEM);
+
+	data = sums_data->base;
+	end = data + sums_data->size;
+	for (; (eol = memchr(data, '\n', end - data)) != NULL; data = eol + 1) {
+		// Package metadata are not installed
+		if (STR_STARTS_WITH(data, (size_t)(eol - data), "MMPACK"))
+			continue;
 
-	if (archive_read_open_filename(a, mpk_filename, READ_ARCHIVE_BLOCK)) {
-		mm_raise_error(archive_errno(a), "opening mpk %s failed: %s",
-		               mpk_filename, archive_error_string(a));
-		archive_read_free(a);
-		return -1;
+		line = mmstr_copy_realloc(line, data, eol - data);
+		strset_add(&sums, line);
 	}
 
-	rv = -1;
-	while (archive_read_next_header(a, &entry) == ARCHIVE_OK) {
-		if (!strcmp(archive_entry_pathname(entry), "./MMPACK/info")) {
-			rv = unpack_entry_into_buffer(a, entry, buffer);
-			break;
+	for (i = 0; i < spkg->num; i++) {
+		entry = &spkg->entries[i];
+		if (entry->type == OBJSTORE_DIR || entry == spkg->sums)
+			continue;
+
+		store_entry_sums_line(&line, entry, 1);
+		if (strset_remove(&sums, line) == 0)
+			continue;
+
+		if (entry->type == OBJSTORE_REG) {
+			store_entry_sums_line(&line, entry, 0);
+			if (strset_remove(&sums, line) == 0)
+				continue;
 		}
 
-		archive_read_data_skip(a);
+		mm_raise_error(EBADMSG, "%s does not match sha256sums",
+		               entry->path);
+		goto exit;
 	}
 
-	archive_read_close(a);
-	archive_read_free(a);
+	if (strset_iter_first(&iter, &sums) != NULL) {
+		mm_raise_error(EBADMSG, "files of sha256sums are missing");
+		goto exit;
+	}
 
+	rv = 0;
+
+exit:
+	mmstr_free(line);
+	strset_deinit(&sums);
 	return rv;
 }
 
-/**************************************************************************
- *                                                                        *
- *                          Packages files removal                        *
- *                                                                        *
- **************************************************************************/
 
-#define UNPACK_MAXPATH 512
+/**
+ * store_pkg_deinit() - cleanup package loaded from the object store
+ * @spkg:       package loaded by store_pkg_load()
+ */
+static
+void store_pkg_deinit(struct store_pkg* spkg)
+{
+	free(spkg->entries);
+	objstore_reader_close(&spkg->reader);
+}
+
 
 /**
- * pkg_list_rm_files() - list files of a package to be removed
- * @pkg:        package about to be removed
- * @files:      pointer to initialized strlist to populate
+ * store_pkg_load() - load and authenticate the manifest of a package
+ * @spkg:       structure receiving the manifest
+ * @store:      folder of the object store
+ * @pkg:        package to install from @store
  *
- * Return: 0 in case of success, -1 otherwise with error
+ * The object store may be shared with other users, hence the manifest of
+ * @pkg is not trusted. The sha256sums file of @pkg is authenticated by the
+ * sumsha of @pkg, then each entry of the manifest is checked against it.
+ * The content of the objects is verified when they are materialized.
+ *
+ * Return: 0 in case of success, -1 otherwise with error state set
+ * accordingly. In both cases, @spkg must be cleansed by store_pkg_deinit().
  */
 static
-int pkg_list_rm_files(const struct mmpkg* pkg, struct strlist* files)
+int store_pkg_load(struct store_pkg* spkg, const mmstr* store,
+                   const struct mmpkg* pkg)
 {
-	int rv = -1;
-	FILE* fp;
-	mmstr* path;
+	struct objstore_entry entry;
+	struct buffer entries, sums_data;
+	mmstr* sums_path;
+	int i, r, rv = -1;
 
-	path = sha256sums_path(pkg);
-	fp = fopen(path, "rb");
-	if (fp == NULL) {
-		mm_raise_from_errno("Can't open %s", path);
+	*spkg = (struct store_pkg) {0};
+	buffer_init(&entries);
+	buffer_init(&sums_data);
+
+	if (objstore_reader_open(&spkg->reader, store, pkg->sumsha))
 		goto exit;
+
+	while ((r = objstore_reader_next(&spkg->reader, &entry)) == 1)
+		buffer_push(&entries, &entry, sizeof(entry));
+
+	spkg->num = entries.size / sizeof(entry);
+	spkg->entries = buffer_take_data_ownership(&entries);
+	if (r < 0)
+		goto exit;
+
+	sums_path = sha256sums_path(pkg);
+	for (i = 0; i < spkg->num; i++) {
+		if (strcmp(spkg->entries[i].path, sums_path) == 0)
+			spkg->sums = &spkg->entries[i];
 	}
 
-	// Add immediately the path of sha256sums
-	strlist_add(files, path);
+	mmstr_free(sums_path);
 
-	path = mmstr_realloc(path, UNPACK_MAXPATH);
-	while (fscanf(fp, "%"MM_STRINGIFY (UNPACK_MAXPATH)"[^:]: %*s ",
-	              path) == 1) {
-		mmstr_update_len_from_buffer(path);
+	if (!spkg->sums || spkg->sums->type != OBJSTORE_REG
+	    || strcmp(spkg->sums->ref, pkg->sumsha) != 0) {
+		mm_raise_error(EBADMSG, "sha256sums of %s not in manifest",
+		               pkg->name);
+		goto exit;
+	}
 
-		// Check the path has not been truncated
-		if (mmstrlen(path) == UNPACK_MAXPATH) {
-			mm_raise_error(ENAMETOOLONG, "Path of file"
-			               " installed by %s has been truncated"
-			               " (truncated path: %s)",
-			               pkg->name, path);
+	// Check entries against the sha256sums matching the sumsha
+	if (objstore_load_object(store, spkg->sums->ref, spkg->sums->mode,
+	                         &sums_data)
+	    || store_pkg_check(spkg, &sums_data))
+		goto exit;
+
+	for (i = 0; i < spkg->num; i++) {
+		if (spkg->entries[i].type == OBJSTORE_REG
+		    && !objstore_has_object(store, spkg->entries[i].ref,
+		                            spkg->entries[i].mode)) {
+			mm_raise_error(ENOENT, "object of %s missing in store",
+			               spkg->entries[i].path);
 			goto exit;
 		}
-
-		// Skip folder (path terminated with '/')
-		if (is_path_separator(path[mmstrlen(path)-1]))
-			continue;
-
-		strlist_add(files, path);
 	}
 
-	fclose(fp);
 	rv = 0;
 
 exit:
+	buffer_deinit(&sums_data);
+	buffer_deinit(&entries);
+	return rv;
+}
+
+
+/**
+ * pkg_in_store() - test whether a package can be installed from the store
+ * @store:      folder of the object store (may be NULL)
+ * @pkg:        package to install
+ *
+ * Return: 1 if the manifest of @pkg is in @store, is consistent with the
+ * sumsha of @pkg and all its objects are present, 0 otherwise.
+ */
+static
+int pkg_in_store(const mmstr* store, const struct mmpkg* pkg)
+{
+	struct store_pkg spkg;
+	int prev_err_flags, rv;
+
+	if (!objstore_has_pkg(store, pkg->sumsha))
+		return 0;
+
+	prev_err_flags = mm_error_set_flags(MM_ERROR_SET, MM_ERROR_IGNORE);
+	rv = (store_pkg_load(&spkg, store, pkg) == 0);
+	mm_error_set_flags(prev_err_flags, MM_ERROR_IGNORE);
+
+	store_pkg_deinit(&spkg);
+	return rv;
+}
+
+
+/**
+ * pkg_unpack_from_store() - install files of a package from the object store
+ * @store:      folder of the object store
+ * @pkg:        package to install
+ * @files:      files to be removed (may be NULL)
+ *
+ * The manifest of the package is authenticated with store_pkg_load(). Then,
+ * like pkg_unpack_files(), the regular files and symlinks are first created
+ * in the unpack cache directory, each object being verified. The
+ * directories are created and the files renamed in their final location
+ * only if all of them could be created.
+ *
+ * Return: 0 on success, a negative value otherwise.
+ */
+static
+int pkg_unpack_from_store(const mmstr* store, const struct mmpkg* pkg,
+                          struct strset* files)
+{
+	const struct objstore_entry* entry;
+	struct store_pkg spkg;
+	struct strlist to_rename;
+	struct strlist to_mkdir;
+	struct dir_cache dirs;
+	struct file_batch batch;
+	mmstr * path = NULL, * file;
+	int i, rv, cpt = 0;
+
+	strlist_init(&to_rename);
+	strlist_init(&to_mkdir);
+	dir_cache_init(&dirs);
+	file = mmstr_malloc(sizeof(UNPACK_CACHEDIR_RELPATH) + 10);
+
+	rv = store_pkg_load(&spkg, store, pkg);
+	for (i = 0; i < spkg.num && rv == 0; i++) {
+		entry = &spkg.entries[i];
+		path = mmstrcpy_cstr_realloc(path, entry->path);
+		if (entry->type == OBJSTORE_DIR) {
+			rv = strlist_add(&to_mkdir, path);
+		} else if (entry->type == OBJSTORE_REG) {
+			// If previous file exists, remove it first
+			sprintf(file, "%s/%d", UNPACK_CACHEDIR_RELPATH, cpt);
+			if (mm_check_access(file, F_OK) != ENOENT
+			    && mm_unlink(file)) {
+				rv = -1;
+				break;
+			}
+
+			rv = objstore_materialize(store, entry->ref,
+			                          entry->mode, file);
+		} else {
+			sprintf(file, "%s/%d", UNPACK_CACHEDIR_RELPATH, cpt);
+			rv = dir_cache_symlink(&dirs, entry->ref, file);
+		}
+
+		if (entry->type != OBJSTORE_DIR && rv == 0) {
+			strlist_add(&to_rename, path);
+			cpt++;
+		}
+
+		if (files)
+			strset_remove(files, path);
+	}
+
+	if (rv == 0)
+		rv = mkdir_all(&to_mkdir, &dirs);
+
+	if (rv == 0) {
+		if (file_batch_init(&batch, &dirs) == 0) {
+			rv = rename_all(&to_rename, &dirs, &batch);
+			file_batch_deinit(&batch);
+		} else {
+			rv = rename_all(&to_rename, &dirs, NULL);
+		}
+	}
+
+	store_pkg_deinit(&spkg);
+	dir_cache_deinit(&dirs);
+	strlist_deinit(&to_mkdir);
+	strlist_deinit(&to_rename);
+	mmstr_free(file);
 	mmstr_free(path);
 	return rv;
 }
 
 
+/**
+ * open_with_magic() - open package file if it starts with a magic number
+ * @mpk_filename:       path of the package file
+ * @magic:              expected first bytes of @mpk_filename
+ * @len:                length of @magic (at most 8)
+ *
+ * Return: file descriptor opened on @mpk_filename and positioned at its
+ * beginning if the file starts with @magic, -1 otherwise.
+ */
 static
-int rm_files_from_list(struct strlist* files)
+int open_with_magic(const char* mpk_filename, const void* magic, size_t len)
 {
-	struct strlist_elt * elt;
-	const mmstr* path;
+	uint8_t head[8];
+	int fd;
 
-	elt = files->head;
+	fd = mm_open(mpk_filename, O_RDONLY, 0);
+	if (fd < 0)
+		return -1;
+
+	if (len > sizeof(head)
+	    || mm_read(fd, head, len) != (ssize_t)len
+	    || memcmp(head, magic, len)
+	    || mm_seek(fd, 0, SEEK_SET) != 0) {
+		mm_close(fd);
+		return -1;
+	}
 
-	while (elt) {
-		path = elt->str.buf;
+	return fd;
+}
 
-		if (mm_unlink(path)) {
-			// If this has failed because the file is not found,
-			// nothing prevent us to continue (maybe the user
-			// has removed the file by mistake... but this
-			// should not block). If something else, let's halt
-			if (mm_get_lasterror_number() != ENOENT)
+
+/*
+ * mmpack-build compresses the package payload in independent xz blocks
+ * (see create_tarball()). libarchive decodes xz on a single thread, so when
+ * the whole package is going to be extracted, the decompression is done here
+ * with the multi-threaded decoder of liblzma, each thread decoding its own
+ * blocks. A package made of a single block is still correctly decoded, only
+ * without parallelism.
+ */
+#if defined (HAVE_LIBLZMA) && LZMA_VERSION >= 50040002
+
+#define XZ_READ_BLOCK (64*1024)
+
+/**
+ * struct xz_mt_reader - multi-threaded xz decoder feeding an archive
+ * @strm:       xz decoder
+ * @fd:         file descriptor of the package file
+ * @eof:        true when the end of the package file has been reached
+ * @inbuf:      compressed data read from @fd
+ * @outbuf:     decompressed data passed to libarchive
+ */
+struct xz_mt_reader {
+	lzma_stream strm;
+	int fd;
+	int eof;
+	uint8_t inbuf[XZ_READ_BLOCK];
+	uint8_t outbuf[XZ_READ_BLOCK];
+};
+
+
+static
+la_ssize_t xz_mt_archive_read(struct archive* a, void* data,
+                              const void** buf)
+{
+	struct xz_mt_reader* reader = data;
+	lzma_stream* strm = &reader->strm;
+	lzma_ret ret;
+	ssize_t rsz;
+
+	strm->next_out = reader->outbuf;
+	strm->avail_out = sizeof(reader->outbuf);
+
+	// Loop until some data is decompressed or the stream is over
+	do {
+		if (strm->avail_in == 0 && !reader->eof) {
+			rsz = mm_read(reader->fd, reader->inbuf,
+			              sizeof(reader->inbuf));
+			if (rsz < 0) {
+				archive_set_error(a, mm_get_lasterror_number(),
+				                  "%s", mm_get_lasterror_desc());
+				return -1;
+			}
+
+			reader->eof = (rsz == 0);
+			strm->next_in = reader->inbuf;
+			strm->avail_in = rsz;
+		}
+
+		ret = lzma_code(strm, reader->eof ? LZMA_FINISH : LZMA_RUN);
+		if (ret == LZMA_STREAM_END)
+			break;
+
+		if (ret != LZMA_OK) {
+			archive_set_error(a, MM_EBADFMT,
+			                  "Invalid xz data (%d)", ret);
+			return -1;
+		}
+	} while (strm->avail_out == sizeof(reader->outbuf));
+
+	*buf = reader->outbuf;
+	return sizeof(reader->outbuf) - strm->avail_out;
+}
+
+
+static
+int xz_mt_archive_close(struct archive* a, void* data)
+{
+	struct xz_mt_reader* reader = data;
+	(void) a;
+
+	lzma_end(&reader->strm);
+	mm_close(reader->fd);
+	free(reader);
+
+	return ARCHIVE_OK;
+}
+
+
+/**
+ * xz_mt_archive_open() - open archive on package with multithreaded decoder
+ * @a:                  archive to open
+ * @mpk_filename:       path of the package file
+ *
+ * Return: 0 if @a has been opened on the multi-threaded decoder, 1 if the
+ * package file is not compressed with xz or if the decoder cannot be set up
+ * (@a is then left untouched), -1 if @a failed to be opened (error being
+ * reported in @a).
+ */
+static
+int xz_mt_archive_open(struct archive* a, const char* mpk_filename)
+{
+	static const uint8_t xz_magic[] = {0xFD, '7', 'z', 'X', 'Z', 0x00};
+	struct xz_mt_reader* reader;
+	lzma_mt mt = {
+		.flags = LZMA_CONCATENATED,
+		.threads = lzma_cputhreads(),
+		.timeout = 0,
+		.memlimit_threading = lzma_physmem() / 4,
+		.memlimit_stop = UINT64_MAX,
+	};
+	int fd;
+
+	if (mt.threads < 2)
+		return 1;
+
+	fd = open_with_magic(mpk_filename, xz_magic, sizeof(xz_magic));
+	if (fd < 0)
+		return 1;
+
+	reader = xx_malloc(sizeof(*reader));
+	reader->strm = (lzma_stream) LZMA_STREAM_INIT;
+	reader->fd = fd;
+	reader->eof = 0;
+	if (lzma_stream_decoder_mt(&reader->strm, &mt) != LZMA_OK) {
+		mm_close(fd);
+		free(reader);
+		return 1;
+	}
+
+	// From now, reader is cleaned up by xz_mt_archive_close()
+	if (archive_read_open(a, reader, NULL, xz_mt_archive_read,
+	                      xz_mt_archive_close))
+		return -1;
+
+	return 0;
+}
+
+#else /* HAVE_LIBLZMA && LZMA_VERSION >= 50040002 */
+
+static
+int xz_mt_archive_open(struct archive* a, const char* mpk_filename)
+{
+	(void) a;
+	(void) mpk_filename;
+	return 1;
+}
+
+#endif /* HAVE_LIBLZMA && LZMA_VERSION >= 50040002 */
+
+
+/*
+ * The payload of packages may be compressed with zstd (compression field of
+ * the specfile). Depending on how libarchive has been built, it decodes zstd
+ * with libzstd, by spawning the zstd program or not at all. To not depend on
+ * this, local package files are decoded here with libzstd if available.
+ */
+#if defined (HAVE_LIBZSTD)
+
+#define ZSTD_READ_BLOCK (128*1024)
+
+/**
+ * struct zstd_reader - zstd decoder feeding an archive
+ * @dctx:       zstd decompression context
+ * @fd:         file descriptor of the package file
+ * @eof:        true when the end of the package file has been reached
+ * @in:         compressed data read from @fd not consumed yet
+ * @inbuf:      compressed data read from @fd
+ * @outbuf:     decompressed data passed to libarchive
+ */
+struct zstd_reader {
+	ZSTD_DCtx* dctx;
+	int fd;
+	int eof;
+	ZSTD_inBuffer in;
+	uint8_t inbuf[ZSTD_READ_BLOCK];
+	uint8_t outbuf[ZSTD_READ_BLOCK];
+};
+
+
+static
+la_ssize_t zstd_archive_read(struct archive* a, void* data,
+                             const void** buf)
+{
+	struct zstd_reader* reader = data;
+	ZSTD_outBuffer out = {.dst = reader->outbuf,
+		              .size = sizeof(reader->outbuf)};
+	ssize_t rsz;
+	size_t ret;
+
+	// Loop until some data is decompressed or the stream is over
+	do {
+		if (reader->in.pos == reader->in.size && !reader->eof) {
+			rsz = mm_read(reader->fd, reader->inbuf,
+			              sizeof(reader->inbuf));
+			if (rsz < 0) {
+				archive_set_error(a, mm_get_lasterror_number(),
+				                  "%s", mm_get_lasterror_desc());
+				return -1;
+			}
+
+			reader->eof = (rsz == 0);
+			reader->in = (ZSTD_inBuffer) {.src = reader->inbuf,
+				                      .size = rsz};
+		}
+
+		ret = ZSTD_decompressStream(reader->dctx, &out, &reader->in);
+		if (ZSTD_isError(ret)) {
+			archive_set_error(a, MM_EBADFMT, "Invalid zstd data: %s",
+			                  ZSTD_getErrorName(ret));
+			return -1;
+		}
+
+		// Nothing left to decode: ret is 0 only if the last frame
+		// is complete
+		if (reader->eof && out.pos == 0) {
+			if (ret != 0) {
+				archive_set_error(a, MM_EBADFMT,
+				                  "Truncated zstd data");
 				return -1;
+			}
+
+			break;
 		}
+	} while (out.pos == 0);
+
+	*buf = reader->outbuf;
+	return out.pos;
+}
+
+
+static
+int zstd_archive_close(struct archive* a, void* data)
+{
+	struct zstd_reader* reader = data;
+	(void) a;
+
+	ZSTD_freeDCtx(reader->dctx);
+	mm_close(reader->fd);
+	free(reader);
+
+	return ARCHIVE_OK;
+}
+
+
+/**
+ * zstd_archive_open() - open archive on package compressed with zstd
+ * @a:                  archive to open
+ * @mpk_filename:       path of the package file
+ *
+ * Return: 0 if @a has been opened on the zstd decoder, 1 if the package
+ * file is not compressed with zstd or if the decoder cannot be set up
+ * (@a is then left untouched), -1 if @a failed to be opened (error being
+ * reported in @a).
+ */
+static
+int zstd_archive_open(struct archive* a, const char* mpk_filename)
+{
+	static const uint8_t zstd_magic[] = {0x28, 0xB5, 0x2F, 0xFD};
+	struct zstd_reader* reader;
+	ZSTD_DCtx* dctx;
+	int fd;
+
+	fd = open_with_magic(mpk_filename, zstd_magic, sizeof(zstd_magic));
+	if (fd < 0)
+		return 1;
+
+	dctx = ZSTD_createDCtx();
+	if (!dctx) {
+		mm_close(fd);
+		return 1;
+	}
+
+	reader = xx_malloc(sizeof(*reader));
+	reader->dctx = dctx;
+	reader->fd = fd;
+	reader->eof = 0;
+	reader->in = (ZSTD_inBuffer) {.src = reader->inbuf, .size = 0};
+
+	// From now, reader is cleaned up by zstd_archive_close()
+	if (archive_read_open(a, reader, NULL, zstd_archive_read,
+	                      zstd_archive_close))
+		return -1;
+
+	return 0;
+}
+
+#else /* HAVE_LIBZSTD */
+
+static
+int zstd_archive_open(struct archive* a, const char* mpk_filename)
+{
+	(void) a;
+	(void) mpk_filename;
+	return 1;
+}
+
+#endif /* HAVE_LIBZSTD */
+
+
+/**
+ * pkg_open_archive() - open archive stream on package file
+ * @mpk_filename: path of the package file
+ * @parallel:   if non zero, decompress the package on multiple threads
+ *
+ * Decompressing on multiple threads is worth only if the whole package is
+ * read: the decoder threads are decompressing ahead of what is being read.
+ *
+ * Return: archive stream ready to be read in case of success, NULL
+ * otherwise with error state set accordingly.
+ */
+static
+struct archive* pkg_open_archive(const char* mpk_filename, int parallel)
+{
+	struct archive * a;
+	int rv;
+
+	a = archive_read_new();
+	archive_read_support_filter_all(a);
+	archive_read_support_format_all(a);
+
+	rv = zstd_archive_open(a, mpk_filename);
+	if (rv == 1 && parallel)
+		rv = xz_mt_archive_open(a, mpk_filename);
+
+	if (rv == 1)
+		rv = archive_read_open_filename(a, mpk_filename,
+		                                READ_ARCHIVE_BLOCK);
+
+	if (rv) {
+		mm_raise_error(archive_errno(a), "opening mpk %s failed: %s",
+		               mpk_filename, archive_error_string(a));
+		archive_read_free(a);
+		return NULL;
+	}
+
+	return a;
+}
+
+
+/* same as archive_read_data_into_fd(), but into a buffer */
+static
+int unpack_entry_into_buffer(struct archive * archive,
+                             struct archive_entry * entry,
+                             struct buffer * buffer)
+{
+	ssize_t r;
+	int64_t info_size = archive_entry_size(entry);
+
+	if (info_size == 0)
+		return -1;
+
+	buffer_reserve_data(buffer, info_size);
+	buffer_inc_size(buffer, info_size);
+
+	r = archive_read_data(archive, buffer->base, buffer->size);
+	if (r >= ARCHIVE_OK && (size_t) r == buffer->size)
+		return 0;
+
+	return -1;
+}
+
+/**
+ * is_metadata_header_entry() - test if entry may be in package metadata header
+ * @path:       path of the entry in the archive
+ *
+ * Return: 1 if @path is a file allowed in the metadata header of packages,
+ * 0 otherwise
+ */
+static
+int is_metadata_header_entry(char const * path)
+{
+	size_t len = strlen(path);
+
+	return STR_STARTS_WITH(path, len, "./MMPACK/")
+	       || STR_STARTS_WITH(path, len, "./" METADATA_RELPATH "/");
+}
+
+
+/**
+ * pkg_load_archive_file() - load a file of a package into buffer
+ * @mpk_filename: path of the package file
+ * @entry_path:   path of the file in the archive
+ * @buffer:       initialized buffer receiving the content of the file
+ *
+ * If the package starts with a metadata header (ie, its first entry is
+ * ./MMPACK/info), all the metadata files are at the beginning of the
+ * package. Then only the header is read when looking for a metadata file:
+ * the payload is not decompressed.
+ *
+ * Return: 0 in case of success, -1 otherwise
+ */
+static
+int pkg_load_archive_file(char const * mpk_filename, char const * entry_path,
+                          struct buffer * buffer)
+{
+	int rv, has_header;
+	struct archive * a;
+	struct archive_entry * entry;
+	char const * path;
+
+	a = pkg_open_archive(mpk_filename, 0);
+	if (!a)
+		return -1;
+
+	rv = -1;
+	has_header = -1;
+	while (archive_read_next_header(a, &entry) == ARCHIVE_OK) {
+		path = archive_entry_pathname(entry);
+		if (has_header == -1)
+			has_header = !strcmp(path, "./MMPACK/info");
+		else if (has_header && !is_metadata_header_entry(path))
+			break;
+
+		if (!strcmp(path, entry_path)) {
+			rv = unpack_entry_into_buffer(a, entry, buffer);
+			break;
+		}
+
+		archive_read_data_skip(a);
+	}
+
+	archive_read_close(a);
+	archive_read_free(a);
+
+	return rv;
+}
+
+
+/**
+ * pkg_get_mmpack_info() - load MMPACK/info file from package into buffer
+ * @mpk_filename: mmpack package to read from
+ * @buffer: buffer structure to receive the raw data
+ *
+ * Open, scans for the MMPACK/info file, and load its data into given buffer
+ * structure. The buffer will be enlarged as needed, and must be freed by the
+ * caller after usage by calling the buffer_deinit() function.
+ *
+ * Return: 0 on success, -1 on error
+ */
+LOCAL_SYMBOL
+int pkg_get_mmpack_info(char const * mpk_filename, struct buffer * buffer)
+{
+	return pkg_load_archive_file(mpk_filename, "./MMPACK/info", buffer);
+}
+
+
+/**
+ * pkg_get_unchanged_files() - list files identical in two package versions
+ * @oldpkg:     version of the package currently installed
+ * @pkg:        version of the package to install
+ * @mpkfile:    path of the package file of @pkg
+ * @unchanged:  initialized table receiving the path of the unchanged files
+ *              associated with their typed hash. It must be cleaned with
+ *              unchanged_files_deinit().
+ *
+ * A file is unchanged if the line listing it in the sha256sums of @oldpkg
+ * is found identically in the sha256sums of @pkg, ie, same path, same type
+ * and same hash.
+ *
+ * NOTE: this function assumes current directory is the prefix path
+ *
+ * Return: 0 in case of success, -1 otherwise
+ */
+static
+int pkg_get_unchanged_files(const struct mmpkg* oldpkg,
+                            const struct mmpkg* pkg, const mmstr* mpkfile,
+                            struct indextable* unchanged)
+{
+	struct strset old_lines;
+	struct buffer new_sums;
+	struct it_entry* ref;
+	mmstr * sums_path, * entry_path, * line, * path;
+	char * data, * end, * eol;
+	void* map;
+	size_t mapsize, line_len;
+	int rv;
+
+	strset_init(&old_lines, STRSET_HANDLE_STRINGS_MEM);
+	buffer_init(&new_sums);
+	line = NULL;
+
+	// Index the lines of the sha256sums of installed version
+	sums_path = sha256sums_path(oldpkg);
+	rv = map_file_in_prefix(NULL, sums_path, &map, &mapsize);
+	mmstr_free(sums_path);
+	if (rv)
+		goto exit;
+
+	data = map;
+	end = data + mapsize;
+	for (; (eol = memchr(data, '\n', end - data)) != NULL; data = eol + 1) {
+		line = mmstr_copy_realloc(line, data, eol - data);
+		strset_add(&old_lines, line);
+	}
+
+	mm_unmap(map);
+
+	// Load sha256sums of the new version from the package file
+	sums_path = sha256sums_path(pkg);
+	entry_path = mmstr_malloca(mmstrlen(sums_path) + 2);
+	mmstrcpy_cstr(entry_path, "./");
+	mmstrcat(entry_path, sums_path);
+	rv = pkg_load_archive_file(mpkfile, entry_path, &new_sums);
+	mmstr_freea(entry_path);
+	mmstr_free(sums_path);
+	if (rv)
+		goto exit;
+
+	data = new_sums.base;
+	end = data + new_sums.size;
+	for (; (eol = memchr(data, '\n', end - data)) != NULL; data = eol + 1) {
+		line_len = eol - data;
+
+		/* 2 is for len(': '). Legacy untyped hashes are skipped */
+		if (line_len <= SHA_HEXSTR_LEN + 2
+		    || data[line_len - SHA_HEXSTR_LEN - 2] != ':')
+			continue;
+
+		line = mmstr_copy_realloc(line, data, line_len);
+		if (!strset_contains(&old_lines, line))
+			continue;
+
+		path = mmstr_malloc_copy(data, line_len - SHA_HEXSTR_LEN - 2);
+		ref = indextable_lookup_create(unchanged, path);
+		if (ref->value) {
+			mmstr_free(path);
+			continue;
+		}
+
+		ref->value = mmstr_malloc_copy(eol - SHA_HEXSTR_LEN,
+		                               SHA_HEXSTR_LEN);
+	}
+
+exit:
+	mmstr_free(line);
+	buffer_deinit(&new_sums);
+	strset_deinit(&old_lines);
+	return rv;
+}
+
+
+/**
+ * unchanged_files_deinit() - cleanup table filled by pkg_get_unchanged_files()
+ * @unchanged:  table to cleanup
+ */
+static
+void unchanged_files_deinit(struct indextable* unchanged)
+{
+	struct it_iterator iter;
+	struct it_entry* ref;
+
+	ref = it_iter_first(&iter, unchanged);
+	for (; ref != NULL; ref = it_iter_next(&iter)) {
+		mmstr_free(ref->key);
+		mmstr_free(ref->value);
+	}
+
+	indextable_deinit(unchanged);
+}
+
+/**************************************************************************
+ *                                                                        *
+ *                          Packages files removal                        *
+ *                                                                        *
+ **************************************************************************/
+
+#define UNPACK_MAXPATH 512
+
+/**
+ * pkg_list_rm_files() - list files of a package to be removed
+ * @pkg:        package about to be removed
+ * @files:      pointer to initialized strset to populate. It must handle the
+ *              memory of the strings (STRSET_HANDLE_STRINGS_MEM).
+ *
+ * The files are listed in a set so that the files kept by a new version of
+ * the package can be withdrawn in constant time while it is being unpacked.
+ *
+ * Return: 0 in case of success, -1 otherwise with error
+ */
+static
+int pkg_list_rm_files(const struct mmpkg* pkg, struct strset* files)
+{
+	int rv = -1;
+	FILE* fp;
+	mmstr* path;
+
+	path = sha256sums_path(pkg);
+	fp = fopen(path, "rb");
+	if (fp == NULL) {
+		mm_raise_from_errno("Can't open %s", path);
+		goto exit;
+	}
+
+	// Add immediately the path of sha256sums and of the file stamps
+	strset_add(files, path);
+	mmstr_free(path);
+	path = stamps_path(pkg);
+	strset_add(files, path);
+
+	path = mmstr_realloc(path, UNPACK_MAXPATH);
+	while (fscanf(fp, "%"MM_STRINGIFY (UNPACK_MAXPATH)"[^:]: %*s ",
+	              path) == 1) {
+		mmstr_update_len_from_buffer(path);
+
+		// Check the path has not been truncated
+		if (mmstrlen(path) == UNPACK_MAXPATH) {
+			mm_raise_error(ENAMETOOLONG, "Path of file"
+			               " installed by %s has been truncated"
+			               " (truncated path: %s)",
+			               pkg->name, path);
+			goto exit;
+		}
+
+		// Skip folder (path terminated with '/')
+		if (is_path_separator(path[mmstrlen(path)-1]))
+			continue;
+
+		strset_add(files, path);
+	}
+
+	fclose(fp);
+	rv = 0;
+
+exit:
+	mmstr_free(path);
+	return rv;
+}
+
+
+static
+int rm_files_from_list(struct strset* files)
+{
+	struct strset_iterator iter;
+	const mmstr* path;
+
+	for (path = strset_iter_first(&iter, files); path;
+	     path = strset_iter_next(&iter)) {
+		if (mm_unlink(path)) {
+			// If this has failed because the file is not found,
+			// nothing prevent us to continue (maybe the user
+			// has removed the file by mistake... but this
+			// should not block). If something else, let's halt
+			if (mm_get_lasterror_number() != ENOENT)
+				return -1;
+		}
+	}
+
+	return 0;
+}
+
+
+/**************************************************************************
+ *                                                                        *
+ *                            Packages retrieval                          *
+ *                                                                        *
+ **************************************************************************/
+/**
+ * check_file_pkg() - Check integrity of given file
+ * @ref_sha: reference file sha256 to compare against
+ * @parent: prefix directory to prepend to @filename to get the
+ *          final path of the file to hash. This may be NULL
+ * @filename: path of file whose hash must be computed
+ *
+ * Return: 0 if no issue has been found, -1 otherwise
+ */
+static
+int check_file_pkg(const mmstr * ref_sha, const mmstr * parent,
+                   const mmstr * filename)
+{
+	int follow;
+	mmstr* sha = mmstr_alloca(SHA_HEXSTR_LEN);
+
+	// If reference hash contains type prefix (ie its length is
+	// SHA_HEXSTR_LEN), symlink must not be followed
+	follow = 0;
+	if (mmstrlen(ref_sha) != SHA_HEXSTR_LEN)
+		follow = 1;
+
+	if (sha_compute(sha, filename, parent, follow))
+		return -1;
+
+	if (!mmstrequal(sha, ref_sha)) {
+		mm_raise_error(EBADMSG, "bad SHA-256 detected %s", filename);
+		return -1;
+	}
+
+	return 0;
+}
+
+
+/**
+ * check_files_pkg() - Check integrity of several files
+ * @checks: array of files to check
+ * @num:    number of elements in @checks (at most SHA_BATCH_MAX_FILES)
+ * @parent: prefix directory to prepend to the filenames. This may be NULL
+ *
+ * Same as check_file_pkg() for each element of @checks, whose @filename and
+ * @ref_sha fields must be set. The @size and @rv fields are set to the size
+ * of the hashed file and the result of the check. The files are hashed
+ * together by sha_compute_batch(), which allows to hash the small files in
+ * parallel. This function is safe to be called concurrently from several
+ * threads.
+ *
+ * Return: 0 if no issue has been found, -1 otherwise
+ */
+LOCAL_SYMBOL
+int check_files_pkg(struct file_check* checks, int num, const mmstr* parent)
+{
+	struct sha_file files[SHA_BATCH_MAX_FILES];
+	int i, rv;
+
+	for (i = 0; i < num; i++) {
+		// If reference hash contains type prefix (ie its length is
+		// SHA_HEXSTR_LEN), symlink must not be followed
+		files[i] = (struct sha_file) {
+			.filename = checks[i].filename,
+			.follow = (mmstrlen(checks[i].ref_sha) != SHA_HEXSTR_LEN),
+			.hash = mmstr_alloca(SHA_HEXSTR_LEN),
+		};
+	}
+
+	sha_compute_batch(files, num, parent);
+
+	rv = 0;
+	for (i = 0; i < num; i++) {
+		checks[i].size = files[i].size;
+		checks[i].rv = files[i].rv;
+		if (checks[i].rv == 0
+		    && !mmstrequal(files[i].hash, checks[i].ref_sha)) {
+			checks[i].rv = mm_raise_error(EBADMSG,
+			                              "bad SHA-256 detected %s",
+			                              checks[i].filename);
+		}
+
+		if (checks[i].rv != 0)
+			rv = -1;
+	}
+
+	return rv;
+}
+
+
+/**
+ * foreach_installed_file() - iterate over the files of an installed package
+ * @ctx:        mmpack context
+ * @pkg:        installed package whose files must be listed
+ * @cb:         function called for each file of @pkg
+ * @data:       pointer passed to @cb
+ *
+ * This function parses the SHA-256 sums file of @pkg and calls @cb for
+ * each file listed in it (except the mmpack metadata) with the path of the
+ * file relative to the prefix and its reference hash. The strings passed to
+ * @cb are only valid for the duration of the call. If @cb returns non
+ * zero, the iteration stops.
+ *
+ * Return: 0 if all files have been iterated, -1 if the sums file could not
+ * be parsed or if @cb has stopped the iteration.
+ */
+LOCAL_SYMBOL
+int foreach_installed_file(const struct mmpack_ctx* ctx,
+                           const struct mmpkg* pkg,
+                           installed_file_cb cb, void* data)
+{
+	mmstr * filename;
+	mmstr * ref_sha;
+	mmstr * sumsha_path;
+	char * line, * eol;
+	size_t line_len, filename_len, mapsize;
+	void * map;
+	int rv;
+
+	sumsha_path = sha256sums_path(pkg);
+	rv = map_file_in_prefix(ctx->prefix, sumsha_path, &map, &mapsize);
+	mmstr_free(sumsha_path);
+	if (rv == -1)
+		return -1;
+
+	line = map;
+	filename = ref_sha = NULL;
+	while ((eol = strchr(line, '\n')) != NULL) {
+		line_len = eol - line;
+
+		if (line_len < SHA_HEXSTR_LEN) {
+			mm_raise_error(EBADMSG,
+			               "Error while parsing SHA-256 file");
+			break;
+		}
+
+		ref_sha = mmstr_copy_realloc(ref_sha,
+		                             &line[line_len - SHA_HEXSTR_LEN],
+		                             SHA_HEXSTR_LEN);
+
+		/* 2 is for len(': ') */
+		if (line_len <= SHA_HEXSTR_LEN + 2) {
+			mm_raise_error(EBADMSG,
+			               "Error while parsing SHA-256 file");
+			break;;
+		}
+
+		filename_len = line_len - SHA_HEXSTR_LEN - 2;
+		filename = mmstr_copy_realloc(filename, line, filename_len);
+		if (is_mmpack_metadata(filename))
+			goto check_continue;
+
+		if (cb(filename, ref_sha, data) != 0)
+			break;
+
+check_continue:
+		line = eol + 1;
+	}
+
+	mmstr_free(filename);
+	mmstr_free(ref_sha);
+	mm_unmap(map);
+
+	return (eol == NULL) ? 0 : -1;
+}
+
+
+/**
+ * struct check_batch - files of installed package waiting to be checked
+ * @ctx:        mmpack context
+ * @checks:     files to be checked
+ * @num:        number of elements in @checks
+ */
+struct check_batch {
+	const struct mmpack_ctx* ctx;
+	struct file_check checks[SHA_BATCH_MAX_FILES];
+	int num;
+};
+
+
+static
+int check_batch_flush(struct check_batch* batch)
+{
+	int i, rv;
+
+	rv = check_files_pkg(batch->checks, batch->num, batch->ctx->prefix);
+
+	for (i = 0; i < batch->num; i++) {
+		mmstr_free(batch->checks[i].filename);
+		mmstr_free(batch->checks[i].ref_sha);
+	}
+
+	batch->num = 0;
+	return rv;
+}
+
+
+static
+int check_installed_file_cb(const mmstr* filename, const mmstr* ref_sha,
+                            void* data)
+{
+	struct check_batch* batch = data;
+
+	batch->checks[batch->num++] = (struct file_check) {
+		.filename = mmstrdup(filename),
+		.ref_sha = mmstrdup(ref_sha),
+	};
+
+	if (batch->num < SHA_BATCH_MAX_FILES)
+		return 0;
+
+	return check_batch_flush(batch);
+}
+
+
+/**
+ * check_installed_pkg() - check integrity of installed package
+ * @ctx:        mmpack context. If NULL, current dir is assumed to be the root
+ *              the mmpack prefix where to search the installed files.
+ * @pkg:        installed package whose integrity must be checked
+ *
+ * The files are checked by batches of SHA_BATCH_MAX_FILES files.
+ *
+ * Return: 0 if no issue has been found, -1 otherwise
+ */
+LOCAL_SYMBOL
+int check_installed_pkg(const struct mmpack_ctx* ctx, const struct mmpkg* pkg)
+{
+	struct check_batch batch = {.ctx = ctx};
+	int rv;
+
+	rv = foreach_installed_file(ctx, pkg, check_installed_file_cb, &batch);
+
+	// Check the last files (or simply release them in case of failure)
+	if (check_batch_flush(&batch))
+		rv = -1;
+
+	return rv;
+}
+
+
+/**************************************************************************
+ *                                                                        *
+ *                          Installed file stamps                         *
+ *                                                                        *
+ **************************************************************************/
+/*
+ * Once a package is installed, the stat attributes of its files (see struct
+ * file_stamp) are recorded next to its sha256sums file, one line per file:
+ *
+ *   <path>: <size> <mtime_ns> <ctime_ns> <inode>
+ *
+ * A file whose attributes still match the record has not been modified
+ * since its installation, hence it is known to be intact without being
+ * hashed. Symlinks followed to be hashed (legacy sha256sums without type
+ * prefix) are not recorded since their target may change without the link
+ * being modified.
+ */
+#define STAMP_LINE_MAXLEN (UNPACK_MAXPATH + 128)
+
+static
+int write_stamp_cb(const mmstr* filename, const mmstr* ref_sha, void* data)
+{
+	FILE* fp = data;
+	struct file_stamp stamp;
+
+	if (mmstrlen(ref_sha) != SHA_HEXSTR_LEN)
+		return 0;
+
+	if (file_stamp_get(&stamp, filename, NULL))
+		return -1;
+
+	if (fprintf(fp, "%s: %lld %lld %lld %llu\n", filename,
+	            (long long)stamp.size, (long long)stamp.mtime_ns,
+	            (long long)stamp.ctime_ns,
+	            (unsigned long long)stamp.ino) < 0)
+		return -1;
+
+	return 0;
+}
+
+
+/**
+ * pkg_record_stamps() - record the stat attributes of installed files
+ * @ctx:        mmpack context
+ * @pkg:        package whose files have just been installed
+ *
+ * Every file of @pkg must have been either extracted from a verified package
+ * or hashed by the operation which has installed it: the files kept from the
+ * previous version on upgrade are hashed by is_installed_file_unchanged().
+ * Otherwise the quick integrity check would report a file modified before
+ * the operation as intact.
+ *
+ * A failure to write the record is not fatal: the files of @pkg without
+ * record will simply be hashed by the quick integrity check.
+ *
+ * NOTE: this function assumes current directory is the prefix path
+ */
+static
+void pkg_record_stamps(const struct mmpack_ctx* ctx, const struct mmpkg* pkg)
+{
+	mmstr* path;
+	FILE* fp;
+	int rv;
+
+	path = stamps_path(pkg);
+	fp = fopen(path, "wb");
+	if (fp == NULL) {
+		mmstr_free(path);
+		return;
+	}
+
+	rv = foreach_installed_file(ctx, pkg, write_stamp_cb, fp);
+	if (fclose(fp) != 0 || rv != 0) {
+		mm_log_warn("Failed to record file stamps of %s", pkg->name);
+		mm_unlink(path);
+	}
+
+	mmstr_free(path);
+}
+
+
+/**
+ * stamp_record_load() - load the stat attributes of installed files
+ * @rec:        stamp record to initialize
+ * @ctx:        mmpack context
+ * @pkg:        installed package whose record must be loaded
+ *
+ * If @pkg has been installed without record, @rec is left empty. The
+ * parsing stops at the first malformed line, the files not loaded yet being
+ * simply missing from @rec. When done, @rec must be cleaned up with
+ * stamp_record_deinit().
+ */
+LOCAL_SYMBOL
+void stamp_record_load(struct stamp_record* rec, const struct mmpack_ctx* ctx,
+                       const struct mmpkg* pkg)
+{
+	struct file_stamp* stamp;
+	struct it_entry* entry;
+	char line[STAMP_LINE_MAXLEN];
+	long long size, mtime, ctime;
+	unsigned long long ino;
+	mmstr* relpath;
+	mmstr* path;
+	mmstr* key;
+	char* sep;
+	FILE* fp;
+	int len;
+
+	indextable_init(&rec->idx, -1, -1);
+
+	relpath = stamps_path(pkg);
+	path = mmstr_malloca(mmstrlen(ctx->prefix) + mmstrlen(relpath) + 1);
+	mmstr_join_path(path, ctx->prefix, relpath);
+	fp = NULL;
+	if (mm_check_access(path, F_OK) == 0)
+		fp = fopen(path, "rb");
+
+	mmstr_freea(path);
+	mmstr_free(relpath);
+	if (fp == NULL)
+		return;
+
+	while (fgets(line, sizeof(line), fp)) {
+		len = strlen(line);
+		if (len == 0 || line[len-1] != '\n')
+			break;
+
+		// The numbers never contain ':', contrary to the path
+		sep = strrchr(line, ':');
+		if (sep == NULL
+		    || sscanf(sep + 1, "%lld %lld %lld %llu",
+		              &size, &mtime, &ctime, &ino) != 4)
+			break;
+
+		stamp = xx_malloc(sizeof(*stamp));
+		*stamp = (struct file_stamp) {
+			.size = size,
+			.mtime_ns = mtime,
+			.ctime_ns = ctime,
+			.ino = ino,
+		};
+
+		key = mmstr_malloc_copy(line, sep - line);
+		entry = indextable_lookup_create(&rec->idx, key);
+		if (entry->value) {
+			// Duplicated path, the last line wins
+			mmstr_free(key);
+			free(entry->value);
+		}
+
+		entry->value = stamp;
+	}
+
+	fclose(fp);
+}
+
+
+/**
+ * stamp_record_lookup() - get the recorded stat attributes of a file
+ * @rec:        loaded stamp record
+ * @filename:   path of the file relative to the prefix
+ *
+ * Return: the attributes of @filename recorded at installation, NULL if
+ * @filename is not in @rec.
+ */
+LOCAL_SYMBOL
+const struct file_stamp* stamp_record_lookup(const struct stamp_record* rec,
+                                             const mmstr* filename)
+{
+	struct it_entry* entry;
+
+	entry = indextable_lookup(&rec->idx, filename);
+	return entry ? entry->value : NULL;
+}
+
+
+/**
+ * stamp_record_deinit() - cleanup a stamp record
+ * @rec:        stamp record loaded with stamp_record_load()
+ */
+LOCAL_SYMBOL
+void stamp_record_deinit(struct stamp_record* rec)
+{
+	struct it_iterator iter;
+	struct it_entry* entry;
+
+	entry = it_iter_first(&iter, &rec->idx);
+	while (entry != NULL) {
+		mmstr_free(entry->key);
+		free(entry->value);
+		entry = it_iter_next(&iter);
+	}
+
+	indextable_deinit(&rec->idx);
+}
+
+
+/**
+ * action_set_pathname_into_dir() - construct path of cached package file
+ * @act:        action struct whose pathname field is to be set
+ * @from_repo:  repository from which the package was downloaded
+ * @dir:        folder in which the cached downloaded packages must reside
+ *
+ * This function set @act->pathname to point to a file whose basename is
+ * the name of the binary package file associed with @act->pkg and whose
+ * folder is specified by @dir. This is typically used to set the name of
+ * the downloaded file in the local folder of cached packages (specified by
+ * @dir).
+ */
+static
+void action_set_pathname_into_dir(struct action* act, const mmstr* dir)
+{
+	mmstr* pkgbase;
+	int len;
+	struct from_repo * from_repo = act->pkg->from_repo;
+
+	pkgbase = mmstr_malloca(mmstrlen(from_repo->filename));
+
+	// Get base filename of downloaded package
+	mmstr_basename(pkgbase, from_repo->filename);
+
+	// Store the joined cachedir and base filename in act->pathname
+	len = mmstrlen(pkgbase) + mmstrlen(dir) + 1;
+	act->pathname = mmstr_malloc(len);
+	mmstr_join_path(act->pathname, dir, pkgbase);
+
+	mmstr_freea(pkgbase);
+}
+
+
+#define CACHE_RECORD_EXT ".verified"
+
+/**
+ * cache_record_path() - get path of the verification record of cached file
+ * @mpkfile:    path of the package file in cache
+ *
+ * Return: an allocated string to be freed with mmstr_free()
+ */
+static
+mmstr* cache_record_path(const mmstr* mpkfile)
+{
+	mmstr* path;
+
+	path = mmstr_malloc(mmstrlen(mpkfile) + sizeof(CACHE_RECORD_EXT));
+	mmstrcpy(path, mpkfile);
+	mmstrcat_cstr(path, CACHE_RECORD_EXT);
+
+	return path;
+}
+
+
+#define REBUILT_PKG_EXT ".tar"
+
+/**
+ * rebuilt_pkg_path() - get path of the archive of a package rebuilt from delta
+ * @mpkfile:    path of the package file in cache
+ *
+ * An archive rebuilt from a delta is the uncompressed archive of the package,
+ * not the package file: it is kept in cache under its own name and recorded
+ * with its own hash (delta-target-sha256 in the repository index).
+ *
+ * Return: an allocated string to be freed with mmstr_free()
+ */
+static
+mmstr* rebuilt_pkg_path(const mmstr* mpkfile)
+{
+	mmstr* path;
+
+	path = mmstr_malloc(mmstrlen(mpkfile) + sizeof(REBUILT_PKG_EXT));
+	mmstrcpy(path, mpkfile);
+	mmstrcat_cstr(path, REBUILT_PKG_EXT);
+
+	return path;
+}
+
+
+/**
+ * cache_record_update() - record that a cached package file has been verified
+ * @mpkfile:    path of the package file in cache
+ * @sha:        SHA-256 of @mpkfile that has been verified
+ *
+ * Write next to @mpkfile a record holding the stamp of the file (size,
+ * modification and change times in nanoseconds and inode, see
+ * file_stamp_get()) along with its verified hash. As long as the stamp does
+ * not change, the file does not need to be hashed again to be trusted. A
+ * failure to write the record is not fatal, it will simply force the file to
+ * be hashed next time.
+ */
+static
+void cache_record_update(const mmstr* mpkfile, const mmstr* sha)
+{
+	struct file_stamp stamp;
+	mmstr* record_path;
+	char line[128 + SHA_HEXSTR_LEN];
+	int fd, len;
+
+	if (file_stamp_get(&stamp, mpkfile, NULL))
+		return;
+
+	len = snprintf(line, sizeof(line), "%lld %lld %lld %llu %s\n",
+	               (long long)stamp.size, (long long)stamp.mtime_ns,
+	               (long long)stamp.ctime_ns,
+	               (unsigned long long)stamp.ino, sha);
+
+	record_path = cache_record_path(mpkfile);
+	fd = open_file_in_prefix(NULL, record_path, O_WRONLY|O_CREAT|O_TRUNC);
+	if (fd >= 0) {
+		if (fullwrite(fd, line, len))
+			mm_unlink(record_path);
+
+		mm_close(fd);
+	}
+
+	mmstr_free(record_path);
+}
+
+
+/**
+ * cache_record_match() - test a cached package file against its record
+ * @mpkfile:    path of the package file in cache
+ * @ref_sha:    expected SHA-256 of @mpkfile
+ *
+ * Return: 1 if a record exists for @mpkfile, matches its current stamp and
+ * holds @ref_sha as verified hash. 0 otherwise.
+ */
+static
+int cache_record_match(const mmstr* mpkfile, const mmstr* ref_sha)
+{
+	struct file_stamp stamp, rec_stamp;
+	mmstr* record_path;
+	char line[128 + SHA_HEXSTR_LEN + 1];
+	char sha[SHA_HEXSTR_LEN + 1];
+	long long size, mtime_ns, ctime_ns;
+	unsigned long long ino;
+	ssize_t rsz;
+	int fd;
+
+	if (file_stamp_get(&stamp, mpkfile, NULL))
+		return 0;
+
+	fd = -1;
+	record_path = cache_record_path(mpkfile);
+	if (mm_check_access(record_path, F_OK) == 0)
+		fd = mm_open(record_path, O_RDONLY, 0);
+
+	mmstr_free(record_path);
+	if (fd < 0)
+		return 0;
+
+	rsz = mm_read(fd, line, sizeof(line) - 1);
+	mm_close(fd);
+	if (rsz <= 0)
+		return 0;
+
+	line[rsz] = '\0';
+	// Records in an older format do not match: the file is hashed again
+	if (sscanf(line, "%lld %lld %lld %llu %68s",
+	           &size, &mtime_ns, &ctime_ns, &ino, sha) != 5)
+		return 0;
+
+	rec_stamp = (struct file_stamp) {
+		.size = size,
+		.mtime_ns = mtime_ns,
+		.ctime_ns = ctime_ns,
+		.ino = ino,
+	};
+
+	return (file_stamp_equal(&stamp, &rec_stamp)
+	        && strcmp(sha, ref_sha) == 0);
+}
+
+
+/**
+ * check_cached_pkg() - check integrity of a package file in cache
+ * @ref_sha:    expected SHA-256 of the package file
+ * @mpkfile:    path of the package file in cache
+ *
+ * The package file is hashed only if it has changed since the last time it
+ * has been verified. The verification record is refreshed accordingly.
+ *
+ * Return: 0 if the cached file can be trusted, -1 otherwise
+ */
+static
+int check_cached_pkg(const mmstr* ref_sha, const mmstr* mpkfile)
+{
+	mmstr* record_path;
+
+	if (mm_check_access(mpkfile, F_OK) != 0)
+		return -1;
+
+	if (cache_record_match(mpkfile, ref_sha))
+		return 0;
+
+	if (check_file_pkg(ref_sha, NULL, mpkfile) == 0) {
+		cache_record_update(mpkfile, ref_sha);
+		return 0;
+	}
+
+	// Drop stale record
+	record_path = cache_record_path(mpkfile);
+	if (mm_check_access(record_path, F_OK) == 0)
+		mm_unlink(record_path);
+
+	mmstr_free(record_path);
+	return -1;
+}
+
+
+/**************************************************************************
+ *                                                                        *
+ *                          Shared package cache                          *
+ *                                                                        *
+ **************************************************************************/
+#define SHARED_CACHE_TMP_EXT ".tmp"
+
+/**
+ * shared_cache_path() - get path of package in the shared cache
+ * @shared_dir: folder of the shared package cache
+ * @sha:        SHA-256 of the package file
+ * @ext:        suffix to append to the path (may be NULL)
+ *
+ * Packages in the shared cache are keyed by the hash of their content, so
+ * that the same file is reused whatever the repository and prefix it comes
+ * from.
+ *
+ * Return: an allocated string to be freed with mmstr_free()
+ */
+static
+mmstr* shared_cache_path(const mmstr* shared_dir, const mmstr* sha,
+                         const char* ext)
+{
+	mmstr* path;
+	int len;
+
+	len = mmstrlen(shared_dir) + mmstrlen(sha) + 8;
+	len += ext ? strlen(ext) : 0;
+	path = mmstr_malloc(len);
+	mmstr_join_path(path, shared_dir, sha);
+	mmstrcat_cstr(path, ".mpk");
+	if (ext)
+		mmstrcat_cstr(path, ext);
+
+	return path;
+}
+
+
+/**
+ * link_or_copy() - populate a new file with the content of another
+ * @src:        path of the file to reuse
+ * @dst:        path of the file to create, must not exist
+ *
+ * @dst is created as hard link of @src if possible (same filesystem), as a
+ * copy otherwise. In both cases, creation fails if @dst already exists.
+ *
+ * Return: 0 in case of success, -1 otherwise with error state set
+ * accordingly.
+ */
+static
+int link_or_copy(const mmstr* src, const mmstr* dst)
+{
+	int prev_err_flags, rv;
+
+	prev_err_flags = mm_error_set_flags(MM_ERROR_SET, MM_ERROR_IGNORE);
+	rv = mm_link(src, dst);
+	mm_error_set_flags(prev_err_flags, MM_ERROR_IGNORE);
+
+	if (rv == 0 || mm_get_lasterror_number() == EEXIST)
+		return rv;
+
+	return copy_file_excl(src, dst, 0666);
+}
+
+
+/**
+ * shared_cache_import() - get package file from shared cache
+ * @ctx:        mmpack context
+ * @sha:        SHA-256 of the package file
+ * @mpkfile:    path of the package file in the cache of the prefix
+ *
+ * If the package is in the shared cache, it is copied (reflinked if the
+ * filesystem supports it) into @mpkfile, replacing it atomically. It is not
+ * hardlinked: the entry of the shared cache is owned by the user who has
+ * published it, who could modify it in place afterwards. The copy is always
+ * hashed before being recorded as verified: a corrupted entry of the shared
+ * cache is removed from it.
+ *
+ * Return: 0 if @mpkfile has been populated from the shared cache, -1
+ * otherwise.
+ */
+static
+int shared_cache_import(struct mmpack_ctx* ctx, const mmstr* sha,
+                        const mmstr* mpkfile)
+{
+	const mmstr* shared_dir = ctx->settings.shared_cache_dir;
+	mmstr * path, * tmp_path;
+	int rv = -1;
+
+	if (!shared_dir)
+		return -1;
+
+	path = shared_cache_path(shared_dir, sha, NULL);
+	if (mm_check_access(path, F_OK) != 0) {
+		mmstr_free(path);
+		return -1;
+	}
+
+	tmp_path = mmstr_malloc(mmstrlen(mpkfile) + 4);
+	mmstrcpy(tmp_path, mpkfile);
+	mmstrcat_cstr(tmp_path, SHARED_CACHE_TMP_EXT);
+	if (mm_check_access(tmp_path, F_OK) == 0)
+		mm_unlink(tmp_path);
+
+	if (copy_file_excl(path, tmp_path, 0666)
+	    || mm_rename(tmp_path, mpkfile))
+		goto exit;
+
+	if (check_file_pkg(sha, NULL, mpkfile)) {
+		mm_log_warn("Drop corrupted %s from shared cache", path);
+		mm_unlink(path);
+		mm_unlink(mpkfile);
+		goto exit;
+	}
+
+	cache_record_update(mpkfile, sha);
+	rv = 0;
+
+exit:
+	mmstr_free(tmp_path);
+	mmstr_free(path);
+	return rv;
+}
+
+
+/**
+ * shared_cache_lock_tmp() - create temporary file of a shared cache entry
+ * @tmp_path:   path of the temporary file
+ * @mpkfile:    verified package file to publish
+ *
+ * The temporary file is created exclusively: if it already exists, another
+ * process is publishing the same package. A temporary file left over by an
+ * interrupted process is removed if it is old enough.
+ *
+ * Return: 0 if @tmp_path has been created, -1 otherwise.
+ */
+static
+int shared_cache_lock_tmp(const mmstr* tmp_path, const mmstr* mpkfile)
+{
+	if (link_or_copy(mpkfile, tmp_path) == 0)
+		return 0;
+
+	if (mm_get_lasterror_number() != EEXIST
+	    || remove_stale_tmp(tmp_path))
+		return -1;
+
+	return link_or_copy(mpkfile, tmp_path);
+}
+
+
+/**
+ * shared_cache_store() - publish a verified package file in shared cache
+ * @ctx:        mmpack context
+ * @sha:        SHA-256 of the package file
+ * @mpkfile:    path of the verified package file in the cache of the prefix
+ *
+ * The file is first linked or copied to a temporary file in the shared
+ * cache, created exclusively, then renamed to its final name. Hence
+ * concurrent mmpack processes never see a partial entry. Failing to store
+ * the package is not an error: it will simply be downloaded again next time.
+ */
+static
+void shared_cache_store(struct mmpack_ctx* ctx, const mmstr* sha,
+                        const mmstr* mpkfile)
+{
+	const mmstr* shared_dir = ctx->settings.shared_cache_dir;
+	mmstr * path, * tmp_path;
+	int prev_err_flags;
+
+	if (!shared_dir)
+		return;
+
+	path = shared_cache_path(shared_dir, sha, NULL);
+	if (mm_check_access(path, F_OK) == 0) {
+		mmstr_free(path);
+		return;
+	}
+
+	prev_err_flags = mm_error_set_flags(MM_ERROR_SET, MM_ERROR_IGNORE);
+
+	tmp_path = shared_cache_path(shared_dir, sha, SHARED_CACHE_TMP_EXT);
+	if (mm_mkdir(shared_dir, 0777, MM_RECURSIVE)
+	    || shared_cache_lock_tmp(tmp_path, mpkfile)) {
+		mm_log_info("Cannot store %s in shared cache", mpkfile);
+	} else if (mm_rename(tmp_path, path)) {
+		mm_log_info("Cannot store %s in shared cache", mpkfile);
+		mm_unlink(tmp_path);
+	}
+
+	mm_error_set_flags(prev_err_flags, MM_ERROR_IGNORE);
+
+	mmstr_free(tmp_path);
+	mmstr_free(path);
+}
+
+
+/**************************************************************************
+ *                                                                        *
+ *                         Package cache eviction                         *
+ *                                                                        *
+ **************************************************************************/
+
+/**
+ * struct cache_entry - file of the cache candidate to eviction
+ * @path:       path of the file
+ * @size:       size of the file, including the one of its verification
+ *              record if it is a package file
+ * @last_use:   time of the last use of the file
+ */
+struct cache_entry {
+	mmstr* path;
+	size_t size;
+	time_t last_use;
+};
+
+
+static
+int cmp_cache_entry_last_use(const void* e1, const void* e2)
+{
+	const struct cache_entry* entry1 = e1;
+	const struct cache_entry* entry2 = e2;
+
+	if (entry1->last_use == entry2->last_use)
+		return 0;
+
+	return (entry1->last_use < entry2->last_use) ? -1 : 1;
+}
+
+
+/**
+ * is_pkg_record() - test whether a cached file is the record of a package
+ * @path:       path of the file in cache
+ *
+ * Return: 1 if @path is the verification record of a package file present
+ * in the cache, 0 otherwise (the file is then an orphaned record or another
+ * artifact).
+ */
+static
+int is_pkg_record(const mmstr* path)
+{
+	size_t len = mmstrlen(path);
+	size_t ext_len = sizeof(CACHE_RECORD_EXT) - 1;
+	mmstr* mpkfile;
+	int rv;
+
+	if (len <= ext_len
+	    || strcmp(path + len - ext_len, CACHE_RECORD_EXT) != 0)
+		return 0;
+
+	mpkfile = mmstr_malloc_copy(path, len - ext_len);
+	rv = (mm_check_access(mpkfile, F_OK) == 0);
+	mmstr_free(mpkfile);
+
+	return rv;
+}
+
+
+/**
+ * cache_entry_init() - initialize eviction candidate from a cached file
+ * @entry:      cache entry to initialize
+ * @path:       path of the file in cache
+ * @st:         file attributes of the file
+ *
+ * The verification record of a package file is refreshed each time the file
+ * is used. Its modification time is thus the time of the last use and its
+ * size is accounted along the package file. Any other file (partial
+ * download, temporary file, orphaned record...) is accounted on its own and
+ * its modification time is used as time of last use.
+ */
+static
+void cache_entry_init(struct cache_entry* entry, const mmstr* path,
+                      const struct mm_stat* st)
+{
+	struct mm_stat record_st;
+	mmstr* record_path;
+
+	*entry = (struct cache_entry) {
+		.path = mmstrdup(path),
+		.size = st->size,
+		.last_use = st->mtime,
+	};
+
+	record_path = cache_record_path(path);
+	if (mm_check_access(record_path, F_OK) == 0
+	    && mm_stat(record_path, &record_st, 0) == 0) {
+		entry->size += record_st.size;
+		if (record_st.mtime > entry->last_use)
+			entry->last_use = record_st.mtime;
+	}
+
+	mmstr_free(record_path);
+}
+
+
+/**
+ * evict_cache_entry() - remove file and its record from cache
+ * @entry:      cache entry to remove
+ */
+static
+void evict_cache_entry(const struct cache_entry* entry)
+{
+	mmstr* record_path;
+
+	mm_log_info("Evict %s from package cache", entry->path);
+	mm_unlink(entry->path);
+
+	record_path = cache_record_path(entry->path);
+	if (mm_check_access(record_path, F_OK) == 0)
+		mm_unlink(record_path);
+
+	mmstr_free(record_path);
+}
+
+
+/**
+ * pkg_cache_evict() - enforce the size budget of the package cache
+ * @ctx:        mmpack context
+ * @act_stk:    action stack that has just been applied
+ *
+ * If the files in cache exceed the pkg-cache-max-size setting, the least
+ * recently used ones are removed until the budget is met. All the files of
+ * the cache are accounted, not only the package files: leftovers of
+ * interrupted transfers and orphaned records are evicted too. The package
+ * files referenced by @act_stk are never removed.
+ *
+ * Return: 0 in case of success, -1 otherwise with error state set
+ * accordingly.
+ */
+static
+int pkg_cache_evict(struct mmpack_ctx* ctx, struct action_stack* act_stk)
+{
+	size_t budget = ctx->settings.pkg_cache_max_size;
+	const mmstr* cachedir = mmpack_ctx_get_pkgcachedir(ctx);
+	const struct mm_dirent* dirent;
+	struct cache_entry entry;
+	struct cache_entry* entries;
+	struct mm_stat st;
+	struct strset keep;
+	struct buffer buff;
+	MM_DIR* dir;
+	mmstr * path, * name;
+	size_t total, num, i;
+
+	if (budget == 0)
+		return 0;
+
+	dir = mm_opendir(cachedir);
+	if (!dir)
+		return -1;
+
+	strset_init(&keep, STRSET_FOREIGN_STRINGS);
+	for (i = 0; i < (size_t)act_stk->index; i++) {
+		if (act_stk->actions[i].pathname)
+			strset_add(&keep, act_stk->actions[i].pathname);
+	}
+
+	buffer_init(&buff);
+	total = 0;
+	path = name = NULL;
+	while ((dirent = mm_readdir(dir, NULL)) != NULL) {
+		if (dirent->type != MM_DT_REG)
+			continue;
+
+		name = mmstrcpy_cstr_realloc(name, dirent->name);
+		path = mmstr_realloc(path, mmstrlen(cachedir)
+		                     + mmstrlen(name) + 1);
+		mmstr_join_path(path, cachedir, name);
+
+		// Records are accounted along their package file
+		if (is_pkg_record(path) || mm_stat(path, &st, 0))
+			continue;
+
+		cache_entry_init(&entry, path, &st);
+		total += entry.size;
+		if (strset_contains(&keep, path)) {
+			mmstr_free(entry.path);
+			continue;
+		}
+
+		buffer_push(&buff, &entry, sizeof(entry));
+	}
+
+	mm_closedir(dir);
+	mmstr_free(name);
+	mmstr_free(path);
+
+	// Remove least recently used files first
+	entries = buff.base;
+	num = buff.size / sizeof(*entries);
+	qsort(entries, num, sizeof(*entries), cmp_cache_entry_last_use);
+	for (i = 0; i < num; i++) {
+		if (total <= budget)
+			break;
+
+		evict_cache_entry(&entries[i]);
+		total -= entries[i].size;
+	}
+
+	for (i = 0; i < num; i++)
+		mmstr_free(entries[i].path);
+
+	buffer_deinit(&buff);
+	strset_deinit(&keep);
+	return 0;
+}
+
+
+/**
+ * find_delta_base() - find a package file usable as base of a delta
+ * @ctx:        mmpack context
+ * @from:       repository entry providing the delta
+ *
+ * The package file whose hash is @from->delta_base is looked up in the
+ * shared cache, then among the package files of the prefix cache whose hash
+ * has been recorded. If the previous version has itself been rebuilt from a
+ * delta, its uncompressed archive, recorded in the prefix cache with the hash
+ * @from->delta_base_tar, is used instead.
+ *
+ * Return: allocated path of the package file or archive if found, NULL
+ * otherwise
+ */
+static
+mmstr* find_delta_base(struct mmpack_ctx* ctx, const struct from_repo* from)
+{
+	const mmstr* cachedir = mmpack_ctx_get_pkgcachedir(ctx);
+	const mmstr* shared_dir = ctx->settings.shared_cache_dir;
+	static const char rebuilt_ext[] = ".mpk" REBUILT_PKG_EXT;
+	const int rebuilt_ext_len = sizeof(rebuilt_ext) - 1;
+	const struct mm_dirent* dirent;
+	const mmstr* base_sha;
+	MM_DIR* dir;
+	mmstr * path, * name;
+	int len, found;
+
+	if (shared_dir) {
+		path = shared_cache_path(shared_dir, from->delta_base, NULL);
+		if (mm_check_access(path, F_OK) == 0)
+			return path;
+
+		mmstr_free(path);
+	}
+
+	dir = mm_opendir(cachedir);
+	if (!dir)
+		return NULL;
+
+	found = 0;
+	path = name = NULL;
+	while (!found && (dirent = mm_readdir(dir, NULL)) != NULL) {
+		len = strlen(dirent->name);
+		if (dirent->type != MM_DT_REG)
+			continue;
+
+		if (len > 4 && strcmp(dirent->name + len - 4, ".mpk") == 0)
+			base_sha = from->delta_base;
+		else if (len > rebuilt_ext_len
+		         && strcmp(dirent->name + len - rebuilt_ext_len,
+		                   rebuilt_ext) == 0)
+			base_sha = from->delta_base_tar;
+		else
+			continue;
+
+		if (!base_sha)
+			continue;
+
+		name = mmstrcpy_cstr_realloc(name, dirent->name);
+		path = mmstr_realloc(path, mmstrlen(cachedir) + len + 1);
+		mmstr_join_path(path, cachedir, name);
+		found = cache_record_match(path, base_sha);
+	}
+
+	mm_closedir(dir);
+	mmstr_free(name);
+	if (!found) {
+		mmstr_free(path);
+		return NULL;
+	}
+
+	return path;
+}
+
+
+/**
+ * struct pkg_download - state of the download of a package
+ * @pkg:        package being downloaded
+ * @pathname:   path where the package is to be written
+ * @from:       repository currently used to download @pkg
+ * @ranked:     repositories providing @pkg, fastest expected first
+ * @num_ranked: number of element in @ranked
+ * @curr:       index in @ranked of @from
+ * @stats:      mirror stats updated with the transfers of the package
+ * @delta_base: package file from which @pkg is rebuilt with the delta
+ *              provided by @from. NULL if the package file is downloaded.
+ * @delta_path: path where the delta is downloaded
+ * @rebuilt_path: path where the archive is rebuilt from the delta (see
+ *              rebuilt_pkg_path())
+ */
+struct pkg_download {
+	const struct mmpkg* pkg;
+	const mmstr* pathname;
+	const struct from_repo* from;
+	const struct from_repo** ranked;
+	int num_ranked;
+	int curr;
+	struct mirror_stats* stats;
+	mmstr* delta_base;
+	mmstr* delta_path;
+	mmstr* rebuilt_path;
+};
+
+
+/**
+ * pkg_download_init() - initialize download of a package
+ * @dl:         package download to initialize
+ * @pkg:        package to download
+ * @pathname:   path where the package is to be written
+ * @stats:      stats used to rank the repositories providing @pkg
+ */
+static
+void pkg_download_init(struct pkg_download* dl, const struct mmpkg* pkg,
+                       const mmstr* pathname, struct mirror_stats* stats)
+{
+	*dl = (struct pkg_download) {
+		.pkg = pkg,
+		.pathname = pathname,
+		.stats = stats,
+	};
+
+	dl->ranked = mirror_stats_rank(stats, pkg->from_repo, &dl->num_ranked);
+	if (dl->num_ranked)
+		dl->from = dl->ranked[0];
+}
 
-		elt = elt->next;
-	}
 
-	return 0;
+static
+void pkg_download_deinit(struct pkg_download* dl)
+{
+	free(dl->ranked);
+	dl->ranked = NULL;
+	mmstr_free(dl->delta_base);
+	dl->delta_base = NULL;
+	mmstr_free(dl->delta_path);
+	dl->delta_path = NULL;
+	mmstr_free(dl->rebuilt_path);
+	dl->rebuilt_path = NULL;
 }
 
 
-/**************************************************************************
- *                                                                        *
- *                            Packages retrieval                          *
- *                                                                        *
- **************************************************************************/
 /**
- * check_file_pkg() - Check integrity of given file
- * @ref_sha: reference file sha256 to compare against
- * @parent: prefix directory to prepend to @filename to get the
- *          final path of the file to hash. This may be NULL
- * @filename: path of file whose hash must be computed
+ * pkg_download_use_delta() - rebuild package from a delta if possible
+ * @dl:         initialized package download
+ * @ctx:        mmpack context
  *
- * Return: 0 if no issue has been found, -1 otherwise
+ * The repositories providing the package are considered in the order of
+ * @dl->ranked. The first one providing a delta computed from a package file
+ * available on the host (typically the version being upgraded) is selected:
+ * the delta is downloaded instead of the package file. The archive rebuilt
+ * from it is written at @dl->rebuilt_path, not at @dl->pathname.
+ *
+ * Return: 1 if a delta is going to be used, 0 otherwise.
  */
 static
-int check_file_pkg(const mmstr * ref_sha, const mmstr * parent,
-                   const mmstr * filename)
+int pkg_download_use_delta(struct pkg_download* dl, struct mmpack_ctx* ctx)
 {
-	int follow;
-	mmstr* sha = mmstr_alloca(SHA_HEXSTR_LEN);
+	const struct from_repo* from;
+	int i;
 
-	// If reference hash contains type prefix (ie its length is
-	// SHA_HEXSTR_LEN), symlink must not be followed
-	follow = 0;
-	if (mmstrlen(ref_sha) != SHA_HEXSTR_LEN)
-		follow = 1;
+	if (!pkg_delta_supported())
+		return 0;
 
-	if (sha_compute(sha, filename, parent, follow))
-		return -1;
+	for (i = 0; i < dl->num_ranked; i++) {
+		from = dl->ranked[i];
+		if (!from->repo || !from->delta_filename
+		    || !from->delta_sha256 || !from->delta_base
+		    || !from->delta_target)
+			continue;
 
-	if (!mmstrequal(sha, ref_sha)) {
-		mm_raise_error(EBADMSG, "bad SHA-256 detected %s", filename);
-		return -1;
+		dl->delta_base = find_delta_base(ctx, from);
+		if (!dl->delta_base)
+			continue;
+
+		dl->curr = i;
+		dl->from = from;
+		dl->delta_path = mmstr_malloc(mmstrlen(dl->pathname) + 6);
+		mmstrcpy(dl->delta_path, dl->pathname);
+		mmstrcat_cstr(dl->delta_path, ".delta");
+		dl->rebuilt_path = rebuilt_pkg_path(dl->pathname);
+		return 1;
 	}
 
 	return 0;
@@ -559,102 +2865,122 @@ int check_file_pkg(const mmstr * ref_sha, const mmstr * parent,
 
 
 /**
- * check_installed_pkg() - check integrity of installed package
- * @ctx:        mmpack context. If NULL, current dir is assumed to be the root
- *              the mmpack prefix where to search the installed files.
- * @pkg:        installed package whose integrity must be checked
+ * pkg_download_fallback() - download package file instead of delta
+ * @dl:         package download whose delta cannot be used
  *
- * Return: 0 if no issue has been found, -1 otherwise
+ * The package file is going to be downloaded from the fastest expected
+ * repository.
  */
-LOCAL_SYMBOL
-int check_installed_pkg(const struct mmpack_ctx* ctx, const struct mmpkg* pkg)
+static
+void pkg_download_fallback(struct pkg_download* dl)
 {
-	mmstr * filename;
-	mmstr * ref_sha;
-	mmstr * sumsha_path;
-	char * line, * eol;
-	size_t line_len, filename_len, mapsize;
-	void * map;
-	int rv;
-
-	sumsha_path = sha256sums_path(pkg);
-	rv = map_file_in_prefix(ctx->prefix, sumsha_path, &map, &mapsize);
-	mmstr_free(sumsha_path);
-	if (rv == -1)
-		return -1;
-
-	line = map;
-	filename = ref_sha = NULL;
-	while ((eol = strchr(line, '\n')) != NULL) {
-		line_len = eol - line;
-
-		if (line_len < SHA_HEXSTR_LEN) {
-			mm_raise_error(EBADMSG,
-			               "Error while parsing SHA-256 file");
-			break;
-		}
-
-		ref_sha = mmstr_copy_realloc(ref_sha,
-		                             &line[line_len - SHA_HEXSTR_LEN],
-		                             SHA_HEXSTR_LEN);
+	mm_log_warn("Cannot rebuild %s from delta (%s), downloading it",
+	            dl->pkg->name, mm_get_lasterror_desc());
+
+	if (mm_check_access(dl->delta_path, F_OK) == 0)
+		mm_unlink(dl->delta_path);
+
+	mmstr_free(dl->delta_base);
+	dl->delta_base = NULL;
+	mmstr_free(dl->rebuilt_path);
+	dl->rebuilt_path = NULL;
+	dl->curr = 0;
+	dl->from = dl->num_ranked ? dl->ranked[0] : NULL;
+}
 
-		/* 2 is for len(': ') */
-		if (line_len <= SHA_HEXSTR_LEN + 2) {
-			mm_raise_error(EBADMSG,
-			               "Error while parsing SHA-256 file");
-			break;;
-		}
 
-		filename_len = line_len - SHA_HEXSTR_LEN - 2;
-		filename = mmstr_copy_realloc(filename, line, filename_len);
-		if (is_mmpack_metadata(filename))
-			goto check_continue;
+/**
+ * pkg_download_queue() - queue package download from current repository
+ * @batch:      download batch in which the transfer must be queued
+ * @dl:         package download whose @dl->from indicates the repository
+ *
+ * Return: 0 if the download has been queued, -1 if @dl->from does not
+ * refer to a repository.
+ */
+static
+int pkg_download_queue(struct download_batch* batch, struct pkg_download* dl)
+{
+	const struct from_repo* from = dl->from;
 
-		if (check_file_pkg(ref_sha, ctx->prefix, filename) != 0)
-			break;
+	if (!from || !from->repo)
+		return -1;
 
-check_continue:
-		line = eol + 1;
+	if (dl->delta_base) {
+		download_batch_add(batch, from->repo->url,
+		                   from->delta_filename, NULL, dl->delta_path,
+		                   from->delta_sha256, from->delta_size, dl);
+		return 0;
 	}
 
-	mmstr_free(filename);
-	mmstr_free(ref_sha);
-	mm_unmap(map);
-
-	return (eol == NULL) ? 0 : -1;
+	download_batch_add(batch, from->repo->url, from->filename,
+	                   NULL, dl->pathname, from->sha256, from->size, dl);
+	return 0;
 }
 
 
 /**
- * action_set_pathname_into_dir() - construct path of cached package file
- * @act:        action struct whose pathname field is to be set
- * @from_repo:  repository from which the package was downloaded
- * @dir:        folder in which the cached downloaded packages must reside
+ * pkg_download_done() - handle the end of a package download transfer
+ * @batch:      download batch of the package transfers
+ * @job:        terminated transfer
+ * @status:     0 if the transfer has succeeded, -1 otherwise
  *
- * This function set @act->pathname to point to a file whose basename is
- * the name of the binary package file associed with @act->pkg and whose
- * folder is specified by @dir. This is typically used to set the name of
- * the downloaded file in the local folder of cached packages (specified by
- * @dir).
+ * The integrity of the downloaded package (or delta) has already been checked
+ * by the download batch while the data was received. The outcome of the
+ * transfer is accounted in the stats of the repository. If a delta has been
+ * downloaded, it is applied to rebuild the package archive. If the transfer
+ * has failed (or the data is corrupted), the download is retried from the
+ * next repository providing the package if any. If the delta cannot be
+ * downloaded or applied, the package file is downloaded instead.
+ *
+ * Return: 0 if package has been successfully downloaded or if the download
+ * is retried, -1 otherwise.
  */
 static
-void action_set_pathname_into_dir(struct action* act, const mmstr* dir)
+int pkg_download_done(struct download_batch* batch,
+                      struct download_job* job, int status)
 {
-	mmstr* pkgbase;
-	int len;
-	struct from_repo * from_repo = act->pkg->from_repo;
+	struct pkg_download* dl = job->data;
+	const struct mmpkg* pkg = dl->pkg;
+
+	mirror_stats_update(dl->stats, dl->from->repo->url,
+	                    &job->metrics, status);
+
+	if (dl->delta_base) {
+		if (status == 0
+		    && pkg_delta_apply(dl->delta_base, dl->delta_path,
+		                       dl->rebuilt_path,
+		                       dl->from->delta_target) == 0) {
+			mm_unlink(dl->delta_path);
+			info("Downloading %s (%s)... OK (delta)\n",
+			     pkg->name, pkg->version);
+			return 0;
+		}
 
-	pkgbase = mmstr_malloca(mmstrlen(from_repo->filename));
+		pkg_download_fallback(dl);
+		if (pkg_download_queue(batch, dl) == 0)
+			return 0;
 
-	// Get base filename of downloaded package
-	mmstr_basename(pkgbase, from_repo->filename);
+		error("Downloading %s (%s)... Failed!\n",
+		      pkg->name, pkg->version);
+		return -1;
+	}
 
-	// Store the joined cachedir and base filename in act->pathname
-	len = mmstrlen(pkgbase) + mmstrlen(dir) + 1;
-	act->pathname = mmstr_malloc(len);
-	mmstr_join_path(act->pathname, dir, pkgbase);
+	if (status == 0) {
+		info("Downloading %s (%s)... OK\n", pkg->name, pkg->version);
+		return 0;
+	}
 
-	mmstr_freea(pkgbase);
+	/* Retry from the next repository providing the package */
+	dl->curr++;
+	dl->from = NULL;
+	if (dl->curr < dl->num_ranked)
+		dl->from = dl->ranked[dl->curr];
+
+	if (pkg_download_queue(batch, dl) == 0)
+		return 0;
+
+	error("Downloading %s (%s)... Failed!\n", pkg->name, pkg->version);
+	return -1;
 }
 
 
@@ -665,9 +2991,11 @@ void action_set_pathname_into_dir(struct action* act, const mmstr* dir)
  * @pathname: path where the package is to be written
  *
  * This function will:
- * - find out the correct repository url
+ * - reuse the package file from the shared cache if it is there
+ * - otherwise find out the repository expected to be the fastest
  * - download the package
  * - check the package's integrity
+ * - publish the package file in the shared cache
  *
  * This function does print info and error messages to the console.
  *
@@ -678,32 +3006,39 @@ LOCAL_SYMBOL
 int download_package(struct mmpack_ctx * ctx, struct mmpkg const * pkg,
                      mmstr const * pathname)
 {
-	struct from_repo * from;
-
-	info("Downloading %s (%s)... ", pkg->name, pkg->version);
+	struct download_batch batch;
+	struct mirror_stats stats;
+	struct pkg_download dl;
+	int rv;
 
-	for (from = pkg->from_repo; from != NULL; from = from->next) {
-		if (!from->repo)
-			return -1;
+	// Reuse package downloaded by another prefix if possible
+	if (pkg->from_repo
+	    && shared_cache_import(ctx, pkg->from_repo->sha256, pathname) == 0) {
+		info("Downloading %s (%s)... OK (shared cache)\n",
+		     pkg->name, pkg->version);
+		return 0;
+	}
 
-		/* Download package from repo */
-		if (download_from_repo(ctx, from->repo->url,
-		                       from->filename, NULL, pathname)) {
-			continue;
-		}
+	mirror_stats_init(&stats);
+	mirror_stats_load(&stats, ctx->prefix);
+	pkg_download_init(&dl, pkg, pathname, &stats);
+	download_batch_init(&batch, ctx, pkg_download_done);
 
-		/* verify integrity of what has been downloaded */
-		if (check_file_pkg(from->sha256, NULL, pathname)) {
-			error("Integrity check failed!\n");
-			return -1;
-		}
+	rv = pkg_download_queue(&batch, &dl);
+	if (rv == 0)
+		rv = download_batch_perform(&batch);
+	else
+		error("Downloading %s (%s)... Failed!\n",
+		      pkg->name, pkg->version);
 
-		info("OK\n");
-		return 0;
-	}
+	if (rv == 0)
+		shared_cache_store(ctx, dl.from->sha256, pathname);
 
-	error("Failed!\n");
-	return -1;
+	download_batch_deinit(&batch);
+	pkg_download_deinit(&dl);
+	mirror_stats_save(&stats, ctx->prefix);
+	mirror_stats_deinit(&stats);
+	return rv;
 }
 
 
@@ -712,6 +3047,19 @@ int download_package(struct mmpack_ctx * ctx, struct mmpkg const * pkg,
  * @ctx:       initialized mmpack context
  * @act_stk:   action stack to be applied
  *
+ * The packages missing from the cache are downloaded concurrently, each from
+ * the repository expected to be the fastest according to the mirror stats
+ * of the prefix, unless
+ * streaming-install setting is enabled: in such a case, they will be
+ * downloaded while being extracted. The packages found in cache are hashed
+ * only if they have changed since they have been verified. Upgraded packages
+ * are rebuilt from a delta if a repository provides one computed from a
+ * package file (or an archive previously rebuilt from delta) present on the
+ * host: the delta is then downloaded along the other packages from the first
+ * repository providing it in the ranked order. The rebuilt archive is kept in
+ * cache under its own name (see rebuilt_pkg_path()) and the action is
+ * updated to install from it.
+ *
  * NOTE: this function assumes current directory is the prefix path
  *
  * Return: 0 in case of success, -1 otherwise
@@ -720,12 +3068,25 @@ static
 int fetch_pkgs(struct mmpack_ctx* ctx, struct action_stack* act_stk)
 {
 	mmstr* mpkfile = NULL;
+	mmstr* rebuilt;
 	const struct mmpkg* pkg;
 	struct from_repo * from;
 	struct action* act;
+	struct action** dl_acts;
+	struct pkg_download* dls;
+	struct download_batch batch;
+	struct mirror_stats stats;
 	const mmstr* cachedir = mmpack_ctx_get_pkgcachedir(ctx);
-	int i;
+	int i, rv, num_dl;
+
+	num_dl = 0;
+	dls = xx_malloc(act_stk->index * sizeof(*dls));
+	dl_acts = xx_malloc(act_stk->index * sizeof(*dl_acts));
+	mirror_stats_init(&stats);
+	mirror_stats_load(&stats, ctx->prefix);
+	download_batch_init(&batch, ctx, pkg_download_done);
 
+	rv = -1;
 	for (i = 0; i < act_stk->index; i++) {
 		act = &act_stk->actions[i];
 		pkg = act->pkg;
@@ -734,7 +3095,7 @@ int fetch_pkgs(struct mmpack_ctx* ctx, struct action_stack* act_stk)
 
 		from = act->pkg->from_repo;
 		if (!from)
-			return -1;
+			goto exit;
 
 		if (!from->repo) {
 			act->pathname = mmstrdup(from->filename);
@@ -749,19 +3110,291 @@ int fetch_pkgs(struct mmpack_ctx* ctx, struct action_stack* act_stk)
 		action_set_pathname_into_dir(act, cachedir);
 		mpkfile = act->pathname;
 
-		// Skip if there is a valid package already downloaded
-		if (mm_check_access(mpkfile, F_OK) == 0
-		    && check_file_pkg(from->sha256, NULL, mpkfile) == 0) {
+		// Skip if the files of the package are already on the host
+		if (pkg_in_store(ctx->settings.object_store_dir, pkg)) {
+			mm_log_info("Going to install %s (%s) from object store",
+			            pkg->name, pkg->version);
+			continue;
+		}
+
+		// Skip if there is a valid package already downloaded. The
+		// record is refreshed to keep track of the last use of the file
+		if (check_cached_pkg(from->sha256, mpkfile) == 0) {
+			cache_record_update(mpkfile, from->sha256);
 			mm_log_info("Going to install %s (%s) from cache",
 			            pkg->name, pkg->version);
 			continue;
 		}
 
-		if (download_package(ctx, pkg, mpkfile) != 0)
-			return -1;
+		// Skip if the archive has already been rebuilt from delta
+		if (from->delta_target) {
+			rebuilt = rebuilt_pkg_path(mpkfile);
+			if (check_cached_pkg(from->delta_target, rebuilt) == 0) {
+				cache_record_update(rebuilt,
+				                    from->delta_target);
+				mmstr_free(act->pathname);
+				act->pathname = rebuilt;
+				mm_log_info("Going to install %s (%s) from "
+				            "cache (rebuilt from delta)",
+				            pkg->name, pkg->version);
+				continue;
+			}
+
+			mmstr_free(rebuilt);
+		}
+
+		// Reuse package downloaded by another prefix if possible
+		if (shared_cache_import(ctx, from->sha256, mpkfile) == 0) {
+			mm_log_info("Going to install %s (%s) from shared cache",
+			            pkg->name, pkg->version);
+			continue;
+		}
+
+		// Rebuild upgraded package from a delta if possible
+		pkg_download_init(&dls[num_dl], pkg, mpkfile, &stats);
+		if (act->action == UPGRADE_PKG
+		    && pkg_download_use_delta(&dls[num_dl], ctx)) {
+			mm_log_info("Going to install %s (%s) from delta",
+			            pkg->name, pkg->version);
+		} else if (ctx->settings.streaming_install) {
+			// Package will be fetched while being installed
+			pkg_download_deinit(&dls[num_dl]);
+			if (mm_check_access(mpkfile, F_OK) == 0)
+				mm_unlink(mpkfile);
+
+			continue;
+		}
+
+		dl_acts[num_dl] = act;
+		pkg_download_queue(&batch, &dls[num_dl++]);
 	}
 
-	return 0;
+	rv = download_batch_perform(&batch);
+
+	// Downloaded files have been hashed while being received: record
+	// them as verified so that they are not hashed again next time. The
+	// archives rebuilt from delta are not package files: they are
+	// recorded with their own hash so that they can be reused, but they
+	// are not shared.
+	if (rv == 0) {
+		for (i = 0; i < num_dl; i++) {
+			if (dls[i].delta_base) {
+				act = dl_acts[i];
+				cache_record_update(dls[i].rebuilt_path,
+				                    dls[i].from->delta_target);
+				dls[i].pathname = NULL;
+				mmstr_free(act->pathname);
+				act->pathname = dls[i].rebuilt_path;
+				dls[i].rebuilt_path = NULL;
+				continue;
+			}
+
+			cache_record_update(dls[i].pathname,
+			                    dls[i].from->sha256);
+			shared_cache_store(ctx, dls[i].from->sha256,
+			                   dls[i].pathname);
+		}
+	}
+
+exit:
+	download_batch_deinit(&batch);
+	for (i = 0; i < num_dl; i++)
+		pkg_download_deinit(&dls[i]);
+
+	free(dls);
+	free(dl_acts);
+	mirror_stats_save(&stats, ctx->prefix);
+	mirror_stats_deinit(&stats);
+	return rv;
+}
+
+
+static
+la_ssize_t stream_archive_read(struct archive * a, void* data,
+                               const void** buf)
+{
+	ssize_t rsz;
+
+	rsz = download_stream_read(data, buf);
+	if (rsz < 0)
+		archive_set_error(a, mm_get_lasterror_number(), "%s",
+		                  mm_get_lasterror_desc());
+
+	return rsz;
+}
+
+
+/**
+ * pkg_open_stream_archive() - open archive stream on a package being fetched
+ * @stream:     download stream of the package file
+ *
+ * Return: archive stream ready to be read in case of success, NULL
+ * otherwise with error state set accordingly.
+ */
+static
+struct archive* pkg_open_stream_archive(struct download_stream* stream)
+{
+	struct archive * a;
+
+	a = archive_read_new();
+	archive_read_support_filter_all(a);
+	archive_read_support_format_all(a);
+
+	if (archive_read_open(a, stream, NULL, stream_archive_read, NULL)) {
+		mm_raise_error(archive_errno(a), "opening mpk %s failed: %s",
+		               stream->url, archive_error_string(a));
+		archive_read_free(a);
+		return NULL;
+	}
+
+	return a;
+}
+
+
+/**
+ * pkg_unpack_streamed() - extract package while it is being downloaded
+ * @ctx:        mmpack context
+ * @pkg:        package to extract
+ * @mpkfile:    path where the package file is written for later reuse
+ * @files:      files to be removed (may be NULL)
+ * @manifest:   manifest in which the extracted files are added to the object
+ *              store (may be NULL)
+ *
+ * The package is downloaded from the repository expected to be the fastest
+ * among those providing it. If this fails, the next repositories are tried.
+ * Since no file is committed before the package is verified, a failed
+ * attempt does not alter the prefix. As for the packages downloaded
+ * beforehand, the statistics of the mirrors are updated with each attempt
+ * and the package file is recorded as verified on success.
+ *
+ * Return: 0 on success, a negative value otherwise.
+ */
+static
+int pkg_unpack_streamed(struct mmpack_ctx* ctx, const struct mmpkg* pkg,
+                        const mmstr* mpkfile, struct strset* files,
+                        struct objstore_manifest* manifest)
+{
+	const struct from_repo* from;
+	const struct from_repo** ranked;
+	struct mirror_stats stats;
+	struct download_stream stream;
+	struct archive * a;
+	int i, num_ranked, rv = -1;
+
+	mirror_stats_init(&stats);
+	mirror_stats_load(&stats, ctx->prefix);
+	ranked = mirror_stats_rank(&stats, pkg->from_repo, &num_ranked);
+
+	for (i = 0; i < num_ranked; i++) {
+		from = ranked[i];
+		mm_log_info("Streaming %s from %s", from->filename,
+		            from->repo->url);
+
+		rv = -1;
+		if (manifest)
+			objstore_manifest_reset(manifest);
+
+		if (download_stream_open(&stream, ctx, from->repo->url,
+		                         from->filename, mpkfile,
+		                         from->sha256) == 0) {
+			a = pkg_open_stream_archive(&stream);
+			if (a)
+				rv = pkg_unpack_files(a, stream.url, files,
+				                      &stream, manifest, NULL);
+		}
+
+		download_stream_close(&stream);
+		if (stream.done)
+			mirror_stats_update(&stats, from->repo->url,
+			                    &stream.metrics,
+			                    stream.verified ? 0 : -1);
+
+		if (rv != -1)
+			break;
+	}
+
+	if (rv == 0) {
+		cache_record_update(mpkfile, from->sha256);
+		shared_cache_store(ctx, from->sha256, mpkfile);
+	}
+
+	mirror_stats_save(&stats, ctx->prefix);
+	mirror_stats_deinit(&stats);
+	free(ranked);
+	return rv;
+}
+
+
+/**
+ * pkg_unpack() - extract files of package from cache or while downloading
+ * @ctx:        mmpack context
+ * @pkg:        package to extract
+ * @oldpkg:     version of the package being replaced (NULL if installed)
+ * @mpkfile:    path of the package file
+ * @files:      files to be removed (may be NULL)
+ *
+ * If the object store is enabled and contains the files of the package,
+ * they are taken from there. Otherwise, the package file is extracted and,
+ * if the object store is enabled, its files are added to the store.
+ *
+ * If the package file is not in the cache (this happens only if the
+ * streaming-install setting is enabled or if the package was expected to be
+ * installed from the object store), the package is extracted while being
+ * downloaded.
+ *
+ * When upgrading from @oldpkg and the package file is available, the files
+ * whose hash is the same in both versions are not extracted again.
+ *
+ * Return: 0 on success, a negative value otherwise.
+ */
+static
+int pkg_unpack(struct mmpack_ctx* ctx, const struct mmpkg* pkg,
+               const struct mmpkg* oldpkg, const mmstr* mpkfile,
+               struct strset* files)
+{
+	const mmstr* store = ctx->settings.object_store_dir;
+	struct objstore_manifest manifest;
+	struct objstore_manifest* store_manifest = NULL;
+	struct indextable unchanged;
+	struct indextable* unchanged_files = NULL;
+	struct archive * a;
+	int rv;
+
+	if (objstore_has_pkg(store, pkg->sumsha)) {
+		if (pkg_unpack_from_store(store, pkg, files) == 0)
+			return 0;
+
+		mm_log_warn("Cannot install %s from object store (%s),"
+		            " extracting package file instead",
+		            pkg->name, mm_get_lasterror_desc());
+	} else if (store && pkg->sumsha) {
+		objstore_manifest_init(&manifest, store, pkg->sumsha);
+		store_manifest = &manifest;
+	}
+
+	if (mm_check_access(mpkfile, F_OK) != 0) {
+		rv = pkg_unpack_streamed(ctx, pkg, mpkfile, files,
+		                         store_manifest);
+	} else {
+		indextable_init(&unchanged, -1, -1);
+		if (oldpkg
+		    && pkg_get_unchanged_files(oldpkg, pkg, mpkfile,
+		                               &unchanged) == 0)
+			unchanged_files = &unchanged;
+
+		rv = -1;
+		a = pkg_open_archive(mpkfile, 1);
+		if (a)
+			rv = pkg_unpack_files(a, mpkfile, files, NULL,
+			                      store_manifest, unchanged_files);
+
+		unchanged_files_deinit(&unchanged);
+	}
+
+	if (store_manifest)
+		objstore_manifest_deinit(store_manifest);
+
+	return rv;
 }
 
 
@@ -794,12 +3427,13 @@ int install_package(struct mmpack_ctx* ctx,
 
 	mm_log_info("\tsumsha: %s", pkg->sumsha);
 
-	rv = pkg_unpack_files(mpkfile, NULL);
+	rv = pkg_unpack(ctx, pkg, NULL, mpkfile, NULL);
 	if (rv) {
 		error("Failed!\n");
 		return -1;
 	}
 
+	pkg_record_stamps(ctx, pkg);
 	install_state_add_pkg(&ctx->installed, pkg);
 	info("OK\n");
 	return rv;
@@ -822,11 +3456,11 @@ static
 int remove_package(struct mmpack_ctx* ctx, const struct mmpkg* pkg)
 {
 	int rv = 0;
-	struct strlist files;
+	struct strset files;
 
 	info("Removing package %s ... ", pkg->name);
 
-	strlist_init(&files);
+	strset_init(&files, STRSET_HANDLE_STRINGS_MEM);
 
 	if (pkg_list_rm_files(pkg, &files)
 	    || rm_files_from_list(&files)) {
@@ -837,7 +3471,7 @@ int remove_package(struct mmpack_ctx* ctx, const struct mmpkg* pkg)
 	install_state_rm_pkgname(&ctx->installed, pkg->name);
 
 exit:
-	strlist_deinit(&files);
+	strset_deinit(&files);
 
 	if (rv)
 		error("Failed!\n");
@@ -867,7 +3501,7 @@ int upgrade_package(struct mmpack_ctx* ctx, const struct mmpkg* pkg,
                     const struct mmpkg* oldpkg, const mmstr* mpkfile)
 {
 	int rv = 0;
-	struct strlist files;
+	struct strset files;
 	const char* operation;
 
 	if (pkg_version_compare(pkg->version, oldpkg->version) < 0)
@@ -878,15 +3512,19 @@ int upgrade_package(struct mmpack_ctx* ctx, const struct mmpkg* pkg,
 	info("%s package %s (%s) over (%s) ... ", operation,
 	     pkg->name, pkg->version, oldpkg->version);
 
-	strlist_init(&files);
+	strset_init(&files, STRSET_HANDLE_STRINGS_MEM);
 
 	if (pkg_list_rm_files(oldpkg, &files)
-	    || pkg_unpack_files(mpkfile, &files)
+	    || pkg_unpack(ctx, pkg, oldpkg, mpkfile, &files)
 	    || rm_files_from_list(&files)) {
 		rv = -1;
 	}
 
-	strlist_deinit(&files);
+	// Record stamps once the old record has been removed
+	if (rv == 0)
+		pkg_record_stamps(ctx, pkg);
+
+	strset_deinit(&files);
 
 	install_state_add_pkg(&ctx->installed, pkg);
 
@@ -1001,6 +3639,10 @@ int apply_action_stack(struct mmpack_ctx* ctx, struct action_stack* stack)
 	// suppress the content of the directory in which the files are unpacked
 	mm_remove(UNPACK_CACHEDIR_RELPATH, MM_DT_ANY|MM_RECURSIVE);
 
+	// Keep the package cache within its budget
+	if (pkg_cache_evict(ctx, stack))
+		mm_log_warn("Failed to evict packages from cache");
+
 	// Restore previous current directory
 	mm_chdir(ctx->cwd);
 
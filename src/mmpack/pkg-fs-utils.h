@@ -6,10 +6,47 @@
 
 #include "action-solver.h"
 #include "context.h"
+#include "indextable.h"
 #include "mmstring.h"
+#include "utils.h"
+
+/**
+ * struct file_check - file to be checked by check_files_pkg()
+ * @filename:   path of the file relative to the prefix
+ * @ref_sha:    reference hash of the file
+ * @size:       size of the hashed file
+ * @rv:         0 if the file is intact, -1 otherwise
+ */
+struct file_check {
+	mmstr* filename;
+	mmstr* ref_sha;
+	size_t size;
+	int rv;
+};
+
+typedef int (* installed_file_cb)(const mmstr* filename,
+                                  const mmstr* ref_sha, void* data);
+
+/**
+ * struct stamp_record - stat attributes of the files of an installed package
+ * @idx:        table of struct file_stamp indexed by the path of the files
+ *              relative to the prefix
+ */
+struct stamp_record {
+	struct indextable idx;
+};
 
 int is_mmpack_metadata(mmstr const * path);
+int check_files_pkg(struct file_check* checks, int num, const mmstr* parent);
+int foreach_installed_file(const struct mmpack_ctx* ctx,
+                           const struct mmpkg* pkg,
+                           installed_file_cb cb, void* data);
 int check_installed_pkg(const struct mmpack_ctx* ctx, const struct mmpkg* pkg);
+void stamp_record_load(struct stamp_record* rec, const struct mmpack_ctx* ctx,
+                       const struct mmpkg* pkg);
+const struct file_stamp* stamp_record_lookup(const struct stamp_record* rec,
+                                             const mmstr* filename);
+void stamp_record_deinit(struct stamp_record* rec);
 int apply_action_stack(struct mmpack_ctx* ctx, struct action_stack* stack);
 int pkg_get_mmpack_info(char const * mpk_filename, struct buffer * buffer);
 int download_package(struct mmpack_ctx * ctx, struct mmpkg const * pkg,
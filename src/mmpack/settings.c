@@ -7,7 +7,11 @@
 
 #include "settings.h"
 
+#include <ctype.h>
+#include <errno.h>
+#include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <yaml.h>
 
@@ -23,6 +27,13 @@ enum {
 	UNKNOWN_FIELD = -1,
 	REPOSITORIES,
 	DEFAULT_PREFIX,
+	MAX_PARALLEL_DOWNLOADS,
+	MAX_HOST_CONNECTIONS,
+	STREAMING_INSTALL,
+	TRANSFER_LOG,
+	SHARED_CACHE_DIR,
+	PKG_CACHE_MAX_SIZE,
+	OBJECT_STORE_DIR,
 };
 
 
@@ -197,11 +208,88 @@ int get_field_type(const char* name, int len)
 		return REPOSITORIES;
 	else if (STR_EQUAL(name, len, "default-prefix"))
 		return DEFAULT_PREFIX;
+	else if (STR_EQUAL(name, len, "max-parallel-downloads"))
+		return MAX_PARALLEL_DOWNLOADS;
+	else if (STR_EQUAL(name, len, "max-host-connections"))
+		return MAX_HOST_CONNECTIONS;
+	else if (STR_EQUAL(name, len, "streaming-install"))
+		return STREAMING_INSTALL;
+	else if (STR_EQUAL(name, len, "transfer-log"))
+		return TRANSFER_LOG;
+	else if (STR_EQUAL(name, len, "shared-cache-dir"))
+		return SHARED_CACHE_DIR;
+	else if (STR_EQUAL(name, len, "pkg-cache-max-size"))
+		return PKG_CACHE_MAX_SIZE;
+	else if (STR_EQUAL(name, len, "object-store-dir"))
+		return OBJECT_STORE_DIR;
 	else
 		return UNKNOWN_FIELD;
 }
 
 
+/**
+ * parse_size() - parse amount of bytes with optional unit suffix
+ * @data:       string to parse, such as "512", "300M" or "2G"
+ * @size:       pointer to variable receiving the parsed number of bytes
+ *
+ * Return: 0 in case of success, -1 if @data is not a valid size, with error
+ * state set accordingly.
+ */
+static
+int parse_size(const char* data, size_t* size)
+{
+	unsigned long long value;
+	char* end;
+	int shift;
+
+	// strtoull() would accept leading blanks and sign
+	if (!isdigit((unsigned char)data[0]))
+		goto error;
+
+	errno = 0;
+	value = strtoull(data, &end, 10);
+	if (errno != 0)
+		goto error;
+
+	switch (*end) {
+	case '\0':
+		shift = 0;
+		break;
+
+	case 'K':
+	case 'k':
+		shift = 10;
+		break;
+
+	case 'M':
+	case 'm':
+		shift = 20;
+		break;
+
+	case 'G':
+	case 'g':
+		shift = 30;
+		break;
+
+	default:
+		goto error;
+	}
+
+	// Only a single unit letter may follow the number
+	if (shift && end[1] != '\0')
+		goto error;
+
+	if (value > (SIZE_MAX >> shift))
+		goto error;
+
+	*size = (size_t)value << shift;
+	return 0;
+
+error:
+	return mm_raise_error(MM_EBADFMT, "invalid size \"%s\"", data);
+}
+
+
 static
 int set_settings_field(struct settings* s, int field_type,
                        const char* data, int len)
@@ -213,6 +301,39 @@ int set_settings_field(struct settings* s, int field_type,
 		                                       len);
 		break;
 
+	case MAX_PARALLEL_DOWNLOADS:
+		s->max_parallel_downloads = atoi(data);
+		break;
+
+	case MAX_HOST_CONNECTIONS:
+		s->max_host_connections = atoi(data);
+		break;
+
+	case STREAMING_INSTALL:
+		s->streaming_install = atoi(data);
+		break;
+
+	case TRANSFER_LOG:
+		s->transfer_log = mmstr_copy_realloc(s->transfer_log,
+		                                     data,
+		                                     len);
+		break;
+
+	case SHARED_CACHE_DIR:
+		s->shared_cache_dir = mmstr_copy_realloc(s->shared_cache_dir,
+		                                         data,
+		                                         len);
+		break;
+
+	case PKG_CACHE_MAX_SIZE:
+		return parse_size(data, &s->pkg_cache_max_size);
+
+	case OBJECT_STORE_DIR:
+		s->object_store_dir = mmstr_copy_realloc(s->object_store_dir,
+		                                         data,
+		                                         len);
+		break;
+
 	default:
 		// Unknown field are silently ignored
 		break;
@@ -534,6 +655,8 @@ void settings_init(struct settings* settings)
 {
 	*settings = (struct settings) {
 		.default_prefix = NULL,
+		.max_parallel_downloads = DEFAULT_MAX_PARALLEL_DOWNLOADS,
+		.max_host_connections = DEFAULT_MAX_HOST_CONNECTIONS,
 	};
 
 	repolist_init(&settings->repo_list);
@@ -549,6 +672,9 @@ void settings_deinit(struct settings* settings)
 {
 	repolist_deinit(&settings->repo_list);
 	mmstr_free(settings->default_prefix);
+	mmstr_free(settings->transfer_log);
+	mmstr_free(settings->shared_cache_dir);
+	mmstr_free(settings->object_store_dir);
 
 	*settings = (struct settings) {0};
 }
@@ -37,9 +37,37 @@ struct repolist_elt* repolist_lookup(struct repolist * list,
 int create_empty_binindex_file(const mmstr* prefix, char const * name);
 int create_initial_binindex_files(const mmstr* prefix, struct repolist* repos);
 
+#define DEFAULT_MAX_PARALLEL_DOWNLOADS 8
+#define DEFAULT_MAX_HOST_CONNECTIONS 4
+
+/**
+ * struct settings - mmpack configuration
+ * @repo_list:  list of configured repositories
+ * @default_prefix: prefix to use if none is specified
+ * @max_parallel_downloads: maximum number of concurrent package downloads
+ * @max_host_connections: maximum number of connections opened to the same
+ *                        host during concurrent downloads
+ * @streaming_install: if non zero, packages missing from cache are extracted
+ *                     while being downloaded
+ * @transfer_log: if not NULL, path of the file where the metrics of each
+ *                transfer are appended as JSON lines
+ * @shared_cache_dir: if not NULL, folder of the package cache shared by all
+ *                    prefixes of the host
+ * @pkg_cache_max_size: if not zero, maximum size in bytes of the package
+ *                      files kept in the cache of the prefix
+ * @object_store_dir: if not NULL, folder of the store of unpacked package
+ *                    files shared by all prefixes of the host
+ */
 struct settings {
 	struct repolist repo_list;
 	mmstr* default_prefix;
+	int max_parallel_downloads;
+	int max_host_connections;
+	int streaming_install;
+	mmstr* transfer_log;
+	mmstr* shared_cache_dir;
+	size_t pkg_cache_max_size;
+	mmstr* object_store_dir;
 };
 
 void settings_init(struct settings* settings);
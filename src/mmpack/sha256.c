@@ -21,6 +21,27 @@
 #include <string.h>
 #include "sha256.h"
 
+#if defined (__GNUC__) && (defined (__x86_64__) || defined (__i386__))
+# define HAVE_SHA256_SHANI 1
+# define HAVE_SHA256_AVX2 1
+# include <cpuid.h>
+# include <immintrin.h>
+#endif
+
+#if defined (__GNUC__) && defined (__aarch64__) && defined (__linux__)
+# define HAVE_SHA256_ARMV8 1
+# include <arm_neon.h>
+# include <sys/auxv.h>
+# ifndef HWCAP_SHA2
+#  define HWCAP_SHA2 (1 << 6)
+# endif
+# if defined (__clang__)
+#  define ARMV8_CRYPTO_TARGET __attribute__((target("crypto")))
+# else
+#  define ARMV8_CRYPTO_TARGET __attribute__((target("+crypto")))
+# endif
+#endif
+
 /****************************** MACROS ******************************/
 #define ROTLEFT(a, b) (((a) << (b)) | ((a) >> (32-(b))))
 #define ROTRIGHT(a, b) (((a) >> (b)) | ((a) << (32-(b))))
@@ -49,50 +70,725 @@ static const uint32_t k[64] = {
 
 /*********************** FUNCTION DEFINITIONS ***********************/
 
+typedef void (* sha256_blocks_fn)(uint32_t state[8],
+                                  const unsigned char* data, size_t nblk);
+
 static
-void sha256_transform(SHA256_CTX * ctx, const unsigned char* data)
+void sha256_blocks_generic(uint32_t state[8], const unsigned char* data,
+                           size_t nblk)
 {
 	uint32_t a, b, c, d, e, f, g, h, t1, t2, m[64];
 	int i, j;
 
-	for (i = 0, j = 0; i < 16; ++i, j += 4)
-		m[i] = (data[j] << 24) | (data[j + 1] << 16) |
-		       (data[j + 2] << 8) | (data[j + 3]);
-
-	for (; i < 64; ++i)
-		m[i] = SIG1(m[i - 2]) + m[i - 7] + SIG0(m[i - 15]) + m[i - 16];
-
-	a = ctx->state[0];
-	b = ctx->state[1];
-	c = ctx->state[2];
-	d = ctx->state[3];
-	e = ctx->state[4];
-	f = ctx->state[5];
-	g = ctx->state[6];
-	h = ctx->state[7];
-
-	for (i = 0; i < 64; ++i) {
-		t1 = h + EP1(e) + CH(e, f, g) + k[i] + m[i];
-		t2 = EP0(a) + MAJ(a, b, c);
+	for (; nblk > 0; nblk--, data += 64) {
+		for (i = 0, j = 0; i < 16; ++i, j += 4)
+			m[i] = (data[j] << 24) | (data[j + 1] << 16) |
+			       (data[j + 2] << 8) | (data[j + 3]);
+
+		for (; i < 64; ++i)
+			m[i] = SIG1(m[i - 2]) + m[i - 7]
+			       + SIG0(m[i - 15]) + m[i - 16];
+
+		a = state[0];
+		b = state[1];
+		c = state[2];
+		d = state[3];
+		e = state[4];
+		f = state[5];
+		g = state[6];
+		h = state[7];
+
+		for (i = 0; i < 64; ++i) {
+			t1 = h + EP1(e) + CH(e, f, g) + k[i] + m[i];
+			t2 = EP0(a) + MAJ(a, b, c);
+			h = g;
+			g = f;
+			f = e;
+			e = d + t1;
+			d = c;
+			c = b;
+			b = a;
+			a = t1 + t2;
+		}
+
+		state[0] += a;
+		state[1] += b;
+		state[2] += c;
+		state[3] += d;
+		state[4] += e;
+		state[5] += f;
+		state[6] += g;
+		state[7] += h;
+	}
+}
+
+
+static
+int sha256_generic_supported(void)
+{
+	return 1;
+}
+
+
+#if defined (HAVE_SHA256_SHANI)
+/*
+ * x86 SHA extensions: the state is kept in 2 registers as ABEF and CDGH
+ * words. Each SHA256RNDS2 instruction performs 2 rounds and the message
+ * schedule is computed 4 words at a time with SHA256MSG1/SHA256MSG2.
+ */
+__attribute__((target("sha,sse4.1")))
+static
+void sha256_blocks_shani(uint32_t state[8], const unsigned char* data,
+                         size_t nblk)
+{
+	const __m128i bswap_mask = _mm_set_epi64x(0x0c0d0e0f08090a0bULL,
+	                                          0x0405060700010203ULL);
+	__m128i state0, state1, abef_save, cdgh_save, tmp, msg[4];
+	int i;
+
+	tmp = _mm_loadu_si128((const __m128i*) &state[0]);
+	state1 = _mm_loadu_si128((const __m128i*) &state[4]);
+	tmp = _mm_shuffle_epi32(tmp, 0xB1);             // CDAB
+	state1 = _mm_shuffle_epi32(state1, 0x1B);       // EFGH
+	state0 = _mm_alignr_epi8(tmp, state1, 8);       // ABEF
+	state1 = _mm_blend_epi16(state1, tmp, 0xF0);    // CDGH
+
+	for (; nblk > 0; nblk--, data += 64) {
+		abef_save = state0;
+		cdgh_save = state1;
+
+		for (i = 0; i < 4; i++) {
+			tmp = _mm_loadu_si128((const __m128i*) (data + 16*i));
+			msg[i] = _mm_shuffle_epi8(tmp, bswap_mask);
+		}
+
+		// Unrolling lets the message schedule overlap the rounds
+#pragma GCC unroll 16
+		for (i = 0; i < 16; i++) {
+			tmp = _mm_loadu_si128((const __m128i*) &k[4*i]);
+			tmp = _mm_add_epi32(msg[i & 3], tmp);
+			state1 = _mm_sha256rnds2_epu32(state1, state0, tmp);
+			tmp = _mm_shuffle_epi32(tmp, 0x0E);
+			state0 = _mm_sha256rnds2_epu32(state0, state1, tmp);
+
+			if (i >= 12)
+				continue;
+
+			// Compute the words 4*(i+4) to 4*(i+4)+3 of schedule
+			tmp = _mm_sha256msg1_epu32(msg[i & 3], msg[(i+1) & 3]);
+			tmp = _mm_add_epi32(tmp, _mm_alignr_epi8(msg[(i+3) & 3],
+			                                         msg[(i+2) & 3],
+			                                         4));
+			msg[i & 3] = _mm_sha256msg2_epu32(tmp, msg[(i+3) & 3]);
+		}
+
+		state0 = _mm_add_epi32(state0, abef_save);
+		state1 = _mm_add_epi32(state1, cdgh_save);
+	}
+
+	tmp = _mm_shuffle_epi32(state0, 0x1B);          // FEBA
+	state1 = _mm_shuffle_epi32(state1, 0xB1);       // DCHG
+	state0 = _mm_blend_epi16(tmp, state1, 0xF0);    // DCBA
+	state1 = _mm_alignr_epi8(state1, tmp, 8);       // HGFE
+
+	_mm_storeu_si128((__m128i*) &state[0], state0);
+	_mm_storeu_si128((__m128i*) &state[4], state1);
+}
+
+
+static
+int sha256_shani_supported(void)
+{
+	unsigned int eax, ebx, ecx, edx;
+
+	if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx)
+	    || !(ecx & bit_SSE4_1) || !(ecx & bit_SSSE3))
+		return 0;
+
+	if (__get_cpuid_max(0, NULL) < 7)
+		return 0;
+
+	__cpuid_count(7, 0, eax, ebx, ecx, edx);
+	return (ebx & bit_SHA) ? 1 : 0;
+}
+#endif /* HAVE_SHA256_SHANI */
+
+
+#if defined (HAVE_SHA256_ARMV8)
+/*
+ * ARMv8 cryptography extensions: SHA256H/SHA256H2 perform 4 rounds on the
+ * ABCD and EFGH halves of the state and SHA256SU0/SHA256SU1 compute the
+ * message schedule 4 words at a time.
+ */
+ARMV8_CRYPTO_TARGET
+static
+void sha256_blocks_armv8(uint32_t state[8], const unsigned char* data,
+                         size_t nblk)
+{
+	uint32x4_t abcd, efgh, abcd_save, efgh_save, wk, tmp, msg[4];
+	int i;
+
+	abcd = vld1q_u32(&state[0]);
+	efgh = vld1q_u32(&state[4]);
+
+	for (; nblk > 0; nblk--, data += 64) {
+		abcd_save = abcd;
+		efgh_save = efgh;
+
+		for (i = 0; i < 4; i++)
+			msg[i] = vreinterpretq_u32_u8(
+				vrev32q_u8(vld1q_u8(data + 16*i)));
+
+		// Unrolling lets the message schedule overlap the rounds
+#pragma GCC unroll 16
+		for (i = 0; i < 16; i++) {
+			wk = vaddq_u32(msg[i & 3], vld1q_u32(&k[4*i]));
+			tmp = abcd;
+			abcd = vsha256hq_u32(abcd, efgh, wk);
+			efgh = vsha256h2q_u32(efgh, tmp, wk);
+
+			if (i >= 12)
+				continue;
+
+			// Compute the words 4*(i+4) to 4*(i+4)+3 of schedule
+			tmp = vsha256su0q_u32(msg[i & 3], msg[(i+1) & 3]);
+			msg[i & 3] = vsha256su1q_u32(tmp, msg[(i+2) & 3],
+			                             msg[(i+3) & 3]);
+		}
+
+		abcd = vaddq_u32(abcd, abcd_save);
+		efgh = vaddq_u32(efgh, efgh_save);
+	}
+
+	vst1q_u32(&state[0], abcd);
+	vst1q_u32(&state[4], efgh);
+}
+
+
+static
+int sha256_armv8_supported(void)
+{
+	return (getauxval(AT_HWCAP) & HWCAP_SHA2) ? 1 : 0;
+}
+#endif /* HAVE_SHA256_ARMV8 */
+
+
+static const struct {
+	const char* name;
+	sha256_blocks_fn blocks;
+	int (* is_supported)(void);
+} sha256_impls[SHA256_NUM_IMPL] = {
+	[SHA256_IMPL_GENERIC] = {"generic", sha256_blocks_generic,
+		                 sha256_generic_supported},
+#if defined (HAVE_SHA256_SHANI)
+	[SHA256_IMPL_SHANI] = {"sha-ni", sha256_blocks_shani,
+		               sha256_shani_supported},
+#else
+	[SHA256_IMPL_SHANI] = {"sha-ni", NULL, NULL},
+#endif
+#if defined (HAVE_SHA256_ARMV8)
+	[SHA256_IMPL_ARMV8] = {"armv8-ce", sha256_blocks_armv8,
+		               sha256_armv8_supported},
+#else
+	[SHA256_IMPL_ARMV8] = {"armv8-ce", NULL, NULL},
+#endif
+};
+
+static int sha256_impl = SHA256_IMPL_GENERIC;
+static sha256_blocks_fn sha256_blocks = sha256_blocks_generic;
+
+
+/**
+ * sha256_impl_supported() - test whether an implementation can be used
+ * @impl:       SHA256_IMPL_* value
+ *
+ * Return: 1 if @impl has been compiled in and is supported by the CPU, 0
+ * otherwise.
+ */
+LOCAL_SYMBOL
+int sha256_impl_supported(int impl)
+{
+	if (impl < 0 || impl >= SHA256_NUM_IMPL
+	    || !sha256_impls[impl].blocks)
+		return 0;
+
+	return sha256_impls[impl].is_supported();
+}
+
+
+/**
+ * sha256_impl_name() - get the name of an implementation
+ * @impl:       SHA256_IMPL_* value
+ *
+ * Return: the name of @impl, NULL if @impl is not a valid value.
+ */
+LOCAL_SYMBOL
+const char* sha256_impl_name(int impl)
+{
+	if (impl < 0 || impl >= SHA256_NUM_IMPL)
+		return NULL;
+
+	return sha256_impls[impl].name;
+}
+
+
+/**
+ * sha256_get_impl() - get the implementation currently in use
+ *
+ * Return: the SHA256_IMPL_* value of the implementation in use.
+ */
+LOCAL_SYMBOL
+int sha256_get_impl(void)
+{
+	return sha256_impl;
+}
+
+
+/**
+ * sha256_set_impl() - force the implementation of the SHA-256 compression
+ * @impl:       SHA256_IMPL_* value
+ *
+ * This is not meant to be used while hashes are being computed by other
+ * threads. It is mostly useful for testing and benchmarking the different
+ * implementations.
+ *
+ * Return: 0 in case of success, -1 if @impl is not supported.
+ */
+LOCAL_SYMBOL
+int sha256_set_impl(int impl)
+{
+	if (!sha256_impl_supported(impl))
+		return -1;
+
+	sha256_impl = impl;
+	sha256_blocks = sha256_impls[impl].blocks;
+	return 0;
+}
+
+
+/**************************************************************************
+ *                                                                        *
+ *                        Multi-buffer hashing                            *
+ *                                                                        *
+ **************************************************************************/
+/*
+ * Several independent messages are hashed at once by interleaving them in
+ * the lanes of SIMD registers: lane l of the vector holding the word j of
+ * the state is the word j of the state of the message hashed in lane l.
+ * Since each message is fully in memory, its padding is generated upfront
+ * and a lane is refilled with the next message as soon as the previous one
+ * has been digested. This is worthwhile for many small messages when no
+ * dedicated SHA-256 instruction is available.
+ */
+
+typedef void (* sha256_mb_blocks_fn)(uint32_t state[8][SHA256_MB_MAX_LANES],
+                                     const unsigned char* blk[]);
+
+static const uint32_t sha256_initial_state[8] = {
+	0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+	0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+};
+
+/**
+ * struct sha256_lane - progress of the message hashed in a lane
+ * @msg:        index of the message being hashed, -1 if lane is idle
+ * @data:       pointer to next block of the message
+ * @nblk:       number of full blocks of message remaining at @data
+ * @tail:       last blocks of the message including the padding
+ * @ntail:      number of blocks in @tail (1 or 2)
+ * @itail:      index of the next block to hash in @tail
+ */
+struct sha256_lane {
+	int msg;
+	const unsigned char* data;
+	size_t nblk;
+	unsigned char tail[128];
+	int ntail;
+	int itail;
+};
+
+
+static
+void sha256_lane_start(struct sha256_lane* lane, int msg,
+                       const unsigned char* data, size_t len)
+{
+	uint64_t bitlen = (uint64_t)len * 8;
+	size_t rem = len % 64;
+	int i;
+
+	lane->msg = msg;
+	lane->data = data;
+	lane->nblk = len / 64;
+	lane->itail = 0;
+
+	// Tail: remaining data, 0x80, zeros and length on 1 or 2 blocks
+	lane->ntail = (rem < 56) ? 1 : 2;
+	memset(lane->tail, 0, sizeof(lane->tail));
+	memcpy(lane->tail, data + 64 * lane->nblk, rem);
+	lane->tail[rem] = 0x80;
+	for (i = 0; i < 8; i++)
+		lane->tail[64 * lane->ntail - 1 - i] = bitlen >> (8 * i);
+}
+
+
+static
+const unsigned char* sha256_lane_next_block(struct sha256_lane* lane)
+{
+	const unsigned char* blk;
+
+	if (lane->nblk > 0) {
+		blk = lane->data;
+		lane->data += 64;
+		lane->nblk--;
+		return blk;
+	}
+
+	return lane->tail + 64 * lane->itail++;
+}
+
+
+static
+int sha256_lane_done(const struct sha256_lane* lane)
+{
+	return lane->nblk == 0 && lane->itail == lane->ntail;
+}
+
+
+/**
+ * sha256_multi_lanes() - hash messages interleaved in SIMD lanes
+ * @num:        number of messages
+ * @data:       array of @num pointers to the messages
+ * @len:        array of @num lengths of the messages
+ * @hash:       array of @num pointers to SHA256_BLOCK_SIZE long buffers
+ *              receiving the digests
+ * @num_lanes:  number of lanes processed by @blocks
+ * @blocks:     function compressing one block in each lane
+ */
+static
+void sha256_multi_lanes(int num, const void* const data[],
+                        const size_t len[], unsigned char* const hash[],
+                        int num_lanes, sha256_mb_blocks_fn blocks)
+{
+	static const unsigned char idle_blk[64];
+	uint32_t state[8][SHA256_MB_MAX_LANES];
+	const unsigned char* blk[SHA256_MB_MAX_LANES];
+	struct sha256_lane lanes[SHA256_MB_MAX_LANES];
+	unsigned char* md;
+	int l, j, next_msg, num_active;
+
+	for (l = 0; l < num_lanes; l++)
+		lanes[l].msg = -1;
+
+	next_msg = 0;
+	while (1) {
+		num_active = 0;
+		for (l = 0; l < num_lanes; l++) {
+			// Refill idle lane with next message
+			if (lanes[l].msg < 0 && next_msg < num) {
+				sha256_lane_start(&lanes[l], next_msg,
+				                  data[next_msg], len[next_msg]);
+				for (j = 0; j < 8; j++)
+					state[j][l] = sha256_initial_state[j];
+
+				next_msg++;
+			}
+
+			if (lanes[l].msg < 0) {
+				blk[l] = idle_blk;
+				continue;
+			}
+
+			blk[l] = sha256_lane_next_block(&lanes[l]);
+			num_active++;
+		}
+
+		if (num_active == 0)
+			break;
+
+		blocks(state, blk);
+
+		// Write the digests of the messages that are complete
+		for (l = 0; l < num_lanes; l++) {
+			if (lanes[l].msg < 0 || !sha256_lane_done(&lanes[l]))
+				continue;
+
+			md = hash[lanes[l].msg];
+			for (j = 0; j < 8; j++) {
+				md[4*j + 0] = state[j][l] >> 24;
+				md[4*j + 1] = state[j][l] >> 16;
+				md[4*j + 2] = state[j][l] >> 8;
+				md[4*j + 3] = state[j][l];
+			}
+
+			lanes[l].msg = -1;
+		}
+	}
+}
+
+
+#if defined (HAVE_SHA256_AVX2)
+#define MB_ROTR(x, n) \
+	_mm256_or_si256(_mm256_srli_epi32(x, n), _mm256_slli_epi32(x, 32-(n)))
+#define MB_CH(x, y, z) \
+	_mm256_xor_si256(_mm256_and_si256(x, y), _mm256_andnot_si256(x, z))
+#define MB_MAJ(x, y, z) \
+	_mm256_or_si256(_mm256_and_si256(x, y), \
+	                _mm256_and_si256(z, _mm256_or_si256(x, y)))
+#define MB_EP0(x) _mm256_xor_si256(_mm256_xor_si256(MB_ROTR(x, 2), \
+	                                            MB_ROTR(x, 13)), \
+	                           MB_ROTR(x, 22))
+#define MB_EP1(x) _mm256_xor_si256(_mm256_xor_si256(MB_ROTR(x, 6), \
+	                                            MB_ROTR(x, 11)), \
+	                           MB_ROTR(x, 25))
+#define MB_SIG0(x) _mm256_xor_si256(_mm256_xor_si256(MB_ROTR(x, 7), \
+	                                             MB_ROTR(x, 18)), \
+	                            _mm256_srli_epi32(x, 3))
+#define MB_SIG1(x) _mm256_xor_si256(_mm256_xor_si256(MB_ROTR(x, 17), \
+	                                             MB_ROTR(x, 19)), \
+	                            _mm256_srli_epi32(x, 10))
+
+static inline
+uint32_t load_be32(const unsigned char* p)
+{
+	return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16)
+	       | ((uint32_t)p[2] << 8) | p[3];
+}
+
+
+/* AVX2: 8 lanes of 32 bits */
+__attribute__((target("avx2")))
+static
+void sha256_mb_blocks_avx2(uint32_t state[8][SHA256_MB_MAX_LANES],
+                           const unsigned char* blk[])
+{
+	__m256i w[16], st[8], a, b, c, d, e, f, g, h, t1, t2;
+	int i;
+
+	for (i = 0; i < 16; i++)
+		w[i] = _mm256_set_epi32(load_be32(blk[7] + 4*i),
+		                        load_be32(blk[6] + 4*i),
+		                        load_be32(blk[5] + 4*i),
+		                        load_be32(blk[4] + 4*i),
+		                        load_be32(blk[3] + 4*i),
+		                        load_be32(blk[2] + 4*i),
+		                        load_be32(blk[1] + 4*i),
+		                        load_be32(blk[0] + 4*i));
+
+	for (i = 0; i < 8; i++)
+		st[i] = _mm256_loadu_si256((const __m256i*) state[i]);
+
+	a = st[0];
+	b = st[1];
+	c = st[2];
+	d = st[3];
+	e = st[4];
+	f = st[5];
+	g = st[6];
+	h = st[7];
+
+	for (i = 0; i < 64; i++) {
+		if (i >= 16) {
+			t1 = _mm256_add_epi32(MB_SIG1(w[(i-2) & 15]),
+			                      w[(i-7) & 15]);
+			t2 = _mm256_add_epi32(MB_SIG0(w[(i-15) & 15]),
+			                      w[i & 15]);
+			w[i & 15] = _mm256_add_epi32(t1, t2);
+		}
+
+		t1 = _mm256_add_epi32(h, MB_EP1(e));
+		t1 = _mm256_add_epi32(t1, MB_CH(e, f, g));
+		t1 = _mm256_add_epi32(t1, _mm256_set1_epi32(k[i]));
+		t1 = _mm256_add_epi32(t1, w[i & 15]);
+		t2 = _mm256_add_epi32(MB_EP0(a), MB_MAJ(a, b, c));
 		h = g;
 		g = f;
 		f = e;
-		e = d + t1;
+		e = _mm256_add_epi32(d, t1);
 		d = c;
 		c = b;
 		b = a;
-		a = t1 + t2;
+		a = _mm256_add_epi32(t1, t2);
 	}
 
-	ctx->state[0] += a;
-	ctx->state[1] += b;
-	ctx->state[2] += c;
-	ctx->state[3] += d;
-	ctx->state[4] += e;
-	ctx->state[5] += f;
-	ctx->state[6] += g;
-	ctx->state[7] += h;
+	st[0] = _mm256_add_epi32(st[0], a);
+	st[1] = _mm256_add_epi32(st[1], b);
+	st[2] = _mm256_add_epi32(st[2], c);
+	st[3] = _mm256_add_epi32(st[3], d);
+	st[4] = _mm256_add_epi32(st[4], e);
+	st[5] = _mm256_add_epi32(st[5], f);
+	st[6] = _mm256_add_epi32(st[6], g);
+	st[7] = _mm256_add_epi32(st[7], h);
+
+	for (i = 0; i < 8; i++)
+		_mm256_storeu_si256((__m256i*) state[i], st[i]);
+}
+
+
+static
+int sha256_avx2_supported(void)
+{
+	unsigned int eax, ebx, ecx, edx;
+
+	if (__get_cpuid_max(0, NULL) < 7)
+		return 0;
+
+	// AVX2 registers must also be enabled by the OS
+	if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx)
+	    || !(ecx & bit_OSXSAVE) || !(ecx & bit_AVX))
+		return 0;
+
+	__asm__ ("xgetbv" : "=a" (eax), "=d" (edx) : "c" (0));
+	if ((eax & 0x6) != 0x6)
+		return 0;
+
+	__cpuid_count(7, 0, eax, ebx, ecx, edx);
+	return (ebx & bit_AVX2) ? 1 : 0;
 }
+#endif /* HAVE_SHA256_AVX2 */
+
+
+static const struct {
+	const char* name;
+	sha256_mb_blocks_fn blocks;
+	int num_lanes;
+	int (* is_supported)(void);
+} sha256_mb_impls[SHA256_MB_NUM_IMPL] = {
+	[SHA256_MB_IMPL_SERIAL] = {"serial", NULL, 1,
+		                   sha256_generic_supported},
+#if defined (HAVE_SHA256_AVX2)
+	[SHA256_MB_IMPL_AVX2] = {"avx2", sha256_mb_blocks_avx2, 8,
+		                 sha256_avx2_supported},
+#else
+	[SHA256_MB_IMPL_AVX2] = {"avx2", NULL, 8, NULL},
+#endif
+};
+
+static int sha256_mb_impl = SHA256_MB_IMPL_SERIAL;
+
+
+/**
+ * sha256_mb_impl_supported() - test whether a multi-buffer engine is usable
+ * @impl:       SHA256_MB_IMPL_* value
+ *
+ * Return: 1 if @impl has been compiled in and is supported by the CPU, 0
+ * otherwise.
+ */
+LOCAL_SYMBOL
+int sha256_mb_impl_supported(int impl)
+{
+	if (impl < 0 || impl >= SHA256_MB_NUM_IMPL
+	    || !sha256_mb_impls[impl].is_supported)
+		return 0;
+
+	return sha256_mb_impls[impl].is_supported();
+}
+
+
+/**
+ * sha256_mb_impl_name() - get the name of a multi-buffer engine
+ * @impl:       SHA256_MB_IMPL_* value
+ *
+ * Return: the name of @impl, NULL if @impl is not a valid value.
+ */
+LOCAL_SYMBOL
+const char* sha256_mb_impl_name(int impl)
+{
+	if (impl < 0 || impl >= SHA256_MB_NUM_IMPL)
+		return NULL;
+
+	return sha256_mb_impls[impl].name;
+}
+
+
+/**
+ * sha256_mb_get_impl() - get the multi-buffer engine currently in use
+ *
+ * Return: the SHA256_MB_IMPL_* value of the engine used by sha256_multi().
+ */
+LOCAL_SYMBOL
+int sha256_mb_get_impl(void)
+{
+	return sha256_mb_impl;
+}
+
+
+/**
+ * sha256_mb_set_impl() - force the engine used by sha256_multi()
+ * @impl:       SHA256_MB_IMPL_* value
+ *
+ * Like sha256_set_impl(), this is meant for testing and benchmarking.
+ *
+ * Return: 0 in case of success, -1 if @impl is not supported.
+ */
+LOCAL_SYMBOL
+int sha256_mb_set_impl(int impl)
+{
+	if (!sha256_mb_impl_supported(impl))
+		return -1;
+
+	sha256_mb_impl = impl;
+	return 0;
+}
+
+
+/**
+ * sha256_multi() - compute the SHA-256 digests of several messages
+ * @num:        number of messages
+ * @data:       array of @num pointers to the messages
+ * @len:        array of @num lengths of the messages
+ * @hash:       array of @num pointers to SHA256_BLOCK_SIZE long buffers
+ *              receiving the digests
+ *
+ * The messages are hashed in parallel in SIMD lanes if a multi-buffer
+ * engine is in use, or one after the other otherwise.
+ */
+LOCAL_SYMBOL
+void sha256_multi(int num, const void* const data[], const size_t len[],
+                  unsigned char* const hash[])
+{
+	SHA256_CTX ctx;
+	int i;
+
+	if (sha256_mb_impl != SHA256_MB_IMPL_SERIAL && num > 1) {
+		sha256_multi_lanes(num, data, len, hash,
+		                   sha256_mb_impls[sha256_mb_impl].num_lanes,
+		                   sha256_mb_impls[sha256_mb_impl].blocks);
+		return;
+	}
+
+	for (i = 0; i < num; i++) {
+		sha256_init(&ctx);
+		sha256_update(&ctx, data[i], len[i]);
+		sha256_final(&ctx, hash[i]);
+	}
+}
+
+
+/*
+ * Select the fastest implementation supported by the CPU when the program
+ * is loaded, hence before any thread may compute a hash. The multi-buffer
+ * engine is used only when no dedicated SHA-256 instruction is available:
+ * those hash a single stream faster than 8 interleaved generic lanes.
+ */
+#if defined (__GNUC__)
+__attribute__((constructor))
+static
+void sha256_select_impl(void)
+{
+	int impl;
+
+	for (impl = SHA256_NUM_IMPL - 1; impl > SHA256_IMPL_GENERIC; impl--) {
+		if (sha256_set_impl(impl) == 0)
+			return;
+	}
+
+	for (impl = SHA256_MB_NUM_IMPL - 1; impl > SHA256_MB_IMPL_SERIAL;
+	     impl--) {
+		if (sha256_mb_set_impl(impl) == 0)
+			return;
+	}
+}
+#endif
 
 
 LOCAL_SYMBOL
@@ -114,18 +810,38 @@ void sha256_init(SHA256_CTX * ctx)
 LOCAL_SYMBOL
 void sha256_update(SHA256_CTX * ctx, const void* buffer, size_t len)
 {
-	size_t i;
+	size_t fill, nblk;
 	const unsigned char* restrict data = buffer;
 
-	for (i = 0; i < len; ++i) {
-		ctx->data[ctx->datalen] = data[i];
-		ctx->datalen++;
-		if (ctx->datalen == 64) {
-			sha256_transform(ctx, ctx->data);
-			ctx->bitlen += 512;
-			ctx->datalen = 0;
-		}
+	// Complete the block partially filled by previous update
+	if (ctx->datalen > 0) {
+		fill = 64 - ctx->datalen;
+		if (fill > len)
+			fill = len;
+
+		memcpy(ctx->data + ctx->datalen, data, fill);
+		ctx->datalen += fill;
+		data += fill;
+		len -= fill;
+		if (ctx->datalen < 64)
+			return;
+
+		sha256_blocks(ctx->state, ctx->data, 1);
+		ctx->bitlen += 512;
+		ctx->datalen = 0;
 	}
+
+	// Process directly all full blocks from input
+	nblk = len / 64;
+	if (nblk > 0) {
+		sha256_blocks(ctx->state, data, nblk);
+		ctx->bitlen += 512 * (uint64_t)nblk;
+		data += 64 * nblk;
+		len -= 64 * nblk;
+	}
+
+	memcpy(ctx->data, data, len);
+	ctx->datalen = len;
 }
 
 
@@ -146,7 +862,7 @@ void sha256_final(SHA256_CTX * ctx, unsigned char* hash)
 		while (i < 64)
 			ctx->data[i++] = 0x00;
 
-		sha256_transform(ctx, ctx->data);
+		sha256_blocks(ctx->state, ctx->data, 1);
 		memset(ctx->data, 0, 56);
 	}
 
@@ -161,7 +877,7 @@ void sha256_final(SHA256_CTX * ctx, unsigned char* hash)
 	ctx->data[58] = ctx->bitlen >> 40;
 	ctx->data[57] = ctx->bitlen >> 48;
 	ctx->data[56] = ctx->bitlen >> 56;
-	sha256_transform(ctx, ctx->data);
+	sha256_blocks(ctx->state, ctx->data, 1);
 
 	// Since this implementation uses little endian byte ordering and SHA
 	// uses big endian, reverse all the bytes when copying the final state
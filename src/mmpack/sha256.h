@@ -16,6 +16,24 @@
 /****************************** MACROS ******************************/
 #define SHA256_BLOCK_SIZE 32            // SHA256 outputs a 32 byte digest
 
+// Implementations of the SHA-256 compression function
+enum {
+	SHA256_IMPL_GENERIC,
+	SHA256_IMPL_SHANI,      // x86 SHA extensions
+	SHA256_IMPL_ARMV8,      // ARMv8 cryptography extensions
+	SHA256_NUM_IMPL,
+};
+
+// Engines hashing several messages at once
+enum {
+	SHA256_MB_IMPL_SERIAL,  // messages hashed one after the other
+	SHA256_MB_IMPL_AVX2,    // 8 messages interleaved in AVX2 registers
+	SHA256_MB_NUM_IMPL,
+};
+
+// Maximum number of messages hashed simultaneously by sha256_multi()
+#define SHA256_MB_MAX_LANES 8
+
 /**************************** DATA TYPES ****************************/
 typedef struct {
 	unsigned char data[64];
@@ -29,4 +47,16 @@ void sha256_init(SHA256_CTX * ctx);
 void sha256_update(SHA256_CTX * ctx, const void* buffer, size_t len);
 void sha256_final(SHA256_CTX * ctx, unsigned char* hash);
 
+int sha256_impl_supported(int impl);
+const char* sha256_impl_name(int impl);
+int sha256_get_impl(void);
+int sha256_set_impl(int impl);
+
+void sha256_multi(int num, const void* const data[], const size_t len[],
+                  unsigned char* const hash[]);
+int sha256_mb_impl_supported(int impl);
+const char* sha256_mb_impl_name(int impl);
+int sha256_mb_get_impl(void);
+int sha256_mb_set_impl(int impl);
+
 #endif   // SHA256_H
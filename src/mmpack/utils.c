@@ -15,6 +15,17 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+
+#if !defined (_WIN32)
+# include <fcntl.h>
+# include <sys/stat.h>
+#endif
+
+#if defined (__linux)
+# include <linux/fs.h>
+# include <sys/ioctl.h>
+#endif
 
 #include "common.h"
 #include "mmstring.h"
@@ -23,8 +34,14 @@
 #include "xx-alloc.h"
 
 #define MSG_MAXLEN 128
-#define HASH_UPDATE_SIZE 512
+#define HASH_UPDATE_SIZE (64*1024)
+// Regular files at least this large are read by blocks of HASH_READ_SIZE
+#define HASH_LARGE_FILE_SIZE (1024*1024)
+#define HASH_READ_SIZE (1024*1024)
 #define BLK_SIZE 512
+#define COPY_BLOCK_SIZE (64*1024)
+// Age from which a temporary file is considered left over by a dead process
+#define STALE_TMP_AGE (3600)
 
 #ifndef STDOUT_FILENO
 #define STDOUT_FILENO 1
@@ -286,6 +303,187 @@ int map_file_in_prefix(const mmstr* prefix, const mmstr* relpath,
 }
 
 
+#define NSEC_PER_SEC 1000000000LL
+
+/**
+ * file_stamp_get() - get the stat attributes of a file
+ * @stamp:      pointer to the structure receiving the attributes
+ * @filename:   path of the file
+ * @parent:     folder to prepend to @filename (may be NULL)
+ *
+ * Symlinks are not followed. Unless forged on purpose, a modification of
+ * the file content or its replacement by another file changes at least one
+ * of the attributes stored in @stamp. The times have a nanosecond
+ * resolution if the system provides it.
+ *
+ * Return: 0 in case of success. Otherwise -1 is returned with error state set
+ * accordingly.
+ */
+LOCAL_SYMBOL
+int file_stamp_get(struct file_stamp* stamp, const mmstr* filename,
+                   const mmstr* parent)
+{
+#if !defined (_WIN32)
+	struct stat st;
+#else
+	struct mm_stat st;
+#endif
+	mmstr* fullpath = NULL;
+	size_t len;
+	int rv = 0;
+
+	if (parent != NULL) {
+		len = mmstrlen(filename) + mmstrlen(parent) + 1;
+		fullpath = mmstr_malloca(len);
+		filename = mmstr_join_path(fullpath, parent, filename);
+	}
+
+#if !defined (_WIN32)
+	if (lstat(filename, &st)) {
+		rv = mm_raise_from_errno("Can't stat %s", filename);
+		goto exit;
+	}
+
+	*stamp = (struct file_stamp) {
+		.size = st.st_size,
+		.mtime_ns = st.st_mtim.tv_sec * NSEC_PER_SEC + st.st_mtim.tv_nsec,
+		.ctime_ns = st.st_ctim.tv_sec * NSEC_PER_SEC + st.st_ctim.tv_nsec,
+		.ino = st.st_ino,
+	};
+#else
+	if (mm_stat(filename, &st, MM_NOFOLLOW)) {
+		rv = -1;
+		goto exit;
+	}
+
+	*stamp = (struct file_stamp) {
+		.size = st.size,
+		.mtime_ns = (int64_t)st.mtime * NSEC_PER_SEC,
+		.ctime_ns = (int64_t)st.ctime * NSEC_PER_SEC,
+		.ino = (uint64_t)st.ino,
+	};
+#endif
+
+exit:
+	mmstr_freea(fullpath);
+	return rv;
+}
+
+
+/**
+ * fullwrite() - write fully data buffer to a file
+ * @fd:         file descriptor where to write data
+ * @data:       data buffer to write
+ * @size:       size of @data
+ *
+ * Return: 0 if @data has been fully written to @fd, -1 otherwise
+ */
+LOCAL_SYMBOL
+int fullwrite(int fd, const char* data, size_t size)
+{
+	ssize_t rsz;
+
+	do {
+		rsz = mm_write(fd, data, size);
+		if (rsz < 0)
+			return -1;
+
+		size -= rsz;
+		data += rsz;
+	} while (size > 0);
+
+	return 0;
+}
+
+
+/**
+ * copy_file_excl() - copy a file into a new file
+ * @src:        path of the file to copy
+ * @dst:        path of the file to create, must not exist
+ * @mode:       permission bits of @dst
+ *
+ * If the filesystem supports it, @dst shares the data blocks of @src
+ * (reflink). Otherwise the content is copied.
+ *
+ * Return: 0 in case of success, -1 otherwise with error state set
+ * accordingly. In case of failure, @dst is removed if it has been created.
+ */
+LOCAL_SYMBOL
+int copy_file_excl(const char* src, const char* dst, int mode)
+{
+	char* buff;
+	ssize_t rsz;
+	int fd_src, fd_dst, rv;
+
+	fd_src = mm_open(src, O_RDONLY, 0);
+	if (fd_src < 0)
+		return -1;
+
+	fd_dst = mm_open(dst, O_WRONLY|O_CREAT|O_EXCL, mode);
+	if (fd_dst < 0) {
+		mm_close(fd_src);
+		return -1;
+	}
+
+	rv = 0;
+#if defined (FICLONE)
+	if (ioctl(fd_dst, FICLONE, fd_src) == 0)
+		goto exit;
+#endif
+
+	buff = xx_malloc(COPY_BLOCK_SIZE);
+	while ((rsz = mm_read(fd_src, buff, COPY_BLOCK_SIZE)) != 0) {
+		if (rsz < 0 || fullwrite(fd_dst, buff, rsz)) {
+			rv = -1;
+			break;
+		}
+	}
+
+	free(buff);
+
+#if defined (FICLONE)
+exit:
+#endif
+	mm_close(fd_src);
+	mm_close(fd_dst);
+
+	if (rv)
+		mm_unlink(dst);
+
+	return rv;
+}
+
+
+/**
+ * remove_stale_tmp() - remove temporary file left over by a dead process
+ * @tmp_path:   path of a temporary file that could not be created because it
+ *              already exists
+ *
+ * Temporary files created exclusively are used to publish files shared by
+ * several processes: if the file exists, another process is publishing the
+ * same file. However it can also be a leftover of an interrupted process.
+ * Such a file is removed if it is old enough.
+ *
+ * Return: 0 if @tmp_path has been removed and can be created again, -1
+ * otherwise (no error is reported).
+ */
+LOCAL_SYMBOL
+int remove_stale_tmp(const char* tmp_path)
+{
+	struct mm_stat st;
+	int prev_err_flags, rv = -1;
+
+	prev_err_flags = mm_error_set_flags(MM_ERROR_SET, MM_ERROR_IGNORE);
+
+	if (mm_stat(tmp_path, &st, MM_NOFOLLOW) == 0
+	    && time(NULL) - st.mtime >= STALE_TMP_AGE)
+		rv = mm_unlink(tmp_path);
+
+	mm_error_set_flags(prev_err_flags, MM_ERROR_IGNORE);
+	return rv;
+}
+
+
 /**************************************************************************
  *                                                                        *
  *                            Host OS detection                           *
@@ -386,7 +584,7 @@ mmstr* get_config_filename(void)
  *
  * Return: length of the string written in @hexstr
  */
-static
+LOCAL_SYMBOL
 int conv_to_hexstr(char* hexstr, const unsigned char* data, size_t len)
 {
 	const char hexlut[] = "0123456789abcdef";
@@ -405,28 +603,48 @@ int conv_to_hexstr(char* hexstr, const unsigned char* data, size_t len)
 
 /**
  * sha_fd_compute() - compute SHA256 hash of an open file
- * @hash:       mmstr* buffer receiving the hexadecimal form of hash. The
- *              pointed buffer must be SHA_HEXSTR_LEN long.
+ * @hash:       buffer receiving the hexadecimal form of hash. The pointed
+ *              buffer must be at least 2*SHA256_BLOCK_SIZE long.
  * @fd:         file descriptor of a file opened for reading
  *
- * The computed hash is stored in hexadecimal as a mmstr* string in @hash whose
- * length must be at least SHA_HEXSTR_LEN long, as reported by mmstr_maxlen().
+ * The 2*SHA256_BLOCK_SIZE hexadecimal digits of the hash of the data read
+ * from @fd until its end are written in @hash, without type prefix nor
+ * null termination.
+ *
+ * Regular files larger than HASH_LARGE_FILE_SIZE are read by blocks of
+ * HASH_READ_SIZE and the kernel is advised that they are read sequentially so
+ * that it reads ahead aggressively. The other files are read by blocks of
+ * HASH_UPDATE_SIZE. Files are not mapped: a file truncated while being hashed
+ * must lead to a hash mismatch, not to a SIGBUS.
  *
  * Return: 0 in case of success, -1 if a problem of file reading has been
  * encountered.
  */
-static
+LOCAL_SYMBOL
 int sha_fd_compute(char* hash, int fd)
 {
-	unsigned char md[SHA256_BLOCK_SIZE], data[HASH_UPDATE_SIZE];
+	unsigned char md[SHA256_BLOCK_SIZE], small_data[HASH_UPDATE_SIZE];
+	unsigned char* data = small_data;
+	size_t data_size = sizeof(small_data);
 	SHA256_CTX ctx;
+	struct mm_stat st;
 	ssize_t rsz;
 	int rv = 0;
 
 	sha256_init(&ctx);
 
+	if (mm_fstat(fd, &st) == 0
+	    && S_ISREG(st.mode)
+	    && st.size >= HASH_LARGE_FILE_SIZE) {
+#if !defined (_WIN32)
+		posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+		data_size = HASH_READ_SIZE;
+		data = xx_malloc(data_size);
+	}
+
 	do {
-		rsz = mm_read(fd, data, sizeof(data));
+		rsz = mm_read(fd, data, data_size);
 		if (rsz < 0) {
 			rv = -1;
 			break;
@@ -436,6 +654,8 @@ int sha_fd_compute(char* hash, int fd)
 	} while (rsz > 0);
 
 	sha256_final(&ctx, md);
+	if (data != small_data)
+		free(data);
 
 	conv_to_hexstr(hash, md, sizeof(md));
 
@@ -576,6 +796,161 @@ exit:
 	return rv;
 }
 
+
+/**
+ * read_small_regfile() - load the content of a small regular file
+ * @path:       path of the file to read
+ * @size:       pointer to the size of the file as reported by stat. It is
+ *              updated with the amount of data actually read.
+ *
+ * The file is read until its end: if it has been modified since it has been
+ * stat'ed, the data loaded is still the whole content of the file, like what
+ * sha_compute() hashes.
+ *
+ * Return: allocated buffer holding the content of the file, to be freed with
+ * free(). NULL in case of failure.
+ */
+static
+void* read_small_regfile(const char* path, size_t* size)
+{
+	char* data;
+	size_t len, maxlen;
+	ssize_t rsz;
+	int fd;
+
+	fd = mm_open(path, O_RDONLY, 0);
+	if (fd < 0)
+		return NULL;
+
+	// Request one byte more than expected to detect a file that has grown
+	maxlen = *size + 1;
+	data = xx_malloc(maxlen);
+	len = 0;
+	while ((rsz = mm_read(fd, data + len, maxlen - len)) > 0) {
+		len += rsz;
+		if (len == maxlen) {
+			maxlen *= 2;
+			data = xx_realloc(data, maxlen);
+		}
+	}
+
+	mm_close(fd);
+	if (rsz < 0) {
+		free(data);
+		return NULL;
+	}
+
+	*size = len;
+	return data;
+}
+
+
+/**
+ * sha_compute_batch() - compute SHA256 hash of several files
+ * @files:      array of files to hash
+ * @num:        number of element in @files (at most SHA_BATCH_MAX_FILES)
+ * @parent:     prefix directory to prepend to the filenames in @files. This
+ *              may be NULL
+ *
+ * This function computes the hash of each file of @files like sha_compute()
+ * does, using the @filename and @follow fields of the element in @files and
+ * setting its @hash, @size and @rv fields. The regular files smaller than
+ * SHA_BATCH_MAX_FILESIZE are read in memory and hashed together with
+ * sha256_multi(). The other files are hashed one after the other.
+ *
+ * Return: 0 if all hashes have been computed, -1 if a problem of file
+ * reading has been encountered for at least one file.
+ */
+LOCAL_SYMBOL
+int sha_compute_batch(struct sha_file* files, int num, const mmstr* parent)
+{
+	unsigned char md[SHA_BATCH_MAX_FILES][SHA256_BLOCK_SIZE];
+	unsigned char* mds[SHA_BATCH_MAX_FILES];
+	const void* data[SHA_BATCH_MAX_FILES];
+	size_t len[SHA_BATCH_MAX_FILES];
+	int idx[SHA_BATCH_MAX_FILES];
+	struct sha_file* file;
+	mmstr* path;
+	char* hexstr;
+	struct mm_stat st;
+	int i, num_small, with_prefix, rv;
+
+	path = NULL;
+	num_small = 0;
+	rv = 0;
+	for (i = 0; i < num; i++) {
+		file = &files[i];
+		with_prefix = !file->follow;
+		file->size = 0;
+		file->rv = 0;
+
+		if (parent != NULL) {
+			path = mmstr_realloc(path, mmstrlen(parent) + 1
+			                     + mmstrlen(file->filename));
+			mmstr_join_path(path, parent, file->filename);
+		} else {
+			path = mmstr_copy_realloc(path, file->filename,
+			                          mmstrlen(file->filename));
+		}
+
+		if (mm_stat(path, &st, file->follow ? 0 : MM_NOFOLLOW)) {
+			file->rv = -1;
+		} else if (S_ISREG(st.mode)
+		           && st.size <= SHA_BATCH_MAX_FILESIZE) {
+			// Defer the hash of small file to the batch
+			len[num_small] = st.size;
+			data[num_small] = read_small_regfile(path,
+			                                     &len[num_small]);
+			if (data[num_small] == NULL) {
+				file->rv = -1;
+			} else {
+				file->size = len[num_small];
+				mds[num_small] = md[num_small];
+				idx[num_small] = i;
+				num_small++;
+			}
+		} else if (S_ISREG(st.mode)) {
+			file->size = st.size;
+			file->rv = sha_regfile_compute(file->hash, path,
+			                               with_prefix);
+		} else if (S_ISLNK(st.mode)) {
+			file->size = st.size;
+			file->rv = sha_symlink_compute(file->hash, path,
+			                               st.size);
+		} else {
+			file->rv = mm_raise_error(EINVAL, "%s is neither a "
+			                          "regular file or symlink",
+			                          path);
+		}
+
+		if (file->rv == -1) {
+			mm_log_error("Cannot compute SHA-256 of %s", path);
+			rv = -1;
+		}
+	}
+
+	sha256_multi(num_small, data, len, mds);
+
+	// Convert the hashes of small files to the format of sha_compute()
+	for (i = 0; i < num_small; i++) {
+		file = &files[idx[i]];
+		if (file->follow) {
+			hexstr = file->hash;
+			mmstr_setlen(file->hash, SHA_HEXSTR_LEN - SHA_HDRLEN);
+		} else {
+			memcpy(file->hash, SHA_HDR_REG, SHA_HDRLEN);
+			hexstr = file->hash + SHA_HDRLEN;
+			mmstr_setlen(file->hash, SHA_HEXSTR_LEN);
+		}
+
+		conv_to_hexstr(hexstr, md[i], sizeof(md[i]));
+		free((void*)data[i]);
+	}
+
+	mmstr_free(path);
+	return rv;
+}
+
 /**
  * strchr_or_end() - gives a pointer to the first occurrence of a character on
  *                   a string.
@@ -6,6 +6,7 @@
 #define UTILS_H
 
 #include <mmlog.h>
+#include <stdint.h>
 #include <stdio.h>
 #include "mmstring.h"
 
@@ -40,6 +41,8 @@ int is_path_separator(char c)
 	MMPACK_STATEDIR_RELPATH "/manually-installed.txt"
 #define REPO_INDEX_RELPATH \
 	MMPACK_STATEDIR_RELPATH "/binindex.yaml"
+#define MIRROR_STATS_RELPATH \
+	MMPACK_STATEDIR_RELPATH "/mirror-stats"
 #define METADATA_RELPATH \
 	MMPACK_STATEDIR_RELPATH "/metadata"
 
@@ -51,9 +54,34 @@ mmstr* get_config_filename(void);
 /* string of header and SHA-256 in hexa (\0 NOT incl.) */
 #define SHA_HEXSTR_LEN (SHA_HDRLEN + 32*2)
 
+int sha_fd_compute(char* hash, int fd);
 int sha_compute(mmstr* hash, const mmstr* filename, const mmstr* parent,
                 int follow);
 
+// Files hashed together by sha_compute_batch(), as many as SHA-256 lanes
+#define SHA_BATCH_MAX_FILES 8
+// Regular files larger than this are not loaded in memory to be batched
+#define SHA_BATCH_MAX_FILESIZE (64*1024)
+
+/**
+ * struct sha_file - file whose hash is computed by sha_compute_batch()
+ * @filename:   path of the file
+ * @follow:     same meaning as the argument of sha_compute()
+ * @hash:       buffer receiving the hash, at least SHA_HEXSTR_LEN long
+ * @size:       size of the file
+ * @rv:         0 if the hash has been computed, -1 otherwise
+ */
+struct sha_file {
+	const mmstr* filename;
+	int follow;
+	mmstr* hash;
+	size_t size;
+	int rv;
+};
+
+int sha_compute_batch(struct sha_file* files, int num, const mmstr* parent);
+int conv_to_hexstr(char* hexstr, const unsigned char* data, size_t len);
+
 
 mmstr* mmstr_basename(mmstr* restrict basepath, const mmstr* restrict path);
 mmstr* mmstr_dirname(mmstr* restrict dirpath, const mmstr* restrict path);
@@ -64,6 +92,36 @@ int open_file_in_prefix(const mmstr* prefix, const mmstr* relpath, int oflag);
 int map_file_in_prefix(const mmstr* prefix, const mmstr* relpath,
                        void** map, size_t* len);
 
+/**
+ * struct file_stamp - stat attributes identifying a version of a file
+ * @size:       size of the file
+ * @mtime_ns:   last modification time in nanoseconds
+ * @ctime_ns:   last status change time in nanoseconds
+ * @ino:        inode number of the file
+ */
+struct file_stamp {
+	int64_t size;
+	int64_t mtime_ns;
+	int64_t ctime_ns;
+	uint64_t ino;
+};
+
+int file_stamp_get(struct file_stamp* stamp, const mmstr* filename,
+                   const mmstr* parent);
+
+int fullwrite(int fd, const char* data, size_t size);
+int copy_file_excl(const char* src, const char* dst, int mode);
+int remove_stale_tmp(const char* tmp_path);
+
+static inline
+int file_stamp_equal(const struct file_stamp* s1, const struct file_stamp* s2)
+{
+	return (s1->size == s2->size
+	        && s1->mtime_ns == s2->mtime_ns
+	        && s1->ctime_ns == s2->ctime_ns
+	        && s1->ino == s2->ino);
+}
+
 void report_user_and_log(int mm_log_level, const char* fmt, ...);
 
 #define info(fmt, ...) report_user_and_log(MM_LOG_INFO, fmt, ## __VA_ARGS__)
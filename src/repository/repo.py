@@ -12,17 +12,35 @@ from collections import Counter
 from hashlib import sha256
 import logging
 import logging.handlers
+import lzma
 import os
 import shutil
+import subprocess
 import tarfile
 from typing import Union, Callable
 import yaml
 
 RELPATH_BINARY_INDEX = 'binary-index'
+RELPATH_BINARY_INDEX_XZ = 'binary-index.xz'
+RELPATH_BINARY_INDEX_GEN = 'binary-index.gen'
+RELPATH_BINARY_INDEX_DELTA_DIR = 'binary-index.d'
 RELPATH_SOURCE_INDEX = 'source-index'
 RELPATH_WORKING_DIR = 'working_dir'
 LOG_FILE = 'mmpack-repo.log'
 
+# Number of deltas of binary-index kept in the repository. Clients whose
+# cached index is older fetch the whole binary-index.
+MAX_BINARY_INDEX_DELTAS = 32
+
+# Suffix of the delta allowing to rebuild a binary package from the package
+# it replaces. A delta is published only if it is smaller than this ratio of
+# the size of the package.
+PKG_DELTA_EXT = '.zstpatch'
+MAX_PKG_DELTA_RATIO = 0.5
+
+# First bytes of packages whose payload is compressed with zstd
+ZSTD_MAGIC = b'\x28\xb5\x2f\xfd'
+
 
 # The functions sha256sum, yaml_serialize, and yaml_load
 # are functions that are extracted from mmpack-build/common.py. There are
@@ -85,12 +103,54 @@ def _info_mpk(pkg_path: str) -> dict:
     This function reads a mpk file and returns a dictionary containing the
     information read.
 
+    The package is read as a stream until MMPACK/info is found. For packages
+    starting with a metadata header, only the header is decompressed.
+
     Args:
         pkg_path: the path through the mkp file to read.
     """
-    with tarfile.open(pkg_path, 'r:*') as mpk:
-        buf = mpk.extractfile('./MMPACK/info').read()
-        return yaml.safe_load(buf)
+    with open(pkg_path, 'rb') as mpkfile:
+        is_zstd = mpkfile.read(len(ZSTD_MAGIC)) == ZSTD_MAGIC
+
+    if not is_zstd:
+        with tarfile.open(pkg_path, 'r|*') as mpk:
+            return _info_from_tar_stream(mpk, pkg_path)
+
+    # tarfile does not support zstd: decompress it with zstd command
+    cmd = ['zstd', '--decompress', '--stdout', '--quiet', pkg_path]
+    with subprocess.Popen(cmd, stdout=subprocess.PIPE) as proc:
+        try:
+            with tarfile.open(fileobj=proc.stdout, mode='r|') as mpk:
+                return _info_from_tar_stream(mpk, pkg_path)
+        finally:
+            proc.kill()
+
+
+def _uncompress_mpk(pkg_path: str, dst: str):
+    """
+    Write the uncompressed archive of the package file pkg_path into dst.
+    All the compressed segments of the package are decompressed.
+    """
+    with open(pkg_path, 'rb') as mpkfile:
+        is_zstd = mpkfile.read(len(ZSTD_MAGIC)) == ZSTD_MAGIC
+
+    if is_zstd:
+        subprocess.run(['zstd', '--decompress', '--quiet', '--force',
+                        pkg_path, '-o', dst], check=True)
+    else:
+        with lzma.open(pkg_path) as src, open(dst, 'wb') as out:
+            shutil.copyfileobj(src, out)
+
+
+def _info_from_tar_stream(mpk: tarfile.TarFile, pkg_path: str) -> dict:
+    """
+    Load MMPACK/info from a package opened in stream mode
+    """
+    for entry in mpk:
+        if entry.name == './MMPACK/info':
+            return yaml.safe_load(mpk.extractfile(entry).read())
+
+    raise KeyError('MMPACK/info not found in ' + pkg_path)
 
 
 def file_serialize(index: dict, filename: str):
@@ -107,6 +167,34 @@ def file_serialize(index: dict, filename: str):
             outfile.write(''.join(lines) + '\n')
 
 
+def _binindex_delta(old: dict, new: dict) -> dict:
+    """
+    Compute the changes between two binary indexes.
+
+    Args:
+        old: binary index before the changes.
+        new: binary index after the changes.
+
+    Returns:
+        dictionary of the package entries that have been added or modified
+        in *new*. The packages removed from *old* are set to None.
+    """
+    delta = {name: info for name, info in new.items()
+             if old.get(name) != info}
+    delta.update({name: None for name in old if name not in new})
+    return delta
+
+
+def _read_generation(filename: str) -> int:
+    """
+    Read generation of binary index. Returns 0 if the file does not exist.
+    """
+    try:
+        return int(open(filename, 'r').read().strip())
+    except (IOError, ValueError):
+        return 0
+
+
 def _srcid(name: str, srcsha256: str) -> str:
     return name + '_' + srcsha256
 
@@ -168,6 +256,10 @@ class Repo:
         if not os.path.isfile(srcindex_file):
             open(srcindex_file, 'w+')
 
+        delta_dir = os.path.join(abs_path_repo, RELPATH_BINARY_INDEX_DELTA_DIR)
+        if not os.path.isdir(delta_dir):
+            os.mkdir(delta_dir)
+
         self.repo_dir = abs_path_repo
         self.working_dir = os.path.abspath(os.path.join(abs_path_repo,
                                                         RELPATH_WORKING_DIR))
@@ -179,6 +271,9 @@ class Repo:
         self.binindex = yaml_load(binindex_file)
         if self.binindex is None:
             self.binindex = dict()
+        # generation: incremented each time binindex is modified
+        self.generation = _read_generation(
+            os.path.join(abs_path_repo, RELPATH_BINARY_INDEX_GEN))
         # srcindex: dictionary of the sources present on the database
         self.srcindex = file_load(srcindex_file)
         if self.srcindex is None:
@@ -257,7 +352,8 @@ class Repo:
             destination = os.path.join(self.repo_dir, filename)
             os.replace(source, destination)
 
-    def _dump_indexes_working_dir(self, to_add: set):
+    def _dump_indexes_working_dir(self, to_add: set, to_remove: set,
+                                  old_binindex: dict):
         """
         Writes the updated binary-index and source-index into the working
         directory. If no problem occurs while writting these files, then this
@@ -265,17 +361,126 @@ class Repo:
         data of the binary-index and of the source-index) and moves the
         binary-index and source-index previously written into the repository.
 
+        The changes of binary-index are also written as a new delta in
+        binary-index.d/<generation>, and the oldest delta is dropped.
+
         Args:
             to_add: set to fill with packages that MUST be removed once we are
                     sure that the upload will be a sucess.
+            to_remove: set to fill with files that MUST be removed once we
+                       are sure that the upload will be a success.
+            old_binindex: binary index before the upload.
         """
         srcindex_file = os.path.join(self.working_dir, RELPATH_SOURCE_INDEX)
         file_serialize(self.srcindex, srcindex_file)
         binindex_file = os.path.join(self.working_dir, RELPATH_BINARY_INDEX)
         self.yaml_serialize(self.binindex, binindex_file, True)
 
+        # Publish compressed binary index along the plain one
+        binindex_xz_file = os.path.join(self.working_dir,
+                                        RELPATH_BINARY_INDEX_XZ)
+        with open(binindex_file, 'rb') as infile, \
+                lzma.open(binindex_xz_file, 'wb') as outfile:
+            shutil.copyfileobj(infile, outfile)
+
         to_add.add(RELPATH_SOURCE_INDEX)
         to_add.add(RELPATH_BINARY_INDEX)
+        to_add.add(RELPATH_BINARY_INDEX_XZ)
+
+        # Write delta of binary index
+        self.generation += 1
+        os.makedirs(os.path.join(self.working_dir,
+                                 RELPATH_BINARY_INDEX_DELTA_DIR),
+                    exist_ok=True)
+        delta_relpath = os.path.join(RELPATH_BINARY_INDEX_DELTA_DIR,
+                                     str(self.generation))
+        self.yaml_serialize(_binindex_delta(old_binindex, self.binindex),
+                            os.path.join(self.working_dir, delta_relpath),
+                            True)
+        to_add.add(delta_relpath)
+
+        old_gen = self.generation - MAX_BINARY_INDEX_DELTAS
+        old_delta = os.path.join(RELPATH_BINARY_INDEX_DELTA_DIR, str(old_gen))
+        if os.path.isfile(os.path.join(self.repo_dir, old_delta)):
+            to_remove.add(old_delta)
+
+    def _commit_generation(self):
+        """
+        Publishes the generation of binary-index. This must be done once
+        binary-index and its delta have been moved in the repository, so that
+        a client never sees a generation whose delta is not available.
+        """
+        gen_file = os.path.join(self.working_dir, RELPATH_BINARY_INDEX_GEN)
+        with open(gen_file, 'w', newline='\n') as outfile:
+            outfile.write('{}\n'.format(self.generation))
+
+        os.replace(gen_file,
+                   os.path.join(self.repo_dir, RELPATH_BINARY_INDEX_GEN))
+
+    def _make_pkg_delta(self, prev_pkginfo: dict, pkginfo: dict,
+                        to_add: set) -> dict:
+        """
+        Generates the delta allowing clients to rebuild the uncompressed
+        archive of an uploaded binary package from the package it replaces.
+        The delta is computed between the uncompressed archives of both
+        packages (zstd --patch-from): deltas of compressed streams would be
+        as large as the package. The hash of the uncompressed archive of the
+        replaced package is published too, so that a client which has itself
+        rebuilt it from a delta can use it as base. The delta is skipped if zstd is not
+        available or if the delta is not significantly smaller than the
+        package.
+
+        Args:
+            prev_pkginfo: binary-index entry of the replaced package.
+            pkginfo: manifest entry of the uploaded package.
+            to_add: set to fill with the delta file if generated.
+
+        Returns:
+            the fields to add to the binary-index entry of the uploaded
+            package. Empty if no delta has been generated.
+        """
+        base = os.path.join(self.repo_dir, prev_pkginfo['filename'])
+        if prev_pkginfo['filename'] == pkginfo['file'] \
+                or not os.path.isfile(base):
+            return {}
+
+        delta_file = pkginfo['file'] + PKG_DELTA_EXT
+        delta = os.path.join(self.working_dir, delta_file)
+        base_tar = delta + '.base.tar'
+        new_tar = delta + '.tar'
+        try:
+            _uncompress_mpk(base, base_tar)
+            _uncompress_mpk(os.path.join(self.working_dir, pkginfo['file']),
+                            new_tar)
+            subprocess.run(['zstd', '-q', '-f', '-19',
+                            '--patch-from=' + base_tar, new_tar,
+                            '-o', delta],
+                           check=True)
+            base_tar_sha256 = sha256sum(base_tar)
+            target_sha256 = sha256sum(new_tar)
+        except (OSError, lzma.LZMAError, subprocess.CalledProcessError):
+            self.logger.info('No delta generated for {}'
+                             .format(pkginfo['file']))
+            if os.path.exists(delta):
+                os.remove(delta)
+            return {}
+        finally:
+            for tmpfile in (base_tar, new_tar):
+                if os.path.exists(tmpfile):
+                    os.remove(tmpfile)
+
+        delta_size = os.path.getsize(delta)
+        if delta_size >= int(pkginfo['size']) * MAX_PKG_DELTA_RATIO:
+            os.remove(delta)
+            return {}
+
+        to_add.add(delta_file)
+        return {'delta-filename': delta_file,
+                'delta-sha256': sha256sum(delta),
+                'delta-base-sha256': prev_pkginfo['sha256'],
+                'delta-base-tar-sha256': base_tar_sha256,
+                'delta-target-sha256': target_sha256,
+                'delta-size': delta_size}
 
     def _prepare_upload(self, manifest: dict, to_remove: set, to_add: set):
         """
@@ -328,6 +533,8 @@ class Repo:
             prev_pkginfo = self.binindex.get(pkg_name)
             if prev_pkginfo:
                 to_remove.add(prev_pkginfo['filename'])
+                if 'delta-filename' in prev_pkginfo:
+                    to_remove.add(prev_pkginfo['delta-filename'])
                 prev_id = _srcid(prev_pkginfo['source'],
                                  prev_pkginfo['srcsha256'])
                 self.count_src_refs[prev_id] -= 1
@@ -341,6 +548,9 @@ class Repo:
             buf[pkg_name].update({'filename': pkginfo['file'],
                                   'size': pkginfo['size'],
                                   'sha256': pkginfo['sha256']})
+            if prev_pkginfo:
+                buf[pkg_name].update(self._make_pkg_delta(prev_pkginfo,
+                                                          pkginfo, to_add))
 
             self.binindex.update(buf)
 
@@ -353,14 +563,16 @@ class Repo:
         """
         to_add = set()
         to_remove = set()
+        old_binindex = self.binindex.copy()
         # Update the binary-index and the source-index with the new packages
         # and upload binary packages and remove the binary packages that are
         # not needed anymore
         self._prepare_upload(manifest, to_remove, to_add)
 
         # Remove the files that are not needed anymore
-        self._dump_indexes_working_dir(to_add)
+        self._dump_indexes_working_dir(to_add, to_remove, old_binindex)
         self._commit_upload(to_add, to_remove)
+        self._commit_generation()
 
     def _mv_files_working_dir(self, manifest_file: str, manifest: dict,
                               mv_op: Callable[[str, str], None]):
@@ -413,6 +625,7 @@ class Repo:
             backup_srcindex = self.srcindex.copy()
             backup_binindex = self.binindex.copy()
             backup_counter = self.count_src_refs.copy()
+            backup_generation = self.generation
 
             os.mkdir(self.working_dir)
             self.logger.info('Checking {}'.format(manifest_file))
@@ -428,5 +641,6 @@ class Repo:
             self.srcindex = backup_srcindex
             self.binindex = backup_binindex
             self.count_src_refs = backup_counter
+            self.generation = backup_generation
         finally:
             shutil.rmtree(self.working_dir)
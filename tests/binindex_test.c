@@ -84,6 +84,43 @@ int check_pkg_fully_set(struct mmpkg* pkg, void * data)
 
 
 
+START_TEST(test_delta_fields)
+{
+	int rv;
+	struct repolist_elt repo;
+	struct mmpkg const * pkg;
+	struct from_repo const * from;
+	STATIC_CONST_MMSTR(pkg_name, "pkg-a");
+
+	repo.url = mmstr_malloc_from_cstr("http://url_delta.com");
+	repo.name = mmstr_malloc_from_cstr("name_delta");
+
+	rv = binindex_populate(&binary_index, TEST_BININDEX_DIR"/delta.yaml",
+	                       &repo);
+	ck_assert(rv == 0);
+
+	pkg = binindex_lookup(&binary_index, pkg_name, NULL);
+	ck_assert(pkg != NULL);
+	from = pkg->from_repo;
+	ck_assert(from != NULL);
+	ck_assert_str_eq(from->delta_filename,
+	                 "pool/pkg-a_0.0.2_amd64-gnu-linux.mpk.zstpatch");
+	ck_assert_str_eq(from->delta_base, "0b3e0ae3c2f7c3d3fa0b9e4f3d0a7f9c"
+	                                   "5a1f4f1e7b8c9d0e1f2a3b4c5d6e7f80");
+	ck_assert_str_eq(from->delta_base_tar,
+	                 "6c2d1e0f9a8b7c6d5e4f30211203f4e5"
+	                 "d6c7b8a9f0e1d2c3b4a5968778695a4b");
+	ck_assert_str_eq(from->delta_target, "9a7f0b3c1d2e4f5061728394a5b6c7d8"
+	                                     "e9f00112233445566778899aabbccdd0");
+	ck_assert(from->delta_sha256 != NULL);
+	ck_assert_int_eq(from->delta_size, 12);
+
+	mmstr_free(repo.url);
+	mmstr_free(repo.name);
+}
+END_TEST
+
+
 START_TEST(test_deduplicate)
 {
 	int rv;
@@ -124,6 +161,7 @@ TCase* create_binindex_tcase(void)
 
     tcase_add_loop_test(tc, test_binindex_parsing, 0, NUM_BININDEXES);
     tcase_add_test(tc, test_deduplicate);
+    tcase_add_test(tc, test_delta_fields);
 
     return tc;
 }
@@ -7,11 +7,13 @@
 #endif
 
 #include <check.h>
+#include <stdio.h>
 
 #include "settings.h"
 #include "testcases.h"
 
 #define TEST_CONFIG SRCDIR"/tests/mmpack-config.yaml"
+#define BAD_SIZE_CONFIG BUILDDIR"/bad-size-config.yaml"
 
 START_TEST(test_parse_settings)
 {
@@ -28,11 +30,35 @@ START_TEST(test_parse_settings)
 	ck_assert_str_eq(settings_get_repo_url(&settings, 2), "http://another.host.com/");
 
 	ck_assert_str_eq(settings.default_prefix, "a/path/to/prefix");
+	ck_assert_int_eq(settings.max_parallel_downloads, 3);
+	ck_assert_int_eq(settings.max_host_connections,
+	                 DEFAULT_MAX_HOST_CONNECTIONS);
+	ck_assert(settings.pkg_cache_max_size == 300*1024*1024);
 
 	settings_deinit(&settings);
 }
 END_TEST
 
+
+START_TEST(test_parse_bad_size)
+{
+	struct settings settings;
+	FILE* fp;
+
+	fp = fopen(BAD_SIZE_CONFIG, "w");
+	ck_assert(fp != NULL);
+	fputs("pkg-cache-max-size: 300MB\n", fp);
+	fclose(fp);
+
+	// An invalid size must not be read as unlimited cache
+	settings_init(&settings);
+	ck_assert(settings_load(&settings, BAD_SIZE_CONFIG) != 0);
+	settings_deinit(&settings);
+
+	remove(BAD_SIZE_CONFIG);
+}
+END_TEST
+
 TCase* create_config_tcase(void)
 {
     TCase * tc;
@@ -40,6 +66,7 @@ TCase* create_config_tcase(void)
     tc = tcase_create("config");
 
     tcase_add_test(tc, test_parse_settings);
+    tcase_add_test(tc, test_parse_bad_size);
 
     return tc;
 }
@@ -7,8 +7,17 @@
 
 #include <check.h>
 #include <stdint.h>
+#include <stdio.h>
+#include <string.h>
 
+#include <mmsysio.h>
+
+#include "dir-cache.h"
+#include "file-batch.h"
+#include "mirror-stats.h"
 #include "mmstring.h"
+#include "object-store.h"
+#include "settings.h"
 #include "testcases.h"
 #include "utils.h"
 #include "common.h"
@@ -107,6 +116,287 @@ START_TEST(next_pow2)
 }
 END_TEST
 
+/**************************************************************************
+ *                                                                        *
+ *                          Mirror ranking tests                          *
+ *                                                                        *
+ **************************************************************************/
+START_TEST(rank_mirrors)
+{
+	struct repolist_elt repos[3] = {
+		{.url = mmstr_malloc_from_cstr("http://slow")},
+		{.url = mmstr_malloc_from_cstr("http://fast")},
+		{.url = mmstr_malloc_from_cstr("http://unknown")},
+	};
+	struct from_repo from[3];
+	struct download_metrics slow = {
+		.connect_time = 0.5, .total_time = 10.5, .size = 1024*1024,
+	};
+	struct download_metrics fast = {
+		.connect_time = 0.1, .total_time = 1.1, .size = 1024*1024,
+	};
+	struct download_metrics reused = {
+		.connect_time = 0.0, .total_time = 0.01, .size = 100,
+		.reused = 1,
+	};
+	struct mirror_stats stats;
+	const struct from_repo** ranked;
+	double estimate;
+	int i, num;
+
+	for (i = 0; i < 3; i++)
+		from[i] = (struct from_repo) {
+			.size = 1024*1024,
+			.repo = &repos[i],
+			.next = (i < 2) ? &from[i+1] : NULL,
+		};
+
+	mirror_stats_init(&stats);
+
+	// Without stats, the order of the list is kept
+	ranked = mirror_stats_rank(&stats, &from[0], &num);
+	ck_assert_int_eq(num, 3);
+	for (i = 0; i < 3; i++)
+		ck_assert(ranked[i] == &from[i]);
+
+	free(ranked);
+
+	// Measured mirrors are ranked by expected transfer time, those never
+	// used are tried first
+	mirror_stats_update(&stats, repos[0].url, &slow, 0);
+	mirror_stats_update(&stats, repos[1].url, &fast, 0);
+	ranked = mirror_stats_rank(&stats, &from[0], &num);
+	ck_assert_int_eq(num, 3);
+	ck_assert(ranked[0] == &from[2]);
+	ck_assert(ranked[1] == &from[1]);
+	ck_assert(ranked[2] == &from[0]);
+	free(ranked);
+
+	// Transfers over a reused connection do not lower the connect time
+	estimate = mirror_stats_estimate(&stats, repos[0].url, 1024*1024);
+	mirror_stats_update(&stats, repos[0].url, &reused, 0);
+	ck_assert(mirror_stats_estimate(&stats, repos[0].url, 1024*1024)
+	          == estimate);
+
+	// Repeated failures demote a mirror
+	for (i = 0; i < 3; i++)
+		mirror_stats_update(&stats, repos[1].url, &fast, -1);
+
+	ck_assert(mirror_stats_estimate(&stats, repos[1].url, 1024*1024)
+	          > mirror_stats_estimate(&stats, repos[0].url, 1024*1024));
+
+	mirror_stats_deinit(&stats);
+	for (i = 0; i < 3; i++)
+		mmstr_free(repos[i].url);
+}
+END_TEST
+
+/**************************************************************************
+ *                                                                        *
+ *                           Object store tests                           *
+ *                                                                        *
+ **************************************************************************/
+#define OBJSTORE_TEST_DIR BUILDDIR"/objstore"
+
+START_TEST(object_store_roundtrip)
+{
+	STATIC_CONST_MMSTR(sumsha, "0123456789abcdef");
+	const char* src = OBJSTORE_TEST_DIR"/src";
+	const char* dst = OBJSTORE_TEST_DIR"/dst";
+	const char* dst2 = OBJSTORE_TEST_DIR"/dst2";
+	char obj[256], ref[SHA_HEXSTR_LEN + 1];
+	struct objstore_manifest manifest;
+	struct objstore_reader reader;
+	struct objstore_entry entry;
+	struct mm_stat st;
+	mmstr* store;
+	int fd;
+
+	mm_remove(OBJSTORE_TEST_DIR, MM_RECURSIVE|MM_DT_ANY);
+	mm_mkdir(OBJSTORE_TEST_DIR, 0777, MM_RECURSIVE);
+	store = mmstr_malloc_from_cstr(OBJSTORE_TEST_DIR"/store");
+
+	fd = mm_open(src, O_WRONLY|O_CREAT|O_TRUNC, 0666);
+	ck_assert(fd >= 0);
+	ck_assert_int_eq(mm_write(fd, "content", 7), 7);
+	mm_close(fd);
+
+	// Store a package made of a folder, a read-only file and a symlink
+	ck_assert(!objstore_has_pkg(store, sumsha));
+	objstore_manifest_init(&manifest, store, sumsha);
+	objstore_manifest_add(&manifest, OBJSTORE_DIR, 0755, NULL, "share");
+	ck_assert(objstore_manifest_add_regfile(&manifest, src, 0444,
+	                                        "share/file") == 0);
+	objstore_manifest_add(&manifest, OBJSTORE_SYMLINK, 0777, "file",
+	                      "share/link");
+	ck_assert(objstore_manifest_commit(&manifest) == 0);
+	objstore_manifest_deinit(&manifest);
+	ck_assert(objstore_has_pkg(store, sumsha));
+
+	// Read back the manifest and materialize the regular file
+	ck_assert(objstore_reader_open(&reader, store, sumsha) == 0);
+
+	ck_assert_int_eq(objstore_reader_next(&reader, &entry), 1);
+	ck_assert_int_eq(entry.type, OBJSTORE_DIR);
+	ck_assert_str_eq(entry.path, "share");
+
+	ck_assert_int_eq(objstore_reader_next(&reader, &entry), 1);
+	ck_assert_int_eq(entry.type, OBJSTORE_REG);
+	ck_assert_int_eq(entry.mode, 0444);
+	ck_assert_str_eq(entry.path, "share/file");
+	ck_assert(objstore_materialize(store, entry.ref, entry.mode, dst) == 0);
+	ck_assert(mm_stat(dst, &st, 0) == 0);
+	ck_assert_int_eq(st.size, 7);
+	sprintf(obj, OBJSTORE_TEST_DIR"/store/objects/%s.0444", entry.ref);
+	strcpy(ref, entry.ref);
+
+	ck_assert_int_eq(objstore_reader_next(&reader, &entry), 1);
+	ck_assert_int_eq(entry.type, OBJSTORE_SYMLINK);
+	ck_assert_str_eq(entry.ref, "file");
+	ck_assert_str_eq(entry.path, "share/link");
+
+	ck_assert_int_eq(objstore_reader_next(&reader, &entry), 0);
+	objstore_reader_close(&reader);
+
+	// An altered object is not used and is dropped from the store
+	ck_assert(mm_unlink(obj) == 0);
+	fd = mm_open(obj, O_WRONLY|O_CREAT|O_TRUNC, 0444);
+	ck_assert(fd >= 0);
+	ck_assert_int_eq(mm_write(fd, "altered", 7), 7);
+	mm_close(fd);
+	ck_assert(objstore_materialize(store, ref, 0444, dst2) != 0);
+	ck_assert(mm_check_access(dst2, F_OK) != 0);
+	ck_assert(mm_check_access(obj, F_OK) != 0);
+
+	// A symlink planted in place of an object is rejected even if the
+	// file it points to has the expected content
+	ck_assert(mm_symlink(src, obj) == 0);
+	ck_assert(objstore_materialize(store, ref, 0444, dst2) != 0);
+	ck_assert(mm_check_access(dst2, F_OK) != 0);
+	ck_assert(mm_stat(obj, &st, MM_NOFOLLOW) != 0);
+
+	mmstr_free(store);
+	mm_remove(OBJSTORE_TEST_DIR, MM_RECURSIVE|MM_DT_ANY);
+}
+END_TEST
+
+
+START_TEST(object_store_untrusted_manifest)
+{
+	STATIC_CONST_MMSTR(sumsha, "0123456789abcdef");
+	const char* bad_paths[] = {"/etc/passwd", "../escape", "share/../..",
+	                           ""};
+	struct objstore_manifest manifest;
+	struct objstore_reader reader;
+	struct objstore_entry entry;
+	mmstr* store;
+	int i;
+
+	mm_remove(OBJSTORE_TEST_DIR, MM_RECURSIVE|MM_DT_ANY);
+	store = mmstr_malloc_from_cstr(OBJSTORE_TEST_DIR"/store");
+
+	// Paths escaping the prefix are rejected when reading the manifest
+	for (i = 0; i < MM_NELEM(bad_paths); i++) {
+		objstore_manifest_init(&manifest, store, sumsha);
+		objstore_manifest_add(&manifest, OBJSTORE_SYMLINK, 0777,
+		                      "target", bad_paths[i]);
+		ck_assert(objstore_manifest_commit(&manifest) == 0);
+		objstore_manifest_deinit(&manifest);
+
+		ck_assert(objstore_reader_open(&reader, store, sumsha) == 0);
+		ck_assert_int_eq(objstore_reader_next(&reader, &entry), -1);
+		objstore_reader_close(&reader);
+		mm_remove(OBJSTORE_TEST_DIR, MM_RECURSIVE|MM_DT_ANY);
+	}
+
+	// Regular file entries must refer to an object by its hash
+	objstore_manifest_init(&manifest, store, sumsha);
+	objstore_manifest_add(&manifest, OBJSTORE_REG, 0644, "../../file",
+	                      "share/file");
+	ck_assert(objstore_manifest_commit(&manifest) == 0);
+	objstore_manifest_deinit(&manifest);
+	ck_assert(objstore_reader_open(&reader, store, sumsha) == 0);
+	ck_assert_int_eq(objstore_reader_next(&reader, &entry), -1);
+	objstore_reader_close(&reader);
+	mm_remove(OBJSTORE_TEST_DIR, MM_RECURSIVE|MM_DT_ANY);
+
+	// Names that would break the manifest format cannot be stored
+	objstore_manifest_init(&manifest, store, sumsha);
+	objstore_manifest_add(&manifest, OBJSTORE_DIR, 0755, NULL,
+	                      "share/new\nline");
+	ck_assert(objstore_manifest_commit(&manifest) != 0);
+	objstore_manifest_deinit(&manifest);
+	ck_assert(!objstore_has_pkg(store, sumsha));
+
+	mmstr_free(store);
+}
+END_TEST
+
+/**************************************************************************
+ *                                                                        *
+ *                         Unpack directory tests                         *
+ *                                                                        *
+ **************************************************************************/
+#define DIRCACHE_TEST_DIR BUILDDIR"/dircache"
+
+START_TEST(dir_cache_ops)
+{
+	struct dir_cache dirs;
+	struct file_batch batch;
+	struct mm_stat st;
+	void* data;
+	int fd;
+
+	mm_remove(DIRCACHE_TEST_DIR, MM_RECURSIVE|MM_DT_ANY);
+	ck_assert(dir_cache_init(&dirs) == 0);
+
+	// Create a tree recursively, then a sibling from the known parent
+	ck_assert(dir_cache_mkdir(&dirs, DIRCACHE_TEST_DIR"/tmp/") == 0);
+	ck_assert(dir_cache_mkdir(&dirs, DIRCACHE_TEST_DIR"/a/b") == 0);
+	ck_assert(dir_cache_mkdir(&dirs, DIRCACHE_TEST_DIR"/a/c") == 0);
+	ck_assert(dir_cache_mkdir(&dirs, DIRCACHE_TEST_DIR"/a/c") == 0);
+	ck_assert(mm_stat(DIRCACHE_TEST_DIR"/a/c", &st, 0) == 0);
+	ck_assert(S_ISDIR(st.mode));
+
+	// Files and symlinks already present are replaced
+	fd = dir_cache_create_file(&dirs, DIRCACHE_TEST_DIR"/tmp/0", 0666);
+	ck_assert(fd >= 0);
+	ck_assert_int_eq(mm_write(fd, "previous", 8), 8);
+	mm_close(fd);
+	fd = dir_cache_create_file(&dirs, DIRCACHE_TEST_DIR"/tmp/0", 0666);
+	ck_assert(fd >= 0);
+	ck_assert_int_eq(mm_write(fd, "new", 3), 3);
+	mm_close(fd);
+	ck_assert(dir_cache_symlink(&dirs, "x", DIRCACHE_TEST_DIR"/tmp/1") == 0);
+	ck_assert(dir_cache_symlink(&dirs, "0", DIRCACHE_TEST_DIR"/tmp/1") == 0);
+
+	ck_assert(dir_cache_rename(&dirs, DIRCACHE_TEST_DIR"/tmp/0",
+	                           DIRCACHE_TEST_DIR"/a/b/file") == 0);
+	ck_assert(dir_cache_rename(&dirs, DIRCACHE_TEST_DIR"/tmp/1",
+	                           DIRCACHE_TEST_DIR"/a/c/link") == 0);
+	ck_assert(mm_stat(DIRCACHE_TEST_DIR"/a/b/file", &st, 0) == 0);
+	ck_assert_int_eq(st.size, 3);
+	ck_assert(mm_stat(DIRCACHE_TEST_DIR"/a/c/link", &st, MM_NOFOLLOW) == 0);
+	ck_assert(S_ISLNK(st.mode));
+
+	// Same through a batch if supported by the system
+	if (file_batch_init(&batch, &dirs) == 0) {
+		ck_assert(file_batch_add_file(&batch, DIRCACHE_TEST_DIR"/tmp/2",
+		                              0644, 5, &data) == 0);
+		memcpy(data, "batch", 5);
+		ck_assert(file_batch_add_rename(&batch, DIRCACHE_TEST_DIR"/tmp/2",
+		                                DIRCACHE_TEST_DIR"/a/c/file") == 0);
+		ck_assert(file_batch_flush(&batch) == 0);
+		ck_assert(mm_stat(DIRCACHE_TEST_DIR"/a/c/file", &st, 0) == 0);
+		ck_assert_int_eq(st.size, 5);
+		file_batch_deinit(&batch);
+	}
+
+	dir_cache_deinit(&dirs);
+	mm_remove(DIRCACHE_TEST_DIR, MM_RECURSIVE|MM_DT_ANY);
+}
+END_TEST
+
 /**************************************************************************
  *                                                                        *
  *                          Test suite setup                              *
@@ -120,6 +410,10 @@ TCase* create_misc_tcase(void)
 	tcase_add_test(tc, parse_dirname);
 	tcase_add_test(tc, parse_basename);
 	tcase_add_test(tc, next_pow2);
+	tcase_add_test(tc, rank_mirrors);
+	tcase_add_test(tc, object_store_roundtrip);
+	tcase_add_test(tc, object_store_untrusted_manifest);
+	tcase_add_test(tc, dir_cache_ops);
 
 	return tc;
 }
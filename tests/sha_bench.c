@@ -0,0 +1,139 @@
+/*
+ * @mindmaze_header@
+ */
+
+#if defined (HAVE_CONFIG_H)
+# include <config.h>
+#endif
+
+#include <mmtime.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "sha256.h"
+
+/*
+ * Throughput benchmark of the SHA-256 implementations. It is run with the
+ * long tests: each implementation supported by the host hashes the same
+ * amount of data and its throughput is printed in MiB/s. Nothing is checked
+ * here, the correctness of the implementations is the business of the unit
+ * tests.
+ */
+
+#define BENCH_BUFFER_SIZE       (1024*1024)
+#define BENCH_NUM_BUFFERS       64
+
+
+static
+double throughput(const struct mm_timespec* start,
+                  const struct mm_timespec* stop)
+{
+	int64_t elapsed_ns;
+
+	elapsed_ns = mm_timediff_ns(stop, start);
+	if (elapsed_ns <= 0)
+		elapsed_ns = 1;
+
+	return BENCH_NUM_BUFFERS * 1.0e9 / elapsed_ns;
+}
+
+
+/**
+ * bench_impl() - measure throughput of a SHA-256 compression implementation
+ * @impl:       SHA256_IMPL_* value
+ * @buffer:     BENCH_BUFFER_SIZE long data to hash
+ *
+ * A single message made of BENCH_NUM_BUFFERS times @buffer is hashed.
+ */
+static
+void bench_impl(int impl, const unsigned char* buffer)
+{
+	unsigned char md[SHA256_BLOCK_SIZE];
+	struct mm_timespec start, stop;
+	SHA256_CTX ctx;
+	int i;
+
+	if (sha256_set_impl(impl)) {
+		printf("SHA-256 %s: not supported\n", sha256_impl_name(impl));
+		return;
+	}
+
+	mm_gettime(MM_CLK_MONOTONIC, &start);
+	sha256_init(&ctx);
+	for (i = 0; i < BENCH_NUM_BUFFERS; i++)
+		sha256_update(&ctx, buffer, BENCH_BUFFER_SIZE);
+
+	sha256_final(&ctx, md);
+	mm_gettime(MM_CLK_MONOTONIC, &stop);
+
+	printf("SHA-256 %s: %.1f MiB/s\n", sha256_impl_name(impl),
+	       throughput(&start, &stop));
+}
+
+
+/**
+ * bench_mb_impl() - measure throughput of a multi-buffer SHA-256 engine
+ * @impl:       SHA256_MB_IMPL_* value
+ * @buffer:     BENCH_BUFFER_SIZE long data to hash
+ *
+ * SHA256_MB_MAX_LANES messages (each being @buffer) are hashed at once until
+ * BENCH_NUM_BUFFERS messages have been hashed.
+ */
+static
+void bench_mb_impl(int impl, const unsigned char* buffer)
+{
+	unsigned char md[SHA256_MB_MAX_LANES][SHA256_BLOCK_SIZE];
+	unsigned char* hash[SHA256_MB_MAX_LANES];
+	const void* data[SHA256_MB_MAX_LANES];
+	size_t len[SHA256_MB_MAX_LANES];
+	struct mm_timespec start, stop;
+	int i;
+
+	if (sha256_mb_set_impl(impl)) {
+		printf("SHA-256 multi-buffer %s: not supported\n",
+		       sha256_mb_impl_name(impl));
+		return;
+	}
+
+	for (i = 0; i < SHA256_MB_MAX_LANES; i++) {
+		data[i] = buffer;
+		len[i] = BENCH_BUFFER_SIZE;
+		hash[i] = md[i];
+	}
+
+	mm_gettime(MM_CLK_MONOTONIC, &start);
+	for (i = 0; i < BENCH_NUM_BUFFERS; i += SHA256_MB_MAX_LANES)
+		sha256_multi(SHA256_MB_MAX_LANES, data, len, hash);
+
+	mm_gettime(MM_CLK_MONOTONIC, &stop);
+
+	printf("SHA-256 multi-buffer %s: %.1f MiB/s\n",
+	       sha256_mb_impl_name(impl), throughput(&start, &stop));
+}
+
+
+int main(void)
+{
+	unsigned char* buffer;
+	int i, default_impl;
+
+	buffer = malloc(BENCH_BUFFER_SIZE);
+	if (!buffer)
+		return EXIT_FAILURE;
+
+	for (i = 0; i < BENCH_BUFFER_SIZE; i++)
+		buffer[i] = rand();
+
+	default_impl = sha256_get_impl();
+	for (i = 0; i < SHA256_NUM_IMPL; i++)
+		bench_impl(i, buffer);
+
+	// Serial engine hashes with the implementation selected by default
+	sha256_set_impl(default_impl);
+	for (i = 0; i < SHA256_MB_NUM_IMPL; i++)
+		bench_mb_impl(i, buffer);
+
+	free(buffer);
+	return EXIT_SUCCESS;
+}
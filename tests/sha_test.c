@@ -14,6 +14,7 @@
 #include <stdlib.h>
 
 #include "mmstring.h"
+#include "sha256.h"
 #include "utils.h"
 #include "testcases.h"
 
@@ -34,6 +35,7 @@ struct {
 	{.len =  515, .name = "afile2"},
 	{.len =  16 << 10, .name = "large_file"},
 	{.len =  (16 << 10) + 63, .name = "large_file2"},
+	{.len =  (9 << 20) + 17, .name = "huge_file"},
 };
 #define NUM_HASH_CASES	MM_NELEM(sha_cases)
 
@@ -60,6 +62,27 @@ struct {
 };
 #define NUM_SYMLINK_CASES       MM_NELEM(symlink_cases)
 
+// FIPS 180-2 test vectors
+static
+struct {
+	const char* msg;
+	int repeat;
+	char refhash[SHA_HEXSTR_LEN - SHA_HDRLEN + 1];
+} vector_cases[] = {
+	{.msg = "", .repeat = 1,
+	 .refhash = "e3b0c44298fc1c149afbf4c8996fb92427ae41e4649b934ca495991b7852b855"},
+	{.msg = "abc", .repeat = 1,
+	 .refhash = "ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad"},
+	{.msg = "abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq", .repeat = 1,
+	 .refhash = "248d6a61d20638b8e5c026930c3e6039a33ce45964ff2167f6ecedd419db06c1"},
+	{.msg = "a", .repeat = 1000000,
+	 .refhash = "cdc76e5c9914fb9281a1c7e284d73e67f1809a48a497200e046d39ccc7112cd0"},
+};
+#define NUM_VECTOR_CASES        MM_NELEM(vector_cases)
+
+static int default_sha256_impl;
+static int default_sha256_mb_impl;
+
 /**************************************************************************
  *                                                                        *
  *                    setup and cleanup test environment                  *
@@ -163,6 +186,22 @@ void sha_cleanup(void)
 }
 
 
+static
+void sha_impl_setup(void)
+{
+	default_sha256_impl = sha256_get_impl();
+	default_sha256_mb_impl = sha256_mb_get_impl();
+}
+
+
+static
+void sha_impl_teardown(void)
+{
+	sha256_set_impl(default_sha256_impl);
+	sha256_mb_set_impl(default_sha256_mb_impl);
+}
+
+
 /**************************************************************************
  *                                                                        *
  *                         Hash test functions                            *
@@ -171,11 +210,24 @@ void sha_cleanup(void)
 STATIC_CONST_MMSTR(hashfile_dir, HASHFILE_DIR);
 
 
+/*
+ * The hash tests are run for each case with each implementation of SHA-256
+ * supported by the CPU: the loop index encodes both the test case and the
+ * implementation.
+ */
+#define CASE_INDEX(i, num_case)  ((i) % (num_case))
+#define IMPL_INDEX(i, num_case)  ((i) / (num_case))
+
+
 START_TEST(hashfile_with_parent)
 {
+	int i = CASE_INDEX(_i, NUM_HASH_CASES);
 	mmstr* hash = mmstr_alloca(SHA_HEXSTR_LEN);
-	const mmstr* filename = mmstr_alloca_from_cstr(sha_cases[_i].name);
-	const mmstr* refhash = mmstr_alloca_from_cstr(sha_cases[_i].refhash);
+	const mmstr* filename = mmstr_alloca_from_cstr(sha_cases[i].name);
+	const mmstr* refhash = mmstr_alloca_from_cstr(sha_cases[i].refhash);
+
+	if (sha256_set_impl(IMPL_INDEX(_i, NUM_HASH_CASES)))
+		return;
 
 	sha_compute(hash, filename, hashfile_dir, 0);
 	ck_assert_str_eq(hash, refhash);
@@ -187,10 +239,14 @@ END_TEST
 
 START_TEST(hashfile_without_parent)
 {
+	int i = CASE_INDEX(_i, NUM_HASH_CASES);
 	mmstr* hash = mmstr_alloca(SHA_HEXSTR_LEN);
 	mmstr* fullpath = mmstr_alloca(256);
-	const mmstr* filename = mmstr_alloca_from_cstr(sha_cases[_i].name);
-	const mmstr* refhash = mmstr_alloca_from_cstr(sha_cases[_i].refhash);
+	const mmstr* filename = mmstr_alloca_from_cstr(sha_cases[i].name);
+	const mmstr* refhash = mmstr_alloca_from_cstr(sha_cases[i].refhash);
+
+	if (sha256_set_impl(IMPL_INDEX(_i, NUM_HASH_CASES)))
+		return;
 
 	mmstr_join_path(fullpath, hashfile_dir, filename);
 
@@ -204,13 +260,17 @@ END_TEST
 
 START_TEST(hash_symlink)
 {
+	int i = CASE_INDEX(_i, NUM_SYMLINK_CASES);
 	mmstr* hash = mmstr_alloca(SHA_HEXSTR_LEN);
-	const mmstr* filename = mmstr_alloca_from_cstr(symlink_cases[_i].name);
-	const char* refhash = symlink_cases[_i].refhash;
-	const char* refhash_follow = symlink_cases[_i].refhash_follow;
-	int expected_rv = symlink_cases[_i].is_reg_target ? 0 : -1;
+	const mmstr* filename = mmstr_alloca_from_cstr(symlink_cases[i].name);
+	const char* refhash = symlink_cases[i].refhash;
+	const char* refhash_follow = symlink_cases[i].refhash_follow;
+	int expected_rv = symlink_cases[i].is_reg_target ? 0 : -1;
 	int rv;
 
+	if (sha256_set_impl(IMPL_INDEX(_i, NUM_SYMLINK_CASES)))
+		return;
+
 	ck_assert(sha_compute(hash, filename, hashfile_dir, 0) == 0);
 	ck_assert_str_eq(hash, refhash);
 
@@ -221,6 +281,125 @@ START_TEST(hash_symlink)
 }
 END_TEST
 
+/**
+ * hash_vector() - compute the hash of a test vector
+ * @hash:       buffer receiving the hash in hexadecimal
+ * @i:          index of the test vector
+ * @chunk_len:  maximum length of data passed at once to sha256_update()
+ */
+static
+void hash_vector(char* hash, int i, size_t chunk_len)
+{
+	unsigned char md[SHA256_BLOCK_SIZE];
+	const char* msg = vector_cases[i].msg;
+	size_t len, off, n;
+	SHA256_CTX ctx;
+	int j;
+
+	len = strlen(msg);
+	sha256_init(&ctx);
+	for (j = 0; j < vector_cases[i].repeat; j++) {
+		for (off = 0; off < len; off += n) {
+			n = (len - off < chunk_len) ? len - off : chunk_len;
+			sha256_update(&ctx, msg + off, n);
+		}
+	}
+
+	sha256_final(&ctx, md);
+	len = conv_to_hexstr(hash, md, sizeof(md));
+	hash[len] = '\0';
+}
+
+
+START_TEST(hash_vectors)
+{
+	int i = CASE_INDEX(_i, NUM_VECTOR_CASES);
+	char hash[SHA_HEXSTR_LEN + 1];
+	size_t chunk_lens[] = {1, 3, 63, 64, 65, SIZE_MAX};
+	int j;
+
+	if (sha256_set_impl(IMPL_INDEX(_i, NUM_VECTOR_CASES)))
+		return;
+
+	// Feed the data by chunks not aligned on block size
+	for (j = 0; j < MM_NELEM(chunk_lens); j++) {
+		hash_vector(hash, i, chunk_lens[j]);
+		ck_assert_str_eq(hash, vector_cases[i].refhash);
+	}
+}
+END_TEST
+
+
+START_TEST(hash_multi_vectors)
+{
+	unsigned char md[NUM_VECTOR_CASES][SHA256_BLOCK_SIZE];
+	unsigned char* mds[NUM_VECTOR_CASES];
+	const void* data[NUM_VECTOR_CASES];
+	size_t len[NUM_VECTOR_CASES];
+	char hash[SHA_HEXSTR_LEN + 1];
+	char* msg;
+	int i, j, num;
+
+	if (sha256_mb_set_impl(_i))
+		return;
+
+	for (i = 0; i < NUM_VECTOR_CASES; i++) {
+		len[i] = strlen(vector_cases[i].msg) * vector_cases[i].repeat;
+		msg = malloc(len[i] + 1);
+		for (j = 0; j < vector_cases[i].repeat; j++)
+			strcpy(msg + j * strlen(vector_cases[i].msg),
+			       vector_cases[i].msg);
+
+		data[i] = msg;
+		mds[i] = md[i];
+	}
+
+	// Hash every number of messages to exercise idle lanes
+	for (num = 1; num <= NUM_VECTOR_CASES; num++) {
+		memset(md, 0, sizeof(md));
+		sha256_multi(num, data, len, mds);
+		for (i = 0; i < num; i++) {
+			hash[conv_to_hexstr(hash, md[i], sizeof(md[i]))] = '\0';
+			ck_assert_str_eq(hash, vector_cases[i].refhash);
+		}
+	}
+
+	for (i = 0; i < NUM_VECTOR_CASES; i++)
+		free((void*)data[i]);
+}
+END_TEST
+
+
+START_TEST(hashfile_batch)
+{
+	struct sha_file files[SHA_BATCH_MAX_FILES];
+	int i, j, num;
+
+	if (sha256_mb_set_impl(_i))
+		return;
+
+	for (i = 0; i < NUM_HASH_CASES; i += num) {
+		num = NUM_HASH_CASES - i;
+		if (num > SHA_BATCH_MAX_FILES)
+			num = SHA_BATCH_MAX_FILES;
+
+		for (j = 0; j < num; j++) {
+			files[j] = (struct sha_file) {
+				.filename = mmstr_alloca_from_cstr(sha_cases[i+j].name),
+				.hash = mmstr_alloca(SHA_HEXSTR_LEN),
+			};
+		}
+
+		ck_assert(sha_compute_batch(files, num, hashfile_dir) == 0);
+		for (j = 0; j < num; j++) {
+			ck_assert_int_eq(files[j].rv, 0);
+			ck_assert_int_eq(files[j].size, sha_cases[i+j].len);
+			ck_assert_str_eq(files[j].hash, sha_cases[i+j].refhash);
+		}
+	}
+}
+END_TEST
+
 /**************************************************************************
  *                                                                        *
  *                         test suite creation                            *
@@ -232,10 +411,18 @@ TCase* create_sha_tcase(void)
 
 	tc = tcase_create("sha");
 	tcase_add_unchecked_fixture(tc, sha_setup, sha_cleanup);
-
-	tcase_add_loop_test(tc, hashfile_without_parent, 0, NUM_HASH_CASES);
-	tcase_add_loop_test(tc, hashfile_with_parent, 0, NUM_HASH_CASES);
-	tcase_add_loop_test(tc, hash_symlink, 0, NUM_SYMLINK_CASES);
+	tcase_add_checked_fixture(tc, sha_impl_setup, sha_impl_teardown);
+
+	tcase_add_loop_test(tc, hashfile_without_parent, 0,
+	                    NUM_HASH_CASES * SHA256_NUM_IMPL);
+	tcase_add_loop_test(tc, hashfile_with_parent, 0,
+	                    NUM_HASH_CASES * SHA256_NUM_IMPL);
+	tcase_add_loop_test(tc, hash_symlink, 0,
+	                    NUM_SYMLINK_CASES * SHA256_NUM_IMPL);
+	tcase_add_loop_test(tc, hash_vectors, 0,
+	                    NUM_VECTOR_CASES * SHA256_NUM_IMPL);
+	tcase_add_loop_test(tc, hash_multi_vectors, 0, SHA256_MB_NUM_IMPL);
+	tcase_add_loop_test(tc, hashfile_batch, 0, SHA256_MB_NUM_IMPL);
 
 	return tc;
 }
@@ -0,0 +1,110 @@
+#!/bin/bash
+#
+# Helpers of the benchmarks installing packages made of many files from a
+# local repository. To use gen-many-files-pkg, the caller must define
+# REPO_MANY (folder where the package is created), pkgname and pkgdir (folder
+# of the package files relative to prefix).
+
+sha256()
+{
+	sha256sum $1 | cut -d$' ' -f1
+}
+
+cleanup-bench-repo()
+{
+	cleanup
+	rm -rf $BENCH_REPO
+}
+
+# prepare-bench-repo <repo>
+# Start from a clean state, remove the repository folder <repo> along the test
+# prefix on exit and set BENCH_REPO_URL to the URL of <repo>.
+prepare-bench-repo()
+{
+	BENCH_REPO=$1
+	trap cleanup-bench-repo EXIT
+	cleanup-bench-repo
+
+	if [ -n "$(which cygpath)" ] ; then
+		BENCH_REPO_URL="file://$(cygpath -m $BENCH_REPO)"
+	else
+		BENCH_REPO_URL="file://$BENCH_REPO"
+	fi
+}
+
+# run-createrepo <repo> <pkgs>
+# Create (or update) the repository <repo> from the packages in folder <pkgs>
+run-createrepo()
+{
+	local createrepo
+
+	createrepo=$(find $_MMPACK_TEST_PREFIX -type f -follow -name mmpack-createrepo)
+	$createrepo $1 $2
+}
+
+# gen-pkg-metadata <dir> <name> <version> <srcpkg> <description>
+# Write the sha256sums and MMPACK/info of the package <name> whose files are
+# in <dir>, built from the source package file <srcpkg>.
+gen-pkg-metadata()
+{
+	local dir=$1
+	local name=$2
+	local version=$3
+	local srcpkg=$4
+	local description=$5
+
+	mkdir -p $dir/MMPACK $dir/var/lib/mmpack/metadata
+	(cd $dir && find . -type f -printf '%P\0' | sort -z | xargs -0 sha256sum) \
+		| sed 's/^\([0-9a-f]*\)  \(.*\)$/\2: reg-\1/' \
+		> $dir.sums
+	mv $dir.sums $dir/var/lib/mmpack/metadata/$name.sha256sums
+
+	cat << EOF_INFO > $dir/MMPACK/info
+$name:
+    depends: {}
+    description: '$description'
+    source: $name
+    srcsha256: $(sha256 $srcpkg)
+    sumsha256sums: $(sha256 $dir/var/lib/mmpack/metadata/$name.sha256sums)
+    sysdepends: []
+    version: '$version'
+    licenses: [dummy]
+EOF_INFO
+}
+
+# gen-many-files-pkg <version> <first> <last>
+# Create package whose files are numbered from <first> to <last>. In version
+# 2.0.0, one file out of 20 is modified.
+gen-many-files-pkg()
+{
+	local version=$1
+	local first=$2
+	local last=$3
+	local i
+	local tmp=$REPO_MANY/tmp
+
+	echo -n "Creating package $pkgname ($version) with $((last - first + 1)) files ... "
+
+	rm -rf $tmp
+	for i in $(seq $first 1000 $last) ; do
+		mkdir -p $tmp/$pkgdir/d$((i / 1000))
+	done
+
+	for i in $(seq $first $last) ; do
+		if [ $version != "1.0.0" ] && [ $((i % 20)) -eq 0 ] ; then
+			echo "file $i $version" > $tmp/$pkgdir/d$((i / 1000))/f$i
+		else
+			echo "file $i" > $tmp/$pkgdir/d$((i / 1000))/f$i
+		fi
+	done
+
+	tar -czf $REPO_MANY/${pkgname}_${version}_src.tar.gz --directory=$tmp/$pkgdir .
+
+	gen-pkg-metadata $tmp $pkgname $version \
+		$REPO_MANY/${pkgname}_${version}_src.tar.gz \
+		'package with many files'
+
+	tar -czf $REPO_MANY/${pkgname}_${version}.mpk --directory=$tmp .
+	rm -rf $tmp
+	echo "OK"
+}
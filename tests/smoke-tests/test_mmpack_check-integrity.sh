@@ -27,11 +27,17 @@ $PREFIX_TEST/bin/hello-world
 echo "" > $PREFIX_TEST/bin/hello-world
 
 mmpack check-integrity && false || echo "Fail as expected"
+mmpack check-integrity hello && false || echo "Fail as expected"
+mmpack check-integrity --quick hello && false || echo "Fail as expected"
+
+# the failure must be reported whatever the number of hashing threads
+MMPACK_CHECK_THREADS=1 mmpack check-integrity | grep "hello .* Failed!"
 
 mmpack fix-broken hello
 
 # should be good now
 mmpack check-integrity
+mmpack check-integrity --quick | grep "files unchanged since installation"
 
 # should not do anything
 tree_before=$(find $PREFIX_TEST -type f | sort | sha1sum)
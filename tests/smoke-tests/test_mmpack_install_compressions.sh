@@ -0,0 +1,88 @@
+#!/bin/bash
+#
+# Benchmark the compressions of package payload: the same content is
+# compressed by mmpack-build in each format, and the time to create the
+# package, its size and the time to install it are reported.
+
+set -e
+
+. $(dirname $0)/test-mmpack-common.sh
+. $(dirname $0)/many-files-common.sh
+prepare_env
+
+NUM_FILES=${NUM_FILES:-20000}
+COMPRESSIONS=${COMPRESSIONS:-"xz zstd zstd-long"}
+REPO_BENCH=$BUILDDIR/test-repo-compressions
+PAYLOAD=$REPO_BENCH/payload
+export PYTHONPATH=${_MMPACK_TEST_PREFIX}${PYTHON_INSTALL_DIR}
+
+prepare-bench-repo $REPO_BENCH
+
+# Payload mixing small text files, executables and incompressible data
+echo -n "Creating payload with $NUM_FILES files ... "
+mkdir -p $PAYLOAD/bin $PAYLOAD/share/data
+for i in $(seq 0 1000 $((NUM_FILES - 1))) ; do
+	mkdir -p $PAYLOAD/share/text/d$((i / 1000))
+done
+for i in $(seq 0 $((NUM_FILES - 1))) ; do
+	seq $i $((i + 200)) > $PAYLOAD/share/text/d$((i / 1000))/f$i
+done
+cp $_MMPACK_TEST_PREFIX$PREFIX/bin/mmpack* $PAYLOAD/bin
+head -c $((16 * 1024 * 1024)) /dev/urandom > $PAYLOAD/share/data/random
+echo "OK"
+
+# gen-compressed-pkg <compression>
+# Create package bench-<compression> from the payload compressed with
+# <compression> and print the time it took and the package size.
+gen-compressed-pkg()
+{
+	local compression=$1
+	local name=bench-$compression
+	local tmp=$REPO_BENCH/tmp
+	local mpk=$REPO_BENCH/pkgs/${name}_1.0.0.mpk
+	local start end
+
+	rm -rf $tmp
+	cp -al $PAYLOAD $tmp
+	echo "dummy source" > $REPO_BENCH/${name}_1.0.0_src.tar.gz
+	gen-pkg-metadata $tmp $name 1.0.0 \
+		$REPO_BENCH/${name}_1.0.0_src.tar.gz \
+		"package compressed with $compression"
+
+	start=$(date +%s%N)
+	python3 -c "import sys
+from mmpack_build.common import create_tarball, parse_compression
+create_tarball(sys.argv[1], sys.argv[2], *parse_compression(sys.argv[3]))" \
+		$tmp $mpk $compression
+	end=$(date +%s%N)
+	rm -rf $tmp
+
+	echo "$compression: build $(( (end - start) / 1000000 )) ms, size $(stat -c %s $mpk) bytes"
+}
+
+mkdir -p $REPO_BENCH/pkgs
+for compression in $COMPRESSIONS ; do
+	gen-compressed-pkg $compression
+done
+
+run-createrepo $REPO_BENCH $REPO_BENCH/pkgs
+
+mmpack mkprefix --name="compressions" --url="$BENCH_REPO_URL" $PREFIX_TEST
+mmpack update
+
+for compression in $COMPRESSIONS ; do
+	name=bench-$compression
+
+	# Fill the package cache so that only the unpacking is measured
+	mmpack install -y $name
+	mmpack remove -y $name
+
+	start=$(date +%s%N)
+	mmpack install -y $name
+	end=$(date +%s%N)
+	echo "$compression: install $(( (end - start) / 1000000 )) ms"
+
+	cmp $PREFIX_TEST/share/data/random $PAYLOAD/share/data/random
+	mmpack check-integrity $name
+	mmpack remove -y $name
+done
@@ -0,0 +1,54 @@
+#!/bin/bash
+#
+# Benchmark the installation of a package made of many small files, with the
+# files created by batches of io_uring operations and with the files created
+# one by one.
+
+set -e
+
+. $(dirname $0)/test-mmpack-common.sh
+. $(dirname $0)/many-files-common.sh
+prepare_env
+
+NUM_FILES=${NUM_FILES:-100000}
+REPO_MANY=$BUILDDIR/test-repo-many-small-files
+pkgname=many-small-files
+pkgdir=share/$pkgname
+
+prepare-bench-repo $REPO_MANY
+
+mkdir -p $REPO_MANY/pkgs
+gen-many-files-pkg 1.0.0 0 $((NUM_FILES - 1))
+mv $REPO_MANY/${pkgname}_1.0.0.mpk $REPO_MANY/pkgs
+
+run-createrepo $REPO_MANY $REPO_MANY/pkgs
+
+mmpack mkprefix --name="many-small-files" --url="$BENCH_REPO_URL" $PREFIX_TEST
+mmpack update
+
+# timed-install <label>
+timed-install()
+{
+	local start end
+
+	start=$(date +%s%N)
+	mmpack install -y $pkgname
+	end=$(date +%s%N)
+	echo "install of $NUM_FILES files ($1) took $(( (end - start) / 1000000 )) ms"
+
+	mmpack list installed | assert-str-equal "[installed] $pkgname (1.0.0) from repositories: many-small-files"
+	[ "$(cat $PREFIX_TEST/$pkgdir/d0/f1)" == "file 1" ]
+	last=$((NUM_FILES - 1))
+	[ "$(cat $PREFIX_TEST/$pkgdir/d$((last / 1000))/f$last)" == "file $last" ]
+	mmpack check-integrity $pkgname
+}
+
+# Fill the package cache so that only the unpacking is measured
+mmpack install -y $pkgname
+mmpack remove -y $pkgname
+
+MMPACK_DISABLE_IO_URING=1 timed-install "files created one by one"
+mmpack remove -y $pkgname
+[ ! -e $PREFIX_TEST/$pkgdir/d0/f1 ]
+
+timed-install "batched file creation"
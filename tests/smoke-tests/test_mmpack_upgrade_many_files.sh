@@ -0,0 +1,56 @@
+#!/bin/bash
+#
+# Benchmark the upgrade of a package made of many files. The files of the
+# installed version are tracked while the new version is unpacked: this must
+# not grow quadratically with the number of files.
+
+set -e
+
+. $(dirname $0)/test-mmpack-common.sh
+. $(dirname $0)/many-files-common.sh
+prepare_env
+
+NUM_FILES=${NUM_FILES:-50000}
+REPO_MANY=$BUILDDIR/test-repo-many-files
+pkgname=many-files
+pkgdir=share/$pkgname
+
+prepare-bench-repo $REPO_MANY
+
+mkdir -p $REPO_MANY
+gen-many-files-pkg 1.0.0 0 $((NUM_FILES - 1))
+mkdir $REPO_MANY/old
+mv $REPO_MANY/${pkgname}_1.0.0.mpk $REPO_MANY/old
+gen-many-files-pkg 2.0.0 100 $((NUM_FILES + 99))
+
+# Install first version from a repository providing only it, then upgrade
+# from a repository providing only the new version
+run-createrepo $REPO_MANY $REPO_MANY/old
+mmpack mkprefix --name="many-files" --url="$BENCH_REPO_URL" $PREFIX_TEST
+mmpack update
+mmpack install -y $pkgname
+mmpack list installed | assert-str-equal "[installed] $pkgname (1.0.0) from repositories: many-files"
+
+mv $REPO_MANY/old/${pkgname}_1.0.0.mpk $REPO_MANY
+rm -rf $REPO_MANY/old
+mkdir $REPO_MANY/new
+mv $REPO_MANY/${pkgname}_2.0.0.mpk $REPO_MANY/new
+run-createrepo $REPO_MANY $REPO_MANY/new
+mmpack update
+
+start=$(date +%s%N)
+mmpack upgrade -y
+end=$(date +%s%N)
+echo "upgrade of $NUM_FILES files took $(( (end - start) / 1000000 )) ms"
+
+mmpack list installed | assert-str-equal "[installed] $pkgname (2.0.0) from repositories: many-files"
+
+# Vanished files are removed, new and modified files are installed
+[ ! -e $PREFIX_TEST/$pkgdir/d0/f0 ]
+[ ! -e $PREFIX_TEST/$pkgdir/d0/f99 ]
+[ "$(cat $PREFIX_TEST/$pkgdir/d0/f100)" == "file 100 2.0.0" ]
+[ "$(cat $PREFIX_TEST/$pkgdir/d0/f101)" == "file 101" ]
+last=$((NUM_FILES + 99))
+[ "$(cat $PREFIX_TEST/$pkgdir/d$((last / 1000))/f$last)" == "file $last" ]
+
+mmpack check-integrity
@@ -1,12 +1,15 @@
 # @mindmaze_header@
+import tarfile
 import unittest
+import zlib
 
-from os import makedirs, getcwd, chdir
+from io import BytesIO
+from os import makedirs, getcwd, chdir, remove
 from os.path import dirname, abspath
 from shutil import rmtree
 
-from mmpack_build.common import list_files, parse_soname, shlib_keyname, \
-    str2bool
+from mmpack_build.common import create_tarball, list_files, \
+    parse_compression, parse_soname, shlib_keyname, str2bool
 
 
 REF_FILELIST = [
@@ -162,3 +165,46 @@ class TestFileList(unittest.TestCase):
 
         for value in refdata_exception:
             self.assertRaises(ValueError, str2bool, value)
+
+    def test_parse_compression(self):
+        """
+        test parse_compression()
+        """
+        refdata = {'xz': ('xz', None),
+                   'xz:0': ('xz', 0),
+                   'zstd': ('zstd', None),
+                   'zstd:19': ('zstd', 19),
+                   'zstd-long:22': ('zstd-long', 22)}
+        refdata_exception = ['gz', 'zst', 'xz:10', 'zstd:0', 'zstd:23',
+                             'zstd:-1', 'zstd:fast']
+
+        for value, ref in refdata.items():
+            self.assertEqual(parse_compression(value), ref)
+
+        for value in refdata_exception:
+            self.assertRaises(ValueError, parse_compression, value)
+
+    def test_create_tarball_leading(self):
+        """
+        test create_tarball() puts leading files in a separate stream
+        """
+        leading = ['bfile', 'adir/cfile']
+        tarpath = 'test_leading.tar.gz'
+        create_tarball(TEST_TREE_ROOT, tarpath, 'gz', leading=leading)
+
+        with tarfile.open(tarpath, 'r:gz') as tar:
+            names = tar.getnames()
+        self.assertEqual(names[:2], ['./bfile', './adir/cfile'])
+        self.assertEqual(sorted(names[2:]),
+                         ['.'] + sorted('./' + f
+                                        for f in REF_FILELIST_WITHDIRS
+                                        if f not in leading))
+
+        # First gzip member must hold only the leading files
+        with open(tarpath, 'rb') as tarball:
+            decomp = zlib.decompressobj(16 + zlib.MAX_WBITS)
+            header = decomp.decompress(tarball.read())
+        remove(tarpath)
+        self.assertTrue(decomp.unused_data)
+        with tarfile.open(fileobj=BytesIO(header), mode='r:') as tar:
+            self.assertEqual(tar.getnames(), ['./bfile', './adir/cfile'])